@@ -26,6 +26,7 @@
 #include <opencv2/core/core.hpp>
 #include <string>
 #include <memory>
+#include <functional>
 
 #include "chilitags_export.hpp"
 
@@ -201,6 +202,48 @@ TagCornerMap find(
     const cv::Mat &inputImage,
     DetectionTrigger detectionTrigger = DETECT_ONLY);
 
+/**
+    The buffers used by a full detection, to pass to detect(). Each thread
+    calling detect() needs its own Workspace; it should be kept from one call
+    to the next, to avoid reallocating its buffers.
+ */
+class CHILITAGS_EXPORT Workspace
+{
+public:
+    Workspace();
+    ~Workspace();
+
+private:
+    friend class Chilitags;
+    class Impl;
+    std::unique_ptr<Impl> mImpl;
+
+    Workspace(const Workspace &);
+    Workspace &operator=(const Workspace &);
+};
+
+/**
+    Runs a full detection like `find(inputImage, DETECT_ONLY)`, but without
+    modifying this Chilitags object: all the intermediate results are stored
+    in the given workspace, and the tags are not filtered (see setFilter()).
+    Several threads can thus share the same configured Chilitags to detect
+    tags concurrently, e.g. in the images of several cameras, each of them
+    using its own Workspace. The codebook and the configuration are not
+    duplicated.
+
+    The configuration of this Chilitags (e.g. setPerformance(),
+    setSegmentation()...) must not be changed while another thread runs
+    detect().
+
+    \returns the detected tags, in the form of a mapping between their id's and
+    the position of their four corners.
+
+    \param inputImage an OpenCV image (gray or BGR)
+
+    \param workspace the buffers of the calling thread.
+ */
+TagCornerMap detect(const cv::Mat &inputImage, Workspace &workspace) const;
+
 /**
     When the detection trigger is Chilitags::DETECT_PERIODICALLY, `period`
     specifies the number of frames between each full detection. The
@@ -216,7 +259,7 @@ void setDetectionPeriod(int period);
  */
 enum PerformancePreset {
 /**
-    Favor speed over accuracy: no corner refinment, no subsampling.
+    Favor speed over accuracy: no corner refinement, no subsampling.
  */
     FASTER = 0,
 /**
@@ -226,13 +269,15 @@ enum PerformancePreset {
 /**
     Favor robustness over accuracy: corner are refined, input is
     subsampled down to 160 pixels wide.
+
+    All the presets restore the default subsamples (see setScales()).
  */
     ROBUST,
 };
 
 /**
     Applies one of the performance tuning preset (See PerformancePreset). To
-    tune more finely the performance trade-offs, see setCornerRefinment(),
+    tune more finely the performance trade-offs, see setCornerRefinement(),
     setMaxInputWidth(), and setMinInputWidth().
  */
 void setPerformance(PerformancePreset preset);
@@ -240,13 +285,111 @@ void setPerformance(PerformancePreset preset);
 //@{
 
 /**
-    Enable or disable the corner refinement. It is enabled (true) by default.
-    When disabled, the processing time is reduced by ~33%, but the coordinates
-    of the tags lose their sub-pixel precision, and there is a marginally
-    higher level of false negatives.
+    Values of the parameter of setCornerRefinement(), telling whether and
+    when the corners of the tags are refined to sub-pixel precision.
+ */
+enum CornerRefinement {
+/**
+    Disable the corner refinement. The processing time is reduced by ~33%,
+    but the coordinates of the tags lose their sub-pixel precision, and there
+    is a marginally higher level of false negatives.
+ */
+    NO_REFINEMENT = 0,
+
+/**
+    Refine every candidate quadrilateral before decoding it (default). If the
+    refined candidate can not be decoded, the raw candidate is tried as well.
+    This is the most robust policy, but its cost grows with the number of
+    candidates, most of which are not tags.
+ */
+    REFINE_CANDIDATES,
+
+/**
+    Decode the raw candidates first, and refine only the confirmed tags.
+    The cost of the refinement then grows with the number of tags rather
+    than with the number of candidates. Tags which can only be decoded after
+    refinement are missed, though. setRefinedTags() further restricts the
+    refinement to the tags which need sub-pixel precision.
+ */
+    REFINE_DECODED,
+};
+
+/**
+    Sets when the corners of the tags are refined (see
+    Chilitags::CornerRefinement). It is Chilitags::REFINE_CANDIDATES by
+    default.
+ */
+void setCornerRefinement(CornerRefinement refinement);
+
+/**
+    Enable (Chilitags::REFINE_CANDIDATES) or disable
+    (Chilitags::NO_REFINEMENT) the corner refinement. It is enabled (true) by
+    default.
  */
 void setCornerRefinement(bool refineCorners);
 
+/**
+    Restricts the refinement of Chilitags::REFINE_DECODED to the given tags,
+    e.g. those whose 3D pose is estimated. The other tags keep the integer
+    coordinates of their detection.
+
+    \param ids the ids of the tags to refine, or an empty list (default) to
+    refine every decoded tag.
+ */
+void setRefinedTags(const std::vector<int> &ids);
+
+/**
+    Values of the parameter of setCornerRefinementMethod(), telling how the
+    corners of the tags are refined.
+ */
+enum CornerRefinementMethod {
+/**
+    Move each corner to the point where the gradients of its neighbourhood
+    meet, like cv::cornerSubPix() (default).
+ */
+    CORNER_GRADIENTS = 0,
+
+/**
+    Locate the strongest gradients across each of the four sides of the tag,
+    robustly fit a line to each side, and take the intersections of these
+    lines as corners. This uses the whole length of the edges rather than
+    the neighbourhood of the corners only, which makes it more precise and
+    cheaper on small or blurred tags.
+ */
+    EDGE_LINES,
+};
+
+/**
+    Sets how the corners of the tags are refined, when they are (see
+    setCornerRefinement()). It is Chilitags::CORNER_GRADIENTS by default.
+ */
+void setCornerRefinementMethod(CornerRefinementMethod method);
+
+/**
+    Values of the parameter of setSegmentation(), telling how the image is
+    binarised before looking for the contours of the tags.
+ */
+enum Segmentation {
+/**
+    Look for the contours in the edges found by cv::Canny() (default).
+ */
+    CANNY_EDGES = 0,
+
+/**
+    Look for the contours of the regions darker than their neighbourhood.
+    The mean of the neighbourhood of each pixel is read from an integral
+    image, which makes this much cheaper than the edge detection, and less
+    sensitive to uneven lighting.
+ */
+    ADAPTIVE_THRESHOLD,
+};
+
+/**
+    Sets how the image is binarised before looking for the contours of the
+    tags. It is Chilitags::CANNY_EDGES by default.
+ */
+void setSegmentation(Segmentation segmentation);
+
 /**
     Ensures that the image used as input for the detection is at most
     `maxWidth` wide. The smaller, the faster, but tags smaller than 20 pixels
@@ -270,9 +413,82 @@ void setMaxInputWidth(int maxWidth);
 
     Disabling the subsampling reduces the processing time by ~40%, but large
     tags (having sides larger than hundreds of pixels) are likely to be missed.
+
+    This setting is ignored while explicit scales are set with setScales().
  */
 void setMinInputWidth(int minWidth);
 
+/**
+    Replaces the default subsamples (see setMinInputWidth()) by an explicit
+    set of scales, e.g. `{1.0f, 0.707f, 0.5f, 0.354f}` for steps of √2, which
+    catch tags falling between two octaves. The subsamples are computed by
+    area averaging, which is less aliased but slower than the point sampling
+    of the default subsamples.
+
+    \param scales the factors (between 0 excluded and 1 included) by which the
+    input image is reduced; the order does not matter. An empty vector
+    restores the default subsamples.
+ */
+void setScales(const std::vector<float> &scales);
+
+/**
+    \returns the average time (in milliseconds, including the subsampling and
+    the search of candidate quadrilaterals) spent on each scale in the last
+    full detections, indexed by the scale factor. It can be used to choose the
+    scales that fit a time budget.
+ */
+std::map<float, float> getScaleCosts() const;
+
+/**
+    Bounds the time spent on the full detection in a single call to find(),
+    e.g. to respect a frame budget on cluttered images, where the edge
+    detection can produce thousands of candidate quadrilaterals.
+
+    When a budget is set, the candidates are examined by order of priority:
+    first those close to previously found tags, then the largest ones. The
+    detection stops as soon as the budget is exhausted, and returns the tags
+    found so far; isLastDetectionPartial() then returns true.
+
+    \param maxMilliseconds the maximum duration of a full detection, or 0
+    (default) for no time limit.
+
+    \param maxCandidates the maximum number of candidate quadrilaterals to
+    decode in a full detection, or 0 (default) for no limit.
+ */
+void setDetectionBudget(float maxMilliseconds, int maxCandidates = 0);
+
+/**
+    \returns true if the last full detection ran out of the budget set with
+    setDetectionBudget(), i.e. if some tags may be missing from its result.
+ */
+bool isLastDetectionPartial() const;
+
+/**
+    Numbers of candidate quadrilaterals rejected by each of the cheap tests
+    which screen out the candidates that can not be tags, before they are
+    refined and decoded.
+ */
+struct ScreenOutCounters {
+    unsigned long long candidates;      ///< Number of screened candidates
+    unsigned long long nonConvex;       ///< Rejected because concave or degenerate
+    unsigned long long badProportions;  ///< Rejected because of the ratios of their sides
+    unsigned long long noBorder;        ///< Rejected because no dark border surrounds them
+    unsigned long long notBimodal;      ///< Rejected because their inside is not black and white
+};
+
+/**
+    \returns the numbers of candidates screened out by the full detections of
+    find() since the creation of this Chilitags, or the last call to
+    resetScreenOutCounters(). They tell how much work the screening saves on
+    the images of an application.
+ */
+ScreenOutCounters getScreenOutCounters() const;
+
+/**
+    Resets to zero the counters returned by getScreenOutCounters().
+ */
+void resetScreenOutCounters();
+
 //@}
 
 //@{
@@ -332,6 +548,117 @@ std::unique_ptr<Impl> mImpl;
 
 };
 
+/**
+    ChilitagsService detects tags in the frames of several streams (e.g.
+    cameras) with a single pool of worker threads, instead of one Chilitags,
+    and its threads, per stream.
+
+    Each stream has its own Chilitags, i.e. its own tracking and filtering
+    state. The frames of a stream are processed in the order in which they
+    were pushed, one at a time, but the frames of different streams are
+    processed in parallel. Idle workers steal the streams waiting for the busy
+    ones, so that the cores are used fully when the streams are bursty,
+    without running more threads than cores.
+
+    When frames arrive faster than they are processed, the oldest frames
+    waiting in the queue of a stream are dropped.
+
+    Without multithreading support, or if no worker thread could be launched,
+    push() processes the frame immediately.
+ */
+class CHILITAGS_EXPORT ChilitagsService
+{
+
+public:
+
+/**
+    The function called with the tags found in each frame.
+
+    \param stream the id of the stream, as returned by addStream().
+
+    \param frame the index of the frame in the stream, counting the frames
+    pushed since the stream was added, including the dropped ones.
+
+    \param tags the tags found in the frame, as returned by Chilitags::find().
+ */
+typedef std::function<void(int stream, int frame, const TagCornerMap &tags)> Callback;
+
+/**
+    \param nWorkers the number of worker threads; 0 (default) uses one thread
+    per core.
+
+    \param maxQueuedFrames the maximum number of frames waiting to be
+    processed in each stream, above which the oldest ones are dropped.
+ */
+ChilitagsService(int nWorkers = 0, int maxQueuedFrames = 1);
+
+/**
+    Stops the workers; the frames still waiting are not processed.
+ */
+~ChilitagsService();
+
+/**
+    Registers a new stream.
+
+    \param callback the function called with the tags of each frame. It is
+    called from the worker threads, but never concurrently for the same
+    stream.
+
+    \param detectionTrigger how to combine tracking and full detection in the
+    stream (see Chilitags::DetectionTrigger). The asynchronous triggers are
+    replaced by their synchronous equivalents, as the service already runs
+    the detection in its own threads.
+
+    \returns the id of the new stream.
+ */
+int addStream(Callback callback,
+              Chilitags::DetectionTrigger detectionTrigger = Chilitags::DETECT_PERIODICALLY);
+
+/**
+    Unregisters a stream; its frames still waiting are not processed.
+ */
+void removeStream(int stream);
+
+/**
+    \returns the detector of the given stream, e.g. to tune its performance
+    or its filter. It must not be modified while frames of this stream are
+    being processed. The reference is invalidated when the stream is removed,
+    so it must not be used concurrently with removeStream().
+
+    Throws std::out_of_range if the stream does not exist, as push() and
+    getDroppedFrames() do.
+ */
+Chilitags &getDetector(int stream);
+
+/**
+    Queues a copy of the frame for processing in the given stream, dropping
+    the oldest waiting frame if the queue of the stream is full.
+
+    \returns false if a frame was dropped.
+ */
+bool push(int stream, const cv::Mat &frame);
+
+/**
+    \returns the number of frames of the given stream which were dropped
+    without being processed.
+ */
+int getDroppedFrames(int stream) const;
+
+/**
+    Blocks until all the queued frames are processed.
+ */
+void waitUntilIdle();
+
+private:
+/** The actual implementation is hidden from the compiler. */
+class Impl;
+std::unique_ptr<Impl> mImpl;
+
+ChilitagsService(const ChilitagsService &);
+ChilitagsService &operator=(const ChilitagsService &);
+
+};
+
 /**
     Chilitags3D aims at recovering the 3D pose (i.e. the 3D position and the 3D
     rotation) of chilitags. It embeds a Chilitags instance to take care of the
@@ -347,6 +674,19 @@ typedef cv::Matx<RealT, 4, 4> TransformMatrix;
 
 typedef std::map<std::string, TransformMatrix> TagPoseMap;
 
+/**
+    The pose of an object (or of a tag), identified by an integer handle rather
+    than by its name. The handles are resolved when the configuration is read
+    (see getObjectHandle(), getTagHandle() and getObjectName()), so that
+    estimateByHandle() does not format nor compare any string.
+ */
+struct ObjectPose {
+    int handle;
+    TransformMatrix transform;
+};
+
+typedef std::vector<ObjectPose> ObjectPoseList;
+
 /**
     Creates an object ready to find the 3D pose of chilitags.
 
@@ -453,6 +793,48 @@ TagPoseMap estimate(
     cv::Vec<RealT, 4> const& camDeltaR = cv::Vec<RealT, 4>(1,0,0,0),
     cv::Vec<RealT, 3> const& camDeltaX = cv::Vec<RealT, 3>(0,0,0));
 
+/**
+    This is a variant of estimate() which identifies the objects by their
+    handle rather than by their name, and reuses the memory of the given list
+    from one call to the next.
+
+    \param tags a list of tags, as returned by Chilitags::find().
+
+    \param poses the output list of the poses of the detected objects and
+    tags, sorted by handle. It is cleared first.
+
+    \param camDeltaR Rotation from the previous camera frame to
+    the current camera frame (see estimate()).
+
+    \param camDeltaX Translation from the previous camera frame
+    to the current camera frame (see estimate()).
+ */
+void estimateByHandle(const TagCornerMap & tags,
+                      ObjectPoseList & poses,
+                      cv::Vec<RealT, 4> const& camDeltaR = cv::Vec<RealT, 4>(1,0,0,0),
+                      cv::Vec<RealT, 3> const& camDeltaX = cv::Vec<RealT, 3>(0,0,0));
+
+/**
+    \returns the handle of the object of the given name, as named in the
+    configuration (see readTagConfiguration()) or "tag_<id>" for a tag, or -1
+    if there is no such object. The handles of the objects of the
+    configuration come first, in the order of the configuration, followed by
+    the ones of the tags: they change when a new configuration is read.
+ */
+int getObjectHandle(const std::string &name) const;
+
+/**
+    \returns the handle of the tag of the given id, i.e. the number of objects
+    in the configuration plus the id, or -1 if the id is invalid.
+ */
+int getTagHandle(int id) const;
+
+/**
+    \returns the name of the object of the given handle, as used as key by
+    estimate(), or an empty string if there is no such object.
+ */
+const std::string &getObjectName(int handle) const;
+
 /**
     Chilitags3D can also detect rigid assemblies of tags. This allows for a
     more precise estimation of the object holding the tag, and for a graceful
@@ -462,6 +844,8 @@ TagPoseMap estimate(
     \param filenameOrString The name of the YAML configuration file (or the whole
     file itself as a string) describing rigid clusters of tags. The library is
     distributed with a sample configuration file documenting the expected format.
+    The file can also be in the binary format written by
+    writeTagConfiguration(), which is loaded without parsing.
 
     \param omitOtherTags If true, ignore the tags that are not explicitly
     listed in the configuration file. If false (default),
@@ -473,13 +857,30 @@ TagPoseMap estimate(
     given string. If false (default) will open the file with the given name and
     try to read the configuration from there.
 
-    \return Whether reading the configuration was successful
+    \return Whether reading the configuration was successful. A configuration
+    in which a tag has no size, or a size which is not positive, is rejected,
+    and the previous configuration is kept.
  */
 bool readTagConfiguration(
     const std::string &filenameOrString,
     bool omitOtherTags = false,
     bool readFromString = false);
 
+/**
+    Writes the current tag configuration in a compact binary format, which
+    readTagConfiguration() maps in memory and loads much faster than YAML,
+    e.g. for large configurations read at every start on embedded devices.
+    The chilitags-convert tool converts YAML configurations to this format.
+
+    The format stores the corners of the tags, rather than their positions
+    and orientations, in the byte order of the writing machine.
+
+    \param filename The name of the file to write.
+
+    \returns Whether writing the configuration was successful
+ */
+bool writeTagConfiguration(const std::string &filename) const;
+
 /**
     Sets the default size of tags (used to compute their 3D pose) when not
     explicitly specified with read3DConfiguration(). To be accurate, the unit
@@ -489,7 +890,8 @@ bool readTagConfiguration(
     different size, you may want to list them in the configuration file (see
     read3DConfiguration()).
 
-    The default value of the default tag size is 20 millimetres.
+    The default value of the default tag size is 20 millimetres. A size which
+    is not positive, or not finite, is ignored.
  */
 void setDefaultTagSize(RealT defaultSize);
 
@@ -508,6 +910,20 @@ void enableFilter(bool enabled);
  */
 void setPersistence(RealT persistence);
 
+/**
+ * @brief Bounds the number of objects (and tags) whose pose is filtered
+ *
+ * The filter of an object is discarded when it is not observed for a while
+ * (see setPersistence()). When a new object is observed while the bound is
+ * reached, the filter of the object observed least recently is discarded
+ * too, so that the memory and the time spent filtering stay bounded even
+ * when many different tags are seen over time.
+ *
+ * @param maxObjects Maximal number of filtered objects, 0 (default) for no
+ * bound
+ */
+void setFilterMaxObjects(int maxObjects);
+
 /**
  * @brief Sets the process noise covariance matrix a.k.a Q for the Kalman filter
  *
@@ -574,10 +990,48 @@ void setCalibration(cv::InputArray newCameraMatrix,
     information directly from a file, as generated by OpenCV's 'calibration'
     sample.
 
+    If the undistortion of the corners with a lookup table is enabled (see
+    enableUndistortionLut()), the table is rebuilt for the read calibration.
+    Computing it takes a few milliseconds: it can be cached in a file next to
+    the calibration file, named after it with a ".lut" suffix, from which it
+    is read back as long as the calibration does not change.
+
+    The file can also be in the binary format written by writeCalibration().
+
     \param filename the path to a file containing the calibration data
+    \param cacheUndistortionLut whether to cache the undistortion lookup
+    table in a file next to the calibration file (false by default).
     \returns the size of the images used to generate the calibration data.
  */
-cv::Size readCalibration(const std::string &filename);
+cv::Size readCalibration(const std::string &filename,
+                         bool cacheUndistortionLut = false);
+
+/**
+    Writes the camera resolution and calibration in a compact binary format,
+    which readCalibration() maps in memory instead of parsing it.
+
+    \param filename The name of the file to write.
+
+    \returns Whether writing the calibration was successful
+ */
+bool writeCalibration(const std::string &filename) const;
+
+/**
+    Undistorts the detected corners by interpolating in a lookup table,
+    rather than by inverting iteratively the distortion model of the camera,
+    which is faster for strongly distorted lenses. The table samples the
+    undistortion of the whole camera image, so it suits cameras whose
+    calibration does not change often: it is rebuilt every time the
+    calibration changes.
+
+    The table has the size of the camera resolution given to the constructor
+    or read by readCalibration(). It can be enabled before or after reading
+    the calibration.
+
+    \param enabled Whether to undistort corners with a lookup table (false by
+    default).
+ */
+void enableUndistortionLut(bool enabled);
 
 /**
     Returns the camera matrix used for the pose estimation.
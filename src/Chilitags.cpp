@@ -22,7 +22,9 @@
 
 #include "EnsureGreyscale.hpp"
 #include "Filter.hpp"
+#include "Decode.hpp"
 #include "Detect.hpp"
+#include "DetectorCore.hpp"
 #include "Track.hpp"
 
 #include <opencv2/imgproc/imgproc.hpp>
@@ -42,7 +44,35 @@ chilitags::TagCornerMap scaleBy(chilitags::TagCornerMap tags, float factor) {
     }
     return tags;
 }
+
+// Resizes the input image to make it at most maxWidth wide (if maxWidth is
+// positive), and converts it to greyscale; returns the resizing factor
+float prepareInput(const cv::Mat &inputImage, int maxWidth,
+                   cv::Mat &resizedInput, EnsureGreyscale &ensureGreyscale,
+                   cv::Mat &greyscaleInput) {
+    float scaleFactor = 1.0f;
+    if (maxWidth > 0 && inputImage.cols > maxWidth) {
+        scaleFactor = (float)inputImage.cols/(float)maxWidth;
+        cv::resize(inputImage, resizedInput, cv::Size(), 1.0f/scaleFactor, 1.0f/scaleFactor, cv::INTER_NEAREST);
+        greyscaleInput = ensureGreyscale(resizedInput);
+    }
+    else {
+        greyscaleInput = ensureGreyscale(inputImage);
+    }
+    return scaleFactor;
 }
+}
+
+class Chilitags::Workspace::Impl
+{
+public:
+
+cv::Mat mResizedInput;
+cv::Mat mResizedGrayscaleInput;
+EnsureGreyscale mEnsureGreyscale;
+DetectorCore::Workspace mDetectorWorkspace;
+
+};
 
 class Chilitags::Impl
 {
@@ -54,7 +84,6 @@ Impl() :
     mResizedGrayscaleInput(),
 
     mEnsureGreyscale(),
-    mDecode(),
 
     mFilter(5, 0.f),
     mDetect(),
@@ -72,17 +101,18 @@ void setFilter(int persistence, float gain) {
 }
 
 void setPerformance(PerformancePreset preset) {
+    mDetect.setScales(std::vector<float>());
     switch (preset) {
     case FASTER:
-        mDetect.setCornerRefinement(false);
+        mDetect.setCornerRefinement(NO_REFINEMENT);
         mDetect.setMinInputWidth(0);
         break;
     case FAST:
-        mDetect.setCornerRefinement(true);
+        mDetect.setCornerRefinement(REFINE_CANDIDATES);
         mDetect.setMinInputWidth(0);
         break;
     case ROBUST:
-        mDetect.setCornerRefinement(true);
+        mDetect.setCornerRefinement(REFINE_CANDIDATES);
         mDetect.setMinInputWidth(160);
         break;
     default:
@@ -90,8 +120,21 @@ void setPerformance(PerformancePreset preset) {
     }
 }
 
-void setCornerRefinement(bool refineCorners) {
-    mDetect.setCornerRefinement(refineCorners);
+void setCornerRefinement(CornerRefinement refinement) {
+    mDetect.setCornerRefinement(refinement);
+}
+
+void setRefinedTags(const std::vector<int> &ids) {
+    mDetect.setRefinedTags(ids);
+}
+
+void setCornerRefinementMethod(CornerRefinementMethod method) {
+    mDetect.setCornerRefinementMethod(method);
+    mTrack.setCornerRefinementMethod(method);
+}
+
+void setSegmentation(Segmentation segmentation) {
+    mDetect.setSegmentation(segmentation);
 }
 
 void setMaxInputWidth(int maxWidth) {
@@ -102,24 +145,40 @@ void setMinInputWidth(int minWidth) {
     mDetect.setMinInputWidth(minWidth);
 }
 
+void setScales(const std::vector<float> &scales) {
+    mDetect.setScales(scales);
+}
+
+std::map<float, float> getScaleCosts() const {
+    return mDetect.getScaleCosts();
+}
+
 void setDetectionPeriod(int period) {
     mCallsBeforeDetection = period;
 }
 
+void setDetectionBudget(float maxMilliseconds, int maxCandidates) {
+    mDetect.setBudget(maxMilliseconds, maxCandidates);
+}
+
+bool isLastDetectionPartial() const {
+    return mDetect.isPartial();
+}
+
+ScreenOutCounters getScreenOutCounters() const {
+    return mDetect.getScreenOutCounters();
+}
+
+void resetScreenOutCounters() {
+    mDetect.resetScreenOutCounters();
+}
+
 TagCornerMap find(
     const cv::Mat &inputImage,
     DetectionTrigger detectionTrigger){
 
-    // Resize the input image to make it at most mMaxInputWidth wide
-    float scaleFactor = 1.0f;
-    if (mMaxInputWidth > 0 && inputImage.cols > mMaxInputWidth) {
-        scaleFactor = (float)inputImage.cols/(float)mMaxInputWidth;
-        cv::resize(inputImage, mResizedInput, cv::Size(), 1.0f/scaleFactor, 1.0f/scaleFactor, cv::INTER_NEAREST);
-        mResizedGrayscaleInput = mEnsureGreyscale(mResizedInput);
-    }
-    else {
-        mResizedGrayscaleInput = mEnsureGreyscale(inputImage);
-    }
+    float scaleFactor = prepareInput(inputImage, mMaxInputWidth, mResizedInput,
+                                     mEnsureGreyscale, mResizedGrayscaleInput);
 
     //Take care of the background thread (if exists)
 #ifdef HAS_MULTITHREADING
@@ -205,15 +264,24 @@ TagCornerMap find(
     return tags;
 }
 
+TagCornerMap detect(const cv::Mat &inputImage, Workspace::Impl &workspace) const {
+    float scaleFactor = prepareInput(inputImage, mMaxInputWidth, workspace.mResizedInput,
+                                     workspace.mEnsureGreyscale,
+                                     workspace.mResizedGrayscaleInput);
+    TagCornerMap tags;
+    mDetect.getCore()(workspace.mResizedGrayscaleInput, tags, workspace.mDetectorWorkspace);
+    return scaleBy(tags, scaleFactor);
+}
+
 cv::Matx<unsigned char, 6, 6> encode(int id) const {
     cv::Matx<unsigned char, 6, 6> encodedId;
-    mDecode.getCodec().getTagEncodedId(id, encodedId.val);
+    Decode::getCodec().getTagEncodedId(id, encodedId.val);
     return encodedId;
 }
 
 int decode(const cv::Matx<unsigned char, 6, 6> &bits) const {
     int id = -1;
-    mDecode.getCodec().decode(bits.val, id);
+    Decode::getCodec().decode(bits.val, id);
     return id;
 }
 
@@ -222,7 +290,7 @@ cv::Mat draw(int id, int cellSize, bool withMargin, cv::Scalar color) const {
     static const int DATA_SIZE = 6;
     cv::Size dataDim(DATA_SIZE,DATA_SIZE);
     unsigned char dataMatrix[DATA_SIZE*DATA_SIZE];
-    mDecode.getCodec().getTagEncodedId(id, dataMatrix);
+    Decode::getCodec().getTagEncodedId(id, dataMatrix);
     cv::Mat dataImage(dataDim, CV_8U, dataMatrix);
 
     // Adding the black border arounf the bit matrix
@@ -258,8 +326,6 @@ cv::Mat mResizedGrayscaleInput;
 
 EnsureGreyscale mEnsureGreyscale;
 
-Decode mDecode;
-
 Filter mFilter;
 
 Detect mDetect;
@@ -284,8 +350,24 @@ void Chilitags::setPerformance(PerformancePreset preset) {
     mImpl->setPerformance(preset);
 }
 
+void Chilitags::setCornerRefinement(CornerRefinement refinement) {
+    mImpl->setCornerRefinement(refinement);
+}
+
 void Chilitags::setCornerRefinement(bool refineCorners) {
-    mImpl->setCornerRefinement(refineCorners);
+    mImpl->setCornerRefinement(refineCorners ? REFINE_CANDIDATES : NO_REFINEMENT);
+}
+
+void Chilitags::setRefinedTags(const std::vector<int> &ids) {
+    mImpl->setRefinedTags(ids);
+}
+
+void Chilitags::setCornerRefinementMethod(CornerRefinementMethod method) {
+    mImpl->setCornerRefinementMethod(method);
+}
+
+void Chilitags::setSegmentation(Segmentation segmentation) {
+    mImpl->setSegmentation(segmentation);
 }
 
 void Chilitags::setMaxInputWidth(int maxWidth) {
@@ -296,6 +378,25 @@ void Chilitags::setMinInputWidth(int minWidth) {
     mImpl->setMinInputWidth(minWidth);
 }
 
+void Chilitags::setScales(const std::vector<float> &scales) {
+    mImpl->setScales(scales);
+}
+
+std::map<float, float> Chilitags::getScaleCosts() const {
+    return mImpl->getScaleCosts();
+}
+
+Chilitags::Workspace::Workspace() :
+    mImpl(new Impl())
+{
+}
+
+Chilitags::Workspace::~Workspace() = default;
+
+TagCornerMap Chilitags::detect(const cv::Mat &inputImage, Workspace &workspace) const {
+    return mImpl->detect(inputImage, *workspace.mImpl);
+}
+
 TagCornerMap Chilitags::find(const cv::Mat &inputImage, DetectionTrigger trigger) {
     return mImpl->find(inputImage, trigger);
 }
@@ -304,6 +405,22 @@ void Chilitags::setDetectionPeriod(int period) {
     mImpl->setDetectionPeriod(period);
 }
 
+void Chilitags::setDetectionBudget(float maxMilliseconds, int maxCandidates) {
+    mImpl->setDetectionBudget(maxMilliseconds, maxCandidates);
+}
+
+bool Chilitags::isLastDetectionPartial() const {
+    return mImpl->isLastDetectionPartial();
+}
+
+Chilitags::ScreenOutCounters Chilitags::getScreenOutCounters() const {
+    return mImpl->getScreenOutCounters();
+}
+
+void Chilitags::resetScreenOutCounters() {
+    mImpl->resetScreenOutCounters();
+}
+
 cv::Matx<unsigned char, 6, 6> Chilitags::encode(int id) const {
     return mImpl->encode(id);
 }
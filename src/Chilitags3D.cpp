@@ -21,7 +21,13 @@
 #include <chilitags.hpp>
 
 #include "EstimatePose3D.hpp"
+#include "MappedFile.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <opencv2/highgui/highgui.hpp> //for FileStorage
 #ifdef OPENCV3
@@ -30,6 +36,69 @@
 
 namespace chilitags {
 
+namespace {
+// Tags have one handle per possible id
+const int N_TAG_IDS = 1024;
+
+// Distance in pixels between the samples of the undistortion lookup table
+const int UNDISTORTION_LUT_STEP = 8;
+
+// The binary formats of the tag configurations and of the calibrations are
+// mapped as is: a header, followed by fixed size records, and then variable
+// size data. A file written with another byte order has another version.
+const char CONFIGURATION_MAGIC[4] = {'C', 'H', 'T', 'C'};
+const char CALIBRATION_MAGIC[4] = {'C', 'H', 'C', 'A'};
+const int BINARY_VERSION = 1;
+
+// Followed by nTags BinaryTag, then the nObjects names, each terminated by
+// a null character, in namesSize bytes
+struct ConfigurationHeader {
+    char magic[4];
+    int version;
+    int nObjects;
+    int nTags;
+    int namesSize;
+    int padding;
+};
+
+struct BinaryTag {
+    int id;
+    int object;
+    int keep;
+    float size;
+    double corners[4][3];   // in the frame of the object
+};
+
+// Followed by nDistCoeffs double
+struct CalibrationHeader {
+    char magic[4];
+    int version;
+    int width;
+    int height;
+    int nDistCoeffs;
+    int padding;
+    double cameraMatrix[9];
+};
+
+// Tags of no or negative size, e.g. of a configuration missing their size,
+// have no meaningful pose
+template<typename RealT>
+bool isValidTagSize(RealT size) {
+    return size > 0 && std::isfinite(size);
+}
+
+// The numbers of distortion coefficients OpenCV accepts
+bool isValidDistCoeffsCount(int nDistCoeffs) {
+    return nDistCoeffs == 0 || nDistCoeffs == 4 || nDistCoeffs == 5
+        || nDistCoeffs == 8 || nDistCoeffs == 12 || nDistCoeffs == 14;
+}
+
+bool hasMagic(const MappedFile &file, const char (&magic)[4]) {
+    return file.size() >= sizeof(magic)
+        && std::memcmp(file.data(), magic, sizeof(magic)) == 0;
+}
+}
+
 template<typename RealT>
 class Chilitags3D_<RealT>::Impl {
 
@@ -37,12 +106,26 @@ public:
 Impl(cv::Size cameraResolution) :
     mChilitags(),
     mEstimatePose3D(cameraResolution),
+    mCameraResolution(cameraResolution),
+    mUndistortionLutEnabled(false),
+    mUndistortionLutCache(),
     mOmitOtherTags(false),
-    mDefaultTagCorners(),
-    mId2Configuration()
+    mDefaultTagSize(),
+    mTagEntries(N_TAG_IDS),
+    mTagCorners(),
+    mObjectNames(),
+    mObjectHandles(),
+    mObjectPoints(),
+    mPoseIndex(),
+    mCorners(),
+    mJobs(),
+    mSolutions(),
+    mWorkspaces(),
+    mPoses()
 {
     setDefaultTagSize(20.f);
     mChilitags.setFilter(0, 0.0f);
+    setObjects(std::vector<std::string>());
 }
 
 const Chilitags &getChilitags() const {
@@ -54,73 +137,139 @@ Chilitags &getChilitags()       {
 
 TagPoseMap estimate(TagCornerMap const& tags, cv::Vec<RealT, 4> const& camDeltaR, cv::Vec<RealT, 3> const& camDeltaX)
 {
+    estimateByHandle(tags, mPoses, camDeltaR, camDeltaX);
+
     TagPoseMap objects;
+    for (const auto &pose : mPoses)
+        objects[mObjectNames[pose.handle]] = pose.transform;
+    return objects;
+}
+
+void estimateByHandle(TagCornerMap const& tags, ObjectPoseList& poses, cv::Vec<RealT, 4> const& camDeltaR, cv::Vec<RealT, 3> const& camDeltaX)
+{
+    poses.clear();
 
     //Pass the latest camera movement difference for prediction (if 3D filtering is enabled)
     mEstimatePose3D.setCamDelta(camDeltaR, camDeltaX);
 
-    //Predict pose for all known tags with camera movement (if 3D filtering is enabled)
-    mEstimatePose3D(objects);
+    //Predict pose for all known objects with camera movement (if 3D filtering is enabled)
+    mEstimatePose3D(poses);
+    for (std::size_t i = 0; i < poses.size(); ++i)
+        mPoseIndex[poses[i].handle] = i;
 
     //Correct pose prediction with new observations
-    std::map<
-        const std::string,     //name of the object
-        std::pair<
-            std::vector<cv::Point3_<RealT> >,      //points in object
-            std::vector<cv::Point2f> > >   //points in frame
-    objectToPointMapping;
-
-    auto configurationIt = mId2Configuration.begin();
-    auto configurationEnd = mId2Configuration.end();
+    for (auto &points : mObjectPoints) {
+        points.first.clear();
+        points.second.clear();
+    }
+
+    //Undistort the corners of all the tags at once
+    mCorners.clear();
     for (const auto &tag : tags) {
+        const cv::Point2f *corners = (const cv::Point2f *) tag.second.val;
+        mCorners.insert(mCorners.end(), corners, corners + 4);
+    }
+    cv::Mat_<cv::Point2f> allCorners(mCorners);
+    mEstimatePose3D.undistort(allCorners);
+
+    int nObjects = mObjectPoints.size();
+    int tagIndex = -1;
+    for (const auto &tag : tags) {
+        ++tagIndex;
         int tagId = tag.first;
-        const cv::Mat_<cv::Point2f> corners(tag.second);
-
-        while (configurationIt != configurationEnd
-               && configurationIt->first < tagId)
-            ++configurationIt;
-
-        if (configurationIt != configurationEnd) {
-            if (configurationIt->first == tagId) {
-                const auto &configuration = configurationIt->second;
-                if (configuration.second.mKeep) {
-                    mEstimatePose3D(cv::format("tag_%d", tagId),
-                                    configuration.second.mLocalcorners,
-                                    corners,
-                                    objects);
-                }
-                auto & pointMapping = objectToPointMapping[configuration.first];
-                pointMapping.first.insert(
-                    pointMapping.first.end(),
-                    configuration.second.mCorners.begin(),
-                    configuration.second.mCorners.end());
-                pointMapping.second.insert(
-                    pointMapping.second.end(),
-                    corners.begin(),
-                    corners.end());
-            } else if (!mOmitOtherTags) {
-                mEstimatePose3D(cv::format("tag_%d", tagId),
-                                mDefaultTagCorners,
-                                corners,
-                                objects);
-            }
+        if (tagId < 0 || tagId >= N_TAG_IDS)
+            continue;
+        const cv::Mat_<cv::Point2f> corners(4, 1, &mCorners[4*tagIndex]);
+
+        const TagEntry &entry = mTagEntries[tagId];
+        if (entry.object < 0) {
+            if (!mOmitOtherTags)
+                addJob(nObjects + tagId, false, mDefaultTagSize, corners);
+            continue;
+        }
+
+        if (entry.keep)
+            addJob(nObjects + tagId, false, entry.size, corners);
+
+        //The buffers are reserved for all the tags of the object
+        const cv::Point3_<RealT> *objectCorners = &mTagCorners[entry.cornerOffset];
+        auto &pointMapping = mObjectPoints[entry.object];
+        pointMapping.first.insert(
+            pointMapping.first.end(),
+            objectCorners,
+            objectCorners + 4);
+        pointMapping.second.insert(
+            pointMapping.second.end(),
+            corners.begin(),
+            corners.end());
+    }
 
-        } else if (!mOmitOtherTags) {
-            mEstimatePose3D(cv::format("tag_%d", tagId),
-                            mDefaultTagCorners,
-                            corners,
-                            objects);
+    int nObjectJobs = 0;
+    for (int handle = 0; handle < nObjects; ++handle) {
+        const auto &objectToPoints = mObjectPoints[handle];
+        if (!objectToPoints.first.empty()) {
+            addJob(handle, true, 0, cv::Mat_<cv::Point2f>(objectToPoints.second));
+            ++nObjectJobs;
         }
     }
 
-    for (auto& objectToPoints : objectToPointMapping) {
-        mEstimatePose3D(objectToPoints.first,
-                        objectToPoints.second.first,
-                        cv::Mat_<cv::Point2f>(objectToPoints.second.second),
-                        objects);
+    //Solve the poses, in parallel when there are several objects, which are
+    //solved iteratively, whereas tags are solved in closed form
+    mSolutions.resize(mJobs.size());
+    int nWorkers = std::min<int>(cv::getNumThreads(), mJobs.size());
+    if (nObjectJobs < 2 || nWorkers < 2)
+        nWorkers = 1;
+    if (mWorkspaces.size() < (std::size_t) nWorkers)
+        mWorkspaces.resize(nWorkers);
+    if (nWorkers > 1)
+        cv::parallel_for_(cv::Range(0, nWorkers), SolveJobs(*this, nWorkers));
+    else
+        SolveJobs(*this, 1)(cv::Range(0, 1));
+
+    //Update the filter with the solutions, always in the same order
+    for (std::size_t job = 0; job < mJobs.size(); ++job) {
+        int handle = mJobs[job].handle;
+        int &index = mPoseIndex[handle];
+        if (index < 0) {
+            index = poses.size();
+            poses.push_back({handle, TransformMatrix()});
+        }
+        mEstimatePose3D.update(handle, mSolutions[job], poses[index].transform);
     }
+    mJobs.clear();
+
+    //Sort the poses by handle, and leave the index clean for the next call
+    std::sort(poses.begin(), poses.end(),
+              [](const ObjectPose &a, const ObjectPose &b) {
+                  return a.handle < b.handle;
+              });
+    for (const auto &pose : poses)
+        mPoseIndex[pose.handle] = -1;
+}
 
-    return objects;
+int getObjectHandle(const std::string &name) const {
+    auto it = mObjectHandles.find(name);
+    if (it != mObjectHandles.end())
+        return it->second;
+
+    int id;
+    char trailing;
+    if (std::sscanf(name.c_str(), "tag_%d%c", &id, &trailing) == 1)
+        return getTagHandle(id);
+    return -1;
+}
+
+int getTagHandle(int id) const {
+    if (id < 0 || id >= N_TAG_IDS)
+        return -1;
+    return mObjectPoints.size() + id;
+}
+
+const std::string &getObjectName(int handle) const {
+    static const std::string NO_NAME;
+    if (handle < 0 || handle >= (int) mObjectNames.size())
+        return NO_NAME;
+    return mObjectNames[handle];
 }
 
 TagPoseMap estimate(
@@ -132,22 +281,32 @@ TagPoseMap estimate(
 }
 
 void setDefaultTagSize(RealT defaultSize){
-    mDefaultTagCorners = {
-        cv::Point3_<RealT>(0.f, 0.f, 0.f),
-        cv::Point3_<RealT>(defaultSize, 0.f, 0.f),
-        cv::Point3_<RealT>(defaultSize, defaultSize, 0.f),
-        cv::Point3_<RealT>(0.f, defaultSize, 0.f),
-    };
+    if (!isValidTagSize(defaultSize)) {
+        std::cerr << "Ignoring invalid default tag size " << defaultSize << std::endl;
+        return;
+    }
+    mDefaultTagSize = defaultSize;
 }
 
 void enableFilter(bool enabled){
     mEstimatePose3D.enableFilter(enabled);
 }
 
+void enableUndistortionLut(bool enabled){
+    mUndistortionLutEnabled = enabled;
+    mEstimatePose3D.setUndistortLut(
+        enabled ? mCameraResolution : cv::Size(), UNDISTORTION_LUT_STEP,
+        mUndistortionLutCache);
+}
+
 void setPersistence(RealT persistence){
     mEstimatePose3D.setFilterPersistence(persistence);
 }
 
+void setFilterMaxObjects(int maxObjects){
+    mEstimatePose3D.setFilterMaxObjects(maxObjects);
+}
+
 void setFilterProcessNoiseCovariance(cv::Mat const& covariance){
     mEstimatePose3D.setFilterProcessNoiseCovariance(covariance);
 }
@@ -159,6 +318,22 @@ void setFilterObservationNoiseCovariance(cv::Mat const& covariance){
 bool read3DConfiguration(const std::string &filenameOrString, bool omitOtherTags, bool readFromString) {
     mOmitOtherTags = omitOtherTags;
 
+    std::vector<TagEntry> tagEntries(N_TAG_IDS);
+    std::vector<cv::Point3_<RealT> > tagCorners;
+    std::vector<std::string> objectNames;
+
+    if (!readFromString) {
+        MappedFile file(filenameOrString);
+        if (hasMagic(file, CONFIGURATION_MAGIC)) {
+            if (!readBinaryConfiguration(file, tagEntries, tagCorners, objectNames)) {
+                std::cerr << "Invalid tag configuration: " << filenameOrString << std::endl;
+                return false;
+            }
+            setConfiguration(tagEntries, tagCorners, objectNames);
+            return true;
+        }
+    }
+
     int mode;
     if(readFromString)
         mode = cv::FileStorage::READ + cv::FileStorage::MEMORY;
@@ -176,8 +351,9 @@ bool read3DConfiguration(const std::string &filenameOrString, bool omitOtherTags
         return false;
     }
 
-    mId2Configuration.clear();
     for(const auto &objectConfig : configuration.root()) {
+        int handle = objectNames.size();
+        objectNames.push_back(objectConfig.name());
         for(const auto &tagConfig : objectConfig) {
             int id;
             tagConfig["tag"] >> id;
@@ -192,40 +368,135 @@ bool read3DConfiguration(const std::string &filenameOrString, bool omitOtherTags
                 tagConfig["rotation"]   [i] >> rotation   [i];
             }
 
-            mId2Configuration[id] = std::make_pair(
-                objectConfig.name(),
-                TagConfig(id, size, keep, cv::Vec3f(translation), cv::Vec3f(rotation)));
+            if (id < 0 || id >= N_TAG_IDS) {
+                std::cerr << "Ignoring tag " << id << " of " << objectConfig.name() << std::endl;
+                continue;
+            }
+            if (!isValidTagSize(size)) {
+                std::cerr << "Invalid size " << size << " of tag " << id
+                          << " of " << objectConfig.name() << std::endl;
+                return false;
+            }
+
+            TagEntry &entry = tagEntries[id];
+            entry.object = handle;
+            entry.cornerOffset = tagCorners.size();
+            entry.size = size;
+            entry.keep = keep;
+            tagCorners.resize(tagCorners.size() + 4);
+            computeCorners(size, cv::Vec<RealT,3>(translation), cv::Vec<RealT,3>(rotation),
+                           &tagCorners[entry.cornerOffset]);
         }
     }
+    setConfiguration(tagEntries, tagCorners, objectNames);
 
     return true;
 }
 
+bool write3DConfiguration(const std::string &filename) const {
+    int nObjects = mObjectPoints.size();
+
+    std::string names;
+    for (int handle = 0; handle < nObjects; ++handle) {
+        names += mObjectNames[handle];
+        names += '\0';
+    }
+
+    std::vector<BinaryTag> tags;
+    for (int id = 0; id < N_TAG_IDS; ++id) {
+        const TagEntry &entry = mTagEntries[id];
+        if (entry.object < 0)
+            continue;
+        BinaryTag tag;
+        tag.id = id;
+        tag.object = entry.object;
+        tag.keep = entry.keep;
+        tag.size = entry.size;
+        for (int i : {0, 1, 2, 3}) {
+            const cv::Point3_<RealT> &corner = mTagCorners[entry.cornerOffset + i];
+            tag.corners[i][0] = corner.x;
+            tag.corners[i][1] = corner.y;
+            tag.corners[i][2] = corner.z;
+        }
+        tags.push_back(tag);
+    }
+
+    ConfigurationHeader header;
+    std::memcpy(header.magic, CONFIGURATION_MAGIC, sizeof(header.magic));
+    header.version = BINARY_VERSION;
+    header.nObjects = nObjects;
+    header.nTags = tags.size();
+    header.namesSize = names.size();
+    header.padding = 0;
+
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    file.write((const char *) &header, sizeof(header));
+    file.write((const char *) tags.data(), tags.size()*sizeof(BinaryTag));
+    file.write(names.data(), names.size());
+    return (bool) file;
+}
+
 /** Sets new camera calibration values.
  */
 void setCalibration(cv::InputArray newCameraMatrix,
                     cv::InputArray newDistCoeffs){
-    mEstimatePose3D.setCameraCalibration(newCameraMatrix.getMat(), newDistCoeffs.getMat());
+    mUndistortionLutCache.clear();
+    updateCalibration(newCameraMatrix.getMat(), newDistCoeffs.getMat());
 }
 
-cv::Size readCalibration(const std::string &filename) {
+cv::Size readCalibration(const std::string &filename, bool cacheUndistortionLut) {
     cv::Size size;
-    cv::FileStorage fs(filename, cv::FileStorage::READ);
     cv::Mat distCoeffs, cameraMatrix;
-    fs["image_width"]             >> size.width;
-    fs["image_height"]            >> size.height;
-    fs["distortion_coefficients"] >> distCoeffs;
-    fs["camera_matrix"]           >> cameraMatrix;
+
+    MappedFile file(filename);
+    if (hasMagic(file, CALIBRATION_MAGIC)) {
+        if (!readBinaryCalibration(file, size, cameraMatrix, distCoeffs)) {
+            std::cerr << "Invalid calibration: " << filename << std::endl;
+            return cv::Size();
+        }
+    }
+    else {
+        cv::FileStorage fs(filename, cv::FileStorage::READ);
+        fs["image_width"]             >> size.width;
+        fs["image_height"]            >> size.height;
+        fs["distortion_coefficients"] >> distCoeffs;
+        fs["camera_matrix"]           >> cameraMatrix;
+    }
 
     if( distCoeffs.type() != CV_32F )
         distCoeffs = cv::Mat_<float>(distCoeffs);
     if( cameraMatrix.type() != CV_32F )
         cameraMatrix = cv::Mat_<float>(cameraMatrix);
-    mEstimatePose3D.setCameraCalibration(cameraMatrix, distCoeffs);
+    //The lookup table, if enabled, has the size of the calibrated images
+    mCameraResolution = size;
+    mUndistortionLutCache = cacheUndistortionLut ? filename + ".lut" : std::string();
+    updateCalibration(cameraMatrix, distCoeffs);
 
     return size;
 }
 
+bool writeCalibration(const std::string &filename) const {
+    cv::Mat_<double> cameraMatrix(getCameraMatrix());
+    cv::Mat_<double> distCoeffs(getDistortionCoeffs());
+    if (cameraMatrix.total() != 9)
+        return false;
+
+    CalibrationHeader header;
+    std::memcpy(header.magic, CALIBRATION_MAGIC, sizeof(header.magic));
+    header.version = BINARY_VERSION;
+    header.width = mCameraResolution.width;
+    header.height = mCameraResolution.height;
+    header.nDistCoeffs = distCoeffs.total();
+    header.padding = 0;
+    std::copy(cameraMatrix.begin(), cameraMatrix.end(), header.cameraMatrix);
+    std::vector<double> coefficients(distCoeffs.begin(), distCoeffs.end());
+
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    file.write((const char *) &header, sizeof(header));
+    file.write((const char *) coefficients.data(), coefficients.size()*sizeof(double));
+    return (bool) file;
+}
+
 const cv::Mat &getCameraMatrix()     const {
     return mEstimatePose3D.getCameraMatrix();
 }
@@ -235,78 +506,274 @@ const cv::Mat &getDistortionCoeffs() const {
 
 private:
 
-struct TagConfig {
-    TagConfig() :
-        mId(-1),
-        mSize(-1.f),
-        mKeep(false),
-        mCorners(4),
-        mLocalcorners(4)
+/** The configuration of a tag, compiled for lookup by id. */
+struct TagEntry {
+    TagEntry() :
+        object(-1),
+        cornerOffset(0),
+        size(0),
+        keep(false)
     {
     }
 
-    TagConfig(int id, RealT size, bool keep, cv::Vec<RealT,3> translation, cv::Vec<RealT,3> rotation) :
-        mId(id),
-        mSize(size),
-        mKeep(keep),
-        mCorners(4),
-        mLocalcorners(4)
+    int object;         // handle of the object, or -1 if the tag is in none
+    int cornerOffset;   // index of the first corner of the tag in mTagCorners
+    RealT size;
+    bool keep;
+};
+
+/** Sets the calibration, and computes the undistortion lookup table for it
+ * only once. */
+void updateCalibration(const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs) {
+    mEstimatePose3D.setUndistortLut(cv::Size(), UNDISTORTION_LUT_STEP);
+    mEstimatePose3D.setCameraCalibration(cameraMatrix, distCoeffs);
+    enableUndistortionLut(mUndistortionLutEnabled);
+}
+
+/** Compiles the tags of a configuration in the binary format.
+ * \returns whether the file is consistent. */
+static bool readBinaryConfiguration(const MappedFile &file,
+                                    std::vector<TagEntry> &tagEntries,
+                                    std::vector<cv::Point3_<RealT> > &tagCorners,
+                                    std::vector<std::string> &objectNames) {
+    ConfigurationHeader header;
+    if (file.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.version != BINARY_VERSION
+        || header.nObjects < 0
+        || header.nTags < 0 || header.nTags > N_TAG_IDS
+        || header.namesSize < 0
+        || header.nObjects > header.namesSize     // each name ends with '\0'
+        || file.size() != sizeof(header) + header.nTags*sizeof(BinaryTag) + header.namesSize)
+        return false;
+
+    const char *names = file.data() + sizeof(header) + header.nTags*sizeof(BinaryTag);
+    const char *namesEnd = names + header.namesSize;
+    objectNames.reserve(header.nObjects);
+    for (int handle = 0; handle < header.nObjects; ++handle) {
+        const char *nameEnd = std::find(names, namesEnd, '\0');
+        if (nameEnd == namesEnd)
+            return false;
+        objectNames.push_back(std::string(names, nameEnd));
+        names = nameEnd + 1;
+    }
+
+    const BinaryTag *tags = reinterpret_cast<const BinaryTag *>(file.data() + sizeof(header));
+    tagCorners.resize(4*header.nTags);
+    for (int i = 0; i < header.nTags; ++i) {
+        const BinaryTag &tag = tags[i];
+        if (tag.id < 0 || tag.id >= N_TAG_IDS
+            || tag.object < 0 || tag.object >= header.nObjects
+            || !isValidTagSize(tag.size))
+            return false;
+
+        TagEntry &entry = tagEntries[tag.id];
+        entry.object = tag.object;
+        entry.cornerOffset = 4*i;
+        entry.size = tag.size;
+        entry.keep = tag.keep;
+        for (int j : {0, 1, 2, 3})
+            tagCorners[4*i+j] = cv::Point3_<RealT>(
+                tag.corners[j][0], tag.corners[j][1], tag.corners[j][2]);
+    }
+    return true;
+}
+
+/** Reads a calibration in the binary format.
+ * \returns whether the file is consistent. */
+static bool readBinaryCalibration(const MappedFile &file, cv::Size &size,
+                                  cv::Mat &cameraMatrix, cv::Mat &distCoeffs) {
+    CalibrationHeader header;
+    if (file.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.version != BINARY_VERSION
+        || header.width <= 0 || header.height <= 0
+        || !isValidDistCoeffsCount(header.nDistCoeffs)
+        || file.size() != sizeof(header) + header.nDistCoeffs*sizeof(double))
+        return false;
+    for (double entry : header.cameraMatrix)
+        if (!std::isfinite(entry))
+            return false;
+
+    size = cv::Size(header.width, header.height);
+    cameraMatrix = cv::Mat(3, 3, CV_64F, header.cameraMatrix).clone();
+    distCoeffs = cv::Mat(header.nDistCoeffs, 1, CV_64F,
+                         const_cast<char *>(file.data() + sizeof(header))).clone();
+    return true;
+}
+
+/** Replaces the configuration by the given compiled one. */
+void setConfiguration(std::vector<TagEntry> &tagEntries,
+                      std::vector<cv::Point3_<RealT> > &tagCorners,
+                      const std::vector<std::string> &objectNames) {
+    setObjects(objectNames);
+
+    mTagEntries.swap(tagEntries);
+    mTagCorners.swap(tagCorners);
+
+    //Reserve the points of all the tags of each object, so that assembling
+    //them does not allocate
+    std::vector<int> nCorners(objectNames.size(), 0);
+    for (const auto &entry : mTagEntries)
+        if (entry.object >= 0)
+            nCorners[entry.object] += 4;
+    for (std::size_t handle = 0; handle < nCorners.size(); ++handle) {
+        mObjectPoints[handle].first.reserve(nCorners[handle]);
+        mObjectPoints[handle].second.reserve(nCorners[handle]);
+    }
+}
+
+/** Resolves the handles of the given objects, and of the tags after them. */
+void setObjects(const std::vector<std::string> &objectNames) {
+    int nObjects = objectNames.size();
+
+    mObjectNames = objectNames;
+    mObjectNames.reserve(nObjects + N_TAG_IDS);
+    for (int id = 0; id < N_TAG_IDS; ++id)
+        mObjectNames.push_back(cv::format("tag_%d", id));
+
+    mObjectHandles.clear();
+    for (int handle = 0; handle < nObjects; ++handle)
+        mObjectHandles[objectNames[handle]] = handle;
+
+    mObjectPoints.assign(nObjects, std::make_pair(
+        std::vector<cv::Point3_<RealT> >(), std::vector<cv::Point2f>()));
+    mPoseIndex.assign(nObjects + N_TAG_IDS, -1);
+
+    //The filtered poses refer to the previous handles
+    mEstimatePose3D.resetFilter();
+}
+
+/** A pose to compute: of an object of the configuration, or of a tag of the
+ * given size. */
+struct Job {
+    int handle;
+    bool isObject;
+    RealT size;     // of the tag, unused for an object
+    cv::Mat_<cv::Point2f> imagePoints;
+};
+
+/** Schedules the computation of the pose of the given object or tag. The
+ * image points are not copied, and must outlive the computation. */
+void addJob(int handle, bool isObject, RealT size, cv::Mat_<cv::Point2f> const& imagePoints) {
+    mJobs.push_back(Job());
+    mJobs.back().handle = handle;
+    mJobs.back().isObject = isObject;
+    mJobs.back().size = size;
+    mJobs.back().imagePoints = imagePoints;
+}
+
+/** Computes the poses of the scheduled jobs, each worker taking every
+ * nWorkers-th job with its own workspace. */
+class SolveJobs : public cv::ParallelLoopBody {
+public:
+    SolveJobs(Impl &impl, int nWorkers) :
+        mImpl(impl),
+        mNWorkers(nWorkers)
     {
-        mLocalcorners[0] = cv::Point3_<RealT>(0.f, 0.f, 0.f);
-        mLocalcorners[1] = cv::Point3_<RealT>(size, 0.f, 0.f);
-        mLocalcorners[2] = cv::Point3_<RealT>(size, size, 0.f);
-        mLocalcorners[3] = cv::Point3_<RealT>(0.f, size, 0.f);
-
-
-        // Rotation matrix computation: cf The Matrix and Quaternions FAQ
-        // http://www.cs.princeton.edu/~gewang/projects/darth/stuff/quat_faq.html#Q36
-
-        static const RealT DEG2RAD = 3.141593f / 180.f;
-        auto A = cos(rotation[0] * DEG2RAD);
-        auto B = sin(rotation[0] * DEG2RAD);
-        auto C = cos(rotation[1] * DEG2RAD);
-        auto D = sin(rotation[1] * DEG2RAD);
-        auto E = cos(rotation[2] * DEG2RAD);
-        auto F = sin(rotation[2] * DEG2RAD);
-
-        TransformMatrix transformation(
-            C*E,        -C*F,    D, translation[0],
-            B*D*E+A*F,  -B*D*F+A*E, -B*C, translation[1],
-            -A*D*E+B*F,   A*D*F+B*E,  A*C, translation[2],
-            0.f,          0.f,   0.f, 1.f             );
-
-        for (auto i : {0, 1, 2, 3}) {
-            auto corner = transformation*cv::Matx<RealT, 4, 1>(mLocalcorners[i].x, mLocalcorners[i].y, 0.f, 1.f);
-            mCorners[i] = cv::Point3_<RealT>(corner(0), corner(1), corner(2));
+    }
+
+    void operator()(const cv::Range &workers) const {
+        for (int worker = workers.start; worker < workers.end; ++worker) {
+            auto &workspace = mImpl.mWorkspaces[worker];
+            for (std::size_t job = worker; job < mImpl.mJobs.size(); job += mNWorkers) {
+                const Job &toSolve = mImpl.mJobs[job];
+                if (toSolve.isObject)
+                    mImpl.mEstimatePose3D.solve(
+                        toSolve.handle, mImpl.mObjectPoints[toSolve.handle].first, toSolve.imagePoints,
+                        mImpl.mSolutions[job], workspace, true);
+                else
+                    mImpl.mEstimatePose3D.solve(
+                        toSolve.handle, toSolve.size, toSolve.imagePoints,
+                        mImpl.mSolutions[job], workspace, true);
+            }
         }
     }
 
-    int mId;
-    float mSize;
-    bool mKeep;
+private:
+    Impl &mImpl;
+    int mNWorkers;
+};
 
-    // this array stores the 3D location of the
-    // 4 corners of the tag *in the parent
-    // object frame*. It is automatically computed.
-    std::vector<cv::Point3_<RealT> > mCorners;
 
-    // this array stores the 3D location of the
-    // 4 corners of the tag *in the tag
-    // own frame*. It is automatically computed.
-    std::vector<cv::Point3_<RealT> > mLocalcorners;
-};
+/** Computes the 4 corners of a tag of the given size, translation and
+ * rotation (in degrees) in the frame of its object. */
+static void computeCorners(RealT size,
+                           cv::Vec<RealT,3> translation,
+                           cv::Vec<RealT,3> rotation,
+                           cv::Point3_<RealT> *corners) {
+    // Rotation matrix computation: cf The Matrix and Quaternions FAQ
+    // http://www.cs.princeton.edu/~gewang/projects/darth/stuff/quat_faq.html#Q36
+
+    static const RealT DEG2RAD = 3.141593f / 180.f;
+    auto A = cos(rotation[0] * DEG2RAD);
+    auto B = sin(rotation[0] * DEG2RAD);
+    auto C = cos(rotation[1] * DEG2RAD);
+    auto D = sin(rotation[1] * DEG2RAD);
+    auto E = cos(rotation[2] * DEG2RAD);
+    auto F = sin(rotation[2] * DEG2RAD);
+
+    TransformMatrix transformation(
+        C*E,        -C*F,    D, translation[0],
+        B*D*E+A*F,  -B*D*F+A*E, -B*C, translation[1],
+        -A*D*E+B*F,   A*D*F+B*E,  A*C, translation[2],
+        0.f,          0.f,   0.f, 1.f             );
+
+    const RealT localCorners[4][2] = {{0.f, 0.f}, {size, 0.f}, {size, size}, {0.f, size}};
+    for (auto i : {0, 1, 2, 3}) {
+        auto corner = transformation*cv::Matx<RealT, 4, 1>(localCorners[i][0], localCorners[i][1], 0.f, 1.f);
+        corners[i] = cv::Point3_<RealT>(corner(0), corner(1), corner(2));
+    }
+}
 
 Chilitags mChilitags;
 
 EstimatePose3D<RealT> mEstimatePose3D;
 
+// the size of the camera images, and whether to undistort their points with
+// a lookup table of this size, cached in the given file if any
+cv::Size mCameraResolution;
+bool mUndistortionLutEnabled;
+std::string mUndistortionLutCache;
+
 bool mOmitOtherTags;
 
-std::vector<cv::Point3_<RealT> > mDefaultTagCorners;
+RealT mDefaultTagSize;
+
+// the configuration of each tag id, and the corners of the configured tags
+// in the frames of their objects, 4 by 4
+std::vector<TagEntry> mTagEntries;
+std::vector<cv::Point3_<RealT> > mTagCorners;
+
+// the names of the handles: the objects of the configuration, then the tags
+std::vector<std::string> mObjectNames;
+
+// the handles of the objects of the configuration
+std::map<std::string, int> mObjectHandles;
+
+// the points of each object of the configuration, in the object and in the
+// frame, reused from one frame to the next
+std::vector<std::pair<
+    std::vector<cv::Point3_<RealT> >,
+    std::vector<cv::Point2f> > > mObjectPoints;
+
+// the index in the output list of the pose of each handle, or -1
+std::vector<int> mPoseIndex;
+
+// the undistorted corners of the tags of the current frame, 4 by 4
+std::vector<cv::Point2f> mCorners;
+
+// the poses to compute in the current frame, and their solutions
+std::vector<Job> mJobs;
+std::vector<typename EstimatePose3D<RealT>::Solution> mSolutions;
+
+// the scratch memory of each worker computing poses
+std::vector<typename EstimatePose3D<RealT>::Workspace> mWorkspaces;
 
-// associates a tag id with an object name and the configuration of the tag
-// in this object
-std::map<int, std::pair<std::string, TagConfig> > mId2Configuration;
+// the poses behind the string map returned by estimate()
+ObjectPoseList mPoses;
 };
 
 template<typename RealT>
@@ -332,6 +799,30 @@ typename Chilitags3D_<RealT>::TagPoseMap Chilitags3D_<RealT>::estimate(
     return mImpl->estimate(tags, camDeltaR, camDeltaX);
 }
 
+template<typename RealT>
+void Chilitags3D_<RealT>::estimateByHandle(
+    const TagCornerMap &tags,
+    ObjectPoseList &poses,
+    cv::Vec<RealT, 4> const& camDeltaR,
+    cv::Vec<RealT, 3> const& camDeltaX) {
+    mImpl->estimateByHandle(tags, poses, camDeltaR, camDeltaX);
+}
+
+template<typename RealT>
+int Chilitags3D_<RealT>::getObjectHandle(const std::string &name) const {
+    return mImpl->getObjectHandle(name);
+}
+
+template<typename RealT>
+int Chilitags3D_<RealT>::getTagHandle(int id) const {
+    return mImpl->getTagHandle(id);
+}
+
+template<typename RealT>
+const std::string &Chilitags3D_<RealT>::getObjectName(int handle) const {
+    return mImpl->getObjectName(handle);
+}
+
 template<typename RealT>
 typename Chilitags3D_<RealT>::TagPoseMap Chilitags3D_<RealT>::estimate(
     const cv::Mat &inputImage,
@@ -356,6 +847,11 @@ void Chilitags3D_<RealT>::setPersistence(RealT persistence){
     mImpl->setPersistence(persistence);
 }
 
+template<typename RealT>
+void Chilitags3D_<RealT>::setFilterMaxObjects(int maxObjects){
+    mImpl->setFilterMaxObjects(maxObjects);
+}
+
 template<typename RealT>
 void Chilitags3D_<RealT>::setFilterProcessNoiseCovariance(cv::Mat const& covariance){
     mImpl->setFilterProcessNoiseCovariance(covariance);
@@ -371,6 +867,11 @@ bool Chilitags3D_<RealT>::readTagConfiguration(const std::string &filenameOrStri
     return mImpl->read3DConfiguration(filenameOrString, omitOtherTags, readFromString);
 }
 
+template<typename RealT>
+bool Chilitags3D_<RealT>::writeTagConfiguration(const std::string &filename) const {
+    return mImpl->write3DConfiguration(filename);
+}
+
 template<typename RealT>
 void Chilitags3D_<RealT>::setCalibration(
     cv::InputArray newCameraMatrix,
@@ -379,8 +880,19 @@ void Chilitags3D_<RealT>::setCalibration(
 }
 
 template<typename RealT>
-cv::Size Chilitags3D_<RealT>::readCalibration(const std::string &filename){
-    return mImpl->readCalibration(filename);
+void Chilitags3D_<RealT>::enableUndistortionLut(bool enabled){
+    mImpl->enableUndistortionLut(enabled);
+}
+
+template<typename RealT>
+cv::Size Chilitags3D_<RealT>::readCalibration(const std::string &filename,
+                                              bool cacheUndistortionLut){
+    return mImpl->readCalibration(filename, cacheUndistortionLut);
+}
+
+template<typename RealT>
+bool Chilitags3D_<RealT>::writeCalibration(const std::string &filename) const {
+    return mImpl->writeCalibration(filename);
 }
 
 template<typename RealT>
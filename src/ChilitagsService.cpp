@@ -0,0 +1,416 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include <chilitags.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef HAS_MULTITHREADING
+#include <pthread.h>
+#endif
+
+namespace chilitags {
+
+class ChilitagsService::Impl
+{
+
+public:
+
+Impl(int nWorkers, int maxQueuedFrames) :
+    mStreams(),
+    mNextStream(0),
+    mMaxQueuedFrames(std::max(1, maxQueuedFrames))
+#ifdef HAS_MULTITHREADING
+    ,mWorkers(),
+    mRunning(true),
+    mScheduledStreams(0),
+    mLock(PTHREAD_MUTEX_INITIALIZER),
+    mWorkAvailable(PTHREAD_COND_INITIALIZER),
+    mIdle(PTHREAD_COND_INITIALIZER)
+#endif
+{
+#ifdef HAS_MULTITHREADING
+    if (nWorkers <= 0) nWorkers = std::max(1u, std::thread::hardware_concurrency());
+    mWorkers.resize(nWorkers);
+    for (int i = 0; i < nWorkers; ++i) {
+        mWorkers[i].service = this;
+        mWorkers[i].index = i;
+        if (pthread_create(&mWorkers[i].thread, NULL, dispatchRun, (void*)&mWorkers[i])) {
+            std::cerr << "Error: Thread could not be launched in " << __PRETTY_FUNCTION__
+                      << ", not enough resources or PTHREAD_THREADS_MAX was hit!" << std::endl;
+            mWorkers.resize(i);
+            break;
+        }
+    }
+    if (mWorkers.empty())
+        std::cerr << "Warning: No worker could be launched in " << __PRETTY_FUNCTION__
+                  << ", the frames are processed in push()" << std::endl;
+#else
+    (void) nWorkers;
+#endif
+}
+
+~Impl()
+{
+#ifdef HAS_MULTITHREADING
+    pthread_mutex_lock(&mLock);
+    mRunning = false;
+    pthread_cond_broadcast(&mWorkAvailable);
+    pthread_mutex_unlock(&mLock);
+    for (auto &worker : mWorkers) pthread_join(worker.thread, NULL);
+#endif
+}
+
+int addStream(Callback callback, Chilitags::DetectionTrigger detectionTrigger)
+{
+    // The detection already runs in the threads of the service
+    if (detectionTrigger == Chilitags::ASYNC_DETECT_PERIODICALLY)
+        detectionTrigger = Chilitags::DETECT_PERIODICALLY;
+    else if (detectionTrigger == Chilitags::ASYNC_DETECT_ALWAYS)
+        detectionTrigger = Chilitags::TRACK_AND_DETECT;
+
+    lock();
+    int stream = mNextStream++;
+    mStreams[stream].reset(new Stream(callback, detectionTrigger));
+    unlock();
+    return stream;
+}
+
+void removeStream(int stream)
+{
+    lock();
+    auto it = mStreams.find(stream);
+    if (it != mStreams.end()) {
+        // A scheduled stream is removed by the worker which takes it
+        if (it->second->scheduled) {
+            it->second->removed = true;
+            it->second->frames.clear();
+        }
+        else mStreams.erase(it);
+    }
+    unlock();
+}
+
+Chilitags &getDetector(int stream)
+{
+    lock();
+    Chilitags &detector = getStream(stream).detector;
+    unlock();
+    return detector;
+}
+
+int getDroppedFrames(int stream)
+{
+    lock();
+    int dropped = getStream(stream).dropped;
+    unlock();
+    return dropped;
+}
+
+#ifdef HAS_MULTITHREADING
+
+bool push(int stream, const cv::Mat &frame)
+{
+    // Copy the frame out of the lock, in a recycled buffer
+    cv::Mat buffer;
+    lock();
+    Stream *queue = &getStream(stream);
+    if (!queue->spareFrames.empty()) {
+        buffer = queue->spareFrames.back();
+        queue->spareFrames.pop_back();
+    }
+    unlock();
+
+    frame.copyTo(buffer);
+
+    lock();
+    auto it = mStreams.find(stream);
+    if (it == mStreams.end() || it->second->removed) {
+        unlock();
+        return true;
+    }
+    queue = it->second.get();
+
+    bool dropped = false;
+    if ((int) queue->frames.size() >= mMaxQueuedFrames) {
+        queue->spareFrames.push_back(queue->frames.front().second);
+        queue->frames.pop_front();
+        ++queue->dropped;
+        dropped = true;
+    }
+    queue->frames.push_back(std::make_pair(queue->nextFrame++, buffer));
+
+    // The frames of a stream are processed one at a time, in order: the
+    // stream is given to a worker only if it is not already scheduled
+    if (!queue->scheduled && !mWorkers.empty()) {
+        queue->scheduled = true;
+        ++mScheduledStreams;
+        Worker *leastBusy = &mWorkers[0];
+        for (auto &worker : mWorkers) {
+            if (worker.tasks.size() < leastBusy->tasks.size()) leastBusy = &worker;
+        }
+        leastBusy->tasks.push_back(stream);
+        pthread_cond_signal(&mWorkAvailable);
+    }
+    else if (!queue->scheduled) {
+        // Without workers, the caller processes the frames of the stream,
+        // including the ones pushed concurrently while it does
+        queue->scheduled = true;
+        ++mScheduledStreams;
+        while (!queue->removed && !queue->frames.empty()) processNextFrame(stream, *queue);
+        unschedule(stream);
+    }
+    unlock();
+
+    return !dropped;
+}
+
+void waitUntilIdle()
+{
+    lock();
+    while (mScheduledStreams > 0) pthread_cond_wait(&mIdle, &mLock);
+    unlock();
+}
+
+#else
+
+bool push(int stream, const cv::Mat &frame)
+{
+    Stream &queue = getStream(stream);
+    TagCornerMap tags = queue.detector.find(frame, queue.trigger);
+    if (queue.callback) queue.callback(stream, queue.nextFrame, tags);
+    ++queue.nextFrame;
+    return true;
+}
+
+void waitUntilIdle()
+{
+}
+
+#endif
+
+protected:
+
+struct Stream {
+    Stream(Callback callback, Chilitags::DetectionTrigger trigger) :
+        detector(),
+        callback(callback),
+        trigger(trigger),
+        frames(),
+        spareFrames(),
+        nextFrame(0),
+        dropped(0),
+        scheduled(false),
+        removed(false)
+    {
+    }
+
+    Chilitags detector;
+    Callback callback;
+    Chilitags::DetectionTrigger trigger;
+    std::deque<std::pair<int, cv::Mat> > frames;   ///< waiting frames and their index
+    std::vector<cv::Mat> spareFrames;               ///< buffers of the processed frames
+    int nextFrame;
+    int dropped;
+    bool scheduled;             ///< waiting in the tasks of a worker, or being processed
+    bool removed;
+};
+
+std::map<int, std::unique_ptr<Stream> > mStreams;
+int mNextStream;
+int mMaxQueuedFrames;
+
+/**
+ * Must be called with the lock held, which is released before throwing
+ * std::out_of_range if the stream does not exist.
+ */
+Stream &getStream(int stream)
+{
+    auto it = mStreams.find(stream);
+    if (it == mStreams.end()) {
+        unlock();
+        throw std::out_of_range("ChilitagsService: no such stream");
+    }
+    return *it->second;
+}
+
+#ifdef HAS_MULTITHREADING
+
+struct Worker {
+    Impl *service;
+    int index;
+    pthread_t thread;
+    std::deque<int> tasks;      ///< ids of the scheduled streams
+};
+
+std::vector<Worker> mWorkers;
+bool mRunning;
+int mScheduledStreams;
+
+pthread_mutex_t mLock;
+pthread_cond_t mWorkAvailable;
+pthread_cond_t mIdle;
+
+void lock() {
+    pthread_mutex_lock(&mLock);
+}
+
+void unlock() {
+    pthread_mutex_unlock(&mLock);
+}
+
+static void* dispatchRun(void* args)
+{
+    Worker *worker = static_cast<Worker*>(args);
+    worker->service->run(worker->index);
+    return NULL;
+}
+
+/**
+ * Takes the next stream from the tasks of the given worker, or steals one
+ * from the other workers, starting from the end of their tasks.
+ */
+bool takeTask(int index, int &stream)
+{
+    std::deque<int> &tasks = mWorkers[index].tasks;
+    if (!tasks.empty()) {
+        stream = tasks.front();
+        tasks.pop_front();
+        return true;
+    }
+    for (size_t i = 1; i < mWorkers.size(); ++i) {
+        std::deque<int> &otherTasks = mWorkers[(index+i) % mWorkers.size()].tasks;
+        if (!otherTasks.empty()) {
+            stream = otherTasks.back();
+            otherTasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Processes the oldest waiting frame of the stream, out of the lock, which
+ * must be held when calling.
+ */
+void processNextFrame(int stream, Stream &queue)
+{
+    std::pair<int, cv::Mat> frame = queue.frames.front();
+    queue.frames.pop_front();
+    unlock();
+
+    TagCornerMap tags = queue.detector.find(frame.second, queue.trigger);
+    if (queue.callback) queue.callback(stream, frame.first, tags);
+
+    lock();
+    queue.spareFrames.push_back(frame.second);
+}
+
+/**
+ * Marks the stream as not scheduled anymore, removing it if requested.
+ */
+void unschedule(int stream)
+{
+    auto it = mStreams.find(stream);
+    it->second->scheduled = false;
+    if (it->second->removed) mStreams.erase(it);
+    if (--mScheduledStreams == 0) pthread_cond_broadcast(&mIdle);
+}
+
+void run(int index)
+{
+    lock();
+    while (true) {
+        int stream;
+        while (mRunning && !takeTask(index, stream))
+            pthread_cond_wait(&mWorkAvailable, &mLock);
+        if (!mRunning) break;
+
+        Stream &queue = *mStreams[stream];
+        if (queue.removed || queue.frames.empty()) {
+            unschedule(stream);
+            continue;
+        }
+
+        processNextFrame(stream, queue);
+
+        // Keep the stream on this worker while it has frames waiting, so
+        // that they are processed in order; the idle workers can steal it
+        if (queue.removed || queue.frames.empty()) unschedule(stream);
+        else {
+            std::deque<int> &tasks = mWorkers[index].tasks;
+            tasks.push_back(stream);
+            if (tasks.size() > 1) pthread_cond_signal(&mWorkAvailable);
+        }
+    }
+    unlock();
+}
+
+#else
+
+void lock() {
+}
+
+void unlock() {
+}
+
+#endif
+
+};
+
+ChilitagsService::ChilitagsService(int nWorkers, int maxQueuedFrames) :
+    mImpl(new Impl(nWorkers, maxQueuedFrames))
+{
+}
+
+ChilitagsService::~ChilitagsService() = default;
+
+int ChilitagsService::addStream(Callback callback, Chilitags::DetectionTrigger detectionTrigger) {
+    return mImpl->addStream(callback, detectionTrigger);
+}
+
+void ChilitagsService::removeStream(int stream) {
+    mImpl->removeStream(stream);
+}
+
+Chilitags &ChilitagsService::getDetector(int stream) {
+    return mImpl->getDetector(stream);
+}
+
+bool ChilitagsService::push(int stream, const cv::Mat &frame) {
+    return mImpl->push(stream, frame);
+}
+
+int ChilitagsService::getDroppedFrames(int stream) const {
+    return mImpl->getDroppedFrames(stream);
+}
+
+void ChilitagsService::waitUntilIdle() {
+    mImpl->waitUntilIdle();
+}
+
+} /* namespace chilitags */
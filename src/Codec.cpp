@@ -42,12 +42,7 @@ Codec::Codec(int bitsId, int bitsCrc, int bitsFec, const char *xorMask, const ch
     m_trackedTagsTable(new tag_info_t[m_maxTagsNumber]),
     m_bitsBeforePuncturing((m_bitsId + m_bitsCrc + 2) * 2),
     m_bitsAfterPuncturing(m_bitsId + m_bitsCrc + m_bitsFec),
-    m_puncturing(new unsigned char[m_bitsBeforePuncturing]),
-    m_dec_fec_id(new unsigned char[2 * m_bitsId]),
-    m_hamming_dist(new int[m_bitsId + 1]),
-    m_exploration_level(new int[m_bitsId + 1]),
-    m_fec_state(new int[m_bitsId + 1]),
-    m_fec_decoded_id(new unsigned char[m_bitsId])
+    m_puncturing(new unsigned char[m_bitsBeforePuncturing])
 {
     for (int i = 0; i < m_bitsAfterPuncturing; ++i) {
         m_puncturing[i] = 1;
@@ -83,11 +78,6 @@ Codec::Codec(int bitsId, int bitsCrc, int bitsFec, const char *xorMask, const ch
 Codec::~Codec() {
     delete[] m_trackedTagsTable;
     delete[] m_puncturing;
-    delete[] m_dec_fec_id;
-    delete[] m_hamming_dist;
-    delete[] m_exploration_level;
-    delete[] m_fec_state;
-    delete[] m_fec_decoded_id;
 }
 
 bool Codec::getTagEncodedId(int tagId, unsigned char* data) const {
@@ -180,44 +170,50 @@ int Codec::computeFEC(tag_info_t *tag) {
 bool Codec::decode(const unsigned char *data, int & id) const {
     // depuncture: expand data by adding 0 at places where bits were removed because of puncturing
     // only 20 bits as discussed above
+    decoding_state_t state;
     int data_index = 0;
     for (int i = 0; i < 2 * m_bitsId; i++) {
         if (m_puncturing[i]) {
-            m_dec_fec_id[i] = data[data_index++];
+            state.dec_fec_id[i] = data[data_index++];
         } else {
-            m_dec_fec_id[i] = 0;
+            state.dec_fec_id[i] = 0;
         }
     }
     tag_info_t *tag = 0;
-    if (viterbi(m_dec_fec_id, data, &tag)) {
+    if (viterbi(state, data, &tag)) {
         id = tag->id;
         return true;
     }
     return false;
 }
 
-// param encoded_id: first 20 bits of the tag to decode
+// param state: its dec_fec_id holds the first 20 bits of the tag to decode
 
-bool Codec::viterbi(const unsigned char *encoded_id,
+bool Codec::viterbi(decoding_state_t &state,
                     const unsigned char *tag_data, tag_info_t **tag) const {
+    const unsigned char *encoded_id = state.dec_fec_id;
+    int *hamming_dist = state.hamming_dist;
+    int *exploration_level = state.exploration_level;
+    int *fec_path_state = state.fec_path_state;
+    unsigned char *fec_decoded_id = state.fec_decoded_id;
     *tag = NULL;
-    m_hamming_dist[0] = 0;
+    hamming_dist[0] = 0;
     for (int i = 0; i < m_bitsId + 1; i++) {
-        m_exploration_level[i] = 0;
+        exploration_level[i] = 0;
     }
-    m_hamming_dist[0] = 0;
-    m_fec_state[0] = 0;
+    hamming_dist[0] = 0;
+    fec_path_state[0] = 0;
     int index = 1;
     while (index > 0) {
-        if (m_exploration_level[index] > 1) {
-            m_exploration_level[index] = 0; // reset exploration level for next trial with different previous path
+        if (exploration_level[index] > 1) {
+            exploration_level[index] = 0; // reset exploration level for next trial with different previous path
             index--;
             continue;
         }
-        int input = m_exploration_level[index];
-        m_exploration_level[index]++;
-        m_hamming_dist[index] = m_hamming_dist[index - 1];
-        int output = m_fec_fsm[m_fec_state[index - 1]].output[input]; // expected output for input 0 or 1
+        int input = exploration_level[index];
+        exploration_level[index]++;
+        hamming_dist[index] = hamming_dist[index - 1];
+        int output = m_fec_fsm[fec_path_state[index - 1]].output[input]; // expected output for input 0 or 1
         int diff = output ^ ((encoded_id[(index - 1) * 2] << 1)
                              + encoded_id[(index - 1) * 2 + 1]); // diff between expected and actual data
         // compute hamming distance for this step, ignoring punctured bits
@@ -226,14 +222,14 @@ bool Codec::viterbi(const unsigned char *encoded_id,
             new_dist += (diff & 0x02) ? 1 : 0;
         if (m_puncturing[(index - 1) * 2 + 1])
             new_dist += diff & 0x01;
-        m_hamming_dist[index] += new_dist;
-        if (m_hamming_dist[index] <= 2) { // still valid path, go to next level
-            m_fec_decoded_id[m_bitsId - index] = input;
+        hamming_dist[index] += new_dist;
+        if (hamming_dist[index] <= 2) { // still valid path, go to next level
+            fec_decoded_id[m_bitsId - index] = input;
             if (index == m_bitsId) {
                 int potential_id;
-                bin2int(m_fec_decoded_id, &potential_id, m_bitsId);
+                bin2int(fec_decoded_id, &potential_id, m_bitsId);
                 potential_id ^= m_xorMask;
-                int errors = m_hamming_dist[index];
+                int errors = hamming_dist[index];
                 for (int i = m_bitsId * 2; i < m_bitsAfterPuncturing; i++) {
                     if (m_trackedTagsTable[potential_id].fec[i] != tag_data[i]) {
                         errors++;
@@ -246,8 +242,8 @@ bool Codec::viterbi(const unsigned char *encoded_id,
                     return true;
                 }
             } else {
-                m_fec_state[index]
-                    = m_fec_fsm[m_fec_state[index - 1]].next_state[input];             // update next state
+                fec_path_state[index]
+                    = m_fec_fsm[fec_path_state[index - 1]].next_state[input];             // update next state
                 index++;
             }
         }
@@ -31,7 +31,8 @@ namespace chilitags {
 class Codec {
 public:
 
-/** The default values will code and decode chilitags */
+/** The default values will code and decode chilitags; bitsId can not
+ * exceed MAX_BITS_ID */
 Codec(
     int bitsId = 10,
     int bitsCrc = 16,
@@ -66,7 +67,26 @@ void encode(tag_info_t *tag);
 int computeCRC(tag_info_t *tag);
 int computeFEC(tag_info_t *tag);
 
-bool viterbi(const unsigned char *encoded_id,
+// The maximum number of bits of the identifiers, bounding the size of the
+// decoding tables
+static const int MAX_BITS_ID = 20;
+
+// tables used to save state at each level: avoids recursive calls that would be slower
+// there are 10 levels, corresponding to the 10 bits that have to be extracted, 11 here since
+// some values are referred to in previous levels.
+// They are allocated on the stack of each call to decode(), so that a
+// single codec can decode concurrently from several threads.
+struct decoding_state_t {
+    // fec decodes only the 20 first bits: enough to decode potential IDs
+    // greatly saves time compared to the full Viterbi algorithm
+    unsigned char dec_fec_id[2 * MAX_BITS_ID];
+    int hamming_dist[MAX_BITS_ID + 1];      // hamming distance at level
+    int exploration_level[MAX_BITS_ID + 1]; // number of tests done at this level (max 2, then back to previous level)
+    int fec_path_state[MAX_BITS_ID + 1];   // state of the encoder at level
+    unsigned char fec_decoded_id[MAX_BITS_ID];
+};
+
+bool viterbi(decoding_state_t &state,
              const unsigned char *tag_data, tag_info_t **tag) const;
 
 static void bin2int(const unsigned char *bin, int *out, int size);
@@ -90,18 +110,6 @@ int m_bitsAfterPuncturing;
 // puncturing matrix
 unsigned char *m_puncturing;
 
-// decoding - fec decodes only the 20 first bits: enough to decode potential IDs
-// greatly saves time compared to the full Viterbi algorithm
-unsigned char *m_dec_fec_id;
-
-// tables used to save state at each level: avoids recursive calls that would be slower
-// there are 10 levels, corresponding to the 10 bits that have to be extracted, 11 here since
-// some values are referred to in previous levels
-int *m_hamming_dist;     // hamming distance at level
-int *m_exploration_level;     // number of tests done at this level (max 2, then back to previous level)
-int *m_fec_state;
-unsigned char *m_fec_decoded_id;
-
 struct fec_state {
     int output[2];
     int next_state[2];
@@ -20,36 +20,32 @@
 
 #include "Decode.hpp"
 
+#include <algorithm>
+
 namespace chilitags {
 
 const int Decode::INVALID_TAG = -1;
 const int DATA_SIZE = 6;
 
-Decode::Decode() :
-    mMatrix   (new unsigned char[DATA_SIZE*DATA_SIZE]),
-    mMatrix90 (new unsigned char[DATA_SIZE*DATA_SIZE]),
-    mMatrix180(new unsigned char[DATA_SIZE*DATA_SIZE]),
-    mMatrix270(new unsigned char[DATA_SIZE*DATA_SIZE]),
-    mCodec()
+Decode::Decode()
 {
 }
 
-Decode::~Decode()
+const Codec &Decode::getCodec()
 {
-    delete[] mMatrix;
-    delete[] mMatrix270;
-    delete[] mMatrix180;
-    delete[] mMatrix90;
+    // The initialisation of a local static is thread safe in C++11
+    static const Codec codec;
+    return codec;
 }
 
-std::pair<int, Quad> Decode::operator()(const std::vector<unsigned char> &bits, const Quad &corners)
+std::pair<int, Quad> Decode::operator()(const std::vector<unsigned char> &bits, const Quad &corners) const
 {
-    auto result = doDecode(bits, corners);
+    auto result = doDecode(bits.data(), corners);
 #ifdef HAS_INVERTED_TAGS
     if (result.first == INVALID_TAG) {
         //flip the bits, in case this tag is inverted
-        std::vector<unsigned char> flippedBits(bits.size());
-        std::transform(bits.begin(), bits.end(), flippedBits.begin(), [](const unsigned char& c) {
+        unsigned char flippedBits[DATA_SIZE*DATA_SIZE];
+        std::transform(bits.begin(), bits.begin()+DATA_SIZE*DATA_SIZE, flippedBits, [](const unsigned char& c) {
                 return 1 - c;
             });
         result = doDecode(flippedBits, corners);
@@ -58,26 +54,31 @@ std::pair<int, Quad> Decode::operator()(const std::vector<unsigned char> &bits,
     return result;
 }
 
-std::pair<int, Quad> Decode::doDecode(const std::vector<unsigned char> &bits, const Quad &corners)
+std::pair<int, Quad> Decode::doDecode(const unsigned char *bits, const Quad &corners) const
 {
+    unsigned char matrix   [DATA_SIZE*DATA_SIZE];
+    unsigned char matrix90 [DATA_SIZE*DATA_SIZE];
+    unsigned char matrix180[DATA_SIZE*DATA_SIZE];
+    unsigned char matrix270[DATA_SIZE*DATA_SIZE];
     for (int i = 0; i < DATA_SIZE; ++i)
     {
         for (int j = 0; j < DATA_SIZE; ++j)
         {
             unsigned char bit = bits[i*DATA_SIZE + j];
-            mMatrix   [            i *DATA_SIZE +             j ] = bit;
-            mMatrix90 [(DATA_SIZE-1-j)*DATA_SIZE +             i ] = bit;
-            mMatrix180[(DATA_SIZE-1-i)*DATA_SIZE + (DATA_SIZE-1-j)] = bit;
-            mMatrix270[            j *DATA_SIZE + (DATA_SIZE-1-i)] = bit;
+            matrix   [            i *DATA_SIZE +             j ] = bit;
+            matrix90 [(DATA_SIZE-1-j)*DATA_SIZE +             i ] = bit;
+            matrix180[(DATA_SIZE-1-i)*DATA_SIZE + (DATA_SIZE-1-j)] = bit;
+            matrix270[            j *DATA_SIZE + (DATA_SIZE-1-i)] = bit;
         }
     }
 
     int orientation = -1;
     int id = INVALID_TAG;
-    if (mCodec.decode(mMatrix, id)) orientation = 0;
-    else if (mCodec.decode(mMatrix90, id)) orientation = 1;
-    else if (mCodec.decode(mMatrix180, id)) orientation = 2;
-    else if (mCodec.decode(mMatrix270, id)) orientation = 3;
+    const Codec &codec = getCodec();
+    if (codec.decode(matrix, id)) orientation = 0;
+    else if (codec.decode(matrix90, id)) orientation = 1;
+    else if (codec.decode(matrix180, id)) orientation = 2;
+    else if (codec.decode(matrix270, id)) orientation = 3;
 
     //The dreadful Black Tag!
     if (id == 682) id = INVALID_TAG;
@@ -36,30 +36,20 @@ static const int INVALID_TAG;
 
 Decode();
 
+/**
+ * Decodes the bits read from the given corners. Decode has no state: it can
+ * be called concurrently from several threads.
+ */
 std::pair<int, Quad> operator()(
     const std::vector<unsigned char> &bits,
-    const Quad &corners);
+    const Quad &corners) const;
 
-std::pair<int, Quad> doDecode(const std::vector<unsigned char> &bits, const Quad &corners);
+std::pair<int, Quad> doDecode(const unsigned char *bits, const Quad &corners) const;
 
-const Codec &getCodec() const {
-    return mCodec;
-}
-
-virtual ~Decode();
-
-protected:
-
-unsigned char *mMatrix;
-unsigned char *mMatrix90;
-unsigned char *mMatrix180;
-unsigned char *mMatrix270;
-
-Codec mCodec;
-
-private:
-Decode(const Decode&);
-Decode& operator=(const Decode&);
+/**
+ * The codec of the chilitags, built once and shared by all the instances.
+ */
+static const Codec &getCodec();
 
 };
 
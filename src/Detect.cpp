@@ -24,16 +24,9 @@
 
 namespace chilitags {
 
-#ifdef OPENCV3
-#include <opencv2/core/utility.hpp>
-#endif
-
 Detect::Detect() :
-    mRefineCorners(true),
-    mFindQuads(),
-    mRefine(),
-    mReadBits(),
-    mDecode(),
+    mCore(),
+    mWorkspace(),
     mFrame(),
     mTags()
 #ifdef HAS_MULTITHREADING
@@ -46,38 +39,9 @@ Detect::Detect() :
 {
 }
 
-void Detect::setMinInputWidth(int minWidth)
-{
-    mFindQuads.setMinInputWidth(minWidth);
-}
-
-void Detect::setCornerRefinement(bool refineCorners)
-{
-    mRefineCorners = refineCorners;
-}
-
 void Detect::doDetection(TagCornerMap& tags)
 {
-    if(mRefineCorners) {
-        for(const auto& quad : mFindQuads(mFrame)) {
-            auto refinedQuad = mRefine(mFrame, quad, 1.5f/10.0f);
-            auto tag = mDecode(mReadBits(mFrame, refinedQuad), refinedQuad);
-            if(tag.first != Decode::INVALID_TAG)
-                tags[tag.first] = tag.second;
-            else{
-                tag = mDecode(mReadBits(mFrame, quad), quad);
-                if(tag.first != Decode::INVALID_TAG)
-                    tags[tag.first] = tag.second;
-            }
-        }
-    }
-    else{
-        for(const auto& quad : mFindQuads(mFrame)) {
-            auto tag = mDecode(mReadBits(mFrame, quad), quad);
-            if(tag.first != Decode::INVALID_TAG)
-                tags[tag.first] = tag.second;
-        }
-    }
+    mCore(mFrame, tags, mWorkspace);
 }
 
 void Detect::operator()(cv::Mat const& greyscaleImage, TagCornerMap& tags)
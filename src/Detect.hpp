@@ -22,6 +22,7 @@
 #define DETECT_HPP
 
 #include <map>
+#include <vector>
 
 #ifdef HAS_MULTITHREADING
 #include <pthread.h>
@@ -29,10 +30,7 @@
 
 #include <opencv2/core/core.hpp>
 
-#include "FindQuads.hpp"
-#include "Decode.hpp"
-#include "Refine.hpp"
-#include "ReadBits.hpp"
+#include "DetectorCore.hpp"
 #include "Track.hpp"
 
 namespace chilitags {
@@ -43,9 +41,72 @@ public:
 
 Detect();
 
-void setMinInputWidth(int minWidth);
-
-void setCornerRefinement(bool refineCorners);
+void setMinInputWidth(int minWidth) {
+    mCore.setMinInputWidth(minWidth);
+}
+
+void setSegmentation(Chilitags::Segmentation segmentation) {
+    mCore.setSegmentation(segmentation);
+}
+
+void setScales(const std::vector<float> &scales) {
+    mCore.setScales(scales);
+}
+
+const std::map<float, float> &getScaleCosts() const {
+    return mWorkspace.getScaleCosts();
+}
+
+void setCornerRefinement(Chilitags::CornerRefinement refinement) {
+    mCore.setCornerRefinement(refinement);
+}
+
+/**
+ * Restricts Chilitags::REFINE_DECODED to the given ids (all if empty).
+ */
+void setRefinedTags(const std::vector<int> &ids) {
+    mCore.setRefinedTags(ids);
+}
+
+void setCornerRefinementMethod(Chilitags::CornerRefinementMethod method) {
+    mCore.setCornerRefinementMethod(method);
+}
+
+/**
+ * Limits the duration and/or the number of decoded candidates of each
+ * detection; 0 means no limit.
+ */
+void setBudget(float maxMilliseconds, int maxCandidates) {
+    mCore.setBudget(maxMilliseconds, maxCandidates);
+}
+
+/**
+ * Whether the last detection ran out of budget before examining every
+ * candidate.
+ */
+bool isPartial() const {
+    return mWorkspace.isPartial();
+}
+
+/**
+ * Number of candidates rejected by each stage of the screening which
+ * precedes the refinement and the decoding.
+ */
+const ScreenOut::Counters &getScreenOutCounters() const {
+    return mWorkspace.getScreenOutCounters();
+}
+
+void resetScreenOutCounters() {
+    mWorkspace.resetScreenOutCounters();
+}
+
+/**
+ * The configuration of the detection, which can be shared with other
+ * workspaces than the one of this Detect.
+ */
+const DetectorCore &getCore() const {
+    return mCore;
+}
 
 void operator()(cv::Mat const& inputImage, TagCornerMap& tags);
 
@@ -57,12 +118,8 @@ void shutdownBackgroundThread();
 
 protected:
 
-bool mRefineCorners;
-
-FindQuads mFindQuads;
-Refine mRefine;
-ReadBits mReadBits;
-Decode mDecode;
+DetectorCore mCore;
+DetectorCore::Workspace mWorkspace;
 
 cv::Mat mFrame;
 TagCornerMap mTags;
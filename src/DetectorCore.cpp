@@ -0,0 +1,320 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include "DetectorCore.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#ifdef OPENCV3
+#include <opencv2/core/utility.hpp>
+#endif
+
+namespace chilitags {
+
+namespace {
+
+// Half size of the search window of the corner refinement, relatively to the
+// side of the quad
+const float PROXIMITY_RATIO = 1.5f/10.0f;
+
+// Generations of the configurations, unique in the process. 0 is never used.
+std::atomic<unsigned long long> lastGeneration(0);
+
+unsigned long long newGeneration()
+{
+    return ++lastGeneration;
+}
+
+cv::Vec3f circumscribe(const Quad &quad)
+{
+    cv::Point2f centre(
+        0.25f*(quad(0,0)+quad(1,0)+quad(2,0)+quad(3,0)),
+        0.25f*(quad(0,1)+quad(1,1)+quad(2,1)+quad(3,1)));
+    float squaredRadius = 0.0f;
+    for (int i : {0,1,2,3}) {
+        cv::Point2f corner(quad(i,0), quad(i,1));
+        squaredRadius = std::max(squaredRadius, (float) (corner-centre).dot(corner-centre));
+    }
+    return cv::Vec3f(centre.x, centre.y, squaredRadius);
+}
+
+float area(const Quad &quad)
+{
+    float doubleArea = 0.0f;
+    for (int i = 0, j = 3; i < 4; j = i++) {
+        doubleArea += quad(j,0)*quad(i,1) - quad(i,0)*quad(j,1);
+    }
+    return 0.5f*std::abs(doubleArea);
+}
+
+}
+
+DetectorCore::Workspace::Workspace() :
+    mConfigurationGeneration(0),
+    mPartial(false),
+    mFindQuads(),
+    mGroupQuads(),
+    mScreenOut(),
+    mRefine(),
+    mReadBits(),
+    mKnownTags(),
+    mCandidateOrder(),
+    mCandidateAreas(),
+    mCandidateNearKnownTag(),
+    mCandidates(),
+    mCandidateIndices(),
+    mRefinedCandidates(),
+    mDecodedIds()
+{
+}
+
+DetectorCore::DetectorCore() :
+    mMinInputWidth(160),
+    mSegmentation(Chilitags::CANNY_EDGES),
+    mScales(),
+    mCornerRefinement(Chilitags::REFINE_CANDIDATES),
+    mRefinedTags(),
+    mCornerRefinementMethod(Chilitags::CORNER_GRADIENTS),
+    mMaxMilliseconds(0.0f),
+    mMaxCandidates(0),
+    mGeneration(newGeneration()),
+    mDecode()
+{
+}
+
+void DetectorCore::setMinInputWidth(int minWidth)
+{
+    mMinInputWidth = minWidth;
+    mGeneration = newGeneration();
+}
+
+void DetectorCore::setSegmentation(Chilitags::Segmentation segmentation)
+{
+    mSegmentation = segmentation;
+    mGeneration = newGeneration();
+}
+
+void DetectorCore::setScales(const std::vector<float> &scales)
+{
+    mScales = scales;
+    mGeneration = newGeneration();
+}
+
+void DetectorCore::setCornerRefinement(Chilitags::CornerRefinement refinement)
+{
+    mCornerRefinement = refinement;
+}
+
+void DetectorCore::setRefinedTags(const std::vector<int> &ids)
+{
+    mRefinedTags.clear();
+    for (int id : ids) {
+        if (id < 0) continue;
+        if (id >= (int) mRefinedTags.size()) mRefinedTags.resize(id+1, false);
+        mRefinedTags[id] = true;
+    }
+}
+
+void DetectorCore::setCornerRefinementMethod(Chilitags::CornerRefinementMethod method)
+{
+    mCornerRefinementMethod = method;
+    mGeneration = newGeneration();
+}
+
+void DetectorCore::setBudget(float maxMilliseconds, int maxCandidates)
+{
+    mMaxMilliseconds = maxMilliseconds;
+    mMaxCandidates = maxCandidates;
+}
+
+void DetectorCore::configure(Workspace &workspace) const
+{
+    if (workspace.mConfigurationGeneration == mGeneration) return;
+
+    workspace.mFindQuads.setMinInputWidth(mMinInputWidth);
+    workspace.mFindQuads.setSegmentation(mSegmentation);
+    workspace.mFindQuads.setScales(mScales);
+    workspace.mRefine.setMethod(mCornerRefinementMethod);
+
+    workspace.mConfigurationGeneration = mGeneration;
+}
+
+void DetectorCore::prioritise(Workspace &workspace,
+                              const std::vector<Quad> &quads,
+                              const std::vector<int> &candidates,
+                              const TagCornerMap &tags) const
+{
+    std::vector<int> &order = workspace.mCandidateOrder;
+    order = candidates;
+
+    // Without budget, every candidate is examined anyway: keep the order of
+    // FindQuads, in which the highest resolutions come last and override the
+    // others
+    if (mMaxMilliseconds <= 0.0f && mMaxCandidates <= 0) return;
+
+    std::vector<cv::Vec3f> &knownTags = workspace.mKnownTags;
+    for (const auto &tag : tags) knownTags.push_back(circumscribe(tag.second));
+
+    std::vector<float> &areas = workspace.mCandidateAreas;
+    std::vector<bool> &nearKnownTag = workspace.mCandidateNearKnownTag;
+    areas.resize(quads.size());
+    nearKnownTag.assign(quads.size(), false);
+    for (int i : candidates) {
+        areas[i] = area(quads[i]);
+        cv::Vec3f candidate = circumscribe(quads[i]);
+        for (const auto &knownTag : knownTags) {
+            float dx = candidate[0] - knownTag[0];
+            float dy = candidate[1] - knownTag[1];
+            if (dx*dx + dy*dy < knownTag[2]) {
+                nearKnownTag[i] = true;
+                break;
+            }
+        }
+    }
+
+    std::stable_sort(order.begin(), order.end(),
+                     [&areas, &nearKnownTag](int a, int b) {
+        if (nearKnownTag[a] != nearKnownTag[b])
+            return (bool) nearKnownTag[a];
+        return areas[a] > areas[b];
+    });
+}
+
+void DetectorCore::operator()(const cv::Mat &greyscaleImage, TagCornerMap &tags,
+                              Workspace &workspace) const
+{
+    int64 deadline = 0;
+    if (mMaxMilliseconds > 0.0f) {
+        deadline = cv::getTickCount()
+                   + (int64) (mMaxMilliseconds*cv::getTickFrequency()/1000.0);
+    }
+
+    configure(workspace);
+
+    const std::vector<Quad> &quads = workspace.mFindQuads(greyscaleImage, deadline);
+    workspace.mPartial = workspace.mFindQuads.wasInterrupted();
+
+    // The same tag is usually found on several levels of the pyramid: only
+    // the quad of the finest level is examined first
+    const std::vector<int> &primaries = workspace.mGroupQuads(
+        quads, workspace.mFindQuads.getQuadLevels());
+
+    prioritise(workspace, quads, primaries, tags);
+
+    std::vector<Quad> &candidates = workspace.mCandidates;
+    std::vector<int> &candidateIndices = workspace.mCandidateIndices;
+    candidates.clear();
+    candidateIndices.clear();
+    for (int index : workspace.mCandidateOrder) {
+        if (deadline != 0 && cv::getTickCount() > deadline) {
+            workspace.mPartial = true;
+            break;
+        }
+
+        // Reject the obvious non-tags before the expensive steps, replacing
+        // them by their coarser duplicates if any
+        while (index >= 0 && !workspace.mScreenOut(greyscaleImage, quads[index]))
+            index = workspace.mGroupQuads.nextFallback(index);
+        if (index < 0) continue;
+        const Quad &quad = quads[index];
+
+        if (mMaxCandidates > 0 && (int) candidates.size() >= mMaxCandidates) {
+            workspace.mPartial = true;
+            break;
+        }
+        candidates.push_back(quad);
+        candidateIndices.push_back(index);
+    }
+
+    // All the corners to refine are refined together, sharing the gradients
+    std::vector<Quad> &refinedCandidates = workspace.mRefinedCandidates;
+    if (mCornerRefinement == Chilitags::REFINE_CANDIDATES) {
+        refinedCandidates = candidates;
+        workspace.mRefine(greyscaleImage, refinedCandidates, PROXIMITY_RATIO);
+    }
+
+    std::vector<int> &decodedIds = workspace.mDecodedIds;
+    decodedIds.clear();
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        if (deadline != 0 && cv::getTickCount() > deadline) {
+            workspace.mPartial = true;
+            break;
+        }
+
+        std::pair<int, Quad> tag = decode(
+            workspace, greyscaleImage, quads, candidateIndices[i],
+            (mCornerRefinement == Chilitags::REFINE_CANDIDATES) ? &refinedCandidates[i] : nullptr);
+        if (tag.first == Decode::INVALID_TAG) continue;
+
+        tags[tag.first] = tag.second;
+        if (mCornerRefinement == Chilitags::REFINE_DECODED
+            && (mRefinedTags.empty()
+                || (tag.first < (int) mRefinedTags.size() && mRefinedTags[tag.first])))
+            decodedIds.push_back(tag.first);
+    }
+
+    if (!decodedIds.empty()) {
+        std::sort(decodedIds.begin(), decodedIds.end());
+        decodedIds.erase(std::unique(decodedIds.begin(), decodedIds.end()),
+                         decodedIds.end());
+        refinedCandidates.clear();
+        for (int id : decodedIds) refinedCandidates.push_back(tags[id]);
+        workspace.mRefine(greyscaleImage, refinedCandidates, PROXIMITY_RATIO);
+        for (size_t i = 0; i < decodedIds.size(); ++i)
+            tags[decodedIds[i]] = refinedCandidates[i];
+    }
+
+    // Remember where the tags were, to examine first the candidates close to
+    // them in the next detection
+    workspace.mKnownTags.clear();
+    for (const auto &tag : tags) workspace.mKnownTags.push_back(circumscribe(tag.second));
+}
+
+std::pair<int, Quad> DetectorCore::decode(Workspace &workspace,
+                                          const cv::Mat &greyscaleImage,
+                                          const std::vector<Quad> &quads, int index,
+                                          const Quad *refinedQuad) const
+{
+    ReadBits &readBits = workspace.mReadBits;
+
+    std::pair<int, Quad> tag(Decode::INVALID_TAG, Quad());
+    if (refinedQuad != nullptr)
+        tag = mDecode(readBits(greyscaleImage, *refinedQuad), *refinedQuad);
+    if (tag.first == Decode::INVALID_TAG)
+        tag = mDecode(readBits(greyscaleImage, quads[index]), quads[index]);
+
+    // The coarser levels are less precise, but less sensitive to noise
+    for (int fallback = workspace.mGroupQuads.nextFallback(index);
+         fallback >= 0 && tag.first == Decode::INVALID_TAG;
+         fallback = workspace.mGroupQuads.nextFallback(fallback)) {
+        const Quad &quad = quads[fallback];
+        if (!workspace.mScreenOut(greyscaleImage, quad)) continue;
+        if (refinedQuad != nullptr) {
+            Quad refined = workspace.mRefine(greyscaleImage, quad, PROXIMITY_RATIO);
+            tag = mDecode(readBits(greyscaleImage, refined), refined);
+        }
+        if (tag.first == Decode::INVALID_TAG)
+            tag = mDecode(readBits(greyscaleImage, quad), quad);
+    }
+    return tag;
+}
+
+} /* namespace chilitags */
@@ -0,0 +1,193 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifndef DetectorCore_HPP
+#define DetectorCore_HPP
+
+#include <map>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <chilitags.hpp>
+
+#include "FindQuads.hpp"
+#include "GroupQuads.hpp"
+#include "Decode.hpp"
+#include "Refine.hpp"
+#include "ReadBits.hpp"
+#include "ScreenOut.hpp"
+
+namespace chilitags {
+
+/**
+ * The detection of the tags in a greyscale image, split between the
+ * configuration, which is only read during a detection, and the buffers of
+ * the pipeline, which are gathered in a Workspace. A single configured
+ * DetectorCore can thus detect tags concurrently from several threads, each
+ * of them using its own Workspace. The configuration must not be changed
+ * while a detection is running.
+ */
+class DetectorCore {
+
+public:
+
+/**
+ * The buffers and intermediate results of a detection, to reuse from one
+ * detection to the next. A Workspace can only be used by one thread at a
+ * time.
+ */
+class Workspace {
+
+public:
+
+Workspace();
+
+/**
+ * Whether the last detection ran out of budget before examining every
+ * candidate.
+ */
+bool isPartial() const {
+    return mPartial;
+}
+
+/**
+ * Average processing time (in ms) of the search of the quads at each scale.
+ */
+const std::map<float, float> &getScaleCosts() const {
+    return mFindQuads.getScaleCosts();
+}
+
+/**
+ * Number of candidates rejected by each stage of the screening which
+ * precedes the refinement and the decoding.
+ */
+const ScreenOut::Counters &getScreenOutCounters() const {
+    return mScreenOut.getCounters();
+}
+
+void resetScreenOutCounters() {
+    mScreenOut.resetCounters();
+}
+
+protected:
+
+friend class DetectorCore;
+
+unsigned long long mConfigurationGeneration;   ///< of the last configuration applied to the functors
+
+bool mPartial;
+
+FindQuads mFindQuads;
+GroupQuads mGroupQuads;
+ScreenOut mScreenOut;
+Refine mRefine;
+ReadBits mReadBits;
+
+std::vector<cv::Vec3f> mKnownTags;  ///< centre and squared radius of the last known tags
+std::vector<int> mCandidateOrder;
+std::vector<float> mCandidateAreas;
+std::vector<bool> mCandidateNearKnownTag;
+std::vector<Quad> mCandidates;          ///< screened candidates, in order of priority
+std::vector<int> mCandidateIndices;     ///< indices of mCandidates in the quads of FindQuads
+std::vector<Quad> mRefinedCandidates;
+std::vector<int> mDecodedIds;           ///< tags to refine with Chilitags::REFINE_DECODED
+
+};
+
+DetectorCore();
+
+void setMinInputWidth(int minWidth);
+
+void setSegmentation(Chilitags::Segmentation segmentation);
+
+void setScales(const std::vector<float> &scales);
+
+void setCornerRefinement(Chilitags::CornerRefinement refinement);
+
+/**
+ * Restricts Chilitags::REFINE_DECODED to the given ids (all if empty).
+ */
+void setRefinedTags(const std::vector<int> &ids);
+
+void setCornerRefinementMethod(Chilitags::CornerRefinementMethod method);
+
+/**
+ * Limits the duration and/or the number of decoded candidates of each
+ * detection; 0 means no limit.
+ */
+void setBudget(float maxMilliseconds, int maxCandidates);
+
+/**
+ * Adds to tags the tags detected in the greyscale image, overwriting the
+ * tags already present with the same id.
+ */
+void operator()(const cv::Mat &greyscaleImage, TagCornerMap &tags,
+                Workspace &workspace) const;
+
+protected:
+
+int mMinInputWidth;
+Chilitags::Segmentation mSegmentation;
+std::vector<float> mScales;
+Chilitags::CornerRefinement mCornerRefinement;
+std::vector<bool> mRefinedTags;     ///< indexed by id, empty to refine all tags
+Chilitags::CornerRefinementMethod mCornerRefinementMethod;
+
+float mMaxMilliseconds;
+int mMaxCandidates;
+
+/**
+ * Identifies the configuration among all the configurations of all the
+ * instances, so that a Workspace used with several instances tells them
+ * apart even if one is allocated where another was destroyed. Renewed by
+ * every change of the configuration.
+ */
+unsigned long long mGeneration;
+
+Decode mDecode;                     ///< stateless, shares the codec of all the instances
+
+/**
+ * Applies the configuration to the functors of the workspace, unless they
+ * already have it.
+ */
+void configure(Workspace &workspace) const;
+
+/**
+ * Sorts the given candidates (indices of quads) by priority in
+ * mCandidateOrder when a budget is set: first those close to a known tag,
+ * then by decreasing area.
+ */
+void prioritise(Workspace &workspace, const std::vector<Quad> &quads,
+                const std::vector<int> &candidates, const TagCornerMap &tags) const;
+
+/**
+ * Decodes the quad, after its refinement if one is given, and falls back on
+ * the coarser duplicates of the quad if it can not be decoded.
+ */
+std::pair<int, Quad> decode(Workspace &workspace, const cv::Mat &greyscaleImage,
+                            const std::vector<Quad> &quads, int index,
+                            const Quad *refinedQuad) const;
+
+};
+
+} /* namespace chilitags */
+
+#endif /* DetectorCore_HPP */
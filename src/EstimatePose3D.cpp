@@ -28,6 +28,14 @@
 #include "EstimatePose3D.hpp"
 
 #include <opencv2/calib3d/calib3d.hpp>
+#ifdef OPENCV3
+#include <opencv2/imgproc/imgproc.hpp> // undistortPoints
+#endif
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
 
 namespace chilitags {
 
@@ -35,8 +43,15 @@ template<typename RealT>
 EstimatePose3D<RealT>::EstimatePose3D(cv::Size cameraResolution) :
     mFilter3D(),
     mFilter3DEnabled(true),
+    mSolutions(),
+    mFrames(0),
     mCameraMatrix(),
-    mDistCoeffs()
+    mDistCoeffs(),
+    mNoDistCoeffs(),
+    mUndistortLut(),
+    mUndistortLutSize(),
+    mUndistortLutStep(0),
+    mUndistortLutCache()
 {
     float focalLength = 700.0f;
     mCameraMatrix = (cv::Mat_<float>(3,3) <<
@@ -51,6 +66,43 @@ void EstimatePose3D<RealT>::setCameraCalibration(cv::Mat newCameraMatrix, cv::Ma
 {
     mCameraMatrix = newCameraMatrix;
     mDistCoeffs = newDistCoeffs;
+    setUndistortLut(mUndistortLutSize, mUndistortLutStep, mUndistortLutCache);
+}
+
+template<typename RealT>
+void EstimatePose3D<RealT>::setUndistortLut(cv::Size imageSize, int step, std::string const& cacheFilename)
+{
+    mUndistortLutSize = imageSize;
+    mUndistortLutStep = step;
+    mUndistortLutCache = cacheFilename;
+    if(imageSize.area() <= 0 || mDistCoeffs.empty()) {
+        mUndistortLut.clear();
+        return;
+    }
+
+    if(!cacheFilename.empty()
+       && mUndistortLut.read(cacheFilename, mCameraMatrix, mDistCoeffs, imageSize, step))
+        return;
+
+    mUndistortLut.build(mCameraMatrix, mDistCoeffs, imageSize, step);
+    if(!cacheFilename.empty() && !mUndistortLut.write(cacheFilename))
+        std::cerr << "Could not write undistortion table: " << cacheFilename << std::endl;
+}
+
+template<typename RealT>
+void EstimatePose3D<RealT>::undistort(cv::Mat_<cv::Point2f>& imagePoints) const
+{
+    if(mDistCoeffs.empty() || imagePoints.empty())
+        return;
+
+    if(!mUndistortLut.empty()) {
+        mUndistortLut(imagePoints[0], imagePoints.rows*imagePoints.cols);
+        return;
+    }
+
+    cv::undistortPoints(imagePoints, mWorkspace.undistorted, mCameraMatrix, mDistCoeffs,
+                        cv::noArray(), mCameraMatrix);
+    mWorkspace.undistorted.copyTo(imagePoints);
 }
 
 template<typename RealT>
@@ -77,6 +129,12 @@ void EstimatePose3D<RealT>::setFilterPersistence(RealT persistence)
     mFilter3D.setPersistence(persistence);
 }
 
+template<typename RealT>
+void EstimatePose3D<RealT>::setFilterMaxObjects(int maxObjects)
+{
+    mFilter3D.setMaxObjects(maxObjects);
+}
+
 template<typename RealT>
 void EstimatePose3D<RealT>::setFilterProcessNoiseCovariance(cv::Mat const& covariance)
 {
@@ -97,39 +155,421 @@ void EstimatePose3D<RealT>::setCamDelta(cv::Vec<RealT, 4> const& camDeltaR, cv::
 }
 
 template<typename RealT>
-void EstimatePose3D<RealT>::operator()(typename Chilitags3D_<RealT>::TagPoseMap& objects)
+void EstimatePose3D<RealT>::resetFilter()
+{
+    mFilter3D.reset();
+    mSolutions.clear();
+}
+
+template<typename RealT>
+void EstimatePose3D<RealT>::operator()(typename Chilitags3D_<RealT>::ObjectPoseList& objects)
 {
+    ++mFrames;
     if(mFilter3DEnabled)
         mFilter3D(objects);
 }
 
 template<typename RealT>
-void EstimatePose3D<RealT>::operator()(std::string const& name,
+void EstimatePose3D<RealT>::normalize(cv::Mat_<cv::Point2f> const& imagePoints,
+                                      cv::Point2d* normalizedPoints,
+                                      cv::Mat const& distCoeffs,
+                                      Workspace& workspace) const
+{
+    int nPoints = imagePoints.rows*imagePoints.cols;
+    const cv::Point2f* points = imagePoints[0];
+    if(!distCoeffs.empty()) {
+        cv::undistortPoints(imagePoints, workspace.undistorted, mCameraMatrix, distCoeffs);
+        for(int i=0; i<nPoints; i++)
+            normalizedPoints[i] = cv::Point2d(workspace.undistorted(i).x, workspace.undistorted(i).y);
+        return;
+    }
+
+    cv::Matx33d cameraMatrix = mCameraMatrix;
+    for(int i=0; i<nPoints; i++)
+        normalizedPoints[i] = cv::Point2d(
+            (points[i].x - cameraMatrix(0,2))/cameraMatrix(0,0),
+            (points[i].y - cameraMatrix(1,2))/cameraMatrix(1,1));
+}
+
+template<typename RealT>
+double EstimatePose3D<RealT>::solveSquare(RealT size,
+                                          cv::Mat_<cv::Point2f> const& imagePoints,
+                                          SquarePose& best,
+                                          SquarePose& alternative) const
+{
+    return solveSquare(size, imagePoints, best, alternative, mWorkspace);
+}
+
+template<typename RealT>
+double EstimatePose3D<RealT>::solveSquare(RealT size,
+                                          cv::Mat_<cv::Point2f> const& imagePoints,
+                                          SquarePose& best,
+                                          SquarePose& alternative,
+                                          Workspace& workspace,
+                                          bool undistorted) const
+{
+    // The corners of the tag, centred on its origin
+    const double h = size/2.;
+    const cv::Point2d model[4] = {{-h,-h}, {h,-h}, {h,h}, {-h,h}};
+
+    cv::Point2d image[4];
+    normalize(imagePoints, image, undistorted ? mNoDistCoeffs : mDistCoeffs, workspace);
+
+    // Homography from the plane of the tag to the normalized image plane,
+    // with H(2,2) = 1
+    cv::Matx<double,8,8> A;
+    cv::Vec<double,8> b;
+    for(int i=0; i<4; i++) {
+        const double x = model[i].x, y = model[i].y;
+        const double u = image[i].x, v = image[i].y;
+        double rowU[8] = {x, y, 1, 0, 0, 0, -u*x, -u*y};
+        double rowV[8] = {0, 0, 0, x, y, 1, -v*x, -v*y};
+        for(int j=0; j<8; j++) {
+            A(2*i,j) = rowU[j];
+            A(2*i+1,j) = rowV[j];
+        }
+        b(2*i) = u;
+        b(2*i+1) = v;
+    }
+    cv::Matx<double,8,1> H = A.solve(b, cv::DECOMP_LU);
+
+    // Projection (p,q) of the centre of the tag, and Jacobian J of the
+    // homography there
+    const double p = H(2), q = H(5);
+    const double j00 = H(0) - p*H(6), j01 = H(1) - p*H(7);
+    const double j10 = H(3) - q*H(6), j11 = H(4) - q*H(7);
+
+    // Rotation Rv bringing the z axis onto the line of sight of the centre,
+    // around their common normal
+    cv::Matx33d Rv = cv::Matx33d::eye();
+    const double n2 = p*p + q*q;
+    if(n2 > 1e-20) {
+        const double n = std::sqrt(1 + n2);
+        const double kx = -q/n, ky = p/n;               // (0,0,1) x (p,q,1)/n
+        const double c = 1/n, k = (1 - c)/(kx*kx + ky*ky);
+        Rv = cv::Matx33d(
+            1 - k*ky*ky,    k*kx*ky,        ky,
+            k*kx*ky,        1 - k*kx*kx,    -kx,
+            -ky,            kx,             c);
+    }
+
+    // The first two rows of the first two columns of Rv^T*R are the
+    // rotation part of B^-1*J, up to the inverse depth gamma, where
+    // B = [I2 | -(p,q)]*Rv(:,0:1)
+    const double b00 = Rv(0,0) - p*Rv(2,0), b01 = Rv(0,1) - p*Rv(2,1);
+    const double b10 = Rv(1,0) - q*Rv(2,0), b11 = Rv(1,1) - q*Rv(2,1);
+    const double invDet = 1/(b00*b11 - b01*b10);
+    const double a00 = invDet*( b11*j00 - b01*j10), a01 = invDet*( b11*j01 - b01*j11);
+    const double a10 = invDet*(-b10*j00 + b00*j10), a11 = invDet*(-b10*j01 + b00*j11);
+
+    // gamma is the largest singular value of A
+    const double ata00 = a00*a00 + a01*a01;
+    const double ata01 = a00*a10 + a01*a11;
+    const double ata11 = a10*a10 + a11*a11;
+    const double gamma = std::sqrt(0.5*(ata00 + ata11 + std::sqrt(
+        (ata00 - ata11)*(ata00 - ata11) + 4*ata01*ata01)));
+
+    const double r00 = a00/gamma, r01 = a01/gamma;
+    const double r10 = a10/gamma, r11 = a11/gamma;
+
+    // The third row completes the columns to unit vectors, with either sign:
+    // these are the two solutions
+    double c0 = std::sqrt(std::max(0., 1 - r00*r00 - r10*r10));
+    double c1 = std::sqrt(std::max(0., 1 - r01*r01 - r11*r11));
+    if(r00*r01 + r10*r11 > 0)
+        c1 = -c1;
+
+    SquarePose solutions[2];
+    for(int s=0; s<2; s++) {
+        const double sign = s == 0 ? 1 : -1;
+        cv::Vec3d col0 = Rv*cv::Vec3d(r00, r10, sign*c0);
+        cv::Vec3d col1 = Rv*cv::Vec3d(r01, r11, sign*c1);
+        cv::Vec3d col2 = col0.cross(col1);
+        cv::Matx33d& R = solutions[s].rotation;
+        for(int i=0; i<3; i++) {
+            R(i,0) = col0(i);
+            R(i,1) = col1(i);
+            R(i,2) = col2(i);
+        }
+
+        // Least-squares translation: each corner X = R*x + t must lie on the
+        // line of sight of its image u, i.e. X - u*X(2) = 0
+        cv::Matx33d AtA;
+        cv::Vec3d Atb;
+        for(int i=0; i<4; i++) {
+            cv::Vec3d X = R*cv::Vec3d(model[i].x, model[i].y, 0);
+            const double u[2] = {image[i].x, image[i].y};
+            for(int d=0; d<2; d++) {
+                const cv::Vec3d row(d == 0, d == 1, -u[d]);
+                const double rhs = u[d]*X(2) - X(d);
+                AtA += row*row.t();
+                Atb += rhs*row;
+            }
+        }
+        cv::Vec3d t = AtA.solve(Atb, cv::DECOMP_CHOLESKY);
+
+        // Root mean square reprojection error, in pixels
+        cv::Matx33d cameraMatrix = mCameraMatrix;
+        double error = 0;
+        for(int i=0; i<4; i++) {
+            cv::Vec3d X = R*cv::Vec3d(model[i].x, model[i].y, 0) + t;
+            const double du = (X(0)/X(2) - image[i].x)*cameraMatrix(0,0);
+            const double dv = (X(1)/X(2) - image[i].y)*cameraMatrix(1,1);
+            error += du*du + dv*dv;
+        }
+        solutions[s].error = std::sqrt(error/4);
+
+        // Back to the origin of the tag, its first corner
+        solutions[s].translation = t - R*cv::Vec3d(h, h, 0);
+    }
+
+    const int bestIndex = solutions[1].error < solutions[0].error ? 1 : 0;
+    best = solutions[bestIndex];
+    alternative = solutions[1-bestIndex];
+    if(alternative.error <= 0)
+        return 1;
+    return best.error/alternative.error;
+}
+
+template<typename RealT>
+void EstimatePose3D<RealT>::operator()(int handle,
+                                       RealT size,
+                                       cv::Mat_<cv::Point2f> const& imagePoints,
+                                       typename Chilitags3D_<RealT>::TransformMatrix& pose)
+{
+    Solution solution;
+    solve(handle, size, imagePoints, solution, mWorkspace);
+    update(handle, solution, pose);
+}
+
+template<typename RealT>
+void EstimatePose3D<RealT>::operator()(int handle,
                                        std::vector<cv::Point3_<RealT> > const& objectPoints,
                                        cv::Mat_<cv::Point2f> const& imagePoints,
-                                       typename Chilitags3D_<RealT>::TagPoseMap& objects)
+                                       typename Chilitags3D_<RealT>::TransformMatrix& pose)
+{
+    Solution solution;
+    solve(handle, objectPoints, imagePoints, solution, mWorkspace);
+    update(handle, solution, pose);
+}
+
+template<typename RealT>
+void EstimatePose3D<RealT>::solve(int handle,
+                                  RealT size,
+                                  cv::Mat_<cv::Point2f> const& imagePoints,
+                                  Solution& solution,
+                                  Workspace& workspace,
+                                  bool undistorted) const
 {
+    // Above this ambiguity, the reprojection error does not tell the poses
+    // apart reliably anymore
+    static const double AMBIGUITY_THRESHOLD = 0.5;
 
-    // Find the 3D pose of our tag
-    cv::solvePnP(objectPoints, imagePoints,
-                 mCameraMatrix, mDistCoeffs,
-                 mTempRotation, mTempTranslation, false,
+    SquarePose best, alternative;
+    double ambiguity = solveSquare(size, imagePoints, best, alternative, workspace, undistorted);
+
+    // Prefer the solution whose rotation is the closest to the filtered one,
+    // i.e. maximizes the trace of Rf^T*R
+    const SquarePose* chosen = &best;
+    typename Chilitags3D_<RealT>::TransformMatrix predicted;
+    if(ambiguity > AMBIGUITY_THRESHOLD && mFilter3DEnabled
+       && mFilter3D.getPrediction(handle, predicted)) {
+        double similarities[2] = {0, 0};
+        const SquarePose* candidates[2] = {&best, &alternative};
+        for(int s=0; s<2; s++)
+            for(int i=0; i<3; i++)
+                for(int j=0; j<3; j++)
+                    similarities[s] += predicted(i,j)*candidates[s]->rotation(i,j);
+        if(similarities[1] > similarities[0])
+            chosen = &alternative;
+    }
+
+    cv::Mat& rotation = workspace.rotation;
+    cv::Rodrigues(chosen->rotation, rotation);
+    for(int i=0; i<3; i++) {
+        solution.rotation(i) = rotation.at<double>(i);
+        solution.translation(i) = chosen->translation(i);
+    }
+    solution.refined = false;
+}
+
+template<typename RealT>
+void EstimatePose3D<RealT>::solve(int handle,
+                                  std::vector<cv::Point3_<RealT> > const& objectPoints,
+                                  cv::Mat_<cv::Point2f> const& imagePoints,
+                                  Solution& solution,
+                                  Workspace& workspace,
+                                  bool undistorted) const
+{
+    // Starting from a guess, a few iterations are enough, unless the object
+    // moved a lot, in which case the reprojection error remains high
+    static const int MAX_GUESS_ITERATIONS = 5;
+    static const double MAX_GUESS_ERROR = 2.0;
+
+    cv::Mat& rotation = workspace.rotation;
+    cv::Mat& translation = workspace.translation;
+    cv::Mat const& distCoeffs = undistorted ? mNoDistCoeffs : mDistCoeffs;
+
+    bool solved = getGuess(handle, workspace)
+        && refine(objectPoints, imagePoints, distCoeffs, MAX_GUESS_ITERATIONS, workspace) < MAX_GUESS_ERROR;
+
+    // Find the 3D pose of our object from scratch
+    if(!solved)
+        cv::solvePnP(objectPoints, imagePoints,
+                     mCameraMatrix, distCoeffs,
+                     rotation, translation, false,
 #ifdef OPENCV3
-                 cv::SOLVEPNP_ITERATIVE);
+                     cv::SOLVEPNP_ITERATIVE);
 #else
-                 cv::ITERATIVE);
+                     cv::ITERATIVE);
 #endif
     //TODO: Rotation and translation vectors come out of solvePnP as double
 
+    for(int i=0; i<3; i++) {
+        solution.rotation(i) = rotation.at<double>(i);
+        solution.translation(i) = translation.at<double>(i);
+    }
+    solution.refined = solved;
+}
+
+template<typename RealT>
+bool EstimatePose3D<RealT>::getGuess(int handle, Workspace& workspace) const
+{
+    cv::Mat& rotation = workspace.rotation;
+    cv::Mat& translation = workspace.translation;
+    rotation.create(3, 1, CV_64F);
+    translation.create(3, 1, CV_64F);
+
+    // The filtered pose, already predicted for this frame
+    typename Chilitags3D_<RealT>::TransformMatrix predicted;
+    if(mFilter3DEnabled && mFilter3D.getPrediction(handle, predicted)) {
+        cv::Matx33d rotationMatrix;
+        for(int i=0; i<3; i++) {
+            for(int j=0; j<3; j++)
+                rotationMatrix(i,j) = predicted(i,j);
+            translation.at<double>(i) = predicted(i,3);
+        }
+        cv::Rodrigues(rotationMatrix, rotation);
+        return true;
+    }
+
+    // Otherwise, the solution of the previous frame
+    if(handle < (int)mSolutions.size() && mSolutions[handle].frame > 0
+       && mSolutions[handle].frame+1 >= mFrames) {
+        for(int i=0; i<3; i++) {
+            rotation.at<double>(i) = mSolutions[handle].rotation(i);
+            translation.at<double>(i) = mSolutions[handle].translation(i);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+template<typename RealT>
+double EstimatePose3D<RealT>::refine(std::vector<cv::Point3_<RealT> > const& objectPoints,
+                                     cv::Mat_<cv::Point2f> const& imagePoints,
+                                     cv::Mat const& distCoeffs,
+                                     int maxIterations,
+                                     Workspace& workspace) const
+{
+    // Below a hundredth of a pixel, further iterations are not worth it
+    static const double MIN_IMPROVEMENT = 0.01;
+
+    const int nPoints = objectPoints.size();
+    const cv::Point2f* observed = imagePoints[0];
+
+    cv::Mat& rotation = workspace.rotation;
+    cv::Mat& translation = workspace.translation;
+    std::vector<cv::Point_<RealT> >& projected = workspace.projected;
+    cv::Mat& jacobian = workspace.jacobian;
+
+    cv::Vec3d previousRotation, previousTranslation;
+    double error = DBL_MAX;
+    for(int iteration = 0; ; iteration++) {
+        cv::projectPoints(objectPoints, rotation, translation,
+                          mCameraMatrix, distCoeffs,
+                          projected, jacobian);
+
+        // Normal equations of the residuals, with respect to the rotation
+        // and the translation, which are the first 6 columns of the Jacobian
+        cv::Matx<double,6,6> JtJ;
+        cv::Vec<double,6> Jtr;
+        double squaredError = 0;
+        for(int i=0; i<2*nPoints; i++) {
+            const double* J = jacobian.ptr<double>(i);
+            const double residual = (i%2 == 0)
+                ? observed[i/2].x - projected[i/2].x
+                : observed[i/2].y - projected[i/2].y;
+            squaredError += residual*residual;
+            for(int j=0; j<6; j++) {
+                Jtr(j) += J[j]*residual;
+                for(int k=j; k<6; k++)
+                    JtJ(j,k) += J[j]*J[k];
+            }
+        }
+        const double newError = std::sqrt(squaredError/nPoints);
+
+        // Go back to the previous pose if it was better
+        if(newError >= error) {
+            for(int i=0; i<3; i++) {
+                rotation.at<double>(i) = previousRotation(i);
+                translation.at<double>(i) = previousTranslation(i);
+            }
+            break;
+        }
+        const bool converged = error - newError < MIN_IMPROVEMENT;
+        error = newError;
+        if(converged || iteration == maxIterations)
+            break;
+
+        for(int i=0; i<3; i++) {
+            previousRotation(i) = rotation.at<double>(i);
+            previousTranslation(i) = translation.at<double>(i);
+        }
+
+        for(int j=0; j<6; j++)
+            for(int k=0; k<j; k++)
+                JtJ(j,k) = JtJ(k,j);
+        cv::Vec<double,6> step = JtJ.solve(Jtr, cv::DECOMP_CHOLESKY);
+        for(int i=0; i<3; i++) {
+            rotation.at<double>(i) += step(i);
+            translation.at<double>(i) += step(3+i);
+        }
+    }
+
+    return error;
+}
+
+template<typename RealT>
+void EstimatePose3D<RealT>::update(int handle,
+                                   Solution const& solution,
+                                   typename Chilitags3D_<RealT>::TransformMatrix& pose)
+{
+    // Keep the solution for the next frame, before it is filtered
+    if(handle >= (int)mSolutions.size())
+        mSolutions.resize(handle+1, Solution());
+    mSolutions[handle] = solution;
+    mSolutions[handle].frame = mFrames;
+
+    cv::Mat& rotation = mWorkspace.rotation;
+    cv::Mat& translation = mWorkspace.translation;
+    rotation.create(3, 1, CV_64F);
+    translation.create(3, 1, CV_64F);
+    for(int i=0; i<3; i++) {
+        rotation.at<double>(i) = solution.rotation(i);
+        translation.at<double>(i) = solution.translation(i);
+    }
+
     if(mFilter3DEnabled)
-        mFilter3D(name, mTempTranslation, mTempRotation);
+        mFilter3D(handle, translation, rotation);
 
-    cv::Rodrigues(mTempRotation, mTempRotMat);
+    cv::Rodrigues(rotation, mTempRotMat);
 
-    objects[name] = {
-        (RealT)mTempRotMat(0,0),    (RealT)mTempRotMat(0,1),    (RealT)mTempRotMat(0,2),    (RealT)mTempTranslation.at<double>(0),
-        (RealT)mTempRotMat(1,0),    (RealT)mTempRotMat(1,1),    (RealT)mTempRotMat(1,2),    (RealT)mTempTranslation.at<double>(1),
-        (RealT)mTempRotMat(2,0),    (RealT)mTempRotMat(2,1),    (RealT)mTempRotMat(2,2),    (RealT)mTempTranslation.at<double>(2),
+    pose = {
+        (RealT)mTempRotMat(0,0),    (RealT)mTempRotMat(0,1),    (RealT)mTempRotMat(0,2),    (RealT)translation.at<double>(0),
+        (RealT)mTempRotMat(1,0),    (RealT)mTempRotMat(1,1),    (RealT)mTempRotMat(1,2),    (RealT)translation.at<double>(1),
+        (RealT)mTempRotMat(2,0),    (RealT)mTempRotMat(2,1),    (RealT)mTempRotMat(2,2),    (RealT)translation.at<double>(2),
         0,                          0,                          0,                          1
     };
 }
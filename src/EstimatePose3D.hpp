@@ -30,11 +30,13 @@
 
 #include <vector>
 #include <map>
+#include <string>
 #include <opencv2/core/core.hpp>
 
 #include <chilitags.hpp>
 
 #include "Filter3D.hpp"
+#include "UndistortLut.hpp"
 
 namespace chilitags {
 
@@ -43,6 +45,39 @@ class EstimatePose3D
 {
 public:
 
+/**
+ * @brief A pose of a square tag, and how well it explains the observed corners
+ */
+struct SquarePose {
+    cv::Matx<double,3,3> rotation;      ///< Rotation of the tag in the camera frame
+    cv::Vec<double,3> translation;      ///< Position of the first corner of the tag in the camera frame
+    double error;                       ///< Root mean square reprojection error, in pixels
+};
+
+/**
+ * @brief A pose of an object, before filtering
+ */
+struct Solution {
+    cv::Vec3d rotation;         ///< 3x1 axis-angle
+    cv::Vec3d translation;
+    unsigned long frame;        ///< Number of the frame, 0 if there is no solution
+    bool refined;               ///< Whether the pose was refined from a guess, rather than solved from scratch
+};
+
+/**
+ * @brief Scratch memory of the computation of poses
+ *
+ * Poses can be computed concurrently by solve(), as long as each thread
+ * uses its own Workspace.
+ */
+struct Workspace {
+    cv::Mat rotation;                           ///< 3x1 axis-angle: (rx,ry,rz)
+    cv::Mat translation;                        ///< 3x1 translation: (x,y,z)
+    std::vector<cv::Point_<RealT> > projected;  ///< Projection of the object points
+    cv::Mat jacobian;                           ///< Derivatives of projected
+    cv::Mat_<cv::Point2f> undistorted;          ///< Undistorted image points, in normalized coordinates
+};
+
 /**
  * @brief Creates a new 6D pose calculator that uses camera image coordinates and camera parameters
  *
@@ -60,6 +95,29 @@ EstimatePose3D(cv::Size cameraResolution = cv::Size(640,480));
  */
 void setCameraCalibration(cv::Mat newCameraMatrix, cv::Mat newDistCoeffs);
 
+/**
+ * @brief Undistorts image points with a lookup table rather than iteratively, for cameras of fixed calibration
+ *
+ * The table is rebuilt by setCameraCalibration(). When a cache file is
+ * given, the table is read from it if it was computed for the same
+ * calibration, and written to it otherwise.
+ *
+ * @param imageSize Size of the camera images, or an empty size to undistort points iteratively
+ * @param step Distance in pixels between two samples of the table
+ * @param cacheFilename File to read the table from, or to write it to, empty for none
+ */
+void setUndistortLut(cv::Size imageSize, int step, std::string const& cacheFilename = std::string());
+
+/**
+ * @brief Undistorts image points in place, into the pixels of the ideal pinhole camera of the same camera matrix
+ *
+ * Undistorting all the points of a frame at once, and passing them to solve()
+ * as undistorted, spares undistorting the points of each object separately.
+ *
+ * @param imagePoints Points in the image, undistorted on output
+ */
+void undistort(cv::Mat_<cv::Point2f>& imagePoints) const;
+
 /**
  * @brief Returns the camera matrix
  *
@@ -88,6 +146,13 @@ void enableFilter(bool enabled);
  */
 void setFilterPersistence(RealT persistence);
 
+/**
+ * @brief Bounds the number of objects whose pose is filtered
+ *
+ * @param maxObjects Maximal number of filtered objects, 0 for no bound
+ */
+void setFilterMaxObjects(int maxObjects);
+
 /**
  * @brief Sets the process noise covariance matrix for the Kalman filter
  *
@@ -111,38 +176,196 @@ void setFilterObservationNoiseCovariance(cv::Mat const& covariance);
 void setCamDelta(cv::Vec<RealT, 4> const& camDeltaR, cv::Vec<RealT, 3> const& camDeltaX);
 
 /**
- * @brief Updates the poses of all known tags via statistical filtering
+ * @brief Forgets the filtered poses, e.g. when the handles of the objects change
+ */
+void resetFilter();
+
+/**
+ * @brief Predicts the poses of all known objects via statistical filtering
+ *
+ * @param objects List to which the predicted poses are appended, in no particular order
+ */
+void operator()(typename Chilitags3D_<RealT>::ObjectPoseList& objects);
+
+/**
+ * @brief Computes the pose of a square tag analytically
+ *
+ * The pose of a plane observed from 4 points is ambiguous: there are up to
+ * two poses which explain the observation, mirrored about the line of sight,
+ * and they are hard to tell apart when the tag is small or far away. Both are
+ * computed in closed form with the Infinitesimal Plane-based Pose Estimation
+ * (IPPE) of Collins and Bartoli, "Infinitesimal Plane-Based Pose Estimation",
+ * IJCV 2014, instead of iteratively.
+ *
+ * @param size Length of the side of the tag
+ * @param imagePoints Corners of the tag in the image
+ * @param best Pose with the smallest reprojection error
+ * @param alternative Other pose
+ * @return Ambiguity of the pose, i.e. the ratio of the reprojection errors of best and alternative: 0 when alternative is obviously wrong, close to 1 when both explain the corners equally well
+ */
+double solveSquare(RealT size,
+                   cv::Mat_<cv::Point2f> const& imagePoints,
+                   SquarePose& best,
+                   SquarePose& alternative) const;
+
+/**
+ * @brief Same as above, with the given scratch memory, and image points possibly already undistorted (see undistort())
+ */
+double solveSquare(RealT size,
+                   cv::Mat_<cv::Point2f> const& imagePoints,
+                   SquarePose& best,
+                   SquarePose& alternative,
+                   Workspace& workspace,
+                   bool undistorted = false) const;
+
+/**
+ * @brief Computes the pose of the given square tag
  *
- * @param objects Map to update in which ID maps to the transform
+ * When the pose is ambiguous (see solveSquare()), the solution closest to the
+ * filtered pose is preferred, to prevent the pose from flipping.
+ *
+ * @param handle Unique ID of the tag
+ * @param size Length of the side of the tag
+ * @param imagePoints Corners of the tag in the image
+ * @param pose Output transform of the tag
  */
-void operator()(typename Chilitags3D_<RealT>::TagPoseMap& objects);
+void operator()(int handle,
+                RealT size,
+                cv::Mat_<cv::Point2f> const& imagePoints,
+                typename Chilitags3D_<RealT>::TransformMatrix& pose);
 
 /**
- * @brief Updates/inserts the pose of the given object in the given map
+ * @brief Computes the pose of the given object
  *
- * @param name Unique ID of the object
+ * When a guess of the pose is available, i.e. the filtered pose, or the pose
+ * of the previous frame when filtering is disabled, a few Gauss-Newton
+ * iterations refine it. The iterative solver of OpenCV only starts from
+ * scratch when there is no guess, or when the refined pose does not explain
+ * the image points well.
+ *
+ * @param handle Unique ID of the object
  * @param objectPoints Reference points on the object
  * @param imagePoints Where reference points are found in the image
- * @param objects Map to update in which ID maps to the transform
+ * @param pose Output transform of the object
  */
-void operator()(std::string const& name,
+void operator()(int handle,
                 std::vector<cv::Point3_<RealT> > const& objectPoints,
                 cv::Mat_<cv::Point2f> const& imagePoints,
-                typename Chilitags3D_<RealT>::TagPoseMap& objects);
+                typename Chilitags3D_<RealT>::TransformMatrix& pose);
+
+/**
+ * @brief Computes the pose of the given square tag, without updating the filter
+ *
+ * This is the first half of the corresponding operator(), which is safe to
+ * call concurrently. update() is the second half.
+ *
+ * @param handle Unique ID of the tag
+ * @param size Length of the side of the tag
+ * @param imagePoints Corners of the tag in the image
+ * @param solution Output pose of the tag
+ * @param workspace Scratch memory, not shared with concurrent calls
+ * @param undistorted Whether the image points are already undistorted (see undistort())
+ */
+void solve(int handle,
+           RealT size,
+           cv::Mat_<cv::Point2f> const& imagePoints,
+           Solution& solution,
+           Workspace& workspace,
+           bool undistorted = false) const;
+
+/**
+ * @brief Computes the pose of the given object, without updating the filter
+ *
+ * This is the first half of the corresponding operator(), which is safe to
+ * call concurrently. update() is the second half.
+ *
+ * @param handle Unique ID of the object
+ * @param objectPoints Reference points on the object
+ * @param imagePoints Where reference points are found in the image
+ * @param solution Output pose of the object
+ * @param workspace Scratch memory, not shared with concurrent calls
+ * @param undistorted Whether the image points are already undistorted (see undistort())
+ */
+void solve(int handle,
+           std::vector<cv::Point3_<RealT> > const& objectPoints,
+           cv::Mat_<cv::Point2f> const& imagePoints,
+           Solution& solution,
+           Workspace& workspace,
+           bool undistorted = false) const;
+
+/**
+ * @brief Filters the pose computed by solve(), and converts it to a transform
+ *
+ * The filter is updated in the order of the calls, which must not be
+ * concurrent with each other nor with solve().
+ *
+ * @param handle Unique ID of the object
+ * @param solution Pose of the object
+ * @param pose Output transform of the object
+ */
+void update(int handle,
+            Solution const& solution,
+            typename Chilitags3D_<RealT>::TransformMatrix& pose);
 
 protected:
 
+/**
+ * @brief Gives a guess of the pose of the given object in the rotation and translation of the workspace
+ *
+ * @param handle Unique ID of the object
+ * @param workspace Scratch memory
+ * @return Whether there is a guess
+ */
+bool getGuess(int handle, Workspace& workspace) const;
+
+/**
+ * @brief Refines the pose in the rotation and translation of the workspace by minimizing the reprojection error with Gauss-Newton
+ *
+ * @param objectPoints Reference points on the object
+ * @param imagePoints Where reference points are found in the image
+ * @param distCoeffs Distortion coefficients of the image points
+ * @param maxIterations Maximal number of iterations
+ * @param workspace Scratch memory
+ * @return Root mean square reprojection error of the refined pose, in pixels
+ */
+double refine(std::vector<cv::Point3_<RealT> > const& objectPoints,
+              cv::Mat_<cv::Point2f> const& imagePoints,
+              cv::Mat const& distCoeffs,
+              int maxIterations,
+              Workspace& workspace) const;
+
+/**
+ * @brief Brings image points to normalized camera coordinates, i.e. undistorted and divided by the focal length
+ *
+ * @param imagePoints Points in the image
+ * @param normalizedPoints Output points, the size of imagePoints
+ * @param distCoeffs Distortion coefficients of the image points
+ * @param workspace Scratch memory
+ */
+void normalize(cv::Mat_<cv::Point2f> const& imagePoints,
+               cv::Point2d* normalizedPoints,
+               cv::Mat const& distCoeffs,
+               Workspace& workspace) const;
+
 Filter3D<RealT> mFilter3D;      ///< Kalman filter to increase stability of the tag
 bool mFilter3DEnabled;          ///< Whether to enable pose filtering
 
+std::vector<Solution> mSolutions; ///< Last solution of each object solved iteratively, by handle
+unsigned long mFrames;          ///< Number of frames so far, i.e. of prediction steps
+
 cv::Mat mCameraMatrix;          ///< 3x3 camera matrix
 cv::Mat mDistCoeffs;            ///< Empty or 4x1 or 5x1 or 8x1 Distortion coefficients of the camera
+cv::Mat mNoDistCoeffs;          ///< Empty distortion coefficients, of undistorted points
+
+UndistortLut mUndistortLut;     ///< Samples of the undistortion of the camera, empty if not used
+cv::Size mUndistortLutSize;     ///< Image size of mUndistortLut, empty if not used
+int mUndistortLutStep;          ///< Distance in pixels between the samples of mUndistortLut
+std::string mUndistortLutCache; ///< File caching mUndistortLut, empty if none
 
-cv::Mat mTempRotation;          ///< 3x1 axis-angle: (rx,ry,rz)
-cv::Mat mTempTranslation;       ///< 3x1 translation: (x,y,z)
+mutable Workspace mWorkspace;   ///< Scratch memory of the calls which do not provide their own
 
 //TODO: This is double because of rodrigues, it doesn't accept float at the time of writing
-cv::Matx33d mTempRotMat;        ///< 3x3 rotation matrix representation of mTempRotation
+cv::Matx33d mTempRotMat;        ///< 3x3 rotation matrix representation of the rotation of mWorkspace
 
 };
 
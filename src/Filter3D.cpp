@@ -20,7 +20,7 @@
 
 /**
  * @file Filter3D.cpp
- * @brief 6D pose filter for multiple std::string ID'd objects
+ * @brief 6D pose filter for multiple integer ID'd objects
  * @author Ayberk Özgür
  */
 
@@ -29,65 +29,85 @@
 #include <type_traits>
 #include <cmath>
 #include <cfloat>
-
-#include <opencv2/calib3d/calib3d.hpp>
+#include <algorithm>
 
 namespace chilitags {
 
 template<typename RealT>
 Filter3D<RealT>::Filter3D() :
-    CV_TYPE(std::is_same<RealT,double>::value ? CV_64F : CV_32F),
     EPSILON(std::is_same<RealT,double>::value ? DBL_EPSILON : FLT_EPSILON),
-    mF(7, 7, CV_TYPE),
-    mB(7, 3, CV_TYPE),
-    mControl(3, 1, CV_TYPE),
+    mFilters(),
+    mSlots(),
+    mMaxObjects(0),
+    mSteps(0),
+    mFRot(cv::Matx<RealT,3,3>::eye()),
+    mFQuat(cv::Matx<RealT,4,4>::eye()),
+    mControl(),
+    mCamMoved(false),
     mQ(),
-    mQChanged(true),
     mR(),
-    mRChanged(true),
-    mCovScales(7, 1, CV_TYPE),
-    mPersistence(10.0f),
-    mTempState(7, 1, CV_TYPE)
+    mCovScales(),
+    mPersistence(10.0f)
 {
 
     //Process noise covariance is 7x7: cov((x,y,z,qw,qx,qy,qz))
-    mQ = (cv::Mat_<RealT>(7,7) <<
-          1e-3f,  0,      0,      0,      0,      0,      0,
-          0,      1e-3f,  0,      0,      0,      0,      0,
-          0,      0,      1e-3f,  0,      0,      0,      0,
-          0,      0,      0,      1e-4f,  0,      0,      0,
-          0,      0,      0,      0,      1e-4f,  0,      0,
-          0,      0,      0,      0,      0,      1e-4f,  0,
-          0,      0,      0,      0,      0,      0,      1e-4f);
+    mQ = Covariance::diag(State(1e-3f, 1e-3f, 1e-3f, 1e-4f, 1e-4f, 1e-4f, 1e-4f));
 
     //Measurement noise covariance is 7x7: cov((x,y,z,qw,qx,qy,qz))
-    mR = (cv::Mat_<RealT>(7,7) <<
-          1e-3f,  0,      0,      0,      0,      0,      0,
-          0,      1e-3f,  0,      0,      0,      0,      0,
-          0,      0,      1e-1f,  0,      0,      0,      0,
-          0,      0,      0,      1e-3f,  0,      0,      0,
-          0,      0,      0,      0,      1e-2f,  0,      0,
-          0,      0,      0,      0,      0,      1e-2f,  0,
-          0,      0,      0,      0,      0,      0,      1e-5f);
+    mR = Covariance::diag(State(1e-3f, 1e-3f, 1e-1f, 1e-3f, 1e-2f, 1e-2f, 1e-5f));
 
     //Scale coefficients when calculating the trace of the covariance estimate
     recalculateCovScales();
 
-    //Process matrix is 7x7 and is identity as long as there is no camera movement info
-    cv::setIdentity(mF);
+    //Process matrix is identity and control input is zero as long as there is no camera movement info
+}
+
+template<typename RealT>
+void Filter3D<RealT>::reset()
+{
+    mFilters.clear();
+    mSlots.clear();
+}
 
-    //Control matrix is 7x3 and is zero as long as there is no camera movement info
-    mB = cv::Mat::zeros(7, 3, CV_TYPE);
+template<typename RealT>
+void Filter3D<RealT>::setMaxObjects(int maxObjects)
+{
+    mMaxObjects = std::max(maxObjects, 0);
+
+    //Discard the objects observed least recently first
+    if(mMaxObjects > 0) {
+        while(mFilters.size() > mMaxObjects)
+            removeOldest();
+        mFilters.reserve(mMaxObjects);
+    }
+}
+
+template<typename RealT>
+void Filter3D<RealT>::remove(std::size_t index)
+{
+    mSlots[mFilters[index].id] = -1;
+    if(index+1 < mFilters.size()) {
+        mFilters[index] = mFilters.back();
+        mSlots[mFilters[index].id] = index;
+    }
+    mFilters.pop_back();
+}
 
-    //Control input is 3x1 and is zero as long as there is no linear camera movement info
-    mControl = cv::Mat::zeros(3, 1, CV_TYPE);
+template<typename RealT>
+void Filter3D<RealT>::removeOldest()
+{
+    std::size_t oldest = 0;
+    for(std::size_t i=1; i<mFilters.size(); i++)
+        if(mFilters[i].lastObserved < mFilters[oldest].lastObserved)
+            oldest = i;
+    remove(oldest);
 }
 
 template<typename RealT>
 inline void Filter3D<RealT>::recalculateCovScales()
 {
     for(int i=0; i<7; i++)
-        mCovScales.at<RealT>(i) = sqrt(mQ.at<RealT>(i,i)*mR.at<RealT>(i,i));
+        mCovScales(i) = sqrt(mQ(i,i)*mR(i,i));
 }
 
 template<typename RealT>
@@ -99,180 +119,212 @@ void Filter3D<RealT>::setPersistence(RealT persistence)
 template<typename RealT>
 void Filter3D<RealT>::setProcessNoiseCovariance(cv::Mat const& covariance)
 {
-    covariance.copyTo(mQ);
+    mQ = (Covariance) covariance;
     recalculateCovScales();
-    mQChanged = true;
 }
 
 template<typename RealT>
 void Filter3D<RealT>::setObservationNoiseCovariance(cv::Mat const& covariance)
 {
-    covariance.copyTo(mR);
+    mR = (Covariance) covariance;
     recalculateCovScales();
-    mRChanged = true;
 }
 
 template<typename RealT>
 void Filter3D<RealT>::setCamDelta(cv::Vec<RealT, 4> const& q, cv::Vec<RealT, 3> const& camDeltaX)
 {
-    RealT* F0 = (RealT*)mF.ptr(0);
-    RealT* F1 = (RealT*)mF.ptr(1);
-    RealT* F2 = (RealT*)mF.ptr(2);
-    RealT* F3 = (RealT*)mF.ptr(3);
-    RealT* F4 = (RealT*)mF.ptr(4);
-    RealT* F5 = (RealT*)mF.ptr(5);
-    RealT* F6 = (RealT*)mF.ptr(6);
-
-    RealT* B0 = (RealT*)mB.ptr(0);
-    RealT* B1 = (RealT*)mB.ptr(1);
-    RealT* B2 = (RealT*)mB.ptr(2);
-
-    RealT* u = (RealT*)mControl.ptr(0);
-
-    //Set the transition matrix (other entries are zero)
-    F0[0] = q(0)*q(0) + q(1)*q(1) - q(2)*q(2) - q(3)*q(3);  F0[1] = 2*(q(1)*q(2) + q(0)*q(3));  F0[2] = 2*(q(1)*q(3) - q(0)*q(2));
-    F1[0] = 2*(q(1)*q(2) - q(0)*q(3));  F1[1] = q(0)*q(0) - q(1)*q(1) + q(2)*q(2) - q(3)*q(3);  F1[2] = 2*(q(2)*q(3) + q(0)*q(1));
-    F2[0] = 2*(q(1)*q(3) + q(0)*q(2));  F2[1] = 2*(q(2)*q(3) - q(0)*q(1));  F2[2] = q(0)*q(0) - q(1)*q(1) - q(2)*q(2) + q(3)*q(3);
-    F3[3] = q(0);   F3[4] = q(1);   F3[5] = q(2);   F3[6] = q(3);
-    F4[3] = -q(1);  F4[4] = q(0);   F4[5] = q(3);   F4[6] = -q(2);
-    F5[3] = -q(2);  F5[4] = -q(3);  F5[5] = q(0);   F5[6] = q(1);
-    F6[3] = -q(3);  F6[4] = q(2);   F6[5] = -q(1);  F6[6] = q(0);
-
-    //Set the control matrix (other entries are zero)
-    memcpy(B0, F0, 3*sizeof(RealT));
-    memcpy(B1, F1, 3*sizeof(RealT));
-    memcpy(B2, F2, 3*sizeof(RealT));
+    //Set the rotation block of the transition matrix, which is also the control matrix
+    mFRot = cv::Matx<RealT,3,3>(
+        q(0)*q(0) + q(1)*q(1) - q(2)*q(2) - q(3)*q(3),  2*(q(1)*q(2) + q(0)*q(3)),  2*(q(1)*q(3) - q(0)*q(2)),
+        2*(q(1)*q(2) - q(0)*q(3)),  q(0)*q(0) - q(1)*q(1) + q(2)*q(2) - q(3)*q(3),  2*(q(2)*q(3) + q(0)*q(1)),
+        2*(q(1)*q(3) + q(0)*q(2)),  2*(q(2)*q(3) - q(0)*q(1)),  q(0)*q(0) - q(1)*q(1) - q(2)*q(2) + q(3)*q(3));
+
+    //Set the Hamilton product block of the transition matrix
+    mFQuat = cv::Matx<RealT,4,4>(
+        q(0),   q(1),   q(2),   q(3),
+        -q(1),  q(0),   q(3),   -q(2),
+        -q(2),  -q(3),  q(0),   q(1),
+        -q(3),  q(2),   -q(1),  q(0));
 
     //Set the control input
-    u[0] = -camDeltaX(0);
-    u[1] = -camDeltaX(1);
-    u[2] = -camDeltaX(2);
+    mControl = -camDeltaX;
+
+    mCamMoved = q != cv::Vec<RealT,4>(1,0,0,0) || camDeltaX != cv::Vec<RealT,3>();
 }
 
 template<typename RealT>
-void Filter3D<RealT>::operator()(typename Chilitags3D_<RealT>::TagPoseMap& tags)
+void Filter3D<RealT>::operator()(typename Chilitags3D_<RealT>::ObjectPoseList& objects)
 {
-    //TODO: These have to be double precision for rodrigues
-    cv::Mat predictedRot(3,1,CV_64F);
-    cv::Matx33d tempRotMat;
+    ++mSteps;
 
-    for(auto& kfq : mFilters) {
-        if(kfq.second.deleted)
-            continue;
-
-        cv::KalmanFilter& filter = kfq.second.filter;
+    for(std::size_t i=0; i<mFilters.size();) {
+        KFQ& kfq = mFilters[i];
 
         //Calculate weighted covariance estimate trace, decide to discard or not
         RealT trace = 0.0f;
-        for(int i=0; i<7; i++)
-            trace += filter.errorCovPost.at<RealT>(i,i)/mCovScales.at<RealT>(i);
+        for(int j=0; j<7; j++)
+            trace += kfq.covariance(j,j)/mCovScales(j);
         trace /= 7.0f;
         if(trace > mPersistence) {
-            kfq.second.deleted = true;
+            //The last filter takes its place, and is predicted next
+            remove(i);
             continue;
         }
 
-        //Do prediction step
-        if(mQChanged)
-            mQ.copyTo(filter.processNoiseCov);
-        if(mRChanged)
-            mR.copyTo(filter.measurementNoiseCov);
-        mF.copyTo(filter.transitionMatrix);
-        mB.copyTo(filter.controlMatrix);
-        filter.predict(mControl).copyTo(mTempState);
-
-        //Convert quaternion rotation to angle-axis rotation
-        getAngleAxis((RealT*)mTempState.ptr() + 3, (double*)predictedRot.ptr());
-
-        //Convert angle-axis to 3x3 rotation matrix
-        cv::Rodrigues(predictedRot, tempRotMat);
-
-        //Write back updated pose
-        tags[kfq.first] = {
-            (RealT)tempRotMat(0,0),     (RealT)tempRotMat(0,1),     (RealT)tempRotMat(0,2),     mTempState.at<RealT>(0),
-            (RealT)tempRotMat(1,0),     (RealT)tempRotMat(1,1),     (RealT)tempRotMat(1,2),     mTempState.at<RealT>(1),
-            (RealT)tempRotMat(2,0),     (RealT)tempRotMat(2,1),     (RealT)tempRotMat(2,2),     mTempState.at<RealT>(2),
-            0,                          0,                          0,                          1
-        };
+        //Do prediction step, and write back updated pose
+        predict(kfq);
+        objects.push_back({kfq.id, {}});
+        getTransform(kfq.state, objects.back().transform);
+        i++;
     }
+}
+
+template<typename RealT>
+bool Filter3D<RealT>::getPrediction(int id, typename Chilitags3D_<RealT>::TransformMatrix& pose) const
+{
+    if(id < 0 || id >= (int)mSlots.size() || mSlots[id] < 0)
+        return false;
+
+    getTransform(mFilters[mSlots[id]].state, pose);
+    return true;
+}
+
+template<typename RealT>
+bool Filter3D<RealT>::getState(int id, cv::Vec<RealT,7>& state, cv::Matx<RealT,7,7>& covariance) const
+{
+    if(id < 0 || id >= (int)mSlots.size() || mSlots[id] < 0)
+        return false;
 
-    mQChanged = false;
-    mRChanged = false;
+    state = mFilters[mSlots[id]].state;
+    covariance = mFilters[mSlots[id]].covariance;
+    return true;
 }
 
 template<typename RealT>
-void Filter3D<RealT>::operator()(std::string const& id, cv::Mat& measuredTrans, cv::Mat& measuredRot)
+void Filter3D<RealT>::operator()(int id, cv::Mat& measuredTrans, cv::Mat& measuredRot)
 {
-    //Create&insert or return the related filter
-    //Second set of 4 params are for Kalman filter: # of state dimensions, # of measurement dimensions,
-    //# of control input dimensions and float precision of internal matrices
-    auto pair = mFilters.emplace(std::piecewise_construct,
-                                 std::make_tuple(id),
-                                 std::make_tuple(7, 7, 3, CV_TYPE));
-    cv::KalmanFilter& filter = pair.first->second.filter;
-    cv::Vec<RealT,4>& prevQuat = pair.first->second.prevQuat;
-    bool& deleted = pair.first->second.deleted;
-
-    //Newly inserted or lazy-deleted
-    if(pair.second || deleted) {
-        deleted = false;
-        initFilter(filter, prevQuat, measuredTrans, measuredRot);
+    if(id >= (int)mSlots.size())
+        mSlots.resize(id+1, -1);
+
+    //Newly observed, or discarded since
+    if(mSlots[id] < 0) {
+        //Make room by discarding the object observed least recently
+        if(mMaxObjects > 0 && mFilters.size() >= mMaxObjects)
+            removeOldest();
+
+        mSlots[id] = mFilters.size();
+        mFilters.push_back(KFQ(id));
+        mFilters.back().lastObserved = mSteps;
+        initFilter(mFilters.back(), measuredTrans, measuredRot);
+        return;
     }
 
+    KFQ& kfq = mFilters[mSlots[id]];
+    kfq.lastObserved = mSteps;
+
     //Already existing filter
-    else{
-        RealT* state = (RealT*)mTempState.ptr();
-        double* trans = (double*)measuredTrans.ptr();
-
-        //Fill state
-        state[0] = (RealT)trans[0]; //x
-        state[1] = (RealT)trans[1]; //y
-        state[2] = (RealT)trans[2]; //z
-        getQuaternion((double*)measuredRot.ptr(), state + 3);
-
-        //Do the correction step
-        shortestPathQuat(prevQuat);
-        filter.correct(mTempState).copyTo(mTempState);
-        normalizeQuat();
-
-        //Write state back
-        trans[0] = state[0]; //x
-        trans[1] = state[1]; //y
-        trans[2] = state[2]; //z
-        getAngleAxis(state + 3, (double*)measuredRot.ptr());
-    }
+    State measurement;
+    double* trans = (double*)measuredTrans.ptr();
+
+    //Fill measurement
+    measurement(0) = (RealT)trans[0]; //x
+    measurement(1) = (RealT)trans[1]; //y
+    measurement(2) = (RealT)trans[2]; //z
+    getQuaternion((double*)measuredRot.ptr(), measurement.val + 3);
+
+    //Do the correction step
+    shortestPathQuat(measurement, kfq.prevQuat);
+    correct(kfq, measurement);
+
+    //Write state back, with a normalized copy of the quaternion: the state
+    //itself is left as the Kalman filter computed it
+    State output = kfq.state;
+    normalizeQuat(output);
+    trans[0] = output(0); //x
+    trans[1] = output(1); //y
+    trans[2] = output(2); //z
+    getAngleAxis(output.val + 3, (double*)measuredRot.ptr());
 }
 
 template<typename RealT>
-void Filter3D<RealT>::initFilter(cv::KalmanFilter& filter, cv::Vec<RealT,4>& prevQuat, cv::Mat& measuredTrans, cv::Mat& measuredRot)
+void Filter3D<RealT>::initFilter(KFQ& kfq, cv::Mat& measuredTrans, cv::Mat& measuredRot)
 {
-    mQ.copyTo(filter.processNoiseCov);
-    mR.copyTo(filter.measurementNoiseCov);
-    filter.errorCovPost = cv::Mat::zeros(7, 7, CV_TYPE);
+    kfq.covariance = Covariance::zeros();
+
+    //Set initial state
+    double* trans = (double*)measuredTrans.ptr();
+
+    kfq.state(0) = (RealT)trans[0]; //x
+    kfq.state(1) = (RealT)trans[1]; //y
+    kfq.state(2) = (RealT)trans[2]; //z
+    getQuaternion((double*)measuredRot.ptr(), kfq.state.val + 3);
+
+    kfq.prevQuat(0) = kfq.state(3);
+    kfq.prevQuat(1) = kfq.state(4);
+    kfq.prevQuat(2) = kfq.state(5);
+    kfq.prevQuat(3) = kfq.state(6);
+}
+
+template<typename RealT>
+void Filter3D<RealT>::predict(KFQ& kfq)
+{
+    State& x = kfq.state;
+    Covariance& P = kfq.covariance;
 
     //We have no expectation from a tag other than staying still as long as there is no camera movement information
-    cv::setIdentity(filter.transitionMatrix);
+    if(mCamMoved) {
+        //X = F*X + B*u, where the top block of B is the one of F
+        cv::Vec<RealT,3> r(x(0) + mControl(0), x(1) + mControl(1), x(2) + mControl(2));
+        cv::Vec<RealT,4> q(x(3), x(4), x(5), x(6));
+        r = mFRot*r;
+        q = mFQuat*q;
+        x = State(r(0), r(1), r(2), q(0), q(1), q(2), q(3));
+
+        //P = F*P*F^T, one block of F at a time: first the rows of F*P...
+        Covariance FP;
+        for(int j=0; j<7; j++) {
+            for(int i=0; i<3; i++)
+                FP(i,j) = mFRot(i,0)*P(0,j) + mFRot(i,1)*P(1,j) + mFRot(i,2)*P(2,j);
+            for(int i=0; i<4; i++)
+                FP(3+i,j) = mFQuat(i,0)*P(3,j) + mFQuat(i,1)*P(4,j) + mFQuat(i,2)*P(5,j) + mFQuat(i,3)*P(6,j);
+        }
 
-    //We make the same measurement as the state: (x,y,z,qw,qx,qy,qz)
-    cv::setIdentity(filter.measurementMatrix);
+        //...then the columns of (F*P)*F^T
+        for(int i=0; i<7; i++) {
+            for(int j=0; j<3; j++)
+                P(i,j) = FP(i,0)*mFRot(j,0) + FP(i,1)*mFRot(j,1) + FP(i,2)*mFRot(j,2);
+            for(int j=0; j<4; j++)
+                P(i,3+j) = FP(i,3)*mFQuat(j,0) + FP(i,4)*mFQuat(j,1) + FP(i,5)*mFQuat(j,2) + FP(i,6)*mFQuat(j,3);
+        }
+    }
 
-    //Set initial state
-    RealT* statePost = (RealT*)filter.statePost.ptr();
-    double* trans = (double*)measuredTrans.ptr();
+    //P += Q
+    P += mQ;
+}
+
+template<typename RealT>
+void Filter3D<RealT>::correct(KFQ& kfq, State const& measurement)
+{
+    State& x = kfq.state;
+    Covariance& P = kfq.covariance;
+
+    //K = P*(P + R)^-1, which is (S^-1*P)^T since P and S = P + R are symmetric
+    Covariance S = P + mR;
+    Covariance Kt = S.solve(P, cv::DECOMP_CHOLESKY);
 
-    statePost[0] = (RealT)trans[0]; //x
-    statePost[1] = (RealT)trans[1]; //y
-    statePost[2] = (RealT)trans[2]; //z
-    getQuaternion((double*)measuredRot.ptr(), statePost + 3);
+    //X += K*(z - X)
+    State innovation = measurement - x;
+    x += Kt.t()*innovation;
 
-    prevQuat(0) = statePost[3];
-    prevQuat(1) = statePost[4];
-    prevQuat(2) = statePost[5];
-    prevQuat(3) = statePost[6];
+    //P -= K*P, kept symmetric against rounding errors
+    Covariance KP = Kt.t()*P;
+    for(int i=0; i<7; i++)
+        for(int j=i; j<7; j++)
+            P(j,i) = P(i,j) = P(i,j) - (KP(i,j) + KP(j,i))/2;
 }
 
 template<typename RealT>
-void Filter3D<RealT>::getAngleAxis(RealT* input, double* output)
+void Filter3D<RealT>::getAngleAxis(RealT const* input, double* output)
 {
     RealT theta = sqrt(input[1]*input[1] + input[2]*input[2] + input[3]*input[3]);
     theta = 2*atan2(theta, input[0]);
@@ -290,7 +342,7 @@ void Filter3D<RealT>::getAngleAxis(RealT* input, double* output)
 }
 
 template<typename RealT>
-void Filter3D<RealT>::getQuaternion(double* input, RealT* output)
+void Filter3D<RealT>::getQuaternion(double const* input, RealT* output)
 {
     RealT theta = (RealT)sqrt(input[0]*input[0] + input[1]*input[1] + input[2]*input[2]);
     output[0] = cos(theta/2); //qw
@@ -308,9 +360,26 @@ void Filter3D<RealT>::getQuaternion(double* input, RealT* output)
 }
 
 template<typename RealT>
-inline void Filter3D<RealT>::normalizeQuat()
+void Filter3D<RealT>::getTransform(State const& state, typename Chilitags3D_<RealT>::TransformMatrix& pose) const
+{
+    RealT w = state(3), x = state(4), y = state(5), z = state(6);
+
+    //The rotation matrix of the unit quaternion q/|q|, scaled by |q|^2
+    RealT norm2 = w*w + x*x + y*y + z*z;
+    RealT s = norm2 > EPSILON ? 2/norm2 : 0;
+
+    pose = {
+        1 - s*(y*y + z*z),  s*(x*y - w*z),      s*(x*z + w*y),      state(0),
+        s*(x*y + w*z),      1 - s*(x*x + z*z),  s*(y*z - w*x),      state(1),
+        s*(x*z - w*y),      s*(y*z + w*x),      1 - s*(x*x + y*y),  state(2),
+        0,                  0,                  0,                  1
+    };
+}
+
+template<typename RealT>
+inline void Filter3D<RealT>::normalizeQuat(State& state)
 {
-    RealT* quat = (RealT*)mTempState.ptr() + 3;
+    RealT* quat = state.val + 3;
     RealT norm = sqrt(quat[0]*quat[0] + quat[1]*quat[1] + quat[2]*quat[2] + quat[3]*quat[3]);
     if(norm > EPSILON) {
         quat[0] /= norm;
@@ -327,9 +396,9 @@ inline void Filter3D<RealT>::normalizeQuat()
 }
 
 template<typename RealT>
-inline void Filter3D<RealT>::shortestPathQuat(cv::Vec<RealT,4>& prevQuat)
+inline void Filter3D<RealT>::shortestPathQuat(State& state, cv::Vec<RealT,4>& prevQuat)
 {
-    RealT* quat = (RealT*)mTempState.ptr() + 3;
+    RealT* quat = state.val + 3;
 
     //If -q would be closer to q_prev than +q, replace new q with -q
     //The following comes from the derivation of |q - q_prev|^2 - |-q - q_prev|^2
@@ -20,7 +20,7 @@
 
 /**
  * @file Filter3D.hpp
- * @brief 6D pose filter for multiple std::string ID'd objects
+ * @brief 6D pose filter for multiple integer ID'd objects
  * @author Ayberk Özgür
  *
  * At the core of this class is one regular Kalman filter per detected tag.
@@ -122,15 +122,22 @@
  * covariance estimate and I is a 7x7 identity matrix. Finally, the a
  * posteriori state estimate is exported at each step as the filtered tag pose
  * output.
+ *
+ * The filters have a fixed size, so they are implemented on cv::Matx rather
+ * than cv::KalmanFilter: the states and covariances live in the filters
+ * themselves, F, B, Q and R are shared by all the filters, and nothing is
+ * allocated once an object is known. Since F is block diagonal and the
+ * observation matrix is the identity, the prediction only rotates the blocks
+ * of the covariance (and is skipped when the camera did not move), and the
+ * correction reduces to one 7x7 Cholesky solve.
  */
 
 #ifndef FILTER3D_HPP
 #define FILTER3D_HPP
 
-#include <map>
+#include <vector>
 
 #include <opencv2/core/core.hpp>
-#include <opencv2/video/tracking.hpp>
 
 #include "chilitags.hpp"
 
@@ -142,10 +149,15 @@ class Filter3D {
 public:
 
 /**
- * @brief Creates a new 6D pose filter for multiple std::string ID'd objects
+ * @brief Creates a new 6D pose filter for multiple integer ID'd objects
  */
 Filter3D();
 
+/**
+ * @brief Forgets all the objects, e.g. when their IDs change meaning
+ */
+void reset();
+
 /**
  * @brief Sets the persistence of tags against being discarded when not observed
  *
@@ -153,6 +165,16 @@ Filter3D();
  */
 void setPersistence(RealT persistence);
 
+/**
+ * @brief Bounds the number of filtered objects
+ *
+ * When a new object is observed while the bound is reached, the filter of the
+ * object observed least recently is discarded.
+ *
+ * @param maxObjects Maximal number of filters, 0 (default) for no bound
+ */
+void setMaxObjects(int maxObjects);
+
 /**
  * @brief Sets the process noise covariance matrix Q
  *
@@ -176,74 +198,127 @@ void setObservationNoiseCovariance(cv::Mat const& covariance);
 void setCamDelta(cv::Vec<RealT, 4> const& camDeltaR, cv::Vec<RealT, 3> const& camDeltaX);
 
 /**
- * @brief Performs KF prediction step for all known tags
+ * @brief Performs KF prediction step for all known objects
  *
- * @param tags The list of tags
+ * Objects which were not observed for too long are discarded (see setPersistence()).
+ *
+ * @param objects The list to which the predicted poses are appended, in no particular order
  */
-void operator()(typename Chilitags3D_<RealT>::TagPoseMap& tags);
+void operator()(typename Chilitags3D_<RealT>::ObjectPoseList& objects);
+
+/**
+ * @brief Gives the current estimate of the pose of the given object, i.e. its prediction after the prediction step
+ *
+ * @param id Unique identifier of the object
+ * @param pose Output transform of the object
+ * @return Whether the object is filtered
+ */
+bool getPrediction(int id, typename Chilitags3D_<RealT>::TransformMatrix& pose) const;
+
+/**
+ * @brief Gives the state of the Kalman filter of the given object, e.g. to check it against another implementation
+ *
+ * @param id Unique identifier of the object
+ * @param state Output state (x,y,z,qw,qx,qy,qz)
+ * @param covariance Output covariance of the state
+ * @return Whether the object is filtered
+ */
+bool getState(int id, cv::Vec<RealT,7>& state, cv::Matx<RealT,7,7>& covariance) const;
 
 /**
  * @brief Performs KF correction step for the given tag
  *
  * TODO: measuredTrans and measuredRot must be double for now
  *
- * @param id Unique identifier of the object
+ * @param id Unique identifier of the object, e.g. its handle in Chilitags3D
  * @param measuredTrans Translation measurement, also the output, 3x1 vector: (x,y,z)
  * @param measuredRot Rotation measurement, also the output, 3x1 axis-angle representation: (rx,ry,rz)
  */
-void operator()(std::string const& id, cv::Mat& measuredTrans, cv::Mat& measuredRot);
+void operator()(int id, cv::Mat& measuredTrans, cv::Mat& measuredRot);
 
 private:
 
-const int CV_TYPE;          ///< One of CV_32F, CV_64F depending on the template type
+typedef cv::Vec<RealT,7> State;            ///< (x,y,z,qw,qx,qy,qz)
+typedef cv::Matx<RealT,7,7> Covariance;    ///< Covariance of the state
+
 const RealT EPSILON;        ///< One of FLT_EPSILON, DBL_EPSILON depending on the template type
 
 /**
- * @brief Describes a Kalman filter, an associated previous rotation state and a lazy deletion flag
+ * @brief Describes the state of a Kalman filter, an associated previous rotation state and the last time it was observed
  */
 struct KFQ {
-    cv::KalmanFilter filter;
+    int id;                     ///< Identifier of the object
+    State state;                ///< A posteriori state estimate, also the a priori one after the prediction
+    Covariance covariance;      ///< A posteriori state covariance estimate, idem
     cv::Vec<RealT,4> prevQuat;
-    bool deleted;
+    unsigned long lastObserved; ///< Number of the prediction step preceding the last correction
 
-    KFQ(int dynamParams, int measureParams, int controlParams, int type) :
-        filter(dynamParams, measureParams, controlParams, type),
+    KFQ(int id) :
+        id(id),
+        state(),
+        covariance(),
         prevQuat(),
-        deleted(false)
+        lastObserved(0)
     {
     }
 };
 
-std::map<std::string, KFQ> mFilters;        ///< We keep one filter per object and do not discard them
+std::vector<KFQ> mFilters;                  ///< Filters of the live objects only, in no particular order
+std::vector<int> mSlots;                    ///< Index in mFilters of the filter of each ID, or -1
+std::size_t mMaxObjects;                    ///< Maximal number of filters, 0 if unbounded
+unsigned long mSteps;                       ///< Number of prediction steps so far
 
-cv::Mat mF;                                 ///< Process matrix, depends on the camera movement info
-cv::Mat mB;                                 ///< Control matrix, depends on the camera movement info
-cv::Mat mControl;                           ///< Control input, depends on the camera movement info
+cv::Matx<RealT,3,3> mFRot;                  ///< Rotation block of the process matrix F, which is also the one of the control matrix B
+cv::Matx<RealT,4,4> mFQuat;                 ///< Hamilton product block of F
+cv::Vec<RealT,3> mControl;                  ///< Control input, depends on the camera movement info
+bool mCamMoved;                             ///< Whether F is not the identity
 
-cv::Mat mQ;                                 ///< Process noise covariance matrix, to be tuned
-bool mQChanged;                             ///< Whether Q was updated externally
-cv::Mat mR;                                 ///< Measurement noise covariance matrix, to be tuned
-bool mRChanged;                             ///< Whether R was updated externally
+Covariance mQ;                              ///< Process noise covariance matrix, to be tuned
+Covariance mR;                              ///< Measurement noise covariance matrix, to be tuned
 
-cv::Mat mCovScales;                         ///< Coefficients to scale the covariance matrix diagonal entries
+State mCovScales;                           ///< Coefficients to scale the covariance matrix diagonal entries
 RealT mPersistence;                         ///< Persistence of tags against being discarded when not seen for a while
 
-cv::Mat mTempState;                         ///< Temporary matrix to hold the state (x,y,z,qr,qi,qj,qk)
-
 /**
  * @brief Recalculates the covariance matrix scale coefficients based on Q and R
  */
 void recalculateCovScales();
 
+/**
+ * @brief Removes the filter at the given index, moving the last one in its place
+ *
+ * @param index Index of the filter in mFilters
+ */
+void remove(std::size_t index);
+
+/**
+ * @brief Removes the filter of the object observed least recently
+ */
+void removeOldest();
+
 /**
  * @brief Initializes the filter for newly discovered tag
  *
- * @param filter Filter to initialize
- * @param prevQuat Set to the current rotation for the future
+ * @param kfq Filter to initialize
  * @param measuredTrans First measurement of position
  * @param measuredRot First measurement of rotation
  */
-void initFilter(cv::KalmanFilter& filter, cv::Vec<RealT,4>& prevQuat, cv::Mat& measuredTrans, cv::Mat& measuredRot);
+void initFilter(KFQ& kfq, cv::Mat& measuredTrans, cv::Mat& measuredRot);
+
+/**
+ * @brief Performs the KF prediction step: X(t|t-1) = F*X(t-1|t-1) + B*u, P(t|t-1) = F*P(t-1|t-1)*F^T + Q
+ *
+ * @param kfq Filter to update
+ */
+void predict(KFQ& kfq);
+
+/**
+ * @brief Performs the KF correction step, with an identity observation matrix
+ *
+ * @param kfq Filter to update
+ * @param measurement Observed state z(t)
+ */
+void correct(KFQ& kfq, State const& measurement);
 
 /**
  * @brief Converts the quaternion rotation in the state to angle-axis representation
@@ -251,7 +326,7 @@ void initFilter(cv::KalmanFilter& filter, cv::Vec<RealT,4>& prevQuat, cv::Mat& m
  * @param input 4x1 quaternion
  * @param output Double precision 3x1 angle-axis
  */
-void getAngleAxis(RealT* input, double* output);
+void getAngleAxis(RealT const* input, double* output);
 
 /**
  * @brief Converts the angle-axis to quaternion
@@ -259,17 +334,25 @@ void getAngleAxis(RealT* input, double* output);
  * @param input Double precision 3x1 angle-axis
  * @param output 4x1 quaternion
  */
-void getQuaternion(double* input, RealT* output);
+void getQuaternion(double const* input, RealT* output);
+
+/**
+ * @brief Converts the quaternion rotation in the state to a pose matrix, without going through angle-axis
+ *
+ * @param state State whose quaternion needs not be normalized
+ * @param pose Output 4x4 transformation
+ */
+void getTransform(State const& state, typename Chilitags3D_<RealT>::TransformMatrix& pose) const;
 
 /**
- * @brief Normalizes the quaternion part of the internal state vector
+ * @brief Normalizes the quaternion part of the state vector
  */
-void normalizeQuat();
+void normalizeQuat(State& state);
 
 /**
- * @brief Ensures the sign of the internal state vector's quaternion is right so that we prevent quaternion unwinding
+ * @brief Ensures the sign of the state vector's quaternion is right so that we prevent quaternion unwinding
  */
-void shortestPathQuat(cv::Vec<RealT,4>& prevQuat);
+void shortestPathQuat(State& state, cv::Vec<RealT,4>& prevQuat);
 
 };
 
@@ -21,6 +21,9 @@
 #include "FindQuads.hpp"
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <algorithm>
+#include <functional>
+
 
 //#define DEBUG_FindQuads
 #ifdef DEBUG_FindQuads
@@ -29,18 +32,16 @@
 #endif
 
 namespace {
-const int MATRIX_SIZE = 10;
-const int MIN_TAG_SIZE = 1.1f*MATRIX_SIZE;
+// The neighbourhood of the adaptive threshold spans 1/THRESHOLD_WINDOW_RATIO
+// of the image width (and at least MIN_THRESHOLD_RADIUS pixels on each side),
+// and pixels need to be THRESHOLD_OFFSET darker than this mean to be marked
+const int THRESHOLD_WINDOW_RATIO = 32;
+const int MIN_THRESHOLD_RADIUS = 3;
+const int THRESHOLD_OFFSET = 7;
 
 #ifdef DEBUG_FindQuads
-void drawContour(cv::Mat &image, cv::Mat &contour, cv::Scalar color, cv::Point offset) {
-    std::vector<std::vector<cv::Point> >contours;
-    contours.push_back(contour);
-    cv::drawContours(image, contours, 0, color, 1, CV_AA, cv::noArray(), INT_MAX, offset);
-    float perimeter = std::abs(cv::arcLength(contour, true));
-    cv::putText(image, cv::format("%.1f", perimeter), offset+contours[0][0],
-                cv::FONT_HERSHEY_SIMPLEX, 1.0f, color);
-}
+cv::Mat debugImage;
+cv::Point debugOffset;
 #endif
 
 }
@@ -48,96 +49,90 @@ void drawContour(cv::Mat &image, cv::Mat &contour, cv::Scalar color, cv::Point o
 namespace chilitags {
 
 FindQuads::FindQuads() :
+    mQuads(),
+    mQuadLevels(),
+    mScales(),
     mGrayPyramid(1),
+    mLevelScales(),
+    mLevelTicks(),
+    mScaleCosts(),
     mBinaryPyramid(1),
-    mMinInputWidth(160)
+    mIntegralImage(),
+    mTraceQuads(),
+    mMinInputWidth(160),
+    mSegmentation(Chilitags::CANNY_EDGES),
+    mInterrupted(false)
 {
 #ifdef DEBUG_FindQuads
     cv::namedWindow("FindQuads");
 #endif
 }
 
-std::vector<Quad> FindQuads::operator()(const cv::Mat &greyscaleImage)
+const std::vector<Quad> &FindQuads::operator()(const cv::Mat &greyscaleImage, int64 deadline)
 {
-    //TODO function too long, split it
-
-    std::vector<Quad> quads;
+    std::vector<Quad> &quads = mQuads;
+    quads.clear();
+    mQuadLevels.clear();
+    mInterrupted = false;
 #ifdef DEBUG_FindQuads
-    cv::RNG rNG( 0xFFFFFFFF );
-    cv::Mat debugImage = cv::Mat::zeros(
+    debugImage = cv::Mat::zeros(
         cv::Size(2*greyscaleImage.cols, greyscaleImage.rows),
         CV_8UC3);
 #endif
 
-    mGrayPyramid[0] = greyscaleImage;
-
-    // Subsample the image by a factor two,
-    // as long as the width is at least mMinInputWidth
-    unsigned int nPyramidLevel = 1;
-    if (mMinInputWidth > 0) {
-        while (mGrayPyramid[nPyramidLevel-1].cols/2 >= mMinInputWidth) {
-            if (nPyramidLevel >= mGrayPyramid.size()) mGrayPyramid.push_back(cv::Mat());
-            cv::resize(mGrayPyramid[nPyramidLevel-1], mGrayPyramid[nPyramidLevel], cv::Size(), 0.5f, 0.5f, cv::INTER_NEAREST);
-            ++nPyramidLevel;
-        }
-    }
+    buildPyramid(greyscaleImage);
+    unsigned int nPyramidLevel = mLevelScales.size();
 
     while (mBinaryPyramid.size() < nPyramidLevel) mBinaryPyramid.push_back(cv::Mat());
-    for (unsigned int i = 0; i < nPyramidLevel; ++i) {
-        cv::Canny(mGrayPyramid[i], mBinaryPyramid[i], 100, 200, 3);
-    }
 
     for (int i = nPyramidLevel-1; i>=0; --i) //starting with the lowest definition, so the highest definition are last, and can simply override the first ones.
     {
-        int scale = 1 << i;
-#ifdef DEBUG_FindQuads
-        cv::Point offset(debugImage.cols-2*mBinaryPyramid[i].cols,0);
-        cv::rectangle(debugImage, cv::Rect(offset.x, offset.y, greyscaleImage.cols/scale, greyscaleImage.rows/scale), cv::Scalar::all(255));
-#endif
-        std::vector<std::vector<cv::Point> > contours;
-        cv::findContours(mBinaryPyramid[i], contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
-
-        for (std::vector<std::vector<cv::Point> >::iterator contour = contours.begin();
-             contour != contours.end();
-             ++contour)
-        {
-            float perimeter = std::abs(cv::arcLength(*contour, true));
-            float area = std::abs(cv::contourArea(*contour));
-
-            if (perimeter > 4*MIN_TAG_SIZE && area > MIN_TAG_SIZE*MIN_TAG_SIZE)
-            {
-                cv::Mat approxContour;
-                cv::approxPolyDP( *contour, approxContour, perimeter*0.05f, true);
-
-                cv::Mat normalisedContour;
-                cv::convexHull(approxContour, normalisedContour, false);
-
-                if (normalisedContour.rows == 4)
-                {
-#ifdef DEBUG_FindQuads
-                    drawContour(debugImage, normalisedContour, cv::Scalar(0,255,0), offset);
-#endif
-                    normalisedContour *= scale;
-                    quads.push_back(normalisedContour.reshape(1));
-                }
+        if (deadline != 0 && cv::getTickCount() > deadline) {
+            mInterrupted = true;
+            break;
+        }
+
+        int64 startTicks = cv::getTickCount();
+
+        // The octaves are subsampled by taking every other pixel, the other
+        // scales by averaging areas, which shifts the pixel centres
+        float scale = (float) greyscaleImage.cols/mGrayPyramid[i].cols;
+        float offset = 0.0f;
+        if (mScales.empty()) scale = (float) (1 << i);
+        else offset = 0.5f*scale - 0.5f;
 #ifdef DEBUG_FindQuads
-                else // not quadrilaterals
-                {
-                    drawContour(debugImage, normalisedContour, cv::Scalar(0,0,255), offset);
-                }
+        debugOffset = cv::Point(debugImage.cols-2*mGrayPyramid[i].cols,0);
+        cv::rectangle(debugImage, cv::Rect(debugOffset.x, debugOffset.y, mGrayPyramid[i].cols, mGrayPyramid[i].rows), cv::Scalar::all(255));
 #endif
-            }
-#ifdef DEBUG_FindQuads
-            else // too small
-            {
-                //drawContour(debugImage, *contour, cv::Scalar(128,128,128), offset);
-            }
+        switch (mSegmentation) {
+        case Chilitags::ADAPTIVE_THRESHOLD:
+            adaptiveThreshold(mGrayPyramid[i], mBinaryPyramid[i], false);
+            traceQuads(mBinaryPyramid[i], scale, offset, quads, deadline);
+#ifdef HAS_INVERTED_TAGS
+            // The borders of inverted tags are brighter than their
+            // surroundings
+            adaptiveThreshold(mGrayPyramid[i], mBinaryPyramid[i], true);
+            traceQuads(mBinaryPyramid[i], scale, offset, quads, deadline);
 #endif
+            break;
+        case Chilitags::CANNY_EDGES:
+        default:
+            cv::Canny(mGrayPyramid[i], mBinaryPyramid[i], 100, 200, 3);
+            traceQuads(mBinaryPyramid[i], scale, offset, quads, deadline);
+            break;
         }
-#ifdef DEBUG_FindQuads
-        cv::putText(debugImage, cv::format("%d, %d", quads.size(), contours.size()), offset+cv::Point(32,32),
-                    cv::FONT_HERSHEY_SIMPLEX, 0.5f, cv::Scalar::all(255));
-#endif
+
+        mQuadLevels.resize(quads.size(), mLevelScales[i]);
+
+        // Exponential moving average of the cost of each scale
+        static const float COST_SMOOTHING = 0.1f;
+        float milliseconds = 1000.0f*(cv::getTickCount() - startTicks + mLevelTicks[i])
+                             /cv::getTickFrequency();
+        auto cost = mScaleCosts.find(mLevelScales[i]);
+        if (cost == mScaleCosts.end())
+            mScaleCosts.insert(std::make_pair(mLevelScales[i], milliseconds));
+        else
+            cost->second += COST_SMOOTHING*(milliseconds - cost->second);
     }
 #ifdef DEBUG_FindQuads
     cv::imshow("FindQuads", debugImage);
@@ -147,4 +142,123 @@ std::vector<Quad> FindQuads::operator()(const cv::Mat &greyscaleImage)
     return quads;
 }
 
+void FindQuads::setScales(const std::vector<float> &scales)
+{
+    mScales.clear();
+    for (float scale : scales) {
+        if (scale > 0.0f) mScales.push_back(std::min(scale, 1.0f));
+    }
+    std::sort(mScales.begin(), mScales.end(), std::greater<float>());
+    mScales.erase(std::unique(mScales.begin(), mScales.end()), mScales.end());
+    mScaleCosts.clear();
+}
+
+void FindQuads::buildPyramid(const cv::Mat &greyscaleImage)
+{
+    mLevelScales.clear();
+    mLevelTicks.clear();
+
+    if (mScales.empty()) {
+        mGrayPyramid[0] = greyscaleImage;
+        mLevelScales.push_back(1.0f);
+        mLevelTicks.push_back(0);
+
+        // Subsample the image by a factor two,
+        // as long as the width is at least mMinInputWidth
+        unsigned int nPyramidLevel = 1;
+        if (mMinInputWidth > 0) {
+            while (mGrayPyramid[nPyramidLevel-1].cols/2 >= mMinInputWidth) {
+                int64 startTicks = cv::getTickCount();
+                if (nPyramidLevel >= mGrayPyramid.size()) mGrayPyramid.push_back(cv::Mat());
+                cv::resize(mGrayPyramid[nPyramidLevel-1], mGrayPyramid[nPyramidLevel], cv::Size(), 0.5f, 0.5f, cv::INTER_NEAREST);
+                mLevelScales.push_back(1.0f/(1 << nPyramidLevel));
+                mLevelTicks.push_back(cv::getTickCount() - startTicks);
+                ++nPyramidLevel;
+            }
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < mScales.size(); ++i) {
+        int64 startTicks = cv::getTickCount();
+        if (i >= mGrayPyramid.size()) mGrayPyramid.push_back(cv::Mat());
+        cv::Size size(cvRound(mScales[i]*greyscaleImage.cols),
+                      cvRound(mScales[i]*greyscaleImage.rows));
+        if (size.width < 1 || size.height < 1) break;
+
+        if (size == greyscaleImage.size()) {
+            mGrayPyramid[i] = greyscaleImage;
+        }
+        else {
+            // Each level is averaged from the previous, finer one, which is
+            // cheaper than from the input image
+            const cv::Mat &finerLevel = (i == 0) ? greyscaleImage : mGrayPyramid[i-1];
+            // Do not write into the input image if it was used as a level
+            if (mGrayPyramid[i].data == greyscaleImage.data) mGrayPyramid[i] = cv::Mat();
+            cv::resize(finerLevel, mGrayPyramid[i], size, 0, 0, cv::INTER_AREA);
+        }
+        mLevelScales.push_back(mScales[i]);
+        mLevelTicks.push_back(cv::getTickCount() - startTicks);
+    }
+}
+
+void FindQuads::adaptiveThreshold(
+    const cv::Mat &greyscaleImage,
+    cv::Mat &binaryImage,
+    bool inverted)
+{
+    cv::integral(greyscaleImage, mIntegralImage, CV_32S);
+    binaryImage.create(greyscaleImage.size(), CV_8UC1);
+
+    const int radius = std::max(MIN_THRESHOLD_RADIUS,
+                                greyscaleImage.cols/THRESHOLD_WINDOW_RATIO/2);
+    const int sign = inverted ? -1 : 1;
+    const int offset = sign*THRESHOLD_OFFSET;
+
+    for (int y = 0; y < greyscaleImage.rows; ++y) {
+        const int y0 = std::max(y-radius, 0);
+        const int y1 = std::min(y+radius+1, greyscaleImage.rows);
+        const int *top = mIntegralImage.ptr<int>(y0);
+        const int *bottom = mIntegralImage.ptr<int>(y1);
+        const uchar *input = greyscaleImage.ptr<uchar>(y);
+        uchar *output = binaryImage.ptr<uchar>(y);
+
+        for (int x = 0; x < greyscaleImage.cols; ++x) {
+            const int x0 = std::max(x-radius, 0);
+            const int x1 = std::min(x+radius+1, greyscaleImage.cols);
+            const int count = (x1-x0)*(y1-y0);
+            const int sum = bottom[x1] - bottom[x0] - top[x1] + top[x0];
+            // input < mean - THRESHOLD_OFFSET (or input > mean +
+            // THRESHOLD_OFFSET if inverted), without division
+            output[x] = (sign*(input[x] + offset)*count < sign*sum) ? 255 : 0;
+        }
+    }
+}
+
+void FindQuads::traceQuads(
+    cv::Mat &binaryImage,
+    float scale,
+    float offset,
+    std::vector<Quad> &quads,
+    int64 deadline)
+{
+#ifdef DEBUG_FindQuads
+    size_t nPreviousQuads = quads.size();
+#endif
+    mTraceQuads(binaryImage, scale, offset, quads, deadline);
+    if (mTraceQuads.wasInterrupted()) mInterrupted = true;
+#ifdef DEBUG_FindQuads
+    for (size_t q = nPreviousQuads; q < quads.size(); ++q) {
+        for (int i = 0, j = 3; i < 4; j = i++) {
+            cv::line(debugImage,
+                     debugOffset + cv::Point((quads[q](j,0)-offset)/scale, (quads[q](j,1)-offset)/scale),
+                     debugOffset + cv::Point((quads[q](i,0)-offset)/scale, (quads[q](i,1)-offset)/scale),
+                     cv::Scalar(0,255,0), 1, CV_AA);
+        }
+    }
+    cv::putText(debugImage, cv::format("%d", quads.size()-nPreviousQuads), debugOffset+cv::Point(32,32),
+                cv::FONT_HERSHEY_SIMPLEX, 0.5f, cv::Scalar::all(255));
+#endif
+}
+
 } /* namespace chilitags */
@@ -21,10 +21,12 @@
 #ifndef FindQuads_H
 #define FindQuads_H
 
+#include <map>
 #include <vector>
 #include <opencv2/core/core.hpp>
 
 #include <chilitags.hpp>
+#include "TraceQuads.hpp"
 
 namespace chilitags {
 
@@ -33,17 +35,82 @@ class FindQuads
 public:
 FindQuads();
 
-std::vector<Quad> operator()(const cv::Mat &greyscaleImage);
+/**
+ * Finds the quadrilaterals of the image. If a deadline (in ticks, see
+ * cv::getTickCount()) is given, the search stops when it is passed, and
+ * wasInterrupted() returns true.
+ *
+ * The returned quads are valid until the next call.
+ */
+const std::vector<Quad> &operator()(const cv::Mat &greyscaleImage, int64 deadline = 0);
+
+bool wasInterrupted() const {
+    return mInterrupted;
+}
 
 void setMinInputWidth(int minWidth) {
     mMinInputWidth = minWidth;
 }
 
+void setSegmentation(Chilitags::Segmentation segmentation) {
+    mSegmentation = segmentation;
+}
+
+/**
+ * Searches the quads at the given scales (area-averaged) instead of the
+ * default octaves (down to the minimum input width); empty to restore them.
+ */
+void setScales(const std::vector<float> &scales);
+
+/**
+ * Scale of the level on which each of the quads returned by the last call
+ * was found (1 for the input image, lower for the subsamples).
+ */
+const std::vector<float> &getQuadLevels() const {
+    return mQuadLevels;
+}
+
+/**
+ * Average processing time (in ms) of the search at each scale.
+ */
+const std::map<float, float> &getScaleCosts() const {
+    return mScaleCosts;
+}
+
 protected:
 
+/**
+ * Marks in binaryImage the pixels darker (or, with inverted = true, brighter)
+ * than the mean of their neighbourhood, computed from an integral image.
+ */
+void adaptiveThreshold(const cv::Mat &greyscaleImage, cv::Mat &binaryImage, bool inverted);
+
+/**
+ * Fills mGrayPyramid with the levels to search, from the finest to the
+ * coarsest, and mLevelScales and mLevelTicks with their scale and the time
+ * taken to compute them.
+ */
+void buildPyramid(const cv::Mat &greyscaleImage);
+
+/**
+ * Appends to quads the quadrilateral contours of the binary image, their
+ * coordinates multiplied by scale and shifted by offset.
+ */
+void traceQuads(cv::Mat &binaryImage, float scale, float offset, std::vector<Quad> &quads, int64 deadline);
+
+std::vector<Quad> mQuads;
+std::vector<float> mQuadLevels;
+std::vector<float> mScales;             ///< decreasing, empty for octaves
 std::vector<cv::Mat> mGrayPyramid;
+std::vector<float> mLevelScales;
+std::vector<int64> mLevelTicks;
+std::map<float, float> mScaleCosts;
 std::vector<cv::Mat> mBinaryPyramid;
+cv::Mat mIntegralImage;
+TraceQuads mTraceQuads;
 int mMinInputWidth;
+Chilitags::Segmentation mSegmentation;
+bool mInterrupted;
 
 };
 
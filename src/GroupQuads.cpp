@@ -0,0 +1,127 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include "GroupQuads.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Two quads are duplicates if their centres are closer than
+// MAX_CENTRE_DISTANCE times the size of the smallest one, and if their sizes
+// (the square roots of their areas) differ by less than MAX_SIZE_RATIO. This
+// is tight enough to keep apart the outer and inner edges of the border of a
+// tag, whose sizes have a ratio of 10/8.
+const float MAX_CENTRE_DISTANCE = 0.1f;
+const float MAX_SIZE_RATIO = 1.15f;
+
+}
+
+namespace chilitags {
+
+GroupQuads::GroupQuads() :
+    mPrimaries(),
+    mNextFallback(),
+    mFinestDuplicate(),
+    mOrder(),
+    mCentres()
+{
+}
+
+const std::vector<int> &GroupQuads::operator()(
+    const std::vector<Quad> &quads,
+    const std::vector<float> &levels)
+{
+    const int n = quads.size();
+    mPrimaries.clear();
+    mNextFallback.assign(n, -1);
+    mFinestDuplicate.resize(n);
+    mOrder.resize(n);
+    mCentres.resize(n);
+
+    for (int i = 0; i < n; ++i) {
+        const Quad &quad = quads[i];
+        float doubleArea = 0.0f;
+        for (int k = 0, l = 3; k < 4; l = k++) {
+            doubleArea += quad(l,0)*quad(k,1) - quad(k,0)*quad(l,1);
+        }
+        mCentres[i] = cv::Vec3f(
+            0.25f*(quad(0,0)+quad(1,0)+quad(2,0)+quad(3,0)),
+            0.25f*(quad(0,1)+quad(1,1)+quad(2,1)+quad(3,1)),
+            std::sqrt(0.5f*std::abs(doubleArea)));
+        mFinestDuplicate[i] = i;
+        mOrder[i] = i;
+    }
+
+    // Sweep the quads by increasing abscissa, comparing each one only with
+    // the following ones which can be close enough
+    std::sort(mOrder.begin(), mOrder.end(), [this](int a, int b) {
+        return mCentres[a][0] < mCentres[b][0];
+    });
+    for (int a = 0; a < n; ++a) {
+        int i = mOrder[a];
+        const cv::Vec3f &ci = mCentres[i];
+        float maxDistance = MAX_CENTRE_DISTANCE*ci[2];
+        for (int b = a+1; b < n && mCentres[mOrder[b]][0] - ci[0] < maxDistance; ++b) {
+            int j = mOrder[b];
+            if (levels[i] == levels[j]) continue;
+
+            const cv::Vec3f &cj = mCentres[j];
+            float minSize = std::min(ci[2], cj[2]);
+            float maxSize = std::max(ci[2], cj[2]);
+            if (maxSize > MAX_SIZE_RATIO*minSize) continue;
+            float dx = ci[0] - cj[0];
+            float dy = ci[1] - cj[1];
+            float distance = MAX_CENTRE_DISTANCE*minSize;
+            if (dx*dx + dy*dy > distance*distance) continue;
+
+            int coarse = (levels[i] < levels[j]) ? i : j;
+            int fine = (coarse == i) ? j : i;
+            if (levels[fine] > levels[mFinestDuplicate[coarse]])
+                mFinestDuplicate[coarse] = fine;
+        }
+    }
+
+    // The finest duplicate of a quad may itself have a finer duplicate
+    for (int i = 0; i < n; ++i) {
+        int primary = i;
+        while (mFinestDuplicate[primary] != primary) primary = mFinestDuplicate[primary];
+        mFinestDuplicate[i] = primary;
+    }
+
+    // Chain the fallbacks after their primary, the finest levels first
+    std::sort(mOrder.begin(), mOrder.end(), [&levels](int a, int b) {
+        return levels[a] < levels[b] || (levels[a] == levels[b] && a < b);
+    });
+    for (int i : mOrder) {
+        int primary = mFinestDuplicate[i];
+        if (primary == i) continue;
+        mNextFallback[i] = mNextFallback[primary];
+        mNextFallback[primary] = i;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (mFinestDuplicate[i] == i) mPrimaries.push_back(i);
+    }
+    return mPrimaries;
+}
+
+} /* namespace chilitags */
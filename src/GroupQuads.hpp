@@ -0,0 +1,71 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifndef GroupQuads_HPP
+#define GroupQuads_HPP
+
+#include <vector>
+
+#include <chilitags.hpp>
+
+namespace chilitags {
+
+/**
+ * Groups the quads found on different levels of the pyramid around the same
+ * tag, so that only one of them, found on the finest level, is refined and
+ * decoded; the others are kept as fallbacks in case it can not be decoded.
+ */
+class GroupQuads {
+
+public:
+
+GroupQuads();
+
+/**
+ * \param quads the quads to group.
+ * \param levels the scale of the level on which each quad was found (1 for
+ * the input image, lower for the subsamples).
+ * \returns the indices of the quads found on the finest level of their group,
+ * in increasing order.
+ */
+const std::vector<int> &operator()(const std::vector<Quad> &quads,
+                                   const std::vector<float> &levels);
+
+/**
+ * \returns the index of the next quad of the group of the given quad, from
+ * the finest to the coarsest level, or -1 if there is none.
+ */
+int nextFallback(int index) const {
+    return mNextFallback[index];
+}
+
+protected:
+
+std::vector<int> mPrimaries;
+std::vector<int> mNextFallback;
+std::vector<int> mFinestDuplicate;  ///< index of the quad on the finest level of the group
+std::vector<int> mOrder;            ///< indices by increasing abscissa of the centre
+std::vector<cv::Vec3f> mCentres;    ///< centre, and square root of the area
+
+};
+
+} /* namespace chilitags */
+
+#endif /* GroupQuads_HPP */
@@ -0,0 +1,75 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifndef Homography_HPP
+#define Homography_HPP
+
+#include <opencv2/core/core.hpp>
+
+namespace chilitags {
+
+/**
+ * Computes the homography mapping the unit square, i.e. (0,0), (1,0), (1,1)
+ * and (0,1), to the four given corners (cf. Heckbert, Fundamentals of
+ * Texture Mapping and Image Warping, 1989).
+ *
+ * Unlike cv::getPerspectiveTransform(), this closed form solution does not
+ * allocate anything, and can be used in double precision.
+ *
+ * \returns false if the corners are degenerate (e.g. three of them aligned).
+ */
+template<typename RealT>
+bool squareToQuad(const cv::Matx<RealT, 4, 2> &corners, cv::Matx<RealT, 3, 3> &homography)
+{
+    RealT dx1 = corners(1,0) - corners(2,0);
+    RealT dx2 = corners(3,0) - corners(2,0);
+    RealT dx3 = corners(0,0) - corners(1,0) + corners(2,0) - corners(3,0);
+    RealT dy1 = corners(1,1) - corners(2,1);
+    RealT dy2 = corners(3,1) - corners(2,1);
+    RealT dy3 = corners(0,1) - corners(1,1) + corners(2,1) - corners(3,1);
+
+    RealT denominator = dx1*dy2 - dx2*dy1;
+    if (denominator == 0) return false;
+
+    RealT g = (dx3*dy2 - dx2*dy3)/denominator;
+    RealT h = (dx1*dy3 - dx3*dy1)/denominator;
+
+    homography = cv::Matx<RealT, 3, 3>(
+        corners(1,0) - corners(0,0) + g*corners(1,0), corners(3,0) - corners(0,0) + h*corners(3,0), corners(0,0),
+        corners(1,1) - corners(0,1) + g*corners(1,1), corners(3,1) - corners(0,1) + h*corners(3,1), corners(0,1),
+        g,                                            h,                                            1);
+    return true;
+}
+
+/**
+ * Applies the given homography to the point (x,y).
+ */
+template<typename RealT>
+cv::Point_<RealT> transformPoint(const cv::Matx<RealT, 3, 3> &homography, RealT x, RealT y)
+{
+    RealT w = homography(2,0)*x + homography(2,1)*y + homography(2,2);
+    return cv::Point_<RealT>(
+        (homography(0,0)*x + homography(0,1)*y + homography(0,2))/w,
+        (homography(1,0)*x + homography(1,1)*y + homography(1,2))/w);
+}
+
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include "MappedFile.hpp"
+
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAS_MMAP
+#endif
+
+namespace chilitags {
+
+MappedFile::MappedFile(const std::string &filename) :
+    mData(0),
+    mSize(0),
+    mMapped(false),
+    mBuffer()
+{
+#ifdef HAS_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat status;
+        if (fstat(fd, &status) == 0 && status.st_size > 0) {
+            void *data = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                mData = static_cast<const char *>(data);
+                mSize = status.st_size;
+                mMapped = true;
+            }
+        }
+        close(fd);
+        if (mMapped)
+            return;
+    }
+#endif
+
+    // The buffer is made of doubles to be aligned like the mapped pages
+    std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+    if (!file)
+        return;
+    std::streamoff size = file.tellg();
+    if (size <= 0)
+        return;
+    mBuffer.resize((size + sizeof(double) - 1)/sizeof(double));
+    file.seekg(0);
+    if (file.read(reinterpret_cast<char *>(mBuffer.data()), size)) {
+        mData = reinterpret_cast<const char *>(mBuffer.data());
+        mSize = size;
+    }
+    else {
+        mBuffer.clear();
+    }
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef HAS_MMAP
+    if (mMapped)
+        munmap(const_cast<char *>(mData), mSize);
+#endif
+}
+
+}
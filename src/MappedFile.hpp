@@ -0,0 +1,78 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifndef MappedFile_HPP
+#define MappedFile_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace chilitags {
+
+/**
+ * Gives read-only access to the contents of a whole file.
+ *
+ * Where the system supports it, the file is mapped in memory, so that its
+ * contents are only paged in when they are accessed, and are shared with the
+ * other processes mapping the same file. Elsewhere, it is read in a buffer.
+ */
+class MappedFile
+{
+public:
+
+/**
+ * Maps the given file, or leaves the MappedFile empty if it can not be read.
+ */
+MappedFile(const std::string &filename);
+
+~MappedFile();
+
+/**
+ * \returns the contents of the file, aligned at least as any fundamental
+ * type, or 0 if it is empty.
+ */
+const char *data() const {
+    return mData;
+}
+
+/**
+ * \returns the size of the file in bytes.
+ */
+std::size_t size() const {
+    return mSize;
+}
+
+protected:
+
+const char *mData;
+std::size_t mSize;
+bool mMapped;                   ///< whether mData is mapped rather than mBuffer
+std::vector<double> mBuffer;    ///< the contents, when they can not be mapped
+
+private:
+MappedFile(const MappedFile &);
+MappedFile &operator=(const MappedFile &);
+
+};
+
+}
+
+#endif
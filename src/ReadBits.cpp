@@ -19,10 +19,14 @@
 *******************************************************************************/
 
 #include "ReadBits.hpp"
-#include <opencv2/imgproc/imgproc.hpp>
+#include "Homography.hpp"
+
+#include <algorithm>
+#include <cfloat>
 
 //#define DEBUG_ReadBits
 #ifdef DEBUG_ReadBits
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <iostream>
 #endif
@@ -41,11 +45,74 @@ namespace chilitags {
 
 static const int DATA_SIZE = 6;
 static const int TAG_MARGIN = 2;
+static const int TAG_SIZE = 2*TAG_MARGIN+DATA_SIZE;
+
+namespace {
+
+// Same threshold as cv::threshold(..., cv::THRESH_OTSU), without the
+// allocations of cv::Mat's
+int otsuThreshold(const std::vector<uchar> &samples)
+{
+    int histogram[256] = {0};
+    for (uchar sample : samples) ++histogram[sample];
+
+    double scale = 1.0/samples.size();
+    double mu = 0.0;
+    for (int i = 0; i < 256; ++i) mu += i*(double) histogram[i];
+    mu *= scale;
+
+    double mu1 = 0.0, q1 = 0.0;
+    double maxSigma = 0.0;
+    int threshold = 0;
+    for (int i = 0; i < 256; ++i) {
+        double p_i = histogram[i]*scale;
+        mu1 *= q1;
+        q1 += p_i;
+        double q2 = 1.0 - q1;
+
+        if (std::min(q1, q2) < FLT_EPSILON || std::max(q1, q2) > 1.0 - FLT_EPSILON)
+            continue;
+
+        mu1 = (mu1 + i*p_i)/q1;
+        double mu2 = (mu - q1*mu1)/q2;
+        double sigma = q1*q2*(mu1 - mu2)*(mu1 - mu2);
+        if (sigma > maxSigma) {
+            maxSigma = sigma;
+            threshold = i;
+        }
+    }
+    return threshold;
+}
+
+// Monotone chain convex hull of the 4 corners, clockwise (in the y-up
+// convention of cv::convexHull), returning the number of vertices
+int convexHull(const cv::Point2f (&corners)[4], cv::Point2f (&hull)[8])
+{
+    cv::Point2f sorted[4] = {corners[0], corners[1], corners[2], corners[3]};
+    std::sort(sorted, sorted+4, [](const cv::Point2f &p, const cv::Point2f &q) {
+        return p.x < q.x || (p.x == q.x && p.y < q.y);
+    });
+    auto cross = [](const cv::Point2f &o, const cv::Point2f &a, const cv::Point2f &b) {
+        return (a.x-o.x)*(b.y-o.y) - (a.y-o.y)*(b.x-o.x);
+    };
+    int n = 0;
+    for (int i = 0; i < 4; ++i) {
+        while (n >= 2 && cross(hull[n-2], hull[n-1], sorted[i]) >= 0) --n;
+        hull[n++] = sorted[i];
+    }
+    for (int i = 2, lower = n+1; i >= 0; --i) {
+        while (n >= lower && cross(hull[n-2], hull[n-1], sorted[i]) >= 0) --n;
+        hull[n++] = sorted[i];
+    }
+    return n-1;
+}
+
+}
 
 ReadBits::ReadBits() :
     mSamplePoints(),
     mTransformedSamplePoints(DATA_SIZE*DATA_SIZE),
-    mSamples(1, DATA_SIZE*DATA_SIZE, CV_8U),
+    mSamples(DATA_SIZE*DATA_SIZE),
     mBits(DATA_SIZE*DATA_SIZE)
 {
     for (int y = 0; y < DATA_SIZE; ++y)
@@ -53,8 +120,8 @@ ReadBits::ReadBits() :
         for (int x = 0; x < DATA_SIZE; ++x)
         {
             mSamplePoints.push_back(cv::Point2f(
-                                        TAG_MARGIN + x + 0.5f,
-                                        TAG_MARGIN + y + 0.5f));
+                                        (TAG_MARGIN + x + 0.5f)/TAG_SIZE,
+                                        (TAG_MARGIN + y + 0.5f)/TAG_SIZE));
         }
     }
 
@@ -66,26 +133,29 @@ ReadBits::ReadBits() :
 
 const std::vector<unsigned char>& ReadBits::operator()(const cv::Mat &inputImage, const Quad &corners)
 {
-    static const float TAG_SIZE = 2*TAG_MARGIN+DATA_SIZE;
-    static const Quad NORMALIZED_CORNERS = {
-        0.f,      0.f,
-        TAG_SIZE,      0.f,
-        TAG_SIZE, TAG_SIZE,
-        0.f, TAG_SIZE
-    };
-
-    cv::Mat_<cv::Point2f> cornersCopy(corners);
+    cv::Point2f cornersCopy[4];
+    for (int i : {0,1,2,3}) cornersCopy[i] = cv::Point2f(corners(i,0), corners(i,1));
 
     // Sometimes, the corners are refined into a concave quadrilateral
     // which makes ReadBits crash
-    cv::Mat convexHull;
-    cv::convexHull(cornersCopy, convexHull, true);
-    if (convexHull.rows != 4) {
-        cornersCopy = convexHull;
-        cornersCopy.push_back(0.5f*(cornersCopy(0)+cornersCopy(1)));
+    cv::Point2f convexHull[8];
+    if (chilitags::convexHull(cornersCopy, convexHull) != 4) {
+        for (int i : {0,1,2}) cornersCopy[i] = convexHull[i];
+        cornersCopy[3] = 0.5f*(cornersCopy[0]+cornersCopy[1]);
     }
 
-    auto roi = cv::boundingRect(cornersCopy);
+    float minX = cornersCopy[0].x, maxX = minX;
+    float minY = cornersCopy[0].y, maxY = minY;
+    for (int i : {1,2,3}) {
+        minX = std::min(minX, cornersCopy[i].x);
+        maxX = std::max(maxX, cornersCopy[i].x);
+        minY = std::min(minY, cornersCopy[i].y);
+        maxY = std::max(maxY, cornersCopy[i].y);
+    }
+    // Same rectangle as cv::boundingRect()
+    cv::Rect roi(cvFloor(minX), cvFloor(minY),
+                 cvFloor(maxX) - cvFloor(minX) + 1,
+                 cvFloor(maxY) - cvFloor(minY) + 1);
 
     // Refine can actually provide corners outside the image
     roi.x = cv::max(roi.x, 0);
@@ -94,23 +164,32 @@ const std::vector<unsigned char>& ReadBits::operator()(const cv::Mat &inputImage
     roi.height = cv::min(roi.height, inputImage.rows-roi.y);
 
     cv::Point2f origin = roi.tl();
-    for (int i : {0,1,2,3}) cornersCopy(i) -= origin;
-
-    cv::Matx33f transformation = cv::getPerspectiveTransform(NORMALIZED_CORNERS, cornersCopy);
+    Quad localCorners;
+    for (int i : {0,1,2,3}) {
+        cornersCopy[i] -= origin;
+        localCorners(i,0) = cornersCopy[i].x;
+        localCorners(i,1) = cornersCopy[i].y;
+    }
 
-    cv::perspectiveTransform(mSamplePoints, mTransformedSamplePoints, transformation);
+    cv::Matx33f transformation;
+    if (!squareToQuad(localCorners, transformation)) {
+        std::fill(mBits.begin(), mBits.end(), 0);
+        return mBits;
+    }
 
     cv::Mat inputRoi = inputImage(roi);
 
-    uchar* sampleData = mSamples.ptr(0);
-    for (auto& transformedSamplePoint : mTransformedSamplePoints) {
+    for (size_t i = 0; i < mSamplePoints.size(); ++i) {
+        cv::Point2f &transformedSamplePoint = mTransformedSamplePoints[i];
+        transformedSamplePoint = transformPoint(transformation, mSamplePoints[i].x, mSamplePoints[i].y);
         transformedSamplePoint.x = cv::max(cv::min(roi.width - 1, (int)std::round(transformedSamplePoint.x)), 0);
         transformedSamplePoint.y = cv::max(cv::min(roi.height - 1, (int)std::round(transformedSamplePoint.y)), 0);
 
-        *sampleData++ = inputRoi.at<uchar>(transformedSamplePoint);
+        mSamples[i] = inputRoi.at<uchar>(transformedSamplePoint);
     }
 
-    cv::threshold(mSamples, mBits, -1, 1, cv::THRESH_BINARY | cv::THRESH_OTSU);
+    int threshold = otsuThreshold(mSamples);
+    for (size_t i = 0; i < mSamples.size(); ++i) mBits[i] = (mSamples[i] > threshold) ? 1 : 0;
 
 #ifdef DEBUG_ReadBits
     for (int i = 0; i < DATA_SIZE; ++i)
@@ -142,20 +221,20 @@ const std::vector<unsigned char>& ReadBits::operator()(const cv::Mat &inputImage
         }
     }
 
-    cv::circle(tag, *cornersCopy[0] * ZOOM_FACTOR, 3, cv::Scalar(255,0,0),2);
+    cv::circle(tag, cornersCopy[0] * ZOOM_FACTOR, 3, cv::Scalar(255,0,0),2);
 
-    cv::line(tag, *cornersCopy[0]*ZOOM_FACTOR, *cornersCopy[1]*ZOOM_FACTOR,cv::Scalar(255,0,0));
-    cv::line(tag, *cornersCopy[1]*ZOOM_FACTOR, *cornersCopy[2]*ZOOM_FACTOR,cv::Scalar(255,0,255));
-    cv::line(tag, *cornersCopy[2]*ZOOM_FACTOR, *cornersCopy[3]*ZOOM_FACTOR,cv::Scalar(255,0,255));
-    cv::line(tag, *cornersCopy[3]*ZOOM_FACTOR, *cornersCopy[0]*ZOOM_FACTOR,cv::Scalar(255,0,255));
+    cv::line(tag, cornersCopy[0]*ZOOM_FACTOR, cornersCopy[1]*ZOOM_FACTOR,cv::Scalar(255,0,0));
+    cv::line(tag, cornersCopy[1]*ZOOM_FACTOR, cornersCopy[2]*ZOOM_FACTOR,cv::Scalar(255,0,255));
+    cv::line(tag, cornersCopy[2]*ZOOM_FACTOR, cornersCopy[3]*ZOOM_FACTOR,cv::Scalar(255,0,255));
+    cv::line(tag, cornersCopy[3]*ZOOM_FACTOR, cornersCopy[0]*ZOOM_FACTOR,cv::Scalar(255,0,255));
 
-    cv::line(tag, *cornersCopy[2]*ZOOM_FACTOR, *cornersCopy[0]*ZOOM_FACTOR,cv::Scalar(255,0,255));
-    cv::line(tag, *cornersCopy[3]*ZOOM_FACTOR, *cornersCopy[1]*ZOOM_FACTOR,cv::Scalar(255,0,255));
+    cv::line(tag, cornersCopy[2]*ZOOM_FACTOR, cornersCopy[0]*ZOOM_FACTOR,cv::Scalar(255,0,255));
+    cv::line(tag, cornersCopy[3]*ZOOM_FACTOR, cornersCopy[1]*ZOOM_FACTOR,cv::Scalar(255,0,255));
 
-    cv::line(debugImage, *cornersCopy[0]+origin, *cornersCopy[1]+origin,cv::Scalar(255,0,255));
-    cv::line(debugImage, *cornersCopy[1]+origin, *cornersCopy[2]+origin,cv::Scalar(255,0,255));
-    cv::line(debugImage, *cornersCopy[2]+origin, *cornersCopy[3]+origin,cv::Scalar(255,0,255));
-    cv::line(debugImage, *cornersCopy[3]+origin, *cornersCopy[0]+origin,cv::Scalar(255,0,255));
+    cv::line(debugImage, cornersCopy[0]+origin, cornersCopy[1]+origin,cv::Scalar(255,0,255));
+    cv::line(debugImage, cornersCopy[1]+origin, cornersCopy[2]+origin,cv::Scalar(255,0,255));
+    cv::line(debugImage, cornersCopy[2]+origin, cornersCopy[3]+origin,cv::Scalar(255,0,255));
+    cv::line(debugImage, cornersCopy[3]+origin, cornersCopy[0]+origin,cv::Scalar(255,0,255));
 
 
     cv::imshow("ReadBits-full", debugImage);
@@ -37,9 +37,9 @@ const std::vector<unsigned char> &operator()(const cv::Mat &inputImage, const Qu
 
 protected:
 
-std::vector<cv::Point2f> mSamplePoints;
+std::vector<cv::Point2f> mSamplePoints;       ///< in the unit square
 std::vector<cv::Point2f> mTransformedSamplePoints;
-cv::Mat mSamples;
+std::vector<uchar> mSamples;
 
 std::vector<uchar> mBits;
 
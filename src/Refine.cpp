@@ -21,6 +21,10 @@
 #include "Refine.hpp"
 
 #include "GrowRoi.hpp"
+
+#include <algorithm>
+#include <cmath>
+
 #include <opencv2/imgproc/imgproc.hpp>
 
 //#define DEBUG_Refine
@@ -32,7 +36,70 @@
 
 namespace chilitags {
 
-Refine::Refine()
+namespace {
+
+// Same termination criteria as the former calls to cv::cornerSubPix()
+const int MAX_ITERATIONS = 5;
+const float EPSILON = 0.01f;
+
+// Taking a ROI around the raw corners with some margin
+const float GROWTH_RATIO = 1.2f/10.0f;
+const int MIN_ROI_SIZE = 10;
+
+float perimeter(const Quad &quad)
+{
+    float length = 0.0f;
+    for (int i = 0, j = 3; i < 4; j = i++) {
+        float dx = quad(i,0) - quad(j,0);
+        float dy = quad(i,1) - quad(j,1);
+        length += std::sqrt(dx*dx + dy*dy);
+    }
+    return length;
+}
+
+// Bilinear interpolation, (x,y) being at least one pixel away from the right
+// and bottom borders
+inline float interpolate(const cv::Mat &image, float x, float y)
+{
+    int ix = (int) x;
+    int iy = (int) y;
+    float fx = x - ix;
+    float fy = y - iy;
+    const uchar *row = image.ptr<uchar>(iy) + ix;
+    const uchar *nextRow = image.ptr<uchar>(iy+1) + ix;
+    return (1.0f-fy)*((1.0f-fx)*row[0] + fx*row[1])
+           + fy*((1.0f-fx)*nextRow[0] + fx*nextRow[1]);
+}
+
+// Edge samples per side for Chilitags::EDGE_LINES, and the minimal step of
+// intensity between two pixels for a sample to count as an edge
+const int MAX_EDGE_SAMPLES = 24;
+const float MIN_EDGE_CONTRAST = 8.0f;
+
+void ensureSize(cv::Mat_<float> &plane, int rows, int cols)
+{
+    if (plane.rows < rows || plane.cols < cols)
+        plane.create(std::max(plane.rows, rows), std::max(plane.cols, cols));
+}
+
+}
+
+Refine::Refine() :
+    mMethod(Chilitags::CORNER_GRADIENTS),
+    mGradientRegion(),
+    mGxx(),
+    mGxy(),
+    mGyy(),
+    mBx(),
+    mBy(),
+    mRegions(),
+    mHalfWindows(),
+    mWeightsX(),
+    mWeightsY(),
+    mColumnSums(),
+    mSingleQuad(),
+    mProfile(),
+    mEdgePoints()
 {
 #ifdef DEBUG_Refine
     cv::namedWindow("Refine");
@@ -44,53 +111,313 @@ Quad Refine::operator()(
     const Quad &quad,
     const float proximityRatio)
 {
-    cv::Mat_<cv::Point2f> refinedQuad(quad);
+    mSingleQuad.assign(1, quad);
+    (*this)(inputImage, mSingleQuad, proximityRatio);
+    return mSingleQuad[0];
+}
+
+void Refine::operator()(
+    const cv::Mat &inputImage,
+    std::vector<Quad> &quads,
+    const float proximityRatio)
+{
+    if (mMethod == Chilitags::EDGE_LINES) {
+        for (Quad &quad : quads) refineEdges(inputImage, quad, proximityRatio);
+        return;
+    }
 
-    // Taking a ROI around the raw corners with some margin
-    static const float GROWTH_RATIO = 1.2f/10.0f;
-    cv::Rect roi = chilitags::growRoi(inputImage, refinedQuad, GROWTH_RATIO);
+    mRegions.clear();
+    mHalfWindows.clear();
 
-    static const int MIN_ROI_SIZE = 10;
-    if (roi.width < MIN_ROI_SIZE || roi.height < MIN_ROI_SIZE) return quad;
+    cv::Rect unionRegion;
+    int totalArea = 0;
+    for (const Quad &quad : quads) {
+        cv::Rect roi = chilitags::growRoi(inputImage,
+            cv::Mat(4, 1, CV_32FC2, (void *) quad.val), GROWTH_RATIO);
 
-    cv::Point2f roiOffset = roi.tl();
-    for (int i : {0,1,2,3}) refinedQuad(i) -= roiOffset;
+        if (roi.width < MIN_ROI_SIZE || roi.height < MIN_ROI_SIZE) {
+            mRegions.push_back(cv::Rect());
+            mHalfWindows.push_back(0);
+            continue;
+        }
 
-    float averageSideLength = cv::arcLength(refinedQuad, true) / 4.0f;
-    float cornerNeighbourhood = proximityRatio*averageSideLength;
+        float cornerNeighbourhood = proximityRatio*perimeter(quad)/4.0f;
 
-    // ensure the cornerSubPixel search window is smaller that the ROI
-    cornerNeighbourhood = cv::min(cornerNeighbourhood, (roi.width - 5.0f)/2.0f);
-    cornerNeighbourhood = cv::min(cornerNeighbourhood, (roi.height - 5.0f)/2.0f);
-    cornerNeighbourhood = cv::max(cornerNeighbourhood, 1.0f);
+        // ensure the search window is smaller that the ROI
+        cornerNeighbourhood = cv::min(cornerNeighbourhood, (roi.width - 5.0f)/2.0f);
+        cornerNeighbourhood = cv::min(cornerNeighbourhood, (roi.height - 5.0f)/2.0f);
+        cornerNeighbourhood = cv::max(cornerNeighbourhood, 1.0f);
 
-    cv::cornerSubPix(inputImage(roi), refinedQuad,
-                     cv::Size(cornerNeighbourhood, cornerNeighbourhood),
-                     cv::Size(-1, -1), cv::TermCriteria(
-                         cv::TermCriteria::MAX_ITER + cv::TermCriteria::EPS,
-                         5, 0.01f));
+        mRegions.push_back(roi);
+        mHalfWindows.push_back((int) cornerNeighbourhood);
+        unionRegion = (totalArea == 0) ? roi : (unionRegion | roi);
+        totalArea += roi.area();
+    }
+    if (totalArea == 0) return;
+
+    // The gradients are computed once for all the quads, unless their union
+    // would cover much more than themselves (e.g. two small tags in opposite
+    // corners of the image)
+    bool sharedGradients = unionRegion.area() <= 2*totalArea;
+    if (sharedGradients) computeGradients(inputImage, unionRegion);
+
+    for (size_t q = 0; q < quads.size(); ++q) {
+        if (mRegions[q].area() == 0) continue;
+        if (!sharedGradients) computeGradients(inputImage, mRegions[q]);
+
+        // The windows stay within the ROI of their quad, so that the result
+        // does not depend on the other quads
+        cv::Rect bounds = mRegions[q] & mGradientRegion;
+        bounds -= mGradientRegion.tl();
+        for (int i : {0,1,2,3})
+            refineCorner(quads[q](i,0), quads[q](i,1), mHalfWindows[q], bounds);
 
 #ifdef DEBUG_Refine
-    cv::Mat debugImage = inputImage(roi).clone();
-    for(int i=0; i<4; ++i)
-    {
-        cv::circle(debugImage, refinedQuad(i), 3, cv::Scalar::all(128), 2);
-        cv::line(debugImage,
-                 refinedQuad(i), refinedQuad(i),
-                 cv::Scalar::all(255), 5);
-        cv::rectangle(debugImage,
-                      refinedQuad(i)-cv::Point2f(cornerNeighbourhood, cornerNeighbourhood), refinedQuad(i)+cv::Point2f(cornerNeighbourhood, cornerNeighbourhood),
-                      cv::Scalar::all(255));
-        printf("%1.1f  %1.1f        ", refinedQuad(i).x, refinedQuad(i).y);
+        cv::Mat debugImage = inputImage(mRegions[q]).clone();
+        cv::Point2f roiOffset = mRegions[q].tl();
+        for(int i=0; i<4; ++i)
+        {
+            cv::Point2f corner(quads[q](i,0), quads[q](i,1));
+            cv::circle(debugImage, corner-roiOffset, 3, cv::Scalar::all(128), 2);
+            cv::rectangle(debugImage,
+                          corner-roiOffset-cv::Point2f(mHalfWindows[q], mHalfWindows[q]),
+                          corner-roiOffset+cv::Point2f(mHalfWindows[q], mHalfWindows[q]),
+                          cv::Scalar::all(255));
+            printf("%1.1f  %1.1f        ", corner.x, corner.y);
+        }
+        printf("\n");
+        cv::imshow("Refine", debugImage);
+        cv::waitKey(0);
+#endif
     }
-    printf("\n");
-    cv::imshow("Refine", debugImage);
-    cv::waitKey(0);
+}
+
+void Refine::refineEdges(
+    const cv::Mat &inputImage,
+    Quad &quad,
+    float proximityRatio)
+{
+    float averageSideLength = perimeter(quad)/4.0f;
+    if (averageSideLength < MIN_ROI_SIZE) return;
+
+    // The profiles across the sides go from outside to inside
+    float doubleArea = 0.0f;
+    for (int i = 0, j = 3; i < 4; j = i++)
+        doubleArea += quad(j,0)*quad(i,1) - quad(i,0)*quad(j,1);
+    float inwards = (doubleArea > 0.0f) ? 1.0f : -1.0f;
+
+    int searchRadius = std::max(2, (int) (proximityRatio*averageSideLength));
+    int profileLength = 2*searchRadius+1;
+    mProfile.resize(profileLength);
+
+    cv::Vec4f lines[4];
+    for (int side = 0; side < 4; ++side) {
+        cv::Point2f from(quad(side,0), quad(side,1));
+        cv::Point2f to(quad((side+1)%4,0), quad((side+1)%4,1));
+        cv::Point2f direction = to - from;
+        float length = std::sqrt(direction.dot(direction));
+        if (length < 1.0f) return;
+        direction *= 1.0f/length;
+        cv::Point2f normal(-inwards*direction.y, inwards*direction.x);
+
+        int nSamples = std::max(3, std::min(MAX_EDGE_SAMPLES, (int) (length/3.0f)));
+        mEdgePoints.clear();
+        for (int k = 0; k < nSamples; ++k) {
+            // Stay away from the corners, where the other sides interfere
+            float t = 0.15f + 0.7f*(k+0.5f)/nSamples;
+            cv::Point2f start = from + t*length*direction - searchRadius*normal;
+            cv::Point2f end = start + 2.0f*searchRadius*normal;
+            if (std::min(start.x, end.x) < 0.0f
+                || std::min(start.y, end.y) < 0.0f
+                || std::max(start.x, end.x) >= inputImage.cols-1
+                || std::max(start.y, end.y) >= inputImage.rows-1) continue;
+
+            for (int j = 0; j < profileLength; ++j)
+                mProfile[j] = interpolate(inputImage,
+                                          start.x + j*normal.x,
+                                          start.y + j*normal.y);
+
+            // Strongest step from the bright outside to the dark border
+            // (either way with inverted tags)
+            int best = 0;
+            float bestStep = 2.0f*MIN_EDGE_CONTRAST;
+            for (int j = 1; j < profileLength-1; ++j) {
+                float step = mProfile[j-1] - mProfile[j+1];
+#ifdef HAS_INVERTED_TAGS
+                step = std::abs(step);
+#endif
+                if (step > bestStep) {
+                    bestStep = step;
+                    best = j;
+                }
+            }
+            if (best == 0) continue;
+
+            // Sub-pixel location of the step, by parabolic interpolation
+            float offset = 0.0f;
+            if (best > 1 && best < profileLength-2) {
+                float previous = mProfile[best-2] - mProfile[best];
+                float next = mProfile[best] - mProfile[best+2];
+#ifdef HAS_INVERTED_TAGS
+                previous = std::abs(previous);
+                next = std::abs(next);
+#endif
+                float curvature = previous - 2.0f*bestStep + next;
+                if (curvature < 0.0f) offset = 0.5f*(previous - next)/curvature;
+            }
+            mEdgePoints.push_back(start + (best + offset)*normal);
+        }
+
+        if (mEdgePoints.size() < 3) return;
+        cv::fitLine(mEdgePoints, lines[side],
+#ifdef OPENCV3
+                    cv::DIST_HUBER,
+#else
+                    CV_DIST_HUBER,
 #endif
+                    0, 0.01, 0.01);
+    }
+
+    Quad refinedQuad;
+    for (int i = 0; i < 4; ++i) {
+        // Corner i is where the side ending at it meets the side starting at it
+        const cv::Vec4f &a = lines[(i+3)%4];
+        const cv::Vec4f &b = lines[i];
+        float cross = a[0]*b[1] - a[1]*b[0];
+        if (std::abs(cross) < 1e-3f) return;
+        float t = ((b[2]-a[2])*b[1] - (b[3]-a[3])*b[0])/cross;
+        refinedQuad(i,0) = a[2] + t*a[0];
+        refinedQuad(i,1) = a[3] + t*a[1];
+
+        // Corners can not move further than the sides were searched
+        float dx = refinedQuad(i,0) - quad(i,0);
+        float dy = refinedQuad(i,1) - quad(i,1);
+        if (!(dx*dx + dy*dy <= 4.0f*searchRadius*searchRadius)) return;
+    }
+    quad = refinedQuad;
+}
+
+void Refine::computeGradients(const cv::Mat &inputImage, cv::Rect region)
+{
+    // Central differences need one pixel on each side
+    region &= cv::Rect(1, 1, inputImage.cols-2, inputImage.rows-2);
+    mGradientRegion = region;
+
+    ensureSize(mGxx, region.height, region.width);
+    ensureSize(mGxy, region.height, region.width);
+    ensureSize(mGyy, region.height, region.width);
+    ensureSize(mBx, region.height, region.width);
+    ensureSize(mBy, region.height, region.width);
+
+    // The coordinates are relative to the region, so that the products
+    // summed over a window keep their precision in single precision
+    for (int y = 0; y < region.height; ++y) {
+        const uchar *above = inputImage.ptr<uchar>(region.y+y-1) + region.x;
+        const uchar *row = inputImage.ptr<uchar>(region.y+y) + region.x;
+        const uchar *below = inputImage.ptr<uchar>(region.y+y+1) + region.x;
+        float *gxx = mGxx.ptr<float>(y);
+        float *gxy = mGxy.ptr<float>(y);
+        float *gyy = mGyy.ptr<float>(y);
+        float *bx = mBx.ptr<float>(y);
+        float *by = mBy.ptr<float>(y);
+        const float fy = (float) y;
+
+        // No branch nor dependency between iterations, so that the compiler
+        // vectorises this loop
+        for (int x = 0; x < region.width; ++x) {
+            float gx = 0.5f*((float) row[x+1] - (float) row[x-1]);
+            float gy = 0.5f*((float) below[x] - (float) above[x]);
+            float fx = (float) x;
+            gxx[x] = gx*gx;
+            gxy[x] = gx*gy;
+            gyy[x] = gy*gy;
+            bx[x] = gx*gx*fx + gx*gy*fy;
+            by[x] = gx*gy*fx + gy*gy*fy;
+        }
+    }
+}
+
+void Refine::refineCorner(float &x, float &y, int halfWindow, const cv::Rect &bounds)
+{
+    const float initialX = x - mGradientRegion.x;
+    const float initialY = y - mGradientRegion.y;
+    const float inverseSquaredHalfWindow = 1.0f/(halfWindow*halfWindow);
+
+    float cornerX = initialX;
+    float cornerY = initialY;
+    for (int iteration = 0; iteration < MAX_ITERATIONS; ++iteration) {
+        int x0 = std::max(cvRound(cornerX) - halfWindow, bounds.x);
+        int x1 = std::min(cvRound(cornerX) + halfWindow, bounds.x+bounds.width-1);
+        int y0 = std::max(cvRound(cornerY) - halfWindow, bounds.y);
+        int y1 = std::min(cvRound(cornerY) + halfWindow, bounds.y+bounds.height-1);
+        if (x0 > x1 || y0 > y1) break;
+        int width = x1-x0+1;
+        int height = y1-y0+1;
+
+        // Separable gaussian weights centred on the current estimate
+        mWeightsX.resize(width);
+        for (int i = 0; i < width; ++i) {
+            float d = x0+i-cornerX;
+            mWeightsX[i] = std::exp(-d*d*inverseSquaredHalfWindow);
+        }
+        mWeightsY.resize(height);
+        for (int j = 0; j < height; ++j) {
+            float d = y0+j-cornerY;
+            mWeightsY[j] = std::exp(-d*d*inverseSquaredHalfWindow);
+        }
+
+        // Sum the rows first, element-wise, then the resulting columns
+        mColumnSums.assign(5*width, 0.0f);
+        float *sxx = mColumnSums.data();
+        float *sxy = sxx + width;
+        float *syy = sxy + width;
+        float *sbx = syy + width;
+        float *sby = sbx + width;
+        for (int j = 0; j < height; ++j) {
+            const float w = mWeightsY[j];
+            const float *gxx = mGxx.ptr<float>(y0+j) + x0;
+            const float *gxy = mGxy.ptr<float>(y0+j) + x0;
+            const float *gyy = mGyy.ptr<float>(y0+j) + x0;
+            const float *bx = mBx.ptr<float>(y0+j) + x0;
+            const float *by = mBy.ptr<float>(y0+j) + x0;
+            for (int i = 0; i < width; ++i) {
+                sxx[i] += w*gxx[i];
+                sxy[i] += w*gxy[i];
+                syy[i] += w*gyy[i];
+                sbx[i] += w*bx[i];
+                sby[i] += w*by[i];
+            }
+        }
+
+        float a = 0.0f, b = 0.0f, c = 0.0f, bb1 = 0.0f, bb2 = 0.0f;
+        for (int i = 0; i < width; ++i) {
+            const float w = mWeightsX[i];
+            a += w*sxx[i];
+            b += w*sxy[i];
+            c += w*syy[i];
+            bb1 += w*sbx[i];
+            bb2 += w*sby[i];
+        }
+
+        // a*c >= b*b; equality means a single edge direction, i.e. no corner
+        float det = a*c - b*b;
+        if (det <= 1e-6f*a*c || det <= 0.0f) break;
+
+        float newX = (c*bb1 - b*bb2)/det;
+        float newY = (a*bb2 - b*bb1)/det;
+        float dx = newX - cornerX;
+        float dy = newY - cornerY;
+        cornerX = newX;
+        cornerY = newY;
+        if (dx*dx + dy*dy < EPSILON*EPSILON) break;
+    }
 
-    for (int i : {0,1,2,3}) refinedQuad(i) += roiOffset;
+    // Like cv::cornerSubPix(), give up on corners drifting out of the window
+    if (!(std::abs(cornerX - initialX) <= halfWindow
+          && std::abs(cornerY - initialY) <= halfWindow)) return;
 
-    return refinedQuad.reshape(1);
+    x = cornerX + mGradientRegion.x;
+    y = cornerY + mGradientRegion.y;
 }
 
 } /* namespace chilitags */
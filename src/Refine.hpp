@@ -29,17 +29,89 @@
 
 namespace chilitags {
 
+/**
+ * Refines the corners of quadrilaterals to sub-pixel precision, with one of
+ * the methods of Chilitags::CornerRefinementMethod.
+ *
+ * Chilitags::CORNER_GRADIENTS works like cv::cornerSubPix(), i.e. moves each
+ * corner to the point minimising its dot product with the gradients in its
+ * neighbourhood. The gradient products are computed once for all the quads
+ * passed together, over the union of their regions of interest when it is
+ * compact enough, and each iteration then only sums them with the weights of
+ * the current window.
+ *
+ * Chilitags::EDGE_LINES intersects the lines fitted to the strongest
+ * gradients found across each side of the quad.
+ */
 class Refine
 {
 public:
 
 Refine();
 
+void setMethod(Chilitags::CornerRefinementMethod method) {
+    mMethod = method;
+}
+
 Quad operator()(
     const cv::Mat &inputImage,
     const Quad &quad,
     const float proximityRatio);
 
+/**
+ * Refines in place all the given quads.
+ *
+ * \param inputImage the greyscale image in which the quads were found.
+ * \param quads the quads to refine.
+ * \param proximityRatio the half size of the search window around each
+ * corner, relatively to the average side length of its quad.
+ */
+void operator()(
+    const cv::Mat &inputImage,
+    std::vector<Quad> &quads,
+    const float proximityRatio);
+
+protected:
+
+Chilitags::CornerRefinementMethod mMethod;
+
+/**
+ * Moves the corners of the quad to the intersections of the lines fitted to
+ * its edges, searched up to proximityRatio times the average side length
+ * away from the current sides.
+ */
+void refineEdges(const cv::Mat &inputImage, Quad &quad, float proximityRatio);
+
+/**
+ * Fills the gradient product planes over the given region (clipped so that
+ * central differences stay within the image).
+ */
+void computeGradients(const cv::Mat &inputImage, cv::Rect region);
+
+/**
+ * Iteratively moves the given corner to the sub-pixel location minimising
+ * its dot product with the gradients of a window of the given half size,
+ * clipped to the given bounds (relative to the gradient region).
+ */
+void refineCorner(float &x, float &y, int halfWindow, const cv::Rect &bounds);
+
+cv::Rect mGradientRegion;
+cv::Mat_<float> mGxx;               ///< gx*gx
+cv::Mat_<float> mGxy;               ///< gx*gy
+cv::Mat_<float> mGyy;               ///< gy*gy
+cv::Mat_<float> mBx;                ///< gx*gx*x + gx*gy*y
+cv::Mat_<float> mBy;                ///< gx*gy*x + gy*gy*y
+
+std::vector<cv::Rect> mRegions;
+std::vector<int> mHalfWindows;
+std::vector<float> mWeightsX;
+std::vector<float> mWeightsY;
+std::vector<float> mColumnSums;     ///< 5 planes of window-wide partial sums
+std::vector<Quad> mSingleQuad;
+
+std::vector<float> mProfile;        ///< intensities across a side
+std::vector<cv::Point2f> mEdgePoints;
+
 };
 
 
@@ -25,9 +25,145 @@
  */
 
 #include "ScreenOut.hpp"
+#include "Homography.hpp"
+
+#include <algorithm>
+#include <cmath>
 
 namespace chilitags {
 
+namespace {
+
+const int DATA_SIZE = 6;
+const int TAG_MARGIN = 2;
+const int TAG_SIZE = 2*TAG_MARGIN+DATA_SIZE;
+
+// The sides of a square seen in perspective
+const float MAX_SIDE_RATIO = 10.0f;
+const float MAX_ASPECT_RATIO = 6.0f;
+
+// The black border has to be darker than the brightest cells of the inside
+const int MIN_CONTRAST = 16;
+const float MIN_DARK_BORDER = 0.75f;
+
+// Ratio of the between-class variance over the total variance of the inside;
+// a unimodal (gaussian) distribution scores 2/pi
+const float MIN_BIMODALITY = 0.7f;
+
+unsigned char sample(cv::Mat const& inputImage, cv::Matx33f const& homography, float x, float y)
+{
+    cv::Point2f position = transformPoint(homography, x/TAG_SIZE, y/TAG_SIZE);
+    int col = cv::max(cv::min(inputImage.cols - 1, cvRound(position.x)), 0);
+    int row = cv::max(cv::min(inputImage.rows - 1, cvRound(position.y)), 0);
+    return inputImage.at<unsigned char>(row, col);
+}
+
+}
+
+ScreenOut::ScreenOut() :
+    mCounters()
+{
+    resetCounters();
+}
+
+void ScreenOut::resetCounters()
+{
+    mCounters.candidates = 0;
+    mCounters.nonConvex = 0;
+    mCounters.badProportions = 0;
+    mCounters.noBorder = 0;
+    mCounters.notBimodal = 0;
+}
+
+bool ScreenOut::operator()(cv::Mat const& inputImage, Quad const& quad)
+{
+    ++mCounters.candidates;
+
+    cv::Matx33f homography;
+    if(!isConvex(quad) || !squareToQuad(quad, homography)) {
+        ++mCounters.nonConvex;
+        return false;
+    }
+
+    if(!hasTagProportions(quad)) {
+        ++mCounters.badProportions;
+        return false;
+    }
+
+    // Sample the centre of the data cells, like ReadBits
+    unsigned char inside[DATA_SIZE*DATA_SIZE];
+    int minInside = 255;
+    int maxInside = 0;
+    for(int y = 0; y < DATA_SIZE; ++y) {
+        for(int x = 0; x < DATA_SIZE; ++x) {
+            unsigned char value = sample(inputImage, homography,
+                                         TAG_MARGIN + x + 0.5f, TAG_MARGIN + y + 0.5f);
+            inside[y*DATA_SIZE + x] = value;
+            minInside = std::min(minInside, (int) value);
+            maxInside = std::max(maxInside, (int) value);
+        }
+    }
+    float threshold = 0.5f*(minInside + maxInside);
+
+    // Sample the middle of the border, all around the tag
+    static const int BORDER_SAMPLES = 4*(TAG_SIZE-2);
+    int darkBorder = 0;
+    int borderSum = 0;
+    for(int i = 0; i < TAG_SIZE-2; ++i) {
+        const float positions[4][2] = {
+            {1.0f + i,          1.0f},
+            {TAG_SIZE - 1.0f,   1.0f + i},
+            {TAG_SIZE - 1.0f - i, TAG_SIZE - 1.0f},
+            {1.0f,              TAG_SIZE - 1.0f - i}
+        };
+        for(const auto &position : positions) {
+            unsigned char value = sample(inputImage, homography, position[0], position[1]);
+            borderSum += value;
+            if(value < threshold) ++darkBorder;
+        }
+    }
+
+    bool hasBorder = darkBorder >= MIN_DARK_BORDER*BORDER_SAMPLES
+                     && maxInside - borderSum/BORDER_SAMPLES >= MIN_CONTRAST;
+#ifdef HAS_INVERTED_TAGS
+    // Inverted tags have a white border
+    hasBorder = hasBorder
+                || (BORDER_SAMPLES - darkBorder >= MIN_DARK_BORDER*BORDER_SAMPLES
+                    && borderSum/BORDER_SAMPLES - minInside >= MIN_CONTRAST);
+#endif
+    if(!hasBorder) {
+        ++mCounters.noBorder;
+        return false;
+    }
+
+    // Compare the between-class variance to the total variance of the inside,
+    // splitting the classes at the same threshold
+    float sum[2] = {0.0f, 0.0f};
+    float squaredSum = 0.0f;
+    int count[2] = {0, 0};
+    for(unsigned char value : inside) {
+        int c = value < threshold ? 0 : 1;
+        sum[c] += value;
+        ++count[c];
+        squaredSum += (float) value*value;
+    }
+    bool isBimodal = false;
+    if(count[0] > 0 && count[1] > 0) {
+        static const float N = DATA_SIZE*DATA_SIZE;
+        float mean = (sum[0] + sum[1])/N;
+        float totalVariance = squaredSum/N - mean*mean;
+        float meanDifference = sum[1]/count[1] - sum[0]/count[0];
+        float betweenVariance = count[0]*count[1]*meanDifference*meanDifference/(N*N);
+        isBimodal = betweenVariance >= MIN_BIMODALITY*totalVariance;
+    }
+    if(!isBimodal) {
+        ++mCounters.notBimodal;
+        return false;
+    }
+
+    return true;
+}
+
 bool ScreenOut::isConvex(Quad const& quad)
 {
     int vPrevX, vPrevY, vNextX, vNextY;
@@ -42,4 +178,23 @@ bool ScreenOut::isConvex(Quad const& quad)
     return true;
 }
 
+bool ScreenOut::hasTagProportions(Quad const& quad)
+{
+    float sides[4];
+    for(int i = 0, j = 1; i < 4; ++i, j = (j + 1)%4) {
+        float dx = quad(j,0) - quad(i,0);
+        float dy = quad(j,1) - quad(i,1);
+        sides[i] = std::sqrt(dx*dx + dy*dy);
+    }
+
+    float shortest = *std::min_element(sides, sides+4);
+    float longest = *std::max_element(sides, sides+4);
+    if(longest > MAX_SIDE_RATIO*shortest)
+        return false;
+
+    float width = sides[0] + sides[2];
+    float height = sides[1] + sides[3];
+    return width <= MAX_ASPECT_RATIO*height && height <= MAX_ASPECT_RATIO*width;
+}
+
 } /* namespace chilitags */
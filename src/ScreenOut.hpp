@@ -27,6 +27,8 @@
  * @author Ayberk Özgür
  */
 
+#include <opencv2/core/core.hpp>
+
 #include <chilitags.hpp>
 
 namespace chilitags {
@@ -35,7 +37,51 @@ class ScreenOut
 {
 public:
 
+/**
+ * @brief Number of candidates rejected by each stage of the screening
+ */
+typedef Chilitags::ScreenOutCounters Counters;
+
+ScreenOut();
+
+/**
+ * @brief Runs a cascade of cheap tests, from the cheapest to the most
+ * expensive, rejecting the candidates that can not be tags before they are
+ * refined and decoded
+ *
+ * The tests are, in order: convexity, proportions of the sides, contrast of
+ * the black border of the tag against its inside, and bimodality of the
+ * inside. Only a few dozen pixels are read.
+ *
+ * @param inputImage Greyscale image in which the candidate was found
+ * @param quad Corners of the candidate
+ * @return false if the candidate can not be a tag
+ */
+bool operator()(cv::Mat const& inputImage, Quad const& quad);
+
+/**
+ * @brief Returns the number of candidates rejected by each stage since the
+ * creation or the last call to resetCounters()
+ */
+Counters const& getCounters() const {
+    return mCounters;
+}
+
+void resetCounters();
+
 static bool isConvex(Quad const& quad);
+
+/**
+ * @brief Checks that opposite sides have comparable lengths, and that no side
+ * is much shorter than the others, as expected from a square seen in
+ * perspective
+ */
+static bool hasTagProportions(Quad const& quad);
+
+protected:
+
+Counters mCounters;
+
 };
 
 } /* namespace chilitags */
@@ -0,0 +1,281 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include "TraceQuads.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const int MATRIX_SIZE = 10;
+const int MIN_TAG_SIZE = 1.1f*MATRIX_SIZE;
+
+// Polygons with more vertices than that are not simplified any further
+const int MAX_VERTICES = 16;
+
+// Values of the pixels of the binary image, as the borders are followed
+const uchar BACKGROUND = 0;
+const uchar UNVISITED = 255;
+const uchar RIGHT_BORDER = 1;   // border with the background on its right
+const uchar VISITED = 2;
+
+// The 8 neighbours, counterclockwise (as displayed) starting from the east
+const int DX[8] = {1,  1,  0, -1, -1, -1, 0, 1};
+const int DY[8] = {0, -1, -1, -1,  0,  1, 1, 1};
+const int EAST = 0;
+const int WEST = 4;
+const float SQRT2 = 1.41421356f;
+
+int cross(const cv::Point &o, const cv::Point &a, const cv::Point &b)
+{
+    return (a.x-o.x)*(b.y-o.y) - (a.y-o.y)*(b.x-o.x);
+}
+
+}
+
+namespace chilitags {
+
+TraceQuads::TraceQuads() :
+    mContour(),
+    mKeep(),
+    mRanges(),
+    mInterrupted(false)
+{
+}
+
+void TraceQuads::operator()(
+    cv::Mat &binaryImage,
+    float scale,
+    float offset,
+    std::vector<Quad> &quads,
+    int64 deadline)
+{
+    mInterrupted = false;
+    if (binaryImage.rows < 3 || binaryImage.cols < 3) return;
+
+    // The border following needs a frame of background around the image
+    binaryImage.row(0).setTo(BACKGROUND);
+    binaryImage.row(binaryImage.rows-1).setTo(BACKGROUND);
+    binaryImage.col(0).setTo(BACKGROUND);
+    binaryImage.col(binaryImage.cols-1).setTo(BACKGROUND);
+
+    for (int d = 0; d < 8; ++d) mOffsets[d] = DY[d]*(int)binaryImage.step + DX[d];
+
+    // A convex quadrilateral can not be longer than the image's perimeter
+    const float maxPerimeter = 2.0f*(binaryImage.rows + binaryImage.cols);
+
+    for (int y = 1; y < binaryImage.rows-1; ++y) {
+        const uchar *row = binaryImage.ptr<uchar>(y);
+        for (int x = 1; x < binaryImage.cols-1; ++x) {
+            uchar value = row[x];
+            if (value == BACKGROUND) continue;
+
+            int fromDirection;
+            if (value == UNVISITED && row[x-1] == BACKGROUND)
+                fromDirection = WEST;   // outer border
+            else if (value != RIGHT_BORDER && row[x+1] == BACKGROUND)
+                fromDirection = EAST;   // hole border
+            else
+                continue;
+
+            if (deadline != 0 && cv::getTickCount() > deadline) {
+                mInterrupted = true;
+                return;
+            }
+
+            float perimeter;
+            if (followBorder(binaryImage, x, y, fromDirection, maxPerimeter, perimeter))
+                fitQuad(perimeter, scale, offset, quads);
+        }
+    }
+}
+
+bool TraceQuads::followBorder(
+    cv::Mat &binaryImage,
+    int x, int y,
+    int fromDirection,
+    float maxPerimeter,
+    float &perimeter)
+{
+    uchar *start = binaryImage.ptr<uchar>(y) + x;
+
+    // Look clockwise for the last pixel of the border, i.e. the one from
+    // which it comes back to the start
+    int direction = fromDirection;
+    int k = 0;
+    for (; k < 8; ++k, direction = (direction+7)&7) {
+        if (start[mOffsets[direction]] != BACKGROUND) break;
+    }
+    if (k == 8) {
+        *start = RIGHT_BORDER;  // isolated pixel
+        return false;
+    }
+    const uchar *last = start + mOffsets[direction];
+
+    mContour.clear();
+    perimeter = 0.0f;
+    int doubleArea = 0;
+    bool tooLong = false;
+
+    uchar *current = start;
+    int currentX = x;
+    int currentY = y;
+    int previousDirection = direction;  // towards the previous pixel
+    int lastMove = -1;
+    for (;;) {
+        // Look counterclockwise for the next pixel of the border, starting
+        // after the previous one
+        bool eastIsBackground = false;
+        direction = previousDirection;
+        for (k = 0; k < 8; ++k) {
+            direction = (direction+1)&7;
+            if (current[mOffsets[direction]] != BACKGROUND) break;
+            if (direction == EAST) eastIsBackground = true;
+        }
+
+        if (eastIsBackground) *current = RIGHT_BORDER;
+        else if (*current == UNVISITED) *current = VISITED;
+
+        // Keep only the points where the border turns, and stop keeping
+        // them once the border is too long to be a tag
+        perimeter += (direction & 1) ? SQRT2 : 1.0f;
+        if (perimeter > maxPerimeter) tooLong = true;
+        if (direction != lastMove && !tooLong) mContour.push_back(cv::Point(currentX, currentY));
+        lastMove = direction;
+
+        int nextX = currentX + DX[direction];
+        int nextY = currentY + DY[direction];
+        doubleArea += currentX*nextY - nextX*currentY;
+
+        uchar *next = current + mOffsets[direction];
+        if (current == last && next == start) break;
+
+        current = next;
+        currentX = nextX;
+        currentY = nextY;
+        previousDirection = (direction+4)&7;
+    }
+
+    return !tooLong
+           && perimeter > 4*MIN_TAG_SIZE
+           && std::abs(doubleArea) > 2*MIN_TAG_SIZE*MIN_TAG_SIZE;
+}
+
+void TraceQuads::fitQuad(float perimeter, float scale, float offset, std::vector<Quad> &quads)
+{
+    const int n = mContour.size();
+    if (n < 4) return;
+
+    // Start the simplification between two distant points, like
+    // cv::approxPolyDP()
+    int a = 0;
+    int b = 0;
+    for (int iteration = 0; iteration < 2; ++iteration) {
+        a = b;
+        int maxDistance = -1;
+        for (int i = 0; i < n; ++i) {
+            cv::Point d = mContour[i] - mContour[a];
+            int distance = d.dot(d);
+            if (distance > maxDistance) {
+                maxDistance = distance;
+                b = i;
+            }
+        }
+    }
+    if (a == b) return;
+
+    // Douglas-Peucker, on indices running from a to a+n
+    const float epsilon = 0.05f*perimeter;
+    mKeep.assign(n, 0);
+    mKeep[a] = 1;
+    mKeep[b] = 1;
+    int nVertices = 2;
+    mRanges.clear();
+    mRanges.push_back(std::make_pair(a, (b > a) ? b : b+n));
+    mRanges.push_back(std::make_pair((b > a) ? b : b+n, a+n));
+    while (!mRanges.empty()) {
+        int first = mRanges.back().first;
+        int end = mRanges.back().second;
+        mRanges.pop_back();
+        if (end - first < 2) continue;
+
+        const cv::Point &p0 = mContour[first%n];
+        const cv::Point &p1 = mContour[end%n];
+        cv::Point2f segment = p1 - p0;
+        float squaredLength = segment.dot(segment);
+
+        int farthest = -1;
+        float maxSquaredDistance = epsilon*epsilon;
+        for (int i = first+1; i < end; ++i) {
+            cv::Point2f d = mContour[i%n] - p0;
+            float squaredDistance;
+            if (squaredLength > 0.0f) {
+                float c = segment.x*d.y - segment.y*d.x;
+                squaredDistance = c*c/squaredLength;
+            }
+            else {
+                squaredDistance = d.dot(d);
+            }
+            if (squaredDistance > maxSquaredDistance) {
+                maxSquaredDistance = squaredDistance;
+                farthest = i;
+            }
+        }
+        if (farthest < 0) continue;
+
+        mKeep[farthest%n] = 1;
+        if (++nVertices > MAX_VERTICES) return;
+        mRanges.push_back(std::make_pair(first, farthest));
+        mRanges.push_back(std::make_pair(farthest, end));
+    }
+
+    cv::Point vertices[MAX_VERTICES];
+    int nKept = 0;
+    for (int i = 0; i < n; ++i) if (mKeep[i]) vertices[nKept++] = mContour[i];
+
+    // Convex hull (Andrew's monotone chain), in the same orientation as
+    // cv::convexHull(..., clockwise = false)
+    std::sort(vertices, vertices+nKept, [](const cv::Point &p, const cv::Point &q) {
+        return p.x < q.x || (p.x == q.x && p.y < q.y);
+    });
+    cv::Point hull[2*MAX_VERTICES];
+    int nHull = 0;
+    for (int i = 0; i < nKept; ++i) {
+        while (nHull >= 2 && cross(hull[nHull-2], hull[nHull-1], vertices[i]) <= 0) --nHull;
+        hull[nHull++] = vertices[i];
+    }
+    for (int i = nKept-2, lowerHull = nHull+1; i >= 0; --i) {
+        while (nHull >= lowerHull && cross(hull[nHull-2], hull[nHull-1], vertices[i]) <= 0) --nHull;
+        hull[nHull++] = vertices[i];
+    }
+    --nHull; // the first point is repeated
+
+    if (nHull != 4) return;
+
+    Quad quad;
+    for (int i : {0,1,2,3}) {
+        quad(i,0) = scale*hull[i].x + offset;
+        quad(i,1) = scale*hull[i].y + offset;
+    }
+    quads.push_back(quad);
+}
+
+} /* namespace chilitags */
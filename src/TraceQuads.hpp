@@ -0,0 +1,93 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifndef TraceQuads_HPP
+#define TraceQuads_HPP
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#include <chilitags.hpp>
+
+namespace chilitags {
+
+/**
+ * Finds the quadrilaterals among the borders of a binary image.
+ *
+ * This replaces the sequence of cv::findContours(), cv::arcLength(),
+ * cv::contourArea(), cv::approxPolyDP() and cv::convexHull(): the borders
+ * are followed like in cv::findContours() (Suzuki and Abe, 1985), their
+ * perimeter and area are accumulated on the way, and only the borders of
+ * plausible size are simplified to polygons, in buffers reused from one
+ * border to the next.
+ *
+ * Unlike with cv::approxPolyDP(), the simplification of a border is given up
+ * beyond 16 vertices: such a border can only be a quadrilateral if it is
+ * deeply notched, i.e. not the border of a tag.
+ */
+class TraceQuads
+{
+public:
+
+TraceQuads();
+
+/**
+ * Appends to quads the quadrilateral borders of the binary image (0 for the
+ * background, 255 for the foreground), their coordinates multiplied by
+ * scale and shifted by offset. The image is used as a work buffer: its
+ * content is lost.
+ *
+ * If a deadline (in ticks, see cv::getTickCount()) is given, the search
+ * stops when it is passed, and wasInterrupted() returns true.
+ */
+void operator()(cv::Mat &binaryImage, float scale, float offset,
+                std::vector<Quad> &quads, int64 deadline = 0);
+
+bool wasInterrupted() const {
+    return mInterrupted;
+}
+
+protected:
+
+/**
+ * Follows the border starting at (x,y), from the neighbour in the given
+ * direction, marking its pixels. Returns whether its perimeter and area
+ * make it a candidate, in which case its corner points are in mContour.
+ */
+bool followBorder(cv::Mat &binaryImage, int x, int y, int fromDirection,
+                  float maxPerimeter, float &perimeter);
+
+/**
+ * Simplifies mContour to a polygon, and appends its convex hull to quads if
+ * it has four vertices. Polygons of more than 16 vertices are dropped.
+ */
+void fitQuad(float perimeter, float scale, float offset, std::vector<Quad> &quads);
+
+int mOffsets[8];                            ///< pointer offsets of the neighbours
+std::vector<cv::Point> mContour;            ///< points where the border turns
+std::vector<uchar> mKeep;                   ///< vertices of the simplified polygon
+std::vector<std::pair<int, int> > mRanges;  ///< ranges of mContour left to simplify
+bool mInterrupted;
+
+};
+
+}
+
+#endif
@@ -24,6 +24,8 @@
 
 #include "opencv2/video/tracking.hpp"
 
+#include <algorithm>
+
 namespace chilitags {
 
 #ifdef HAS_MULTITHREADING
@@ -31,12 +33,20 @@ Track::Track() :
     mRefine(),
     mPrevFrame(),
     mFromTags(),
+    mTrackedIds(),
+    mTrackedQuads(),
+    mStatus(),
+    mErrors(),
     mInputLock(PTHREAD_MUTEX_INITIALIZER)
 #else
 Track::Track() :
     mRefine(),
     mPrevFrame(),
-    mFromTags()
+    mFromTags(),
+    mTrackedIds(),
+    mTrackedQuads(),
+    mStatus(),
+    mErrors()
 #endif
 {
 }
@@ -66,20 +76,18 @@ void Track::update(TagCornerMap const& tags)
 TagCornerMap Track::operator()(cv::Mat const& grayscaleInputImage)
 {
 
-    std::vector<uchar> status;
-    std::vector<float> errors;
-
     //Do the tracking
 #ifdef HAS_MULTITHREADING
     pthread_mutex_lock(&mInputLock);
 #endif
     TagCornerMap trackedTags;
-    Quad quad;
+    mTrackedIds.clear();
+    mTrackedQuads.clear();
     for (auto tag : mFromTags) {
         Quad result;
 
         static const float GROWTH_RATIO = 20.0f/10.0f;
-        cv::Rect roi = growRoi(grayscaleInputImage, cv::Mat_<cv::Point2f>(tag.second), GROWTH_RATIO);
+        cv::Rect roi = growRoi(grayscaleInputImage, cv::Mat(4, 1, CV_32FC2, tag.second.val), GROWTH_RATIO);
         cv::Point2f roiOffset = roi.tl();
         for (int i : {0,1,2,3}) {
             tag.second(i,0) -= roiOffset.x;
@@ -89,7 +97,7 @@ TagCornerMap Track::operator()(cv::Mat const& grayscaleInputImage)
         cv::calcOpticalFlowPyrLK(
             mPrevFrame(roi), grayscaleInputImage(roi),
             tag.second, result,
-            status, errors,
+            mStatus, mErrors,
             //TODO play with parameters (with tests)
             cv::Size(21,21), 3,
             cv::TermCriteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 30, 0.01f)
@@ -100,13 +108,19 @@ TagCornerMap Track::operator()(cv::Mat const& grayscaleInputImage)
             result(i,1) += roiOffset.y;
         }
 
-        if (cv::sum(cv::Mat(status))[0] == status.size()) {
-            quad = mRefine(grayscaleInputImage, result, 0.5f/10.0f);
-            if(ScreenOut::isConvex(quad))
-                trackedTags[tag.first] = quad;
+        if (std::count(mStatus.begin(), mStatus.end(), 0) == 0) {
+            mTrackedIds.push_back(tag.first);
+            mTrackedQuads.push_back(result);
         }
     }
 
+    // Refine all the tracked tags at once
+    mRefine(grayscaleInputImage, mTrackedQuads, 0.5f/10.0f);
+    for (size_t i = 0; i < mTrackedIds.size(); ++i) {
+        if(ScreenOut::isConvex(mTrackedQuads[i]))
+            trackedTags[mTrackedIds[i]] = mTrackedQuads[i];
+    }
+
     mFromTags = std::move(trackedTags);
     TagCornerMap tagsCopy = mFromTags; //TODO: Try to get around this copy
 #ifdef HAS_MULTITHREADING
@@ -39,6 +39,10 @@ public:
 
 Track();
 
+void setCornerRefinementMethod(Chilitags::CornerRefinementMethod method) {
+    mRefine.setMethod(method);
+}
+
 //Both these methods are thread-safe
 void update(TagCornerMap const& tags);
 TagCornerMap operator()(cv::Mat const& inputImage);
@@ -50,6 +54,11 @@ Refine mRefine;
 cv::Mat mPrevFrame;
 TagCornerMap mFromTags;
 
+std::vector<int> mTrackedIds;
+std::vector<Quad> mTrackedQuads;
+std::vector<uchar> mStatus;
+std::vector<float> mErrors;
+
 #ifdef HAS_MULTITHREADING
 pthread_mutex_t mInputLock;
 #endif
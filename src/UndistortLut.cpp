@@ -0,0 +1,204 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include "UndistortLut.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include <stdint.h>
+
+#include <opencv2/calib3d/calib3d.hpp>
+#ifdef OPENCV3
+#include <opencv2/imgproc/imgproc.hpp> // undistortPoints
+#endif
+
+namespace chilitags {
+
+namespace {
+
+const char MAGIC[4] = {'C', 'H', 'L', 'U'};
+const int VERSION = 1;
+
+// Appends the elements of a matrix of any depth, as double
+void append(std::vector<double> &values, const cv::Mat &matrix)
+{
+    cv::Mat_<double> asDouble(matrix);
+    values.insert(values.end(), asDouble.begin(), asDouble.end());
+}
+
+// The size of the grid covering the whole image, including its last row and
+// column, or false if the image is empty or the grid would be too large
+bool getGridSize(cv::Size imageSize, int step, int &columns, int &rows)
+{
+    if (imageSize.width <= 0 || imageSize.height <= 0 || step <= 0)
+        return false;
+
+    int64_t gridColumns = ((int64_t) imageSize.width + step - 1)/step + 1;
+    int64_t gridRows = ((int64_t) imageSize.height + step - 1)/step + 1;
+    if (gridColumns*gridRows > std::numeric_limits<int>::max()/(int64_t) sizeof(cv::Point2f))
+        return false;
+
+    columns = (int) gridColumns;
+    rows = (int) gridRows;
+    return true;
+}
+
+}
+
+UndistortLut::UndistortLut() :
+    mKey(),
+    mStep(1),
+    mColumns(0),
+    mRows(0),
+    mSamples()
+{
+}
+
+void UndistortLut::build(const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+                         cv::Size imageSize, int step)
+{
+    setKey(cameraMatrix, distCoeffs, imageSize, step);
+    mStep = std::max(step, 1);
+    if (!getGridSize(imageSize, mStep, mColumns, mRows)) {
+        clear();
+        return;
+    }
+
+    std::vector<cv::Point2f> nodes;
+    nodes.reserve(mColumns*mRows);
+    for (int row = 0; row < mRows; ++row)
+        for (int column = 0; column < mColumns; ++column)
+            nodes.push_back(cv::Point2f(column*mStep, row*mStep));
+
+    cv::undistortPoints(nodes, mSamples, cameraMatrix, distCoeffs,
+                        cv::noArray(), cameraMatrix);
+}
+
+void UndistortLut::setKey(const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+                          cv::Size imageSize, int step)
+{
+    mKey.clear();
+    mKey.push_back(imageSize.width);
+    mKey.push_back(imageSize.height);
+    mKey.push_back(step);
+    append(mKey, cameraMatrix);
+    append(mKey, distCoeffs);
+}
+
+bool UndistortLut::read(const std::string &filename,
+                        const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+                        cv::Size imageSize, int step)
+{
+    clear();
+    setKey(cameraMatrix, distCoeffs, imageSize, step);
+
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    char magic[4];
+    int version = 0;
+    int keySize = 0;
+    if (!file.read(magic, sizeof(magic))
+        || std::memcmp(magic, MAGIC, sizeof(magic)) != 0
+        || !file.read((char *) &version, sizeof(version))
+        || version != VERSION
+        || !file.read((char *) &keySize, sizeof(keySize))
+        || keySize != (int) mKey.size())
+        return false;
+
+    // The grid is not trusted from the file, but must be the one build()
+    // would compute
+    int expectedStep = std::max(step, 1);
+    int expectedColumns, expectedRows;
+    if (!getGridSize(imageSize, expectedStep, expectedColumns, expectedRows))
+        return false;
+
+    std::vector<double> key(keySize);
+    int fileStep = 0;
+    int fileColumns = 0;
+    int fileRows = 0;
+    if (!file.read((char *) key.data(), keySize*sizeof(double))
+        || key != mKey
+        || !file.read((char *) &fileStep, sizeof(fileStep))
+        || !file.read((char *) &fileColumns, sizeof(fileColumns))
+        || !file.read((char *) &fileRows, sizeof(fileRows))
+        || fileStep != expectedStep
+        || fileColumns != expectedColumns
+        || fileRows != expectedRows)
+        return false;
+
+    mStep = fileStep;
+    mColumns = fileColumns;
+    mRows = fileRows;
+
+    mSamples.resize(mColumns*mRows);
+    if (!file.read((char *) mSamples.data(), mSamples.size()*sizeof(cv::Point2f))) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+bool UndistortLut::write(const std::string &filename) const
+{
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    int keySize = mKey.size();
+    file.write(MAGIC, sizeof(MAGIC));
+    file.write((const char *) &VERSION, sizeof(VERSION));
+    file.write((const char *) &keySize, sizeof(keySize));
+    file.write((const char *) mKey.data(), keySize*sizeof(double));
+    file.write((const char *) &mStep, sizeof(mStep));
+    file.write((const char *) &mColumns, sizeof(mColumns));
+    file.write((const char *) &mRows, sizeof(mRows));
+    file.write((const char *) mSamples.data(), mSamples.size()*sizeof(cv::Point2f));
+    return (bool) file;
+}
+
+void UndistortLut::clear()
+{
+    mSamples.clear();
+    mColumns = 0;
+    mRows = 0;
+}
+
+void UndistortLut::operator()(cv::Point2f *points, int nPoints) const
+{
+    const float invStep = 1.f/mStep;
+    for (int i = 0; i < nPoints; ++i) {
+        const float x = points[i].x*invStep;
+        const float y = points[i].y*invStep;
+
+        // The cell of the point, or the closest one, whose bilinear
+        // interpolation extrapolates outside of the grid
+        const int column = std::min(std::max((int) x, 0), mColumns - 2);
+        const int row = std::min(std::max((int) y, 0), mRows - 2);
+        const float u = x - column;
+        const float v = y - row;
+
+        const cv::Point2f *topLeft = &mSamples[row*mColumns + column];
+        const cv::Point2f *bottomLeft = topLeft + mColumns;
+        points[i] =
+            (1.f-v)*((1.f-u)*topLeft[0] + u*topLeft[1]) +
+            v*((1.f-u)*bottomLeft[0] + u*bottomLeft[1]);
+    }
+}
+
+}
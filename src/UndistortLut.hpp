@@ -0,0 +1,117 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifndef UndistortLut_HPP
+#define UndistortLut_HPP
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace chilitags {
+
+/**
+ * Undistorts image points by bilinear interpolation in a grid of samples of
+ * the undistortion of a camera, instead of iteratively inverting its
+ * distortion model for every point as cv::undistortPoints() does.
+ *
+ * The undistorted points are expressed in pixels of the ideal pinhole camera
+ * of the same camera matrix. The grid samples the image every few pixels:
+ * the distortion varies smoothly enough for the interpolation error to stay
+ * well below the precision of the detected corners.
+ *
+ * The samples can be saved to a file, along with the calibration and the
+ * sampling they were computed for, so that they are read back instead of
+ * computed again only if they still match.
+ */
+class UndistortLut
+{
+public:
+
+UndistortLut();
+
+/**
+ * Samples the undistortion of the given camera.
+ *
+ * \param cameraMatrix the 3x3 camera matrix.
+ * \param distCoeffs the distortion coefficients of the camera.
+ * \param imageSize the size of the images of the camera.
+ * \param step the distance in pixels between two samples of the grid.
+ */
+void build(const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+           cv::Size imageSize, int step);
+
+/**
+ * Reads the samples from a file written by write(), if they were computed
+ * with the same arguments as given to build(). The size of the grid in the
+ * file must be the one which build() computes from these arguments.
+ *
+ * \returns whether the samples could be read, else they are cleared.
+ */
+bool read(const std::string &filename,
+          const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+          cv::Size imageSize, int step);
+
+/**
+ * Writes the samples, and what they were computed with, to a file.
+ *
+ * \returns whether the file could be written.
+ */
+bool write(const std::string &filename) const;
+
+/**
+ * Forgets the samples.
+ */
+void clear();
+
+/**
+ * \returns whether there are no samples to undistort points with.
+ */
+bool empty() const {
+    return mSamples.empty();
+}
+
+/**
+ * Undistorts in place the given points. Points outside of the image are
+ * extrapolated from the closest samples.
+ */
+void operator()(cv::Point2f *points, int nPoints) const;
+
+protected:
+
+/**
+ * Sets mKey to the values which determine the samples: the image size, the
+ * step, the camera matrix and the distortion coefficients.
+ */
+void setKey(const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+            cv::Size imageSize, int step);
+
+std::vector<double> mKey;
+int mStep;
+int mColumns;                       ///< number of samples per row
+int mRows;                          ///< number of rows of samples
+std::vector<cv::Point2f> mSamples;  ///< undistorted grid nodes, row by row
+
+};
+
+}
+
+#endif
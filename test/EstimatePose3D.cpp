@@ -0,0 +1,160 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifdef OPENCV3
+#include <opencv2/ts.hpp>
+#else
+#include <opencv2/ts/ts.hpp>
+#endif
+
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <EstimatePose3D.hpp>
+#include <chilitags.hpp>
+
+namespace {
+
+typedef chilitags::EstimatePose3D<float> EstimatePose3D;
+
+const float SIZE = 20;
+
+// The corners of a tag of the given pose, as seen by the default camera of
+// EstimatePose3D, shifted by the given offsets
+cv::Mat_<cv::Point2f> project(const cv::Matx33d &rotation, const cv::Vec3d &translation,
+                              const float offsets[4][2]) {
+    static const float corners[4][2] = {{0,0}, {SIZE,0}, {SIZE,SIZE}, {0,SIZE}};
+    cv::Mat_<cv::Point2f> image(4, 1);
+    for (int i = 0; i < 4; ++i) {
+        cv::Vec3d X = rotation*cv::Vec3d(corners[i][0], corners[i][1], 0) + translation;
+        image(i) = cv::Point2f(700*X(0)/X(2) + 320 + offsets[i][0],
+                               700*X(1)/X(2) + 240 + offsets[i][1]);
+    }
+    return image;
+}
+
+double distance(const cv::Matx33d &expected, const EstimatePose3D::SquarePose &pose) {
+    return cv::norm(expected - pose.rotation, cv::NORM_L1);
+}
+
+cv::Matx33d rotation(double rx, double ry, double rz) {
+    cv::Matx33d result;
+    cv::Rodrigues(cv::Vec3d(rx, ry, rz), result);
+    return result;
+}
+
+}
+
+TEST(EstimatePose3D, SquarePoses) {
+    const float exact[4][2] = {{0,0}, {0,0}, {0,0}, {0,0}};
+    const cv::Matx33d expectedRotation = rotation(0.5, -0.3, 2.0);
+    const cv::Vec3d expectedTranslation(20, -10, 300);
+
+    EstimatePose3D estimatePose3D(cv::Size(640, 480));
+    EstimatePose3D::SquarePose best, alternative;
+    double ambiguity = estimatePose3D.solveSquare(
+        SIZE, project(expectedRotation, expectedTranslation, exact), best, alternative);
+
+    EXPECT_GT(1e-3, distance(expectedRotation, best));
+    EXPECT_GT(1e-2, cv::norm(expectedTranslation - best.translation));
+    EXPECT_GT(1e-2, best.error);
+
+    // The other solution is a different pose, which explains the corners
+    // less well
+    EXPECT_LT(0.1, distance(expectedRotation, alternative));
+    EXPECT_LT(best.error, alternative.error);
+    EXPECT_GT(0.1, ambiguity);
+}
+
+TEST(EstimatePose3D, NoFlipping) {
+    // A small tag far away: with a fraction of a pixel of noise, the wrong
+    // solution explains the corners best
+    const float noise[4][2] = {{0.3f,-0.2f}, {-0.3f,0.2f}, {0.2f,0.3f}, {-0.2f,-0.3f}};
+    const float exact[4][2] = {{0,0}, {0,0}, {0,0}, {0,0}};
+    const cv::Matx33d expectedRotation = rotation(0.2, 0.1, 0.3);
+    const cv::Vec3d expectedTranslation(50, -30, 1500);
+
+    EstimatePose3D estimatePose3D(cv::Size(640, 480));
+    EstimatePose3D::SquarePose best, alternative;
+    double ambiguity = estimatePose3D.solveSquare(
+        SIZE, project(expectedRotation, expectedTranslation, noise), best, alternative);
+    EXPECT_LT(0.5, ambiguity);
+    EXPECT_LT(0.3, distance(expectedRotation, best));
+
+    // Once the filter knows the pose, the ambiguous solution closest to it is
+    // preferred
+    chilitags::Chilitags3Df::ObjectPoseList predictions;
+    chilitags::Chilitags3Df::TransformMatrix pose;
+    estimatePose3D(predictions);
+    estimatePose3D(0, SIZE, project(expectedRotation, expectedTranslation, exact), pose);
+    for (int i = 0; i < 10; ++i) {
+        estimatePose3D(predictions);
+        estimatePose3D(0, SIZE, project(expectedRotation, expectedTranslation, noise), pose);
+        cv::Matx33d actualRotation = pose.get_minor<3,3>(0,0);
+        EXPECT_GT(0.3, cv::norm(expectedRotation - actualRotation, cv::NORM_L1));
+    }
+}
+
+TEST(EstimatePose3D, WarmStart) {
+    std::vector<cv::Point3f> objectPoints;
+    objectPoints.push_back(cv::Point3f(0, 0, 0));
+    objectPoints.push_back(cv::Point3f(50, 0, 0));
+    objectPoints.push_back(cv::Point3f(50, 50, 0));
+    objectPoints.push_back(cv::Point3f(0, 50, 0));
+    objectPoints.push_back(cv::Point3f(100, 0, 0));
+    objectPoints.push_back(cv::Point3f(100, 50, 10));
+
+    // Without filtering, the previous solution seeds the solver, which has to
+    // follow a moving object, even when it suddenly turns around, or
+    // disappears for a while
+    EstimatePose3D estimatePose3D(cv::Size(640, 480));
+    estimatePose3D.enableFilter(false);
+    chilitags::Chilitags3Df::ObjectPoseList predictions;
+    chilitags::Chilitags3Df::TransformMatrix pose;
+    EstimatePose3D::Workspace workspace;
+    EstimatePose3D::Solution solution;
+    for (int i = 0; i < 30; ++i) {
+        estimatePose3D(predictions);
+        if (i == 20) continue;
+
+        const cv::Matx33d expectedRotation = rotation(
+            0.3 + 0.01*i + (i < 10 ? 0 : 2.5), -0.2 + 0.005*i, 0.1);
+        const cv::Vec3d expectedTranslation(-20 + i, 10, 400 + 2*i);
+        cv::Mat_<cv::Point2f> imagePoints(objectPoints.size(), 1);
+        for (size_t j = 0; j < objectPoints.size(); ++j) {
+            cv::Vec3d X = expectedRotation*cv::Vec3d(objectPoints[j].x, objectPoints[j].y, objectPoints[j].z) + expectedTranslation;
+            imagePoints(j) = cv::Point2f(700*X(0)/X(2) + 320, 700*X(1)/X(2) + 240);
+        }
+
+        estimatePose3D.solve(0, objectPoints, imagePoints, solution, workspace);
+        estimatePose3D.update(0, solution, pose);
+
+        // Only the first frame, and the one after the object disappeared,
+        // have no guess; the sudden turn may or may not need a fresh start
+        if (i == 0 || i == 21) EXPECT_FALSE(solution.refined) << "frame " << i;
+        else if (i != 10) EXPECT_TRUE(solution.refined) << "frame " << i;
+
+        cv::Matx33d actualRotation = pose.get_minor<3,3>(0,0);
+        cv::Vec3d actualTranslation(pose(0,3), pose(1,3), pose(2,3));
+        EXPECT_GT(1e-2, cv::norm(expectedRotation - actualRotation, cv::NORM_L1));
+        EXPECT_GT(1e-1, cv::norm(expectedTranslation - actualTranslation));
+    }
+}
+
+CV_TEST_MAIN(".")
@@ -25,14 +25,37 @@
 #endif
 
 #include <Filter.hpp>
+#include <Filter3D.hpp>
 #include <chilitags.hpp>
 
+#include <opencv2/video/tracking.hpp> // KalmanFilter
+
+#include <cmath>
 #include <iostream>
 
 namespace {
 const chilitags::TagCornerMap EMPTY_TAG_LIST;
 const chilitags::TagCornerMap ONLY_TAG_42 = {{42, {}}};
 const chilitags::TagCornerMap ONLY_TAG_43 = {{43, {}}};
+
+// Unit quaternion (w,x,y,z) of the given angle-axis rotation
+cv::Vec4d toQuaternion(cv::Vec3d angleAxis)
+{
+    double angle = cv::norm(angleAxis);
+    if (angle == 0) return cv::Vec4d(1, 0, 0, 0);
+    cv::Vec3d axis = angleAxis*(std::sin(angle/2)/angle);
+    return cv::Vec4d(std::cos(angle/2), axis(0), axis(1), axis(2));
+}
+
+// Matrix of the left Hamilton product by q
+cv::Matx44d hamiltonLeft(cv::Vec4d q)
+{
+    return cv::Matx44d(
+        q(0), -q(1), -q(2), -q(3),
+        q(1),  q(0), -q(3),  q(2),
+        q(2),  q(3),  q(0), -q(1),
+        q(3), -q(2),  q(1),  q(0));
+}
 }
 
 TEST(FindOutdated, ZeroPersistence) {
@@ -126,4 +149,102 @@ TEST(Filter, NonZeroGain) {
     EXPECT_EQ(0.0f, cv::norm(cv::Mat(expected) - cv::Mat(results[0])));
 }
 
+TEST(Filter3D, KalmanFilter) {
+    // One object, observed while the camera moves every other frame
+    const int ID = 3;
+    const int N_FRAMES = 30;
+
+    chilitags::Filter3D<double> filter;
+    filter.setPersistence(1e9);
+
+    cv::Mat Q = cv::Mat::diag(cv::Mat(cv::Vec<double,7>(1e-3, 2e-3, 1e-3, 1e-4, 2e-4, 1e-4, 1e-4)));
+    cv::Mat R = cv::Mat::diag(cv::Mat(cv::Vec<double,7>(1e-2, 1e-2, 1e-1, 1e-3, 1e-2, 1e-2, 1e-3)));
+    filter.setProcessNoiseCovariance(Q);
+    filter.setObservationNoiseCovariance(R);
+
+    cv::KalmanFilter reference(7, 7, 3, CV_64F);
+    reference.measurementMatrix = cv::Mat::eye(7, 7, CV_64F);
+    reference.processNoiseCov = Q;
+    reference.measurementNoiseCov = R;
+
+    cv::Vec4d previousQuaternion;
+    chilitags::Chilitags3D_<double>::ObjectPoseList objects;
+    for (int frame = 0; frame < N_FRAMES; ++frame) {
+        // The camera rotates about a fixed axis, and moves
+        cv::Vec3d camRotation(0, 0, 0);
+        cv::Vec3d camTranslation(0, 0, 0);
+        if (frame % 2) {
+            camRotation = cv::Vec3d(0.02, -0.01, 0.03);
+            camTranslation = cv::Vec3d(1, 2, -1);
+        }
+        cv::Vec4d camQuaternion = toQuaternion(camRotation);
+        filter.setCamDelta(camQuaternion, camTranslation);
+
+        // The transition rotates by the inverse of the camera rotation
+        cv::Matx33d cameraR;
+        cv::Rodrigues(camRotation, cameraR);
+        cv::Matx44d conjugateProduct = hamiltonLeft(cv::Vec4d(
+            camQuaternion(0), -camQuaternion(1), -camQuaternion(2), -camQuaternion(3)));
+        cv::Mat F = cv::Mat::zeros(7, 7, CV_64F);
+        cv::Mat(cameraR.t()).copyTo(F(cv::Rect(0, 0, 3, 3)));
+        cv::Mat(conjugateProduct).copyTo(F(cv::Rect(3, 3, 4, 4)));
+        reference.transitionMatrix = F;
+        reference.controlMatrix = cv::Mat::zeros(7, 3, CV_64F);
+        cv::Mat(cameraR.t()).copyTo(reference.controlMatrix(cv::Rect(0, 0, 3, 3)));
+
+        objects.clear();
+        filter(objects);
+        if (frame > 0) {
+            ASSERT_EQ(1u, objects.size());
+            reference.predict(cv::Mat(-camTranslation));
+        }
+
+        cv::Vec3d measuredTranslation(10 + frame, -5 + 0.5*frame, 300 + 3*std::sin(frame));
+        cv::Vec3d measuredRotation(0.1 + 0.02*frame, -0.2, 0.3 + 0.05*std::cos(frame));
+        cv::Mat translation = cv::Mat(measuredTranslation).clone();
+        cv::Mat rotation = cv::Mat(measuredRotation).clone();
+        filter(ID, translation, rotation);
+
+        // The measured quaternion keeps the sign closest to the previous one
+        cv::Vec4d quaternion = toQuaternion(measuredRotation);
+        if (frame > 0 && quaternion.dot(previousQuaternion) < 0) quaternion = -quaternion;
+        previousQuaternion = quaternion;
+        cv::Vec<double,7> measurement(
+            measuredTranslation(0), measuredTranslation(1), measuredTranslation(2),
+            quaternion(0), quaternion(1), quaternion(2), quaternion(3));
+
+        if (frame == 0) {
+            reference.statePost = cv::Mat(measurement).clone();
+            reference.errorCovPost = cv::Mat::zeros(7, 7, CV_64F);
+        }
+        else {
+            reference.correct(cv::Mat(measurement));
+        }
+
+        cv::Vec<double,7> state;
+        cv::Matx<double,7,7> covariance;
+        ASSERT_TRUE(filter.getState(ID, state, covariance));
+        for (int i = 0; i < 7; ++i) {
+            EXPECT_NEAR(reference.statePost.at<double>(i), state(i), 1e-8)
+                << "frame " << frame << ", state " << i;
+            for (int j = 0; j < 7; ++j)
+                EXPECT_NEAR(reference.errorCovPost.at<double>(i, j), covariance(i, j), 1e-12)
+                    << "frame " << frame << ", covariance " << i << "," << j;
+        }
+
+        // The filtered pose is written back in the measurement
+        for (int i = 0; i < 3; ++i)
+            EXPECT_NEAR(state(i), translation.at<double>(i), 1e-8);
+
+        // with the normalized quaternion of the state as rotation
+        cv::Vec4d filteredQuaternion(state(3), state(4), state(5), state(6));
+        filteredQuaternion *= 1/cv::norm(filteredQuaternion);
+        cv::Vec4d writtenQuaternion = toQuaternion(cv::Vec3d(
+            rotation.at<double>(0), rotation.at<double>(1), rotation.at<double>(2)));
+        if (writtenQuaternion.dot(filteredQuaternion) < 0) writtenQuaternion = -writtenQuaternion;
+        for (int i = 0; i < 4; ++i)
+            EXPECT_NEAR(filteredQuaternion(i), writtenQuaternion(i), 1e-8);
+    }
+}
+
 CV_TEST_MAIN(".")
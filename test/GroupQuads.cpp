@@ -0,0 +1,141 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifdef OPENCV3
+#include <opencv2/ts.hpp>
+#else
+#include <opencv2/ts/ts.hpp>
+#endif
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <FindQuads.hpp>
+#include <GroupQuads.hpp>
+#include <chilitags.hpp>
+
+namespace {
+
+chilitags::Quad square(float x, float y, float size) {
+    return chilitags::Quad(
+        x,      y,
+        x+size, y,
+        x+size, y+size,
+        x,      y+size);
+}
+
+}
+
+TEST(GroupQuads, AcrossLevels) {
+    // The same tag found on three levels, from the coarsest to the finest, as
+    // returned by FindQuads, and another tag found once
+    std::vector<chilitags::Quad> quads = {
+        square(19.0f, 19.0f, 102.0f),
+        square(300.0f, 50.0f, 60.0f),
+        square(20.0f, 20.0f, 101.0f),
+        square(19.5f, 19.5f, 100.0f),
+    };
+    std::vector<float> levels = {0.25f, 0.5f, 0.5f, 1.0f};
+
+    chilitags::GroupQuads groupQuads;
+    std::vector<int> primaries = groupQuads(quads, levels);
+    ASSERT_EQ(2, primaries.size());
+    EXPECT_EQ(1, primaries[0]);
+    EXPECT_EQ(3, primaries[1]);
+
+    EXPECT_EQ(-1, groupQuads.nextFallback(1));
+    EXPECT_EQ(2, groupQuads.nextFallback(3));
+    EXPECT_EQ(0, groupQuads.nextFallback(2));
+    EXPECT_EQ(-1, groupQuads.nextFallback(0));
+}
+
+TEST(GroupQuads, KeepDistinctQuads) {
+    std::vector<chilitags::Quad> quads = {
+        // The outer and inner edges of the border of a tag
+        square(19.5f, 19.5f, 100.0f),
+        square(29.5f, 29.5f, 80.0f),
+        // Two quads of the same level
+        square(200.0f, 20.0f, 100.0f),
+        square(200.5f, 20.5f, 100.0f),
+        // Too far apart
+        square(400.0f, 20.0f, 100.0f),
+        square(420.0f, 20.0f, 100.0f),
+    };
+    std::vector<float> levels = {1.0f, 0.5f, 1.0f, 1.0f, 1.0f, 0.5f};
+
+    chilitags::GroupQuads groupQuads;
+    EXPECT_EQ(quads.size(), groupQuads(quads, levels).size());
+    for (size_t i = 0; i < quads.size(); ++i) {
+        EXPECT_EQ(-1, groupQuads.nextFallback(i));
+    }
+}
+
+TEST(GroupQuads, Robust) {
+    // A tag on an image large enough for three levels of pyramid
+    chilitags::Chilitags chilitags;
+    chilitags.setPerformance(chilitags::Chilitags::ROBUST);
+    cv::Mat tag;
+    cv::cvtColor(chilitags.draw(42, 20, true), tag, cv::COLOR_BGR2GRAY);
+    cv::Mat image(480, 640, CV_8U, cv::Scalar::all(255));
+    tag.copyTo(image(cv::Rect(200, 100, tag.cols, tag.rows)));
+
+    // The tag is found on every level...
+    chilitags::FindQuads findQuads;
+    findQuads.setMinInputWidth(160);
+    const std::vector<chilitags::Quad> &quads = findQuads(image);
+    const std::vector<float> &levels = findQuads.getQuadLevels();
+    ASSERT_EQ(quads.size(), levels.size());
+
+    // ... and its duplicates are collapsed in one group per border
+    chilitags::GroupQuads groupQuads;
+    std::vector<int> primaries = groupQuads(quads, levels);
+    EXPECT_LT(primaries.size(), quads.size());
+
+    int nGrouped = 0;
+    int largest = -1;
+    for (int primary : primaries) {
+        for (int index = primary; index >= 0; index = groupQuads.nextFallback(index)) {
+            ++nGrouped;
+            int fallback = groupQuads.nextFallback(index);
+            if (fallback >= 0) EXPECT_GE(levels[index], levels[fallback]);
+        }
+        if (largest < 0 || cv::contourArea(quads[primary]) > cv::contourArea(quads[largest]))
+            largest = primary;
+    }
+    EXPECT_EQ((int) quads.size(), nGrouped);
+
+    // The outer border of the tag is kept from the finest level, with the
+    // coarser ones as fallbacks
+    ASSERT_LE(0, largest);
+    EXPECT_EQ(1.0f, levels[largest]);
+    int nFallbacks = 0;
+    for (int index = groupQuads.nextFallback(largest); index >= 0;
+         index = groupQuads.nextFallback(index)) {
+        EXPECT_GT(1.0f, levels[index]);
+        ++nFallbacks;
+    }
+    EXPECT_LE(1, nFallbacks);
+
+    // ... so that the tag is decoded once
+    auto tags = chilitags.find(image, chilitags.DETECT_ONLY);
+    ASSERT_EQ(1, tags.size());
+    EXPECT_EQ(42, tags.cbegin()->first);
+}
+
+CV_TEST_MAIN(".")
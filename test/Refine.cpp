@@ -0,0 +1,227 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifdef OPENCV3
+#include <opencv2/ts.hpp>
+#else
+#include <opencv2/ts/ts.hpp>
+#endif
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <GrowRoi.hpp>
+#include <Refine.hpp>
+#include <chilitags.hpp>
+
+#include <iostream>
+
+namespace {
+
+// Tag 42 drawn with cells of 10 pixels and a white margin
+cv::Mat drawTag() {
+    chilitags::Chilitags chilitags;
+    cv::Mat image;
+    cv::cvtColor(chilitags.draw(42, 10, true), image, cv::COLOR_BGR2GRAY);
+    return image;
+}
+
+// Corners of the black border, taking the pixel centres as integer coordinates
+const chilitags::Quad TAG_CORNERS = {
+    19.5f,  19.5f,
+    119.5f, 19.5f,
+    119.5f, 119.5f,
+    19.5f,  119.5f
+};
+
+// Projects the tag on the given corners, and blurs it
+cv::Mat warpTag(const chilitags::Quad &corners, double blurSigma) {
+    cv::Mat tag = drawTag();
+    cv::Mat homography = cv::getPerspectiveTransform(
+        cv::Mat_<cv::Point2f>(TAG_CORNERS), cv::Mat_<cv::Point2f>(corners));
+    cv::Mat image;
+    cv::warpPerspective(tag, image, homography, cv::Size(320, 320),
+                        cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar::all(255));
+    if (blurSigma > 0.0) cv::GaussianBlur(image, image, cv::Size(), blurSigma);
+    return image;
+}
+
+// A deterministic error of the raw corners, of at most 1.5 pixels
+chilitags::Quad perturb(const chilitags::Quad &corners) {
+    static const float NOISE[8] = {1.2f, -0.8f, -1.1f, 0.7f, 0.5f, 1.3f, -1.4f, -0.6f};
+    chilitags::Quad perturbed = corners;
+    for (int i = 0; i < 8; ++i) perturbed.val[i] += NOISE[i];
+    return perturbed;
+}
+
+float meanError(const chilitags::Quad &expected, const chilitags::Quad &actual) {
+    float error = 0.0f;
+    for (int i : {0,1,2,3}) {
+        float dx = expected(i,0) - actual(i,0);
+        float dy = expected(i,1) - actual(i,1);
+        error += std::sqrt(dx*dx + dy*dy);
+    }
+    return error/4.0f;
+}
+
+const float PROXIMITY_RATIO = 1.5f/10.0f;
+
+struct Result {
+    float error;
+    double milliseconds;
+};
+
+Result refineWith(chilitags::Chilitags::CornerRefinementMethod method,
+                  const cv::Mat &image, const chilitags::Quad &corners) {
+    static const int REPETITIONS = 100;
+    chilitags::Refine refine;
+    refine.setMethod(method);
+    chilitags::Quad raw = perturb(corners);
+    chilitags::Quad refined;
+    int64 startTime = cv::getTickCount();
+    for (int i = 0; i < REPETITIONS; ++i) refined = refine(image, raw, PROXIMITY_RATIO);
+    int64 endTime = cv::getTickCount();
+    return {meanError(corners, refined),
+            1000.0*(endTime-startTime)/cv::getTickFrequency()/REPETITIONS};
+}
+
+// The corner refinement as done before the batched refinement, with
+// cv::cornerSubPix() on a region around the quad
+chilitags::Quad refineWithCornerSubPix(const cv::Mat &image, const chilitags::Quad &quad) {
+    cv::Mat_<cv::Point2f> refinedQuad(quad);
+    cv::Rect roi = chilitags::growRoi(image, refinedQuad, 1.2f/10.0f);
+    cv::Point2f roiOffset = roi.tl();
+    for (int i : {0,1,2,3}) refinedQuad(i) -= roiOffset;
+
+    float cornerNeighbourhood = PROXIMITY_RATIO*cv::arcLength(refinedQuad, true)/4.0f;
+    cornerNeighbourhood = std::min(cornerNeighbourhood, (roi.width - 5.0f)/2.0f);
+    cornerNeighbourhood = std::min(cornerNeighbourhood, (roi.height - 5.0f)/2.0f);
+    cornerNeighbourhood = std::max(cornerNeighbourhood, 1.0f);
+
+    cv::cornerSubPix(image(roi), refinedQuad,
+                     cv::Size(cornerNeighbourhood, cornerNeighbourhood),
+                     cv::Size(-1, -1), cv::TermCriteria(
+                         cv::TermCriteria::MAX_ITER + cv::TermCriteria::EPS,
+                         5, 0.01f));
+
+    for (int i : {0,1,2,3}) refinedQuad(i) += roiOffset;
+    return refinedQuad.reshape(1);
+}
+
+}
+
+TEST(Refine, Batch) {
+    const chilitags::Quad corners = {
+        60.3f,  50.7f,
+        250.2f, 70.1f,
+        240.8f, 260.4f,
+        70.6f,  240.2f
+    };
+    cv::Mat image = warpTag(corners, 1.0);
+
+    for (auto method : {chilitags::Chilitags::CORNER_GRADIENTS,
+                        chilitags::Chilitags::EDGE_LINES}) {
+        chilitags::Refine refine;
+        refine.setMethod(method);
+
+        // Refining quads together or separately gives the same result
+        std::vector<chilitags::Quad> quads(2, perturb(corners));
+        quads[1] = corners;
+        refine(image, quads, PROXIMITY_RATIO);
+        for (size_t q = 0; q < quads.size(); ++q) {
+            chilitags::Quad single = refine(image,
+                (q == 0) ? perturb(corners) : corners, PROXIMITY_RATIO);
+            EXPECT_LT(meanError(single, quads[q]), 1e-3f);
+        }
+        EXPECT_GT(meanError(corners, perturb(corners)), meanError(corners, quads[0]));
+    }
+}
+
+TEST(Refine, CornerSubPix) {
+    const chilitags::Quad CORNERS[] = {
+        {60.3f, 50.7f, 250.2f, 70.1f, 240.8f, 260.4f, 70.6f, 240.2f},
+        {100.4f, 100.8f, 152.1f, 104.3f, 149.7f, 151.2f, 97.2f, 148.5f},
+    };
+
+    // The structure tensor of the batched refinement is the one of
+    // cv::cornerSubPix(), only computed differently
+    for (const auto &corners : CORNERS) {
+        for (double blurSigma : {0.0, 1.5}) {
+            cv::Mat image = warpTag(corners, blurSigma);
+
+            std::vector<chilitags::Quad> quads(1, perturb(corners));
+            chilitags::Refine refine;
+            refine.setMethod(chilitags::Chilitags::CORNER_GRADIENTS);
+            refine(image, quads, PROXIMITY_RATIO);
+
+            chilitags::Quad expected = refineWithCornerSubPix(image, perturb(corners));
+            for (int i : {0,1,2,3}) {
+                EXPECT_NEAR(expected(i,0), quads[0](i,0), 0.15f) << "corner " << i << ", blur " << blurSigma;
+                EXPECT_NEAR(expected(i,1), quads[0](i,1), 0.15f) << "corner " << i << ", blur " << blurSigma;
+            }
+            EXPECT_LT(meanError(expected, quads[0]), 0.1f) << "blur " << blurSigma;
+        }
+    }
+}
+
+TEST(Refine, SyntheticAccuracy) {
+    struct Case {
+        const char *name;
+        chilitags::Quad corners;
+        double blurSigma;
+    };
+    const chilitags::Quad LARGE = {
+        60.3f,  50.7f,
+        250.2f, 70.1f,
+        240.8f, 260.4f,
+        70.6f,  240.2f
+    };
+    const chilitags::Quad SMALL = {
+        100.4f, 100.8f,
+        152.1f, 104.3f,
+        149.7f, 151.2f,
+        97.2f,  148.5f
+    };
+    const Case CASES[] = {
+        {"large, sharp", LARGE, 0.0},
+        {"large, blurred", LARGE, 2.5},
+        {"small, sharp", SMALL, 0.0},
+        {"small, blurred", SMALL, 1.5},
+    };
+
+    std::cout << "Mean corner error (pixels) and time per quad (ms)" << std::endl;
+    std::cout << "case              corner gradients     edge lines" << std::endl;
+    for (const Case &c : CASES) {
+        cv::Mat image = warpTag(c.corners, c.blurSigma);
+        float rawError = meanError(c.corners, perturb(c.corners));
+        Result gradients = refineWith(chilitags::Chilitags::CORNER_GRADIENTS, image, c.corners);
+        Result edges = refineWith(chilitags::Chilitags::EDGE_LINES, image, c.corners);
+
+        std::cout << c.name << "\t"
+                  << gradients.error << " (" << gradients.milliseconds << ")\t"
+                  << edges.error << " (" << edges.milliseconds << ")" << std::endl;
+
+        // Lenient bounds: this is mostly a benchmark
+        EXPECT_LT(gradients.error, rawError) << c.name;
+        EXPECT_LT(edges.error, 0.3f) << c.name;
+        EXPECT_LT(edges.error, gradients.error + 0.1f) << c.name;
+    }
+}
+
+CV_TEST_MAIN(".")
@@ -0,0 +1,130 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifdef OPENCV3
+#include <opencv2/ts.hpp>
+#else
+#include <opencv2/ts/ts.hpp>
+#endif
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <ScreenOut.hpp>
+#include <chilitags.hpp>
+
+namespace {
+
+// Tag 42 drawn with cells of 10 pixels and a white margin
+cv::Mat drawTag() {
+    chilitags::Chilitags chilitags;
+    cv::Mat image;
+    cv::cvtColor(chilitags.draw(42, 10, true), image, cv::COLOR_BGR2GRAY);
+    return image;
+}
+
+// Corners of the black border, taking the pixel centres as integer coordinates
+const chilitags::Quad TAG_CORNERS = {
+    19.5f,  19.5f,
+    119.5f, 19.5f,
+    119.5f, 119.5f,
+    19.5f,  119.5f
+};
+
+}
+
+TEST(ScreenOut, AcceptTag) {
+    chilitags::ScreenOut screenOut;
+    EXPECT_TRUE(screenOut(drawTag(), TAG_CORNERS));
+
+    auto counters = screenOut.getCounters();
+    EXPECT_EQ(1u, counters.candidates);
+    EXPECT_EQ(0u, counters.nonConvex);
+    EXPECT_EQ(0u, counters.badProportions);
+    EXPECT_EQ(0u, counters.noBorder);
+    EXPECT_EQ(0u, counters.notBimodal);
+}
+
+TEST(ScreenOut, RejectConcave) {
+    chilitags::ScreenOut screenOut;
+    chilitags::Quad concave = {
+        20.0f,  20.0f,
+        120.0f, 20.0f,
+        40.0f,  40.0f,
+        20.0f,  120.0f
+    };
+    EXPECT_FALSE(screenOut(drawTag(), concave));
+    EXPECT_EQ(1u, screenOut.getCounters().nonConvex);
+}
+
+TEST(ScreenOut, RejectElongated) {
+    chilitags::ScreenOut screenOut;
+    chilitags::Quad elongated = {
+        20.0f,  20.0f,
+        120.0f, 20.0f,
+        120.0f, 25.0f,
+        20.0f,  25.0f
+    };
+    EXPECT_FALSE(screenOut(drawTag(), elongated));
+    EXPECT_EQ(1u, screenOut.getCounters().badProportions);
+}
+
+TEST(ScreenOut, RejectBlank) {
+    chilitags::ScreenOut screenOut;
+    cv::Mat blank(140, 140, CV_8U, cv::Scalar::all(255));
+    EXPECT_FALSE(screenOut(blank, TAG_CORNERS));
+    EXPECT_EQ(1u, screenOut.getCounters().noBorder);
+}
+
+TEST(ScreenOut, RejectEmptyFrame) {
+    chilitags::ScreenOut screenOut;
+    // A black frame around a white inside, like a window or a screen
+    cv::Mat frame(140, 140, CV_8U, cv::Scalar::all(255));
+    cv::rectangle(frame, cv::Point(20, 20), cv::Point(119, 119), cv::Scalar::all(0), -1);
+    cv::rectangle(frame, cv::Point(40, 40), cv::Point(99, 99), cv::Scalar::all(255), -1);
+    EXPECT_FALSE(screenOut(frame, TAG_CORNERS));
+    EXPECT_EQ(1u, screenOut.getCounters().notBimodal);
+
+    screenOut.resetCounters();
+    EXPECT_EQ(0u, screenOut.getCounters().candidates);
+    EXPECT_EQ(0u, screenOut.getCounters().notBimodal);
+}
+
+TEST(ScreenOut, DetectionCounters) {
+    // A tag next to an empty frame, which only the screening rejects
+    cv::Mat image(140, 280, CV_8U, cv::Scalar::all(255));
+    drawTag().copyTo(image(cv::Rect(0, 0, 140, 140)));
+    cv::rectangle(image, cv::Point(160, 20), cv::Point(259, 119), cv::Scalar::all(0), -1);
+    cv::rectangle(image, cv::Point(180, 40), cv::Point(239, 99), cv::Scalar::all(255), -1);
+
+    chilitags::Chilitags chilitags;
+    EXPECT_EQ(1u, chilitags.find(image).count(42));
+
+    auto counters = chilitags.getScreenOutCounters();
+    EXPECT_LE(2u, counters.candidates);
+    EXPECT_LE(1u, counters.nonConvex + counters.badProportions
+                  + counters.noBorder + counters.notBimodal);
+
+    chilitags.resetScreenOutCounters();
+    counters = chilitags.getScreenOutCounters();
+    EXPECT_EQ(0u, counters.candidates);
+    EXPECT_EQ(0u, counters.notBimodal);
+}
+
+CV_TEST_MAIN(".")
@@ -0,0 +1,175 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifdef OPENCV3
+#include <opencv2/ts.hpp>
+#else
+#include <opencv2/ts/ts.hpp>
+#endif
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <TraceQuads.hpp>
+#include <chilitags.hpp>
+
+#include <algorithm>
+
+namespace {
+
+// As in TraceQuads.cpp
+const int MIN_TAG_SIZE = 11;
+
+// The pipeline replaced by TraceQuads
+std::vector<chilitags::Quad> findWithOpenCV(const cv::Mat &binaryImage) {
+    // TraceQuads ignores the pixels on the edges of the image
+    cv::Mat image = binaryImage.clone();
+    cv::rectangle(image, cv::Point(0, 0), cv::Point(image.cols-1, image.rows-1),
+                  cv::Scalar::all(0));
+
+    std::vector<std::vector<cv::Point> > contours;
+    cv::findContours(image, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+
+    std::vector<chilitags::Quad> quads;
+    for (const auto &contour : contours) {
+        float perimeter = std::abs(cv::arcLength(contour, true));
+        float area = std::abs(cv::contourArea(contour));
+        if (perimeter > 4*MIN_TAG_SIZE && area > MIN_TAG_SIZE*MIN_TAG_SIZE) {
+            cv::Mat approxContour;
+            cv::approxPolyDP(contour, approxContour, perimeter*0.05f, true);
+            cv::Mat normalisedContour;
+            cv::convexHull(approxContour, normalisedContour, false);
+            if (normalisedContour.rows == 4) quads.push_back(normalisedContour.reshape(1));
+        }
+    }
+    return quads;
+}
+
+std::vector<chilitags::Quad> findWithTraceQuads(const cv::Mat &binaryImage) {
+    cv::Mat image = binaryImage.clone();
+    std::vector<chilitags::Quad> quads;
+    chilitags::TraceQuads traceQuads;
+    traceQuads(image, 1.0f, 0.0f, quads);
+    return quads;
+}
+
+float signedArea(const chilitags::Quad &quad) {
+    float area = 0.0f;
+    for (int i : {0,1,2,3}) {
+        int j = (i+1)%4;
+        area += quad(i,0)*quad(j,1) - quad(j,0)*quad(i,1);
+    }
+    return area/2.0f;
+}
+
+// Whether the quads have the same vertices, in the same orientation, whatever
+// the first one
+bool sameQuad(const chilitags::Quad &a, const chilitags::Quad &b) {
+    if ((signedArea(a) > 0.0f) != (signedArea(b) > 0.0f)) return false;
+    for (int shift : {0,1,2,3}) {
+        bool same = true;
+        for (int i : {0,1,2,3}) {
+            int j = (i+shift)%4;
+            same = same && std::abs(a(i,0) - b(j,0)) <= 1.0f
+                        && std::abs(a(i,1) - b(j,1)) <= 1.0f;
+        }
+        if (same) return true;
+    }
+    return false;
+}
+
+void expectSameQuads(const cv::Mat &binaryImage, const char *name) {
+    std::vector<chilitags::Quad> expected = findWithOpenCV(binaryImage);
+    std::vector<chilitags::Quad> actual = findWithTraceQuads(binaryImage);
+
+    EXPECT_LT(0u, expected.size()) << name;
+    EXPECT_EQ(expected.size(), actual.size()) << name;
+    for (const auto &quad : expected) {
+        EXPECT_TRUE(std::any_of(actual.begin(), actual.end(),
+            [&quad](const chilitags::Quad &other) { return sameQuad(quad, other); }))
+            << name << ": missing\n" << cv::Mat(quad);
+    }
+}
+
+}
+
+TEST(TraceQuads, NestedBorders) {
+    cv::Mat image(200, 200, CV_8U, cv::Scalar::all(0));
+    cv::rectangle(image, cv::Point(20, 20), cv::Point(179, 179), cv::Scalar::all(255), 2);
+    cv::rectangle(image, cv::Point(50, 50), cv::Point(149, 149), cv::Scalar::all(255), 1);
+    cv::rectangle(image, cv::Point(80, 80), cv::Point(119, 119), cv::Scalar::all(255), -1);
+    cv::rectangle(image, cv::Point(90, 90), cv::Point(109, 109), cv::Scalar::all(0), -1);
+    expectSameQuads(image, "nested");
+}
+
+TEST(TraceQuads, TouchingBlobs) {
+    cv::Mat image(200, 300, CV_8U, cv::Scalar::all(0));
+    // Sharing a side
+    cv::rectangle(image, cv::Point(20, 20), cv::Point(69, 69), cv::Scalar::all(255), -1);
+    cv::rectangle(image, cv::Point(70, 30), cv::Point(119, 79), cv::Scalar::all(255), -1);
+    // Sharing a corner, 8-connected
+    cv::rectangle(image, cv::Point(150, 20), cv::Point(199, 69), cv::Scalar::all(255), -1);
+    cv::rectangle(image, cv::Point(200, 70), cv::Point(249, 119), cv::Scalar::all(255), -1);
+    // Rotated quads, one inside the hole of the other
+    const cv::Point outer[] = {{60, 110}, {140, 120}, {130, 190}, {50, 180}};
+    const cv::Point inner[] = {{80, 130}, {120, 135}, {115, 170}, {75, 165}};
+    cv::polylines(image, std::vector<std::vector<cv::Point> >(1,
+        std::vector<cv::Point>(outer, outer+4)), true, cv::Scalar::all(255), 3);
+    cv::fillConvexPoly(image, inner, 4, cv::Scalar::all(255));
+    expectSameQuads(image, "touching");
+}
+
+TEST(TraceQuads, ImageEdges) {
+    cv::Mat image(150, 200, CV_8U, cv::Scalar::all(0));
+    cv::rectangle(image, cv::Point(-20, -20), cv::Point(59, 59), cv::Scalar::all(255), -1);
+    cv::rectangle(image, cv::Point(100, 0), cv::Point(199, 60), cv::Scalar::all(255), 2);
+    cv::rectangle(image, cv::Point(1, 90), cv::Point(60, 149), cv::Scalar::all(255), -1);
+    cv::rectangle(image, cv::Point(120, 80), cv::Point(170, 130), cv::Scalar::all(255), -1);
+    expectSameQuads(image, "edges");
+}
+
+TEST(TraceQuads, Edges) {
+    // The edges of a tag in perspective, as found by FindQuads
+    chilitags::Chilitags chilitags;
+    cv::Mat tag;
+    cv::cvtColor(chilitags.draw(42, 10, true), tag, cv::COLOR_BGR2GRAY);
+    const cv::Point2f from[] = {{0, 0}, {140, 0}, {140, 140}, {0, 140}};
+    const cv::Point2f to[] = {{30, 40}, {250, 20}, {270, 230}, {50, 260}};
+    cv::Mat image;
+    cv::warpPerspective(tag, image, cv::getPerspectiveTransform(from, to), cv::Size(300, 300),
+                        cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar::all(255));
+    cv::Canny(image, image, 100, 200, 3);
+    expectSameQuads(image, "tag edges");
+}
+
+TEST(TraceQuads, ScaleAndOffset) {
+    cv::Mat image(100, 100, CV_8U, cv::Scalar::all(0));
+    cv::rectangle(image, cv::Point(20, 30), cv::Point(69, 79), cv::Scalar::all(255), -1);
+
+    std::vector<chilitags::Quad> quads;
+    chilitags::TraceQuads traceQuads;
+    traceQuads(image, 2.0f, 0.5f, quads);
+    ASSERT_EQ(1u, quads.size());
+    for (int i : {0,1,2,3}) {
+        EXPECT_TRUE(quads[0](i,0) == 40.5f || quads[0](i,0) == 138.5f);
+        EXPECT_TRUE(quads[0](i,1) == 60.5f || quads[0](i,1) == 158.5f);
+    }
+}
+
+CV_TEST_MAIN(".")
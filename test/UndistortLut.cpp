@@ -0,0 +1,137 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifdef OPENCV3
+#include <opencv2/ts.hpp>
+#else
+#include <opencv2/ts/ts.hpp>
+#endif
+
+#include <opencv2/calib3d/calib3d.hpp>
+#ifdef OPENCV3
+#include <opencv2/imgproc/imgproc.hpp>
+#endif
+
+#include <UndistortLut.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+namespace {
+
+// A wide angle lens, with strong barrel distortion
+const cv::Size IMAGE_SIZE(640, 480);
+const cv::Matx33f CAMERA_MATRIX(
+    500, 0,   320,
+    0,   500, 240,
+    0,   0,   1);
+const cv::Vec<float,5> DIST_COEFFS(-0.3f, 0.1f, 0.001f, -0.001f, 0.f);
+
+// Overwrites the int at the given offset of the file
+void patch(const std::string &filename, std::streamoff offset, int value)
+{
+    std::fstream file(filename.c_str(), std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(offset);
+    file.write((const char *) &value, sizeof(value));
+}
+
+}
+
+TEST(UndistortLut, Interpolation) {
+    chilitags::UndistortLut undistortLut;
+    EXPECT_TRUE(undistortLut.empty());
+    undistortLut.build(cv::Mat(CAMERA_MATRIX), cv::Mat(DIST_COEFFS), IMAGE_SIZE, 8);
+    EXPECT_FALSE(undistortLut.empty());
+
+    // Points all over the image, off the samples, and a bit outside of it
+    std::vector<cv::Point2f> points;
+    for (float y = -3.5f; y < IMAGE_SIZE.height + 4; y += 13.3f)
+        for (float x = -3.5f; x < IMAGE_SIZE.width + 4; x += 17.7f)
+            points.push_back(cv::Point2f(x, y));
+
+    std::vector<cv::Point2f> expected;
+    cv::undistortPoints(points, expected, cv::Mat(CAMERA_MATRIX), cv::Mat(DIST_COEFFS),
+                        cv::noArray(), cv::Mat(CAMERA_MATRIX));
+
+    // The interpolation is the least accurate in the corners, and outside
+    // of the image, where it extrapolates
+    cv::Rect image(cv::Point(), IMAGE_SIZE);
+    std::vector<cv::Point2f> distorted = points;
+    undistortLut(points.data(), points.size());
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        float tolerance = image.contains(distorted[i]) ? 0.1f : 0.5f;
+        EXPECT_GT(tolerance, cv::norm(points[i] - expected[i])) << distorted[i];
+    }
+
+    undistortLut.clear();
+    EXPECT_TRUE(undistortLut.empty());
+}
+
+TEST(UndistortLut, Persistence) {
+    const std::string filename = "UndistortLut.lut";
+    const cv::Mat cameraMatrix(CAMERA_MATRIX);
+    const cv::Mat distCoeffs(DIST_COEFFS);
+
+    chilitags::UndistortLut built;
+    built.build(cameraMatrix, distCoeffs, IMAGE_SIZE, 8);
+    ASSERT_TRUE(built.write(filename));
+
+    // Read back for the same calibration, the samples are the same
+    chilitags::UndistortLut read;
+    ASSERT_TRUE(read.read(filename, cameraMatrix, distCoeffs, IMAGE_SIZE, 8));
+    cv::Point2f points[2] = {cv::Point2f(12.3f, 45.6f), cv::Point2f(600.1f, 470.2f)};
+    cv::Point2f expected[2] = {points[0], points[1]};
+    built(expected, 2);
+    read(points, 2);
+    EXPECT_EQ(expected[0], points[0]);
+    EXPECT_EQ(expected[1], points[1]);
+
+    // Another calibration, or sampling, needs other samples
+    cv::Vec<float,5> otherDistCoeffs = DIST_COEFFS;
+    otherDistCoeffs[0] = -0.2f;
+    EXPECT_FALSE(read.read(filename, cameraMatrix, cv::Mat(otherDistCoeffs), IMAGE_SIZE, 8));
+    EXPECT_TRUE(read.empty());
+    EXPECT_FALSE(read.read(filename, cameraMatrix, distCoeffs, IMAGE_SIZE, 16));
+    EXPECT_FALSE(read.read("no such file", cameraMatrix, distCoeffs, IMAGE_SIZE, 8));
+
+    // The grid of the file must be the one of its key: the magic number, the
+    // version and the key size are followed by the key (the image size, the
+    // step, 9 camera matrix and 5 distortion coefficients), then by the
+    // step, the columns and the rows
+    const std::streamoff gridOffset = 3*sizeof(int) + (3 + 9 + 5)*sizeof(double);
+    const int expectedGrid[3] = {8, 640/8 + 1, 480/8 + 1};
+    const int corruptions[3][2] = {{0, 16}, {1, 1 << 30}, {2, 0}};
+    for (const auto &corruption : corruptions) {
+        ASSERT_TRUE(built.write(filename));
+        ASSERT_TRUE(read.read(filename, cameraMatrix, distCoeffs, IMAGE_SIZE, 8));
+        std::streamoff offset = gridOffset + corruption[0]*sizeof(int);
+        patch(filename, offset, corruption[1]);
+        EXPECT_FALSE(read.read(filename, cameraMatrix, distCoeffs, IMAGE_SIZE, 8))
+            << "field " << corruption[0] << " set to " << corruption[1];
+        EXPECT_TRUE(read.empty());
+        patch(filename, offset, expectedGrid[corruption[0]]);
+        EXPECT_TRUE(read.read(filename, cameraMatrix, distCoeffs, IMAGE_SIZE, 8));
+    }
+
+    std::remove(filename.c_str());
+}
+
+CV_TEST_MAIN(".")
@@ -0,0 +1,317 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifdef OPENCV3
+#include <opencv2/ts.hpp>
+#else
+#include <opencv2/ts/ts.hpp>
+#endif
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <Detect.hpp>
+#include <Codec.hpp>
+#include <EstimatePose3D.hpp>
+#include <Filter3D.hpp>
+#include <chilitags.hpp>
+
+#include <cerrno>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Count the calls to the allocation functions of glibc, on which operator
+// new relies as well, by interposing them
+namespace {
+bool countAllocations = false;
+int nAllocations = 0;
+size_t nBytes = 0;
+
+inline void count(size_t size) {
+    if (countAllocations) {
+        ++nAllocations;
+        nBytes += size;
+    }
+}
+}
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) {
+    count(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    count(n*size);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    count(size);
+    return __libc_realloc(pointer, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    count(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment-1)) != 0) return EINVAL;
+    count(size);
+    // *pointer must not be modified on failure
+    void *allocated = __libc_memalign(alignment, size);
+    if (!allocated) return ENOMEM;
+    *pointer = allocated;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    count(size);
+    return __libc_memalign(alignment, size);
+}
+
+}
+
+namespace {
+
+// A few tags on a white background
+cv::Mat drawScene() {
+    chilitags::Chilitags chilitags;
+    cv::Mat scene(480, 640, CV_8U, cv::Scalar::all(255));
+    const int ids[] = {3, 42, 1000};
+    for (int i = 0; i < 3; ++i) {
+        cv::Mat tag;
+        cv::cvtColor(chilitags.draw(ids[i], 8, true), tag, cv::COLOR_BGR2GRAY);
+        tag.copyTo(scene(cv::Rect(40+200*i, 40+100*i, tag.cols, tag.rows)));
+    }
+    return scene;
+}
+
+struct Allocations {
+    float perCall;
+    float bytesPerCall;
+};
+
+// Runs a few calls to warm up the buffers, then counts the allocations of
+// the following calls
+template<typename Call>
+Allocations measure(Call call) {
+    static const int WARM_UP_CALLS = 3;
+    static const int MEASURED_CALLS = 10;
+    for (int i = 0; i < WARM_UP_CALLS; ++i) call();
+
+    nAllocations = 0;
+    nBytes = 0;
+    countAllocations = true;
+    for (int i = 0; i < MEASURED_CALLS; ++i) call();
+    countAllocations = false;
+
+    return {(float) nAllocations/MEASURED_CALLS, (float) nBytes/MEASURED_CALLS};
+}
+
+void report(const char *name, const Allocations &allocations) {
+    std::cout
+        << std::setw(32) << name
+        << std::setw(14) << std::fixed << std::setprecision(1) << allocations.perCall
+        << std::setw(14) << std::fixed << std::setprecision(0) << allocations.bytesPerCall
+        << "\n";
+}
+
+}
+
+TEST(Allocations, SteadyStateDetection) {
+    cv::Mat scene = drawScene();
+
+    chilitags::Detect detect;
+    detect.setSegmentation(chilitags::Chilitags::ADAPTIVE_THRESHOLD);
+    detect.setMinInputWidth(0);
+
+    // The first detections size the buffers, and insert the tags in the map
+    chilitags::TagCornerMap tags;
+    for (int i = 0; i < 3; ++i) detect(scene, tags);
+    ASSERT_EQ(3, tags.size());
+
+    countAllocations = true;
+    nAllocations = 0;
+    detect(scene, tags);
+    countAllocations = false;
+
+    EXPECT_EQ(0, nAllocations);
+    EXPECT_EQ(3, tags.size());
+}
+
+TEST(Allocations, HotPath) {
+    cv::Mat scene = drawScene();
+
+    // Upper bounds on the allocations per call. They are meant to catch
+    // regressions, not to be tight: lower them when the hot path improves.
+    struct Trigger {
+        chilitags::Chilitags::DetectionTrigger trigger;
+        const char *name;
+        float maxAllocations;
+    };
+    const Trigger triggers[] = {
+        {chilitags::Chilitags::DETECT_ONLY,         "find(DETECT_ONLY)",         64},
+        {chilitags::Chilitags::TRACK_ONLY,          "find(TRACK_ONLY)",          256},
+        {chilitags::Chilitags::TRACK_AND_DETECT,    "find(TRACK_AND_DETECT)",    320},
+        {chilitags::Chilitags::DETECT_PERIODICALLY, "find(DETECT_PERIODICALLY)", 256},
+    };
+    static const float MAX_ESTIMATE_ALLOCATIONS = 256;
+
+    std::cout << "Allocations per call, with 3 tags in the image\n";
+    std::cout << "                            call   allocations         bytes\n";
+
+    for (const Trigger &trigger : triggers) {
+        chilitags::Chilitags chilitags;
+        // Detect once, so that there is something to track
+        chilitags.find(scene);
+        Allocations allocations = measure([&]() {
+            chilitags.find(scene, trigger.trigger);
+        });
+        report(trigger.name, allocations);
+        EXPECT_LE(allocations.perCall, trigger.maxAllocations) << trigger.name;
+    }
+
+    {
+        chilitags::Chilitags3D chilitags3D;
+        chilitags::TagCornerMap tags = chilitags3D.getChilitags().find(scene);
+        ASSERT_EQ(3, tags.size());
+        Allocations allocations = measure([&]() {
+            chilitags3D.estimate(tags);
+        });
+        report("Chilitags3D::estimate", allocations);
+        EXPECT_LE(allocations.perCall, MAX_ESTIMATE_ALLOCATIONS);
+    }
+
+    {
+        chilitags::Chilitags3D chilitags3D;
+        chilitags::TagCornerMap tags = chilitags3D.getChilitags().find(scene);
+        chilitags::Chilitags3D::ObjectPoseList poses;
+        Allocations allocations = measure([&]() {
+            chilitags3D.estimateByHandle(tags, poses);
+        });
+        report("Chilitags3D::estimateByHandle", allocations);
+        EXPECT_LE(allocations.perCall, MAX_ESTIMATE_ALLOCATIONS);
+        EXPECT_EQ(3, poses.size());
+    }
+
+    {
+        chilitags::Filter3D<float> filter;
+        chilitags::Chilitags3Df::ObjectPoseList poses;
+        cv::Mat translation = (cv::Mat_<double>(3,1) << 10.0, 20.0, 500.0);
+        cv::Mat rotation = (cv::Mat_<double>(3,1) << 0.1, 0.2, 0.3);
+        Allocations allocations = measure([&]() {
+            poses.clear();
+            filter(poses);
+            filter(3, translation, rotation);
+        });
+        report("Filter3D (predict + correct)", allocations);
+        EXPECT_EQ(0, allocations.perCall);
+    }
+
+    {
+        chilitags::Codec codec;
+        unsigned char bits[36];
+        codec.getTagEncodedId(42, bits);
+        int id;
+        Allocations allocations = measure([&]() {
+            codec.decode(bits, id);
+        });
+        report("Codec::decode", allocations);
+        EXPECT_EQ(0, allocations.perCall);
+        EXPECT_EQ(42, id);
+    }
+}
+
+TEST(Allocations, RigidObject) {
+    cv::Mat scene = drawScene();
+
+    // The tags of the scene as one planar object, in pixels
+    const std::string BOARD =
+        "%YAML:1.0\n"
+        "board:\n"
+        "    - tag: 3\n"
+        "      size: 64\n"
+        "    - tag: 42\n"
+        "      size: 64\n"
+        "      translation: [200., 100., 0.]\n"
+        "    - tag: 1000\n"
+        "      size: 64\n"
+        "      translation: [400., 200., 0.]\n";
+    const float offsets[3][2] = {{0, 0}, {200, 100}, {400, 200}};
+
+    chilitags::Chilitags3D chilitags3D;
+    ASSERT_TRUE(chilitags3D.readTagConfiguration(BOARD, true, true));
+    chilitags::TagCornerMap tags = chilitags3D.getChilitags().find(scene);
+    ASSERT_EQ(3, tags.size());
+
+    chilitags::Chilitags3D::ObjectPoseList poses;
+    Allocations estimate = measure([&]() {
+        chilitags3D.estimateByHandle(tags, poses);
+    });
+    report("estimateByHandle(object)", estimate);
+    ASSERT_EQ(1, poses.size());
+    EXPECT_EQ(chilitags3D.getObjectHandle("board"), poses[0].handle);
+
+    // The same object solved directly, from the points in the order in which
+    // Chilitags3D assembles them
+    std::vector<cv::Point3f> objectPoints;
+    cv::Mat_<cv::Point2f> imagePoints(0, 1);
+    int tag = 0;
+    for (const auto &detected : tags) {
+        const float *offset = offsets[tag++];
+        objectPoints.push_back(cv::Point3f(offset[0], offset[1], 0));
+        objectPoints.push_back(cv::Point3f(offset[0]+64, offset[1], 0));
+        objectPoints.push_back(cv::Point3f(offset[0]+64, offset[1]+64, 0));
+        objectPoints.push_back(cv::Point3f(offset[0], offset[1]+64, 0));
+        for (int i = 0; i < 4; ++i)
+            imagePoints.push_back(cv::Point2f(detected.second(i,0), detected.second(i,1)));
+    }
+
+    chilitags::EstimatePose3D<float> estimatePose3D(cv::Size(640, 480));
+    chilitags::EstimatePose3D<float>::Workspace workspace;
+    chilitags::EstimatePose3D<float>::Solution solution;
+    chilitags::Chilitags3D::ObjectPoseList predictions;
+    chilitags::Chilitags3D::TransformMatrix pose;
+    Allocations solve = measure([&]() {
+        predictions.clear();
+        estimatePose3D(predictions);
+        estimatePose3D.solve(0, objectPoints, imagePoints, solution, workspace, true);
+        estimatePose3D.update(0, solution, pose);
+    });
+    report("EstimatePose3D (object)", solve);
+    EXPECT_TRUE(solution.refined);
+
+    // Gathering the points of the tags into the object allocates nothing
+    // besides the solving itself
+    EXPECT_LE(estimate.perCall, solve.perCall);
+    EXPECT_LE(estimate.bytesPerCall, solve.bytesPerCall);
+}
+
+CV_TEST_MAIN(".")
@@ -0,0 +1,167 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifdef OPENCV3
+#include <opencv2/ts.hpp>
+#else
+#include <opencv2/ts/ts.hpp>
+#endif
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <chilitags.hpp>
+
+#include <ChilitagsClient.hpp>
+#include <ChilitagsDaemon.hpp>
+
+namespace {
+
+std::string segmentName(const char *test)
+{
+    return std::string("/chilitags-test-") + test + "-" + std::to_string(getpid());
+}
+
+// Describes the acquired frame inconsistently, as a faulty client could
+class FaultyClient : public chilitags::ChilitagsClient {
+public:
+    void setStride(int stride) {
+        mAcquiredSlot->stride = stride;
+    }
+};
+
+}
+
+TEST(Daemon, Loopback) {
+    chilitags::Chilitags3D estimator(cv::Size(640, 480));
+    chilitags::ChilitagsDaemon daemon(estimator, false);
+    std::string name = segmentName("Loopback");
+    ASSERT_TRUE(daemon.start(name, 2, 640, 480));
+
+    chilitags::ChilitagsClient client;
+    ASSERT_TRUE(client.connect(name));
+
+    cv::Mat image = chilitags::Chilitags().draw(42, 5, true);
+    chilitags::TagCornerMap expected = chilitags::Chilitags().find(image, chilitags::Chilitags::DETECT_ONLY);
+    ASSERT_EQ(1, expected.count(42));
+
+    // Copied frame
+    ASSERT_TRUE(client.pushFrame(image.data, image.cols, image.rows, image.step, 3,
+                                 1234, chilitags::shm::DETECT_ONLY, 0));
+    ASSERT_TRUE(daemon.processFrame(1000));
+
+    chilitags::ChilitagsClient::Result result;
+    ASSERT_TRUE(client.readResult(result, 0));
+    EXPECT_EQ(0u, result.sequence);
+    EXPECT_EQ(1234, result.timestamp);
+    ASSERT_EQ(1u, result.tags.size());
+    EXPECT_EQ(42, result.tags[0].id);
+    for (int i = 0; i < 8; ++i) EXPECT_NEAR(expected[42].val[i], result.tags[0].corners[i], 1e-3);
+    EXPECT_TRUE(result.objects.empty());
+
+    // Frame written in place
+    int stride;
+    unsigned char *pixels = client.acquireFrame(image.cols, image.rows, 3, stride, 0);
+    ASSERT_TRUE(pixels != NULL);
+    for (int y = 0; y < image.rows; ++y) std::memcpy(pixels + y*stride, image.ptr(y), image.cols*3);
+    EXPECT_EQ(1u, client.publishFrame(5678, chilitags::shm::DETECT_ONLY));
+    ASSERT_TRUE(daemon.processFrame(1000));
+
+    ASSERT_TRUE(client.readResult(result, 0));
+    EXPECT_EQ(1u, result.sequence);
+    EXPECT_EQ(5678, result.timestamp);
+    ASSERT_EQ(1u, result.tags.size());
+    EXPECT_EQ(42, result.tags[0].id);
+
+    // Nothing else was published
+    EXPECT_FALSE(daemon.processFrame(0));
+    EXPECT_FALSE(client.readResult(result, 0));
+    EXPECT_EQ(0u, client.getDroppedResults());
+}
+
+TEST(Daemon, InconsistentFrames) {
+    chilitags::Chilitags3D estimator(cv::Size(640, 480));
+    chilitags::ChilitagsDaemon daemon(estimator, false);
+    std::string name = segmentName("InconsistentFrames");
+    ASSERT_TRUE(daemon.start(name, 1, 640, 480));
+
+    FaultyClient client;
+    ASSERT_TRUE(client.connect(name));
+
+    cv::Mat image = chilitags::Chilitags().draw(42, 5, true);
+
+    // Strides which would read the rows out of the slot, or overlap them
+    const int STRIDES[] = {0, image.cols*3 - 1, -image.cols*3, 3*640*480};
+    for (int stride : STRIDES) {
+        int slotStride;
+        unsigned char *pixels = client.acquireFrame(image.cols, image.rows, 3, slotStride, 0);
+        ASSERT_TRUE(pixels != NULL);
+        for (int y = 0; y < image.rows; ++y) std::memcpy(pixels + y*slotStride, image.ptr(y), image.cols*3);
+        client.setStride(stride);
+        client.publishFrame(0, chilitags::shm::DETECT_ONLY);
+
+        // The frame is skipped, but still gets its (empty) result
+        ASSERT_TRUE(daemon.processFrame(1000));
+        chilitags::ChilitagsClient::Result result;
+        ASSERT_TRUE(client.readResult(result, 0));
+        EXPECT_TRUE(result.tags.empty()) << "stride " << stride;
+    }
+
+    // The frames larger than the slots are refused by the client
+    int stride;
+    EXPECT_TRUE(client.acquireFrame(641, 480, 3, stride, 0) == NULL);
+    EXPECT_TRUE(client.acquireFrame(1 << 20, 1 << 20, 3, stride, 0) == NULL);
+}
+
+TEST(Daemon, Stopped) {
+    chilitags::Chilitags3D estimator(cv::Size(640, 480));
+    chilitags::ChilitagsDaemon daemon(estimator, false);
+    std::string name = segmentName("Stopped");
+    ASSERT_TRUE(daemon.start(name, 1, 640, 480));
+
+    chilitags::ChilitagsClient client;
+    ASSERT_TRUE(client.connect(name));
+
+    // Fill the only frame slot, which the daemon never frees
+    int stride;
+    ASSERT_TRUE(client.acquireFrame(64, 48, 1, stride, 0) != NULL);
+    client.publishFrame();
+
+    std::thread stopper([&daemon]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        daemon.stop();
+    });
+
+    // The indefinite waits give up once the daemon is stopped
+    chilitags::ChilitagsClient::Result result;
+    EXPECT_FALSE(client.readResult(result, -1));
+    EXPECT_TRUE(client.acquireFrame(64, 48, 1, stride, -1) == NULL);
+    stopper.join();
+
+    // The segment is removed
+    chilitags::ChilitagsClient other;
+    EXPECT_FALSE(other.connect(name));
+}
+
+CV_TEST_MAIN(".")
@@ -271,6 +271,56 @@ TEST(Integration, Snapshots) {
         ++referenceFalseNegativesIt;
     }
     std::cout << totalNewFalseNegatives << "/" << total << " tags were not detected with the tuned processing.\n";
+
+    // Compare the segmentation backends of the detection, with the FAST preset
+    struct Backend {
+        chilitags::Chilitags::Segmentation segmentation;
+        const char *name;
+    };
+    const Backend backends[] = {
+        {chilitags::Chilitags::CANNY_EDGES, "Canny edges"},
+        {chilitags::Chilitags::ADAPTIVE_THRESHOLD, "adaptive threshold"},
+    };
+
+    cout << "\nSegmentation backends\n";
+    cout << "           backend  Processing time (ms)  Recall  False positives\n";
+    for (const Backend &backend : backends) {
+        chilitags.setSegmentation(backend.segmentation);
+
+        vector<float> durations;
+        int detected = 0;
+        int falsePositives = 0;
+        for (auto testCase : TestMetadata::all) {
+            std::string path = std::string(cvtest::TS::ptr()->get_data_path())+testCase.filename;
+            cv::Mat image = cv::imread(path);
+            if(!image.data) continue;
+
+            chilitags::TagCornerMap tags;
+            for (int i = 0; i < ITERATIONS; i++) {
+                int64 startCount = cv::getTickCount();
+                tags = chilitags.find(image, chilitags::Chilitags::DETECT_ONLY);
+                int64 endCount = cv::getTickCount();
+                durations.push_back(((float) endCount - startCount)*1000/cv::getTickFrequency());
+            }
+
+            std::vector<int> foundIds;
+            for (const auto &tag : tags) foundIds.push_back(tag.first);
+            std::sort(
+                testCase.expectedTagIds.begin(),
+                testCase.expectedTagIds.end());
+            int nFalsePositives = my_set_difference(foundIds, testCase.expectedTagIds).size();
+            falsePositives += nFalsePositives;
+            detected += foundIds.size() - nFalsePositives;
+        }
+
+        cout
+            << std::setw(18) << backend.name
+            << std::setw(22) << std::fixed << std::setprecision(1) << mean(durations)
+            << std::setw(7) << std::fixed << std::setprecision(0) << 100.0f*detected/total << "%"
+            << std::setw(17) << falsePositives
+            << "\n";
+    }
+    chilitags.setSegmentation(chilitags::Chilitags::CANNY_EDGES);
 }
 
 CV_TEST_MAIN(".")
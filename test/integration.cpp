@@ -26,6 +26,9 @@
 
 #include <chilitags.hpp>
 
+#include <thread>
+#include <vector>
+
 TEST(Integration, Minimal) {
     int expectedId = 42;
     chilitags::Chilitags chilitags;
@@ -105,4 +108,212 @@ TEST(Integration, MaxWidth) {
     }
 }
 
+TEST(Integration, DetectionBudget) {
+    int expectedId = 42;
+    chilitags::Chilitags chilitags;
+    cv::Mat image = chilitags.draw(expectedId, 3, true);
+
+    // A generous budget does not change the result
+    chilitags.setDetectionBudget(1000.0f, 1000);
+    auto tags = chilitags.find(image);
+    EXPECT_FALSE(chilitags.isLastDetectionPartial());
+    ASSERT_EQ(1, tags.size());
+    EXPECT_EQ(expectedId, tags.cbegin()->first);
+
+    // The largest candidate, i.e. the tag, is examined first
+    chilitags.setDetectionBudget(0.0f, 1);
+    tags = chilitags.find(image);
+    ASSERT_EQ(1, tags.size());
+    EXPECT_EQ(expectedId, tags.cbegin()->first);
+
+    // An exhausted budget is reported
+    chilitags.setDetectionBudget(1e-6f);
+    tags = chilitags.find(image);
+    EXPECT_TRUE(chilitags.isLastDetectionPartial());
+
+    chilitags.setDetectionBudget(0.0f);
+    tags = chilitags.find(image);
+    EXPECT_FALSE(chilitags.isLastDetectionPartial());
+    ASSERT_EQ(1, tags.size());
+}
+
+TEST(Integration, CornerRefinement) {
+    int expectedId = 42;
+    chilitags::Chilitags chilitags;
+    chilitags.setFilter(0, 0.0f);
+    cv::Mat image = chilitags.draw(expectedId, 3, true);
+
+    chilitags.setCornerRefinement(chilitags::Chilitags::REFINE_CANDIDATES);
+    auto candidates = chilitags.find(image, chilitags.DETECT_ONLY);
+    ASSERT_EQ(1, candidates.size());
+
+    chilitags.setCornerRefinement(chilitags::Chilitags::NO_REFINEMENT);
+    auto raw = chilitags.find(image, chilitags.DETECT_ONLY);
+    ASSERT_EQ(1, raw.size());
+
+    // Refining the decoded tag gives the same corners as refining it as a
+    // candidate
+    chilitags.setCornerRefinement(chilitags::Chilitags::REFINE_DECODED);
+    auto decoded = chilitags.find(image, chilitags.DETECT_ONLY);
+    ASSERT_EQ(1, decoded.size());
+    EXPECT_EQ(expectedId, decoded.cbegin()->first);
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_NEAR(candidates[expectedId](i,0), decoded[expectedId](i,0), 0.01f);
+        EXPECT_NEAR(candidates[expectedId](i,1), decoded[expectedId](i,1), 0.01f);
+    }
+
+    // Tags which are not selected keep the coordinates of their detection
+    chilitags.setRefinedTags(std::vector<int>(1, expectedId+1));
+    auto unrefined = chilitags.find(image, chilitags.DETECT_ONLY);
+    ASSERT_EQ(1, unrefined.size());
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(raw[expectedId](i,0), unrefined[expectedId](i,0));
+        EXPECT_EQ(raw[expectedId](i,1), unrefined[expectedId](i,1));
+    }
+}
+
+TEST(Integration, Scales) {
+    int expectedId = 42;
+    chilitags::Chilitags chilitags;
+    chilitags.setFilter(0, 0.0f);
+    int zoom = 10;
+    cv::Mat image = chilitags.draw(expectedId, zoom, true);
+
+    float close = zoom*2.0f - 0.5f;
+    float far   = zoom*12.0f - 0.5f;
+    chilitags::Quad expectedCorners = {
+        close, close,
+        far, close,
+        far, far,
+        close, far
+    };
+
+    // The tag found only on a subsample is mapped back to the input image
+    for (float scale : {0.5f, 0.7f}) {
+        chilitags.setScales(std::vector<float>(1, scale));
+        auto tags = chilitags.find(image, chilitags.DETECT_ONLY);
+        ASSERT_EQ(1, tags.size()) << "with scale=" << scale;
+        EXPECT_EQ(expectedId, tags.cbegin()->first);
+        for (int i : {0,1,2,3}) {
+            EXPECT_GT(0.5f, cv::norm(tags.cbegin()->second.row(i) - expectedCorners.row(i)))
+                << "with scale=" << scale << ", i=" << i;
+        }
+    }
+
+    chilitags.setScales({1.0f, 0.5f, 0.707f});
+    auto tags = chilitags.find(image, chilitags.DETECT_ONLY);
+    ASSERT_EQ(1, tags.size());
+
+    // The costs of the previous scales are forgotten
+    auto costs = chilitags.getScaleCosts();
+    ASSERT_EQ(3, costs.size());
+    for (auto cost : costs) EXPECT_LE(0.0f, cost.second);
+    EXPECT_EQ(1, costs.count(0.707f));
+
+    // The presets restore the octaves
+    chilitags.setPerformance(chilitags::Chilitags::FAST);
+    tags = chilitags.find(image, chilitags.DETECT_ONLY);
+    ASSERT_EQ(1, tags.size());
+    costs = chilitags.getScaleCosts();
+    ASSERT_EQ(1, costs.size());
+    EXPECT_EQ(1, costs.count(1.0f));
+}
+
+TEST(Integration, Workspace) {
+    chilitags::Chilitags chilitags;
+    chilitags.setFilter(0, 0.0f);
+    cv::Mat image42 = chilitags.draw(42, 5, true);
+    cv::Mat image7 = chilitags.draw(7, 7, true);
+    auto expected42 = chilitags.find(image42);
+    auto expected7 = chilitags.find(image7);
+
+    // Two workspaces, as for two threads sharing the same detector
+    const chilitags::Chilitags &shared = chilitags;
+    chilitags::Chilitags::Workspace workspace42;
+    chilitags::Chilitags::Workspace workspace7;
+    for (int i = 0; i < 3; ++i) {
+        auto tags42 = shared.detect(image42, workspace42);
+        auto tags7 = shared.detect(image7, workspace7);
+        ASSERT_EQ(1, tags42.size());
+        ASSERT_EQ(1, tags7.size());
+        ASSERT_EQ(42, tags42.cbegin()->first);
+        ASSERT_EQ(7, tags7.cbegin()->first);
+        for (int j : {0,1,2,3}) {
+            EXPECT_EQ(expected42[42](j,0), tags42[42](j,0));
+            EXPECT_EQ(expected42[42](j,1), tags42[42](j,1));
+            EXPECT_EQ(expected7[7](j,0), tags7[7](j,0));
+            EXPECT_EQ(expected7[7](j,1), tags7[7](j,1));
+        }
+    }
+
+    // The workspaces follow the changes of configuration
+    chilitags.setCornerRefinement(chilitags::Chilitags::NO_REFINEMENT);
+    auto raw = chilitags.find(image42);
+    auto tags42 = shared.detect(image42, workspace42);
+    ASSERT_EQ(1, tags42.size());
+    for (int j : {0,1,2,3}) {
+        EXPECT_EQ(raw[42](j,0), tags42[42](j,0));
+        EXPECT_EQ(raw[42](j,1), tags42[42](j,1));
+    }
+}
+
+TEST(Integration, SharedDetector) {
+    chilitags::Chilitags chilitags;
+    chilitags.setFilter(0, 0.0f);
+    const std::vector<cv::Mat> images = {
+        chilitags.draw(42, 5, true),
+        chilitags.draw(7, 7, true),
+        chilitags.draw(1000, 6, true),
+    };
+    std::vector<chilitags::TagCornerMap> expected;
+    for (const auto &image : images) expected.push_back(chilitags.find(image));
+
+    // Several threads detecting concurrently with the same detector
+    static const int N_THREADS = 4;
+    static const int N_DETECTIONS = 30;
+    const chilitags::Chilitags &shared = chilitags;
+    std::vector<int> nMismatches(N_THREADS, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < N_THREADS; ++t) {
+        threads.push_back(std::thread([&, t]() {
+            chilitags::Chilitags::Workspace workspace;
+            for (int i = 0; i < N_DETECTIONS; ++i) {
+                int image = (t+i) % images.size();
+                auto tags = shared.detect(images[image], workspace);
+                if (tags.size() != 1 || tags.cbegin()->first != expected[image].cbegin()->first
+                    || cv::norm(tags.cbegin()->second - expected[image].cbegin()->second) != 0.0) {
+                    ++nMismatches[t];
+                }
+            }
+        }));
+    }
+    for (auto &thread : threads) thread.join();
+    for (int t = 0; t < N_THREADS; ++t) EXPECT_EQ(0, nMismatches[t]) << "thread " << t;
+}
+
+TEST(Integration, WorkspaceOfSeveralDetectors) {
+    cv::Mat image = chilitags::Chilitags().draw(42, 5, true);
+
+    // Detectors of different configurations, successively allocated at the
+    // same address, and changed the same number of times
+    chilitags::Chilitags::Workspace workspace;
+    for (int i = 0; i < 4; ++i) {
+        chilitags::Chilitags chilitags;
+        chilitags.setFilter(0, 0.0f);
+        chilitags.setCornerRefinementMethod((i % 2 == 0)
+            ? chilitags::Chilitags::EDGE_LINES
+            : chilitags::Chilitags::CORNER_GRADIENTS);
+
+        chilitags::Chilitags::Workspace freshWorkspace;
+        auto expected = chilitags.detect(image, freshWorkspace);
+        auto tags = chilitags.detect(image, workspace);
+        ASSERT_EQ(1, expected.size());
+        ASSERT_EQ(1, tags.size());
+        for (int j : {0,1,2,3}) {
+            EXPECT_EQ(expected[42](j,0), tags[42](j,0)) << "detector " << i;
+            EXPECT_EQ(expected[42](j,1), tags[42](j,1)) << "detector " << i;
+        }
+    }
+}
+
 CV_TEST_MAIN(".")
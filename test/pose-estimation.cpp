@@ -18,8 +18,12 @@
  *   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
  *******************************************************************************/
 
+#include <cstdio>
 #include <fstream>
+#include <iterator>
+#include <limits>
 #include <string>
+#include <vector>
 
 #ifdef OPENCV3
 #include <opencv2/ts.hpp>
@@ -33,6 +37,23 @@
 
 namespace {
 
+std::string readBytes(const std::string &filename) {
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeBytes(const std::string &filename, const std::string &bytes) {
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    file.write(bytes.data(), bytes.size());
+}
+
+// Overwrites the value at the given offset of the bytes
+template<typename T>
+std::string patch(std::string bytes, std::size_t offset, T value) {
+    bytes.replace(offset, sizeof(value), (const char *) &value, sizeof(value));
+    return bytes;
+}
+
 //As assumed by Chilitags3D
 const cv::Size CAMERA_SIZE(640,480);
 const float FOCAL_LENGTH = 700.0f;
@@ -210,4 +231,268 @@ TEST(Estimate3dPose, Configurations) {
     }
 }
 
+TEST(Estimate3dPose, Handles) {
+    auto objectTransformation = makeTransformation(135, 145, 155, 201, 401, 601);
+    auto tagTransformation = objectTransformation*makeTransformation(0, 0, 0, -50, -100, 0);
+
+    chilitags::TagCornerMap tags = {
+        {2, makeTransformedCorners(tagTransformation, 20)},
+        {7, makeTransformedCorners(makeTransformation(35,45,65,20,40,60), 20)},
+    };
+
+    chilitags::Chilitags3D chilitags3D(CAMERA_SIZE);
+    chilitags3D.enableFilter(false);
+    ASSERT_TRUE(chilitags3D.readTagConfiguration(
+        "%YAML:1.0\n"
+        "myobject:\n"
+        "    - tag: 2\n"
+        "      size: 20\n"
+        "      translation: [-50., -100., 0.]\n"
+        "      keep: 1\n",
+        false, true));
+
+    // The objects of the configuration come first, then the tags
+    EXPECT_EQ(0, chilitags3D.getObjectHandle("myobject"));
+    EXPECT_EQ(3, chilitags3D.getTagHandle(2));
+    EXPECT_EQ(8, chilitags3D.getObjectHandle("tag_7"));
+    EXPECT_EQ(-1, chilitags3D.getObjectHandle("nothing"));
+    EXPECT_EQ(-1, chilitags3D.getTagHandle(1024));
+    EXPECT_EQ("myobject", chilitags3D.getObjectName(0));
+    EXPECT_EQ("tag_2", chilitags3D.getObjectName(3));
+    EXPECT_EQ("", chilitags3D.getObjectName(-1));
+
+    chilitags::Chilitags3D::ObjectPoseList poses;
+    chilitags3D.estimateByHandle(tags, poses);
+    ASSERT_EQ(3, poses.size());
+    EXPECT_EQ(0, poses[0].handle);
+    EXPECT_EQ(3, poses[1].handle);
+    EXPECT_EQ(8, poses[2].handle);
+    EXPECT_GT(1e-3, cv::norm(poses[0].transform - objectTransformation));
+    EXPECT_GT(1e-3, cv::norm(poses[1].transform - tagTransformation));
+
+    // The string map is a view of the same poses
+    auto result = chilitags3D.estimate(tags);
+    ASSERT_EQ(poses.size(), result.size());
+    for (const auto &pose : poses) {
+        auto it = result.find(chilitags3D.getObjectName(pose.handle));
+        ASSERT_TRUE(it != result.end());
+        EXPECT_GT(1e-3, cv::norm(it->second - pose.transform));
+    }
+}
+
+TEST(Estimate3dPose, InvalidTagSizes) {
+    auto tagTransformation = makeTransformation(35, 45, 65, 20, 40, 60);
+    chilitags::TagCornerMap tags = {
+        {2, makeTransformedCorners(tagTransformation, 20)},
+        {7, makeTransformedCorners(tagTransformation, 20)},
+    };
+
+    chilitags::Chilitags3D chilitags3D(CAMERA_SIZE);
+    chilitags3D.enableFilter(false);
+    ASSERT_TRUE(chilitags3D.readTagConfiguration(
+        "%YAML:1.0\n"
+        "myobject:\n"
+        "    - tag: 2\n"
+        "      size: 20\n"
+        "      keep: 1\n",
+        true, true));
+
+    // A kept tag without size is rejected, and the previous configuration is
+    // kept
+    EXPECT_FALSE(chilitags3D.readTagConfiguration(
+        "%YAML:1.0\n"
+        "other:\n"
+        "    - tag: 2\n"
+        "      keep: 1\n",
+        false, true));
+    EXPECT_EQ(0, chilitags3D.getObjectHandle("myobject"));
+    EXPECT_EQ(-1, chilitags3D.getObjectHandle("other"));
+
+    chilitags::Chilitags3D::ObjectPoseList poses;
+    chilitags3D.estimateByHandle(tags, poses);
+    ASSERT_EQ(2, poses.size());
+    EXPECT_EQ(chilitags3D.getObjectHandle("myobject"), poses[0].handle);
+    EXPECT_EQ(chilitags3D.getTagHandle(2), poses[1].handle);
+
+    // Invalid default sizes are ignored
+    chilitags::Chilitags3D freeTags(CAMERA_SIZE);
+    freeTags.enableFilter(false);
+    freeTags.setDefaultTagSize(0);
+    freeTags.setDefaultTagSize(-20);
+    freeTags.setDefaultTagSize(std::numeric_limits<float>::quiet_NaN());
+    freeTags.setDefaultTagSize(std::numeric_limits<float>::infinity());
+    auto result = freeTags.estimate(tags);
+    ASSERT_EQ(2, result.size());
+    EXPECT_GT(1e-3, cv::norm(result["tag_2"] - tagTransformation));
+    EXPECT_GT(1e-3, cv::norm(result["tag_7"] - tagTransformation));
+}
+
+TEST(Estimate3dPose, FilterMaxObjects) {
+    chilitags::Quad corners = makeTransformedCorners(makeTransformation(35,45,65,20,40,60), 20);
+
+    chilitags::Chilitags3D chilitags3D(CAMERA_SIZE);
+    chilitags3D.estimate({{1, corners}});
+    chilitags3D.estimate({{2, corners}});
+    // Without any observation, the filtered poses are predicted
+    EXPECT_EQ(2, chilitags3D.estimate(chilitags::TagCornerMap()).size());
+
+    // Only the object observed most recently is kept
+    chilitags3D.setFilterMaxObjects(1);
+    chilitags3D.estimate({{1, corners}});
+    chilitags3D.estimate({{2, corners}});
+    auto result = chilitags3D.estimate(chilitags::TagCornerMap());
+    ASSERT_EQ(1, result.size());
+    EXPECT_EQ("tag_2", result.cbegin()->first);
+}
+
+TEST(Estimate3dPose, ParallelObjects) {
+    // Several objects of two tags each, whose poses are solved in parallel
+    static const int N_OBJECTS = 8;
+    std::string configuration = "%YAML:1.0\n";
+    for (int i = 0; i < N_OBJECTS; ++i) {
+        configuration += cv::format(
+            "object%d:\n"
+            "    - tag: %d\n"
+            "      size: 20\n"
+            "      translation: [0., 0., 0.]\n"
+            "    - tag: %d\n"
+            "      size: 20\n"
+            "      translation: [40., 0., 0.]\n",
+            i, 2*i, 2*i+1);
+    }
+
+    // The filter is updated in the same order, whatever the number of threads
+    chilitags::Chilitags3D::ObjectPoseList poses[2];
+    for (int run = 0; run < 2; ++run) {
+        cv::setNumThreads(run == 0 ? 1 : 4);
+        chilitags::Chilitags3D chilitags3D(CAMERA_SIZE);
+        ASSERT_TRUE(chilitags3D.readTagConfiguration(configuration, false, true));
+        for (int frame = 0; frame < 5; ++frame) {
+            chilitags::TagCornerMap tags;
+            for (int i = 0; i < N_OBJECTS; ++i) {
+                auto objectTransformation = makeTransformation(
+                    30+5*i+frame, 20, 10*i, -200+50*i, 10*frame, 600);
+                tags[2*i] = makeTransformedCorners(objectTransformation, 20);
+                tags[2*i+1] = makeTransformedCorners(
+                    objectTransformation*makeTransformation(0, 0, 0, 40, 0, 0), 20);
+            }
+            chilitags3D.estimateByHandle(tags, poses[run]);
+        }
+    }
+    cv::setNumThreads(-1);
+
+    ASSERT_EQ(N_OBJECTS, poses[0].size());
+    ASSERT_EQ(poses[0].size(), poses[1].size());
+    for (int i = 0; i < N_OBJECTS; ++i) {
+        EXPECT_EQ(poses[0][i].handle, poses[1][i].handle);
+        EXPECT_GT(1e-3, cv::norm(poses[0][i].transform - poses[1][i].transform));
+    }
+}
+
+TEST(Estimate3dPose, BinaryFormat) {
+    auto objectTransformation = makeTransformation(135, 145, 155, 201, 401, 601);
+    chilitags::TagCornerMap tags = {
+        {2, makeTransformedCorners(objectTransformation*makeTransformation(0, 0, 0, -50, -100, 0), 20)},
+        {3, makeTransformedCorners(objectTransformation*makeTransformation(0, 0, 0, +50, -100, 0), 30)},
+    };
+
+    chilitags::Chilitags3D yaml(CAMERA_SIZE);
+    yaml.enableFilter(false);
+    ASSERT_TRUE(yaml.readTagConfiguration(
+        "%YAML:1.0\n"
+        "other:\n"
+        "    - tag: 7\n"
+        "      size: 20\n"
+        "myobject3:\n"
+        "    - tag: 2\n"
+        "      size: 20\n"
+        "      translation: [-50., -100., 0.]\n"
+        "      keep: 1\n"
+        "    - tag: 3\n"
+        "      size: 30\n"
+        "      translation: [50., -100., 0.]\n",
+        true, true));
+    cv::Mat cameraMatrix = (cv::Mat_<float>(3, 3) <<
+        FOCAL_LENGTH, 0, CAMERA_SIZE.width/2,
+        0, FOCAL_LENGTH, CAMERA_SIZE.height/2,
+        0, 0, 1);
+    yaml.setCalibration(cameraMatrix, cv::Mat::zeros(5, 1, CV_32F));
+
+    const std::string configurationFilename = "BinaryFormat.tags";
+    const std::string calibrationFilename = "BinaryFormat.calibration";
+    ASSERT_TRUE(yaml.writeTagConfiguration(configurationFilename));
+    ASSERT_TRUE(yaml.writeCalibration(calibrationFilename));
+
+    chilitags::Chilitags3D binary(cv::Size(320, 240));
+    binary.enableFilter(false);
+    EXPECT_TRUE(binary.readTagConfiguration(configurationFilename, true));
+    EXPECT_EQ(CAMERA_SIZE, binary.readCalibration(calibrationFilename));
+
+    // Truncated or inconsistent files are rejected. They keep their magic
+    // number, so that they are still read as binary files
+    const std::string configurationBytes = readBytes(configurationFilename);
+    const std::string calibrationBytes = readBytes(calibrationFilename);
+    std::vector<std::string> corruptConfigurations, corruptCalibrations;
+    for (std::size_t size : {std::size_t(4), std::size_t(8),
+                             configurationBytes.size()/2, configurationBytes.size()-1})
+        corruptConfigurations.push_back(configurationBytes.substr(0, size));
+    for (std::size_t size : {std::size_t(4), std::size_t(8),
+                             calibrationBytes.size()/2, calibrationBytes.size()-1})
+        corruptCalibrations.push_back(calibrationBytes.substr(0, size));
+    corruptConfigurations.push_back(configurationBytes + '\0');
+    corruptCalibrations.push_back(calibrationBytes + '\0');
+
+    // The headers start with the magic number and the version, followed by
+    // the numbers of objects and tags for a configuration (whose first tag
+    // starts with its id after a header of 6 int), or by the image width,
+    // height and number of distortion coefficients for a calibration
+    corruptConfigurations.push_back(patch(configurationBytes, 4, 2));
+    corruptConfigurations.push_back(patch(configurationBytes, 8, 1 << 30));
+    corruptConfigurations.push_back(patch(configurationBytes, 12, -1));
+    corruptConfigurations.push_back(patch(configurationBytes, 6*sizeof(int), 5000));
+    corruptConfigurations.push_back(patch(configurationBytes, 9*sizeof(int), 0));   // tag size
+    corruptCalibrations.push_back(patch(calibrationBytes, 8, 0));
+    corruptCalibrations.push_back(patch(calibrationBytes, 12, -480));
+    corruptCalibrations.push_back(patch(calibrationBytes, 16, 1 << 28));
+    // 3 distortion coefficients, consistently with the size of the file
+    corruptCalibrations.push_back(patch(calibrationBytes, 16, 3).substr(
+        0, calibrationBytes.size() - 2*sizeof(double)));
+    // The camera matrix follows the 6 int of the header
+    corruptCalibrations.push_back(patch(calibrationBytes, 6*sizeof(int),
+                                        std::numeric_limits<double>::quiet_NaN()));
+    corruptCalibrations.push_back(patch(calibrationBytes, 6*sizeof(int) + 2*sizeof(double),
+                                        std::numeric_limits<double>::infinity()));
+
+    const std::string corruptFilename = "BinaryFormat.corrupt";
+    chilitags::Chilitags3D corrupt(CAMERA_SIZE);
+    for (std::size_t i = 0; i < corruptConfigurations.size(); ++i) {
+        writeBytes(corruptFilename, corruptConfigurations[i]);
+        EXPECT_FALSE(corrupt.readTagConfiguration(corruptFilename)) << "configuration " << i;
+    }
+    for (std::size_t i = 0; i < corruptCalibrations.size(); ++i) {
+        writeBytes(corruptFilename, corruptCalibrations[i]);
+        EXPECT_EQ(cv::Size(), corrupt.readCalibration(corruptFilename)) << "calibration " << i;
+    }
+
+    std::remove(corruptFilename.c_str());
+    std::remove(configurationFilename.c_str());
+    std::remove(calibrationFilename.c_str());
+
+    EXPECT_EQ(0, cv::norm(yaml.getCameraMatrix(), binary.getCameraMatrix()));
+    EXPECT_EQ(yaml.getObjectHandle("myobject3"), binary.getObjectHandle("myobject3"));
+    EXPECT_EQ(yaml.getTagHandle(2), binary.getTagHandle(2));
+
+    // The same configuration gives the same poses
+    auto expected = yaml.estimate(tags);
+    auto result = binary.estimate(tags);
+    ASSERT_EQ(2, expected.size());
+    ASSERT_EQ(expected.size(), result.size());
+    for (const auto &pose : expected) {
+        auto it = result.find(pose.first);
+        ASSERT_TRUE(it != result.end()) << "Missing:" << pose.first;
+        EXPECT_GT(1e-3, cv::norm(it->second - pose.second)) << "For:" << pose.first;
+    }
+    EXPECT_GT(1e-3, cv::norm(result["myobject3"] - objectTransformation));
+}
+
 CV_TEST_MAIN(".")
@@ -0,0 +1,83 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifdef OPENCV3
+#include <opencv2/ts.hpp>
+#else
+#include <opencv2/ts/ts.hpp>
+#endif
+
+#include <mutex>
+
+#include <chilitags.hpp>
+
+TEST(ChilitagsService, Streams) {
+    const int N_STREAMS = 3;
+    const int N_FRAMES = 5;
+    const int IDS[N_STREAMS] = {3, 42, 1000};
+
+    std::mutex lock;
+    std::vector<std::vector<int> > frames(N_STREAMS);
+    std::vector<std::vector<int> > ids(N_STREAMS);
+
+    chilitags::Chilitags drawer;
+    chilitags::ChilitagsService service(2, N_FRAMES);
+    std::vector<int> streams;
+    for (int i = 0; i < N_STREAMS; ++i) {
+        streams.push_back(service.addStream(
+            [&, i](int stream, int frame, const chilitags::TagCornerMap &tags) {
+            std::lock_guard<std::mutex> guard(lock);
+            EXPECT_EQ(streams[i], stream);
+            frames[i].push_back(frame);
+            for (const auto &tag : tags) ids[i].push_back(tag.first);
+        }, chilitags::Chilitags::TRACK_AND_DETECT));
+    }
+
+    for (int frame = 0; frame < N_FRAMES; ++frame) {
+        for (int i = 0; i < N_STREAMS; ++i) {
+            EXPECT_TRUE(service.push(streams[i], drawer.draw(IDS[i], 5, true)));
+        }
+    }
+    service.waitUntilIdle();
+
+    // Each stream sees its own tag, in every frame, in order
+    for (int i = 0; i < N_STREAMS; ++i) {
+        EXPECT_EQ(0, service.getDroppedFrames(streams[i]));
+        ASSERT_EQ(N_FRAMES, frames[i].size());
+        ASSERT_EQ(N_FRAMES, ids[i].size());
+        for (int frame = 0; frame < N_FRAMES; ++frame) {
+            EXPECT_EQ(frame, frames[i][frame]);
+            EXPECT_EQ(IDS[i], ids[i][frame]);
+        }
+    }
+
+    service.removeStream(streams[0]);
+    EXPECT_THROW(service.getDetector(streams[0]), std::out_of_range);
+    EXPECT_THROW(service.getDroppedFrames(streams[0]), std::out_of_range);
+    EXPECT_THROW(service.push(streams[0], drawer.draw(IDS[0], 5, true)), std::out_of_range);
+
+    // The service is still usable after the unknown streams
+    EXPECT_TRUE(service.push(streams[1], drawer.draw(IDS[1], 5, true)));
+    service.waitUntilIdle();
+    ASSERT_EQ(N_FRAMES+1, frames[1].size());
+    EXPECT_EQ(N_FRAMES, frames[1].back());
+}
+
+CV_TEST_MAIN(".")
@@ -0,0 +1,390 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include <chilitags.hpp>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp> // imread, VideoCapture
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef OPENCV3
+#include <opencv2/core/utility.hpp> // getTickCount
+#define FRAME_COUNT cv::CAP_PROP_FRAME_COUNT
+#define POS_FRAMES cv::CAP_PROP_POS_FRAMES
+#else
+#define FRAME_COUNT CV_CAP_PROP_FRAME_COUNT
+#define POS_FRAMES CV_CAP_PROP_POS_FRAMES
+#endif
+
+namespace {
+
+const char BINARY_MAGIC[4] = {'C', 'H', 'L', 'B'};
+const uint32_t BINARY_VERSION = 1;
+
+void usage(const char *program)
+{
+    std::cout
+        << "Usage: " << program << " input [-o output] [-f json|binary] [-j workers]"
+        << " [-l length]\n"
+        << " - input is a directory of images, or a video file,\n"
+        << " - output is the file to write the detections to\n"
+        << "   (default: the standard output),\n"
+        << " - the format of the output is either one JSON object per line and\n"
+        << "   per frame (default), or binary: the 4 bytes \"CHLB\", a uint32\n"
+        << "   version, then for each frame a uint32 frame index, a uint32\n"
+        << "   number of tags, and for each tag an int32 id and its 4 corners\n"
+        << "   as 8 float32 (in the byte order of the machine),\n"
+        << " - workers is the number of threads (default: one per core),\n"
+        << " - length is the number of frames of the segments of a video\n"
+        << "   (default: 300). Each segment is tracked independently, with\n"
+        << "   Chilitags::TRACK_AND_DETECT.\n"
+        << "The throughput is reported on the standard error.\n";
+}
+
+/**
+ * The results of the frames, written in order as soon as they are ready,
+ * whichever worker computed them.
+ */
+class OrderedWriter {
+
+public:
+
+OrderedWriter(FILE *output, bool binary, const std::vector<std::string> &files) :
+    mOutput(output),
+    mBinary(binary),
+    mFiles(files),
+    mLock(),
+    mReady(),
+    mResults(),
+    mDone(),
+    mNextToWrite(0),
+    mTags(0)
+{
+    if (mBinary) {
+        fwrite(BINARY_MAGIC, 1, sizeof(BINARY_MAGIC), mOutput);
+        fwrite(&BINARY_VERSION, sizeof(BINARY_VERSION), 1, mOutput);
+    }
+}
+
+void setFrameCount(size_t frameCount) {
+    mResults.resize(frameCount);
+    mDone.assign(frameCount, false);
+}
+
+void add(size_t frame, chilitags::TagCornerMap &tags) {
+    std::lock_guard<std::mutex> guard(mLock);
+    if (frame >= mResults.size()) {
+        // The number of frames of a video is only an estimate
+        mResults.resize(frame+1);
+        mDone.resize(frame+1, false);
+    }
+    mResults[frame].swap(tags);
+    mDone[frame] = true;
+    mReady.notify_one();
+}
+
+/**
+ * Writes the frames in order, until the given number of frames is written.
+ */
+void writeUntil(size_t frameCount) {
+    std::unique_lock<std::mutex> guard(mLock);
+    while (mNextToWrite < frameCount) {
+        mReady.wait(guard, [this] {
+            return mNextToWrite < mDone.size() && mDone[mNextToWrite];
+        });
+        while (mNextToWrite < mDone.size() && mDone[mNextToWrite]) {
+            write(mNextToWrite, mResults[mNextToWrite]);
+            chilitags::TagCornerMap().swap(mResults[mNextToWrite]);
+            ++mNextToWrite;
+        }
+    }
+}
+
+/**
+ * Writes the remaining frames once no more are added, up to the last one
+ * received, the missing ones without any tag.
+ */
+void writeAll() {
+    std::lock_guard<std::mutex> guard(mLock);
+    for (; mNextToWrite < mDone.size(); ++mNextToWrite) {
+        write(mNextToWrite, mResults[mNextToWrite]);
+        chilitags::TagCornerMap().swap(mResults[mNextToWrite]);
+    }
+}
+
+/**
+ * Marks the frames which could not be read as done, without any tag.
+ */
+void skip(size_t frame) {
+    chilitags::TagCornerMap none;
+    add(frame, none);
+}
+
+size_t getTagCount() const {
+    return mTags;
+}
+
+protected:
+
+void write(size_t frame, const chilitags::TagCornerMap &tags) {
+    mTags += tags.size();
+    if (mBinary) {
+        uint32_t header[2] = {(uint32_t) frame, (uint32_t) tags.size()};
+        fwrite(header, sizeof(uint32_t), 2, mOutput);
+        for (const auto &tag : tags) {
+            int32_t id = tag.first;
+            fwrite(&id, sizeof(id), 1, mOutput);
+            fwrite(tag.second.val, sizeof(float), 8, mOutput);
+        }
+        return;
+    }
+
+    fprintf(mOutput, "{\"frame\":%zu", frame);
+    if (frame < mFiles.size()) {
+        // Escape the characters which would break the JSON string
+        fputs(",\"file\":\"", mOutput);
+        for (char c : mFiles[frame]) {
+            if (c == '"' || c == '\\') fputc('\\', mOutput);
+            fputc(c, mOutput);
+        }
+        fputc('"', mOutput);
+    }
+    fputs(",\"tags\":[", mOutput);
+    bool first = true;
+    for (const auto &tag : tags) {
+        fprintf(mOutput, "%s{\"id\":%d,\"corners\":[", first ? "" : ",", tag.first);
+        for (int i = 0; i < 8; ++i) {
+            fprintf(mOutput, "%s%.2f", i ? "," : "", tag.second.val[i]);
+        }
+        fputs("]}", mOutput);
+        first = false;
+    }
+    fputs("]}\n", mOutput);
+}
+
+FILE *mOutput;
+bool mBinary;
+const std::vector<std::string> &mFiles;
+
+std::mutex mLock;
+std::condition_variable mReady;
+std::vector<chilitags::TagCornerMap> mResults;
+std::vector<bool> mDone;
+size_t mNextToWrite;
+size_t mTags;
+
+};
+
+/**
+ * Detects the tags of independent images: the workers share one detector,
+ * each with its own workspace.
+ */
+size_t processImages(const std::vector<std::string> &files, int nWorkers,
+                     OrderedWriter &writer)
+{
+    chilitags::Chilitags detector;
+    std::atomic<size_t> nextFile(0);
+    std::atomic<size_t> nFrames(0);
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nWorkers; ++i) {
+        workers.push_back(std::thread([&] {
+            chilitags::Chilitags::Workspace workspace;
+            for (size_t file = nextFile++; file < files.size(); file = nextFile++) {
+                cv::Mat image = cv::imread(files[file]);
+                if (image.empty()) {
+                    std::cerr << "Could not read " << files[file] << std::endl;
+                    writer.skip(file);
+                    continue;
+                }
+                chilitags::TagCornerMap tags = detector.detect(image, workspace);
+                writer.add(file, tags);
+                ++nFrames;
+            }
+        }));
+    }
+
+    writer.writeUntil(files.size());
+    for (auto &worker : workers) worker.join();
+    return nFrames;
+}
+
+/**
+ * Moves the capture to the given frame. Seeking lands on a key frame with
+ * some backends: if the position is not the requested one, the video is
+ * read again from the start, discarding the frames before the given one.
+ */
+void seek(cv::VideoCapture &capture, const std::string &filename, int frame)
+{
+    if (capture.set(POS_FRAMES, frame) && (int) capture.get(POS_FRAMES) == frame) return;
+
+    capture.release();
+    capture.open(filename);
+    for (int skipped = 0; skipped < frame && capture.grab(); ++skipped) {
+    }
+}
+
+/**
+ * Detects and tracks the tags of a video, split in segments processed in
+ * parallel, each by its own detector.
+ */
+size_t processVideo(const std::string &filename, int nWorkers, int segmentLength,
+                    OrderedWriter &writer)
+{
+    cv::VideoCapture capture(filename);
+    if (!capture.isOpened()) {
+        std::cerr << "Could not open " << filename << std::endl;
+        return 0;
+    }
+
+    // Without a reliable frame count, the video can not be split
+    int frameCount = (int) capture.get(FRAME_COUNT);
+    int nSegments = 1;
+    if (frameCount > 0) nSegments = (frameCount + segmentLength - 1)/segmentLength;
+    else segmentLength = 0;
+    writer.setFrameCount(std::max(frameCount, 0));
+    capture.release();
+
+    std::atomic<int> nextSegment(0);
+    std::atomic<size_t> nFrames(0);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nWorkers; ++i) {
+        workers.push_back(std::thread([&] {
+            for (int segment = nextSegment++; segment < nSegments; segment = nextSegment++) {
+                cv::VideoCapture segmentCapture(filename);
+                int first = segment*segmentLength;
+                if (first > 0) seek(segmentCapture, filename, first);
+
+                // The last segment reads until the actual end of the video,
+                // the frame count being only an estimate
+                bool last = (segment == nSegments-1);
+                int end = first + segmentLength;
+
+                chilitags::Chilitags detector;
+                cv::Mat image;
+                int frame = first;
+                for (; (last || frame < end) && segmentCapture.read(image); ++frame) {
+                    chilitags::TagCornerMap tags = detector.find(
+                        image, chilitags::Chilitags::TRACK_AND_DETECT);
+                    writer.add(frame, tags);
+                    ++nFrames;
+                }
+                // The frames announced but missing from the video are empty
+                for (; frame < std::min(end, frameCount); ++frame) writer.skip(frame);
+            }
+        }));
+    }
+
+    writer.writeUntil(std::max(frameCount, 0));
+    for (auto &worker : workers) worker.join();
+    // The last segment may have read frames beyond the estimated count
+    writer.writeAll();
+    return nFrames;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argv[1][0] == '-') {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string input = argv[1];
+    std::string outputFilename;
+    bool binary = false;
+    int nWorkers = std::max(1u, std::thread::hardware_concurrency());
+    int segmentLength = 300;
+    for (int i = 2; i+1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "-o") outputFilename = argv[i+1];
+        else if (option == "-f" && std::string(argv[i+1]) == "binary") binary = true;
+        else if (option == "-f" && std::string(argv[i+1]) == "json") binary = false;
+        else if (option == "-j") nWorkers = std::atoi(argv[i+1]);
+        else if (option == "-l") segmentLength = std::atoi(argv[i+1]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (nWorkers <= 0 || segmentLength <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *output = stdout;
+    if (!outputFilename.empty()) {
+        output = fopen(outputFilename.c_str(), binary ? "wb" : "w");
+        if (output == NULL) {
+            std::cerr << "Could not open " << outputFilename << std::endl;
+            return 1;
+        }
+    }
+
+    // A directory is listed, anything else is read as a video
+    std::vector<std::string> files;
+    struct stat inputStat;
+    if (stat(input.c_str(), &inputStat) == 0 && S_ISDIR(inputStat.st_mode)) {
+        std::vector<cv::String> entries;
+        cv::glob(input + "/*", entries, false);
+        files.assign(entries.begin(), entries.end());
+        std::sort(files.begin(), files.end());
+        if (files.empty()) {
+            std::cerr << input << " is empty" << std::endl;
+            return 1;
+        }
+    }
+
+    OrderedWriter writer(output, binary, files);
+    int64 startTicks = cv::getTickCount();
+    size_t nFrames;
+    if (!files.empty()) {
+        writer.setFrameCount(files.size());
+        nFrames = processImages(files, nWorkers, writer);
+    }
+    else {
+        nFrames = processVideo(input, nWorkers, segmentLength, writer);
+    }
+    double seconds = (cv::getTickCount() - startTicks)/cv::getTickFrequency();
+
+    if (output != stdout) fclose(output);
+    else fflush(output);
+
+    std::cerr << nFrames << " frames, " << writer.getTagCount() << " tags in "
+              << seconds << " s: " << nFrames/std::max(seconds, 1e-9) << " frames/s with "
+              << nWorkers << " workers" << std::endl;
+
+    return nFrames > 0 ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include <chilitags.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include <iostream>
+#include <string>
+
+#ifdef OPENCV3
+#include <opencv2/core/utility.hpp> // getTickCount
+#endif
+
+namespace {
+
+void usage(const char *program)
+{
+    std::cout
+        << "Usage: " << program << " [-c tags.yml tags.bin]"
+        << " [-k calibration.yml calibration.bin]\n"
+        << " - tags.yml is a tag configuration to convert to tags.bin,\n"
+        << " - calibration.yml is a camera calibration to convert to\n"
+        << "   calibration.bin.\n"
+        << "The binary files can be given instead of the YAML ones to\n"
+        << "Chilitags3D::readTagConfiguration() and\n"
+        << "Chilitags3D::readCalibration(), which load them without parsing.\n"
+        << "The loading times of both formats are reported on the standard error.\n";
+}
+
+double millisecondsSince(int64 startTicks)
+{
+    return 1000.*(cv::getTickCount() - startTicks)/cv::getTickFrequency();
+}
+
+bool convertConfiguration(const std::string &input, const std::string &output)
+{
+    chilitags::Chilitags3D chilitags3D;
+
+    int64 startTicks = cv::getTickCount();
+    if (!chilitags3D.readTagConfiguration(input)) return false;
+    double yamlMs = millisecondsSince(startTicks);
+
+    if (!chilitags3D.writeTagConfiguration(output)) {
+        std::cerr << "Could not write " << output << std::endl;
+        return false;
+    }
+
+    startTicks = cv::getTickCount();
+    if (!chilitags3D.readTagConfiguration(output)) return false;
+    double binaryMs = millisecondsSince(startTicks);
+
+    std::cerr << input << ": " << yamlMs << " ms, "
+              << output << ": " << binaryMs << " ms" << std::endl;
+    return true;
+}
+
+bool convertCalibration(const std::string &input, const std::string &output)
+{
+    chilitags::Chilitags3D chilitags3D;
+    // Only the loading is timed, not the building of the undistortion table
+    chilitags3D.enableUndistortionLut(false);
+
+    int64 startTicks = cv::getTickCount();
+    cv::Size size = chilitags3D.readCalibration(input);
+    double yamlMs = millisecondsSince(startTicks);
+    if (size.area() <= 0 || chilitags3D.getCameraMatrix().total() != 9) {
+        std::cerr << "Could not read the calibration of " << input << std::endl;
+        return false;
+    }
+
+    if (!chilitags3D.writeCalibration(output)) {
+        std::cerr << "Could not write " << output << std::endl;
+        return false;
+    }
+
+    startTicks = cv::getTickCount();
+    if (chilitags3D.readCalibration(output) != size) return false;
+    double binaryMs = millisecondsSince(startTicks);
+
+    std::cerr << input << ": " << yamlMs << " ms, "
+              << output << ": " << binaryMs << " ms" << std::endl;
+    return true;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4 || (argc-1) % 3 != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i+2 < argc; i += 3) {
+        std::string option = argv[i];
+        bool converted;
+        if (option == "-c") converted = convertConfiguration(argv[i+1], argv[i+2]);
+        else if (option == "-k") converted = convertCalibration(argv[i+1], argv[i+2]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+        if (!converted) return 1;
+    }
+
+    return 0;
+}
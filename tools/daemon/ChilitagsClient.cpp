@@ -0,0 +1,200 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include "ChilitagsClient.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace chilitags {
+
+namespace {
+
+// Waits for the semaphore at most timeoutMs milliseconds
+bool timedWait(sem_t *semaphore, int timeoutMs)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs/1000;
+    deadline.tv_nsec += (timeoutMs%1000)*1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (sem_timedwait(semaphore, &deadline) != 0) {
+        if (errno != EINTR) return false;
+    }
+    return true;
+}
+
+bool isDaemonRunning(const shm::Header *header)
+{
+    return header->daemonRunning && header->magic == shm::MAGIC;
+}
+
+// Waits for the semaphore: timeoutMs 0 does not wait, negative waits
+// indefinitely. The wait is sliced to give up as soon as the daemon stops,
+// as it would never post the semaphore anymore.
+bool waitFor(const shm::Header *header, sem_t *semaphore, int timeoutMs)
+{
+    const int SLICE_MS = 100;
+    while (true) {
+        if (sem_trywait(semaphore) == 0) return true;
+        if (timeoutMs == 0 || !isDaemonRunning(header)) return false;
+
+        int slice = (timeoutMs < 0) ? SLICE_MS : std::min(timeoutMs, SLICE_MS);
+        if (timedWait(semaphore, slice)) return true;
+        if (timeoutMs > 0) timeoutMs -= slice;
+    }
+}
+
+}
+
+ChilitagsClient::ChilitagsClient() :
+    mHeader(nullptr),
+    mSize(0),
+    mAcquiredSlot(nullptr),
+    mNextSequence(0)
+{
+}
+
+ChilitagsClient::~ChilitagsClient()
+{
+    disconnect();
+}
+
+bool ChilitagsClient::connect(const std::string &name)
+{
+    disconnect();
+
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(shm::Header)) {
+        close(fd);
+        return false;
+    }
+
+    void *segment = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) return false;
+
+    shm::Header *header = static_cast<shm::Header *>(segment);
+    if (header->magic != shm::MAGIC || header->version != shm::VERSION
+        || (size_t) status.st_size < shm::segmentSize(header->nSlots, header->maxFrameBytes)) {
+        munmap(segment, status.st_size);
+        return false;
+    }
+
+    mHeader = header;
+    mSize = status.st_size;
+    mNextSequence = 0;
+    return true;
+}
+
+void ChilitagsClient::disconnect()
+{
+    if (mHeader == nullptr) return;
+    munmap(mHeader, mSize);
+    mHeader = nullptr;
+    mSize = 0;
+    mAcquiredSlot = nullptr;
+}
+
+unsigned char *ChilitagsClient::acquireFrame(int width, int height, int channels,
+                                             int &stride, int timeoutMs)
+{
+    if (mHeader == nullptr || mAcquiredSlot != nullptr) return NULL;
+    if (channels != 1 && channels != 3) return NULL;
+    if (width <= 0 || height <= 0
+        || (uint64_t) width*channels*height > mHeader->maxFrameBytes) return NULL;
+    stride = width*channels;
+
+    if (!waitFor(mHeader, &mHeader->freeFrames, timeoutMs)) return NULL;
+
+    uint32_t index = mHeader->frameWriteIndex;
+    mAcquiredSlot = shm::frameSlot(mHeader, index);
+    mAcquiredSlot->width = width;
+    mAcquiredSlot->height = height;
+    mAcquiredSlot->stride = stride;
+    mAcquiredSlot->channels = channels;
+    return shm::frameData(mHeader, index);
+}
+
+uint64_t ChilitagsClient::publishFrame(int64_t timestamp, shm::Trigger trigger)
+{
+    if (mAcquiredSlot == nullptr) return 0;
+
+    uint64_t sequence = mNextSequence++;
+    mAcquiredSlot->sequence = sequence;
+    mAcquiredSlot->timestamp = timestamp;
+    mAcquiredSlot->trigger = trigger;
+    mAcquiredSlot = nullptr;
+
+    mHeader->frameWriteIndex = (mHeader->frameWriteIndex + 1) % mHeader->nSlots;
+    sem_post(&mHeader->readyFrames);
+    return sequence;
+}
+
+bool ChilitagsClient::pushFrame(const unsigned char *data, int width, int height,
+                                int stride, int channels, int64_t timestamp,
+                                shm::Trigger trigger, int timeoutMs)
+{
+    int slotStride;
+    unsigned char *slot = acquireFrame(width, height, channels, slotStride, timeoutMs);
+    if (slot == NULL) return false;
+
+    for (int y = 0; y < height; ++y) {
+        memcpy(slot + y*slotStride, data + y*stride, slotStride);
+    }
+    publishFrame(timestamp, trigger);
+    return true;
+}
+
+bool ChilitagsClient::readResult(Result &result, int timeoutMs)
+{
+    if (mHeader == nullptr) return false;
+    if (!waitFor(mHeader, &mHeader->readyResults, timeoutMs)) return false;
+
+    const shm::ResultSlot *slot = shm::resultSlot(mHeader, mHeader->resultReadIndex);
+    result.sequence = slot->sequence;
+    result.timestamp = slot->timestamp;
+    result.tags.assign(slot->tags, slot->tags + slot->nTags);
+    result.objects.assign(slot->objects, slot->objects + slot->nObjects);
+
+    mHeader->resultReadIndex = (mHeader->resultReadIndex + 1) % mHeader->nSlots;
+    sem_post(&mHeader->freeResults);
+    return true;
+}
+
+uint32_t ChilitagsClient::getDroppedResults() const
+{
+    return (mHeader == nullptr) ? 0 : mHeader->droppedResults;
+}
+
+} /* namespace chilitags */
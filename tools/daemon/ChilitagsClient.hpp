@@ -0,0 +1,130 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifndef ChilitagsClient_HPP
+#define ChilitagsClient_HPP
+
+#include <string>
+#include <vector>
+
+#include "ShmProtocol.hpp"
+
+namespace chilitags {
+
+/**
+ * Sends frames to a running chilitags-daemon and reads the detected tags,
+ * through the shared memory segment of one camera. It does not depend on
+ * OpenCV.
+ *
+ * The frames are written directly in the shared memory, either with
+ * acquireFrame() and publishFrame(), or with the copying pushFrame().
+ */
+class ChilitagsClient {
+
+public:
+
+struct Result {
+    uint64_t sequence;
+    int64_t timestamp;
+    std::vector<shm::Tag> tags;
+    std::vector<shm::ObjectPose> objects;
+};
+
+ChilitagsClient();
+
+~ChilitagsClient();
+
+/**
+ * Maps the shared memory segment created by the daemon under the given
+ * name, e.g. "/chilitags-camera0".
+ *
+ * @return false if there is no compatible segment with this name.
+ */
+bool connect(const std::string &name);
+
+void disconnect();
+
+bool isConnected() const {
+    return mHeader != nullptr;
+}
+
+/**
+ * Reserves the next frame slot of the shared memory, to be filled by the
+ * caller before calling publishFrame().
+ *
+ * @param timeoutMs how long to wait for a free slot: 0 to return
+ * immediately, negative to wait indefinitely. The wait ends early if the
+ * daemon stops.
+ * @param stride set to the number of bytes per row of the slot.
+ * @return the pixels of the slot, or NULL if no slot is free in time or if
+ * the frame is larger than the slots.
+ */
+unsigned char *acquireFrame(int width, int height, int channels, int &stride,
+                            int timeoutMs = -1);
+
+/**
+ * Hands the frame acquired with acquireFrame() over to the daemon.
+ *
+ * @return the sequence number of the frame, reported in its Result.
+ */
+uint64_t publishFrame(int64_t timestamp = 0, shm::Trigger trigger = shm::DETECT_PERIODICALLY);
+
+/**
+ * Copies the given frame to the shared memory and hands it over to the
+ * daemon.
+ *
+ * @return false if no slot is free in time or if the frame is too large.
+ */
+bool pushFrame(const unsigned char *data, int width, int height, int stride,
+               int channels, int64_t timestamp = 0,
+               shm::Trigger trigger = shm::DETECT_PERIODICALLY, int timeoutMs = -1);
+
+/**
+ * Reads the oldest result not read yet.
+ *
+ * @param timeoutMs how long to wait for a result: 0 to return immediately,
+ * negative to wait indefinitely. The wait ends early if the daemon stops.
+ * @return false if no result is available in time, or if the daemon
+ * stopped.
+ */
+bool readResult(Result &result, int timeoutMs = -1);
+
+/**
+ * @return the number of results which the daemon could not write because
+ * they were not read fast enough.
+ */
+uint32_t getDroppedResults() const;
+
+protected:
+
+shm::Header *mHeader;
+size_t mSize;
+shm::FrameSlot *mAcquiredSlot;
+uint64_t mNextSequence;
+
+private:
+ChilitagsClient(const ChilitagsClient &);
+ChilitagsClient &operator=(const ChilitagsClient &);
+
+};
+
+} /* namespace chilitags */
+
+#endif /* ChilitagsClient_HPP */
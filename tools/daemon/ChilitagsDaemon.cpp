@@ -0,0 +1,222 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include "ChilitagsDaemon.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+namespace chilitags {
+
+namespace {
+
+// Waits for the semaphore at most timeoutMs milliseconds
+bool waitFor(sem_t *semaphore, int timeoutMs)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs/1000;
+    deadline.tv_nsec += (timeoutMs%1000)*1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return sem_timedwait(semaphore, &deadline) == 0;
+}
+
+Chilitags::DetectionTrigger toDetectionTrigger(int32_t trigger)
+{
+    switch (trigger) {
+    case shm::DETECT_ONLY:
+        return Chilitags::DETECT_ONLY;
+    case shm::TRACK_ONLY:
+        return Chilitags::TRACK_ONLY;
+    case shm::TRACK_AND_DETECT:
+        return Chilitags::TRACK_AND_DETECT;
+    case shm::DETECT_PERIODICALLY:
+    default:
+        return Chilitags::DETECT_PERIODICALLY;
+    }
+}
+
+// The rows of the frame must fit in its slot, whatever the client wrote
+bool fitsInSlot(const shm::FrameSlot &frame, uint32_t maxFrameBytes)
+{
+    if (frame.channels != 1 && frame.channels != 3) return false;
+    if (frame.width <= 0 || frame.height <= 0) return false;
+    int64_t rowBytes = (int64_t) frame.width*frame.channels;
+    return frame.stride >= rowBytes
+        && (int64_t) frame.stride*frame.height <= (int64_t) maxFrameBytes;
+}
+
+}
+
+ChilitagsDaemon::ChilitagsDaemon(Chilitags3D &estimator, bool estimatePoses) :
+    mEstimator(estimator),
+    mEstimatePoses(estimatePoses),
+    mName(),
+    mHeader(nullptr),
+    mSize(0),
+    mPoses()
+{
+}
+
+ChilitagsDaemon::~ChilitagsDaemon()
+{
+    stop();
+}
+
+bool ChilitagsDaemon::start(const std::string &name, int nSlots, int maxWidth, int maxHeight,
+                            mode_t mode)
+{
+    stop();
+
+    if (nSlots <= 0 || maxWidth <= 0 || maxHeight <= 0) return false;
+    uint64_t maxFrameBytes = 3ull*maxWidth*maxHeight;
+    if (maxFrameBytes > std::numeric_limits<uint32_t>::max()) {
+        std::cerr << "The frames of " << maxWidth << "x" << maxHeight
+                  << " pixels are too large" << std::endl;
+        return false;
+    }
+    size_t size = shm::segmentSize(nSlots, (uint32_t) maxFrameBytes);
+
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, mode);
+    if (fd < 0) {
+        std::cerr << "Could not create " << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (ftruncate(fd, size) != 0) {
+        std::cerr << "Could not allocate " << size << " bytes: " << strerror(errno) << std::endl;
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        std::cerr << "Could not map " << name << ": " << strerror(errno) << std::endl;
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    shm::Header *header = static_cast<shm::Header *>(segment);
+    header->version = shm::VERSION;
+    header->nSlots = nSlots;
+    header->maxFrameBytes = (uint32_t) maxFrameBytes;
+    header->droppedResults = 0;
+    header->frameWriteIndex = 0;
+    header->frameReadIndex = 0;
+    header->resultWriteIndex = 0;
+    header->resultReadIndex = 0;
+    sem_init(&header->freeFrames, 1, nSlots);
+    sem_init(&header->readyFrames, 1, 0);
+    sem_init(&header->freeResults, 1, nSlots);
+    sem_init(&header->readyResults, 1, 0);
+    header->daemonRunning = 1;
+    // The clients only accept the segment once the magic number is set
+    __sync_synchronize();
+    header->magic = shm::MAGIC;
+
+    mName = name;
+    mHeader = header;
+    mSize = size;
+    return true;
+}
+
+bool ChilitagsDaemon::processFrame(int timeoutMs)
+{
+    if (mHeader == nullptr || !waitFor(&mHeader->readyFrames, timeoutMs)) return false;
+
+    // The description of the frame is copied before being checked, so that
+    // the client can not change it in between
+    uint32_t frameIndex = mHeader->frameReadIndex;
+    shm::FrameSlot frameSlot = *shm::frameSlot(mHeader, frameIndex);
+
+    TagCornerMap tags;
+    mPoses.clear();
+    if (fitsInSlot(frameSlot, mHeader->maxFrameBytes)) {
+        // The detection reads the frame directly in the shared memory
+        cv::Mat frame(frameSlot.height, frameSlot.width,
+                      frameSlot.channels == 1 ? CV_8UC1 : CV_8UC3,
+                      shm::frameData(mHeader, frameIndex),
+                      frameSlot.stride);
+        tags = mEstimator.getChilitags().find(frame, toDetectionTrigger(frameSlot.trigger));
+        if (mEstimatePoses) mEstimator.estimateByHandle(tags, mPoses);
+    }
+
+    // The frame slot is not used anymore
+    mHeader->frameReadIndex = (frameIndex + 1) % mHeader->nSlots;
+    sem_post(&mHeader->freeFrames);
+
+    // Drop the result rather than wait for a client which does not read
+    if (sem_trywait(&mHeader->freeResults) != 0) {
+        ++mHeader->droppedResults;
+        return true;
+    }
+
+    shm::ResultSlot *result = shm::resultSlot(mHeader, mHeader->resultWriteIndex);
+    result->sequence = frameSlot.sequence;
+    result->timestamp = frameSlot.timestamp;
+    result->nTags = 0;
+    for (const auto &tag : tags) {
+        if (result->nTags >= shm::MAX_TAGS) break;
+        shm::Tag &out = result->tags[result->nTags++];
+        out.id = tag.first;
+        std::copy(tag.second.val, tag.second.val + 8, out.corners);
+    }
+    result->nObjects = 0;
+    for (const auto &pose : mPoses) {
+        if (result->nObjects >= shm::MAX_OBJECTS) break;
+        shm::ObjectPose &out = result->objects[result->nObjects++];
+        strncpy(out.name, mEstimator.getObjectName(pose.handle).c_str(),
+                shm::MAX_NAME_LENGTH-1);
+        out.name[shm::MAX_NAME_LENGTH-1] = '\0';
+        std::copy(pose.transform.val, pose.transform.val + 16, out.transform);
+    }
+
+    mHeader->resultWriteIndex = (mHeader->resultWriteIndex + 1) % mHeader->nSlots;
+    sem_post(&mHeader->readyResults);
+    return true;
+}
+
+void ChilitagsDaemon::stop()
+{
+    if (mHeader == nullptr) return;
+
+    // The clients waiting on the semaphores check these between their waits
+    mHeader->daemonRunning = 0;
+    mHeader->magic = 0;
+    shm_unlink(mName.c_str());
+    munmap(mHeader, mSize);
+    mHeader = nullptr;
+    mSize = 0;
+}
+
+} /* namespace chilitags */
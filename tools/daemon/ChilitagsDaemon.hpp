@@ -0,0 +1,97 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifndef ChilitagsDaemon_HPP
+#define ChilitagsDaemon_HPP
+
+#include <string>
+
+#include <sys/types.h>
+
+#include <chilitags.hpp>
+
+#include "ShmProtocol.hpp"
+
+namespace chilitags {
+
+/**
+ * Serves the detection of one camera to a ChilitagsClient, through a shared
+ * memory segment laid out as described in ShmProtocol.hpp.
+ */
+class ChilitagsDaemon {
+
+public:
+
+/**
+ * @param estimator detects the tags of the frames, and estimates their 3D
+ * poses if estimatePoses is true.
+ */
+ChilitagsDaemon(Chilitags3D &estimator, bool estimatePoses);
+
+/**
+ * Stops serving, see stop().
+ */
+~ChilitagsDaemon();
+
+/**
+ * Creates the shared memory segment under the given name, replacing a
+ * stale segment of the same name.
+ *
+ * @param mode the permissions of the segment, restricted by the umask.
+ * @return false if the segment could not be created; the reason is
+ * printed on the standard error.
+ */
+bool start(const std::string &name, int nSlots, int maxWidth, int maxHeight,
+           mode_t mode = 0600);
+
+/**
+ * Processes the next frame published by the client, and writes its result.
+ *
+ * @param timeoutMs how long to wait for a frame.
+ * @return false if no frame was published in time.
+ */
+bool processFrame(int timeoutMs);
+
+/**
+ * Tells the clients that the daemon stopped, and removes the segment.
+ */
+void stop();
+
+protected:
+
+Chilitags3D &mEstimator;
+bool mEstimatePoses;
+
+std::string mName;
+shm::Header *mHeader;
+size_t mSize;
+
+// Reused from one frame to the next
+Chilitags3D::ObjectPoseList mPoses;
+
+private:
+ChilitagsDaemon(const ChilitagsDaemon &);
+ChilitagsDaemon &operator=(const ChilitagsDaemon &);
+
+};
+
+} /* namespace chilitags */
+
+#endif /* ChilitagsDaemon_HPP */
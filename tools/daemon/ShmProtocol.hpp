@@ -0,0 +1,153 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#ifndef ShmProtocol_HPP
+#define ShmProtocol_HPP
+
+/**
+ * @file ShmProtocol.hpp
+ * @brief Layout of the shared memory segment through which chilitags-daemon
+ * and its clients exchange frames and detection results
+ *
+ * The segment is created by the daemon, under a POSIX shared memory name
+ * (e.g. "/chilitags-camera0"), and contains, in order:
+ *  - a Header, holding the process-shared semaphores of the two rings,
+ *  - nSlots FrameSlot, describing the frames written by the client,
+ *  - nSlots ResultSlot, holding the results written by the daemon,
+ *  - nSlots buffers of maxFrameBytes bytes, holding the pixels of the frames.
+ *
+ * Each ring has a single producer and a single consumer: one client pushes
+ * the frames of one camera, and reads their results. The daemon and its
+ * clients must be built for the same architecture.
+ *
+ * This header does not depend on OpenCV.
+ */
+
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace chilitags {
+namespace shm {
+
+const uint32_t MAGIC = 0x43484c54;  // "CHLT"
+const uint32_t VERSION = 1;
+
+const int MAX_TAGS = 64;
+const int MAX_OBJECTS = 64;
+const int MAX_NAME_LENGTH = 32;
+
+/** Values of FrameSlot::trigger, matching Chilitags::DetectionTrigger */
+enum Trigger {
+    DETECT_ONLY = 0,
+    TRACK_ONLY,
+    TRACK_AND_DETECT,
+    DETECT_PERIODICALLY,
+};
+
+struct FrameSlot {
+    uint64_t sequence;          ///< index of the frame, set by the client
+    int64_t timestamp;          ///< free for the client, copied to the result
+    int32_t width;
+    int32_t height;
+    int32_t stride;             ///< bytes per row
+    int32_t channels;           ///< 1 (grey) or 3 (BGR)
+    int32_t trigger;            ///< see Trigger
+    int32_t padding;
+};
+
+struct Tag {
+    int32_t id;
+    float corners[8];           ///< x and y of the 4 corners
+};
+
+struct ObjectPose {
+    char name[MAX_NAME_LENGTH]; ///< null terminated, truncated if needed
+    float transform[16];        ///< row major 4x4 transformation matrix
+};
+
+struct ResultSlot {
+    uint64_t sequence;          ///< of the frame
+    int64_t timestamp;          ///< of the frame
+    int32_t nTags;
+    int32_t nObjects;           ///< 0 unless the daemon estimates 3D poses
+    Tag tags[MAX_TAGS];
+    ObjectPose objects[MAX_OBJECTS];
+};
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nSlots;
+    uint32_t maxFrameBytes;
+
+    volatile int32_t daemonRunning;
+    volatile uint32_t droppedResults;   ///< results not written for lack of free slot
+
+    sem_t freeFrames;           ///< posted by the daemon, waited by the client
+    sem_t readyFrames;          ///< posted by the client, waited by the daemon
+    sem_t freeResults;          ///< posted by the client, waited by the daemon
+    sem_t readyResults;         ///< posted by the daemon, waited by the client
+
+    uint32_t frameWriteIndex;   ///< only used by the client
+    uint32_t frameReadIndex;    ///< only used by the daemon
+    uint32_t resultWriteIndex;  ///< only used by the daemon
+    uint32_t resultReadIndex;   ///< only used by the client
+};
+
+inline size_t align(size_t size) {
+    return (size + 63) & ~(size_t) 63;
+}
+
+inline size_t frameSlotsOffset() {
+    return align(sizeof(Header));
+}
+
+inline size_t resultSlotsOffset(uint32_t nSlots) {
+    return frameSlotsOffset() + align(nSlots*sizeof(FrameSlot));
+}
+
+inline size_t framesOffset(uint32_t nSlots) {
+    return resultSlotsOffset(nSlots) + align(nSlots*sizeof(ResultSlot));
+}
+
+inline size_t segmentSize(uint32_t nSlots, uint32_t maxFrameBytes) {
+    return framesOffset(nSlots) + nSlots*align(maxFrameBytes);
+}
+
+inline FrameSlot *frameSlot(Header *header, uint32_t index) {
+    return reinterpret_cast<FrameSlot *>(
+        reinterpret_cast<char *>(header) + frameSlotsOffset()) + index;
+}
+
+inline ResultSlot *resultSlot(Header *header, uint32_t index) {
+    return reinterpret_cast<ResultSlot *>(
+        reinterpret_cast<char *>(header) + resultSlotsOffset(header->nSlots)) + index;
+}
+
+inline unsigned char *frameData(Header *header, uint32_t index) {
+    return reinterpret_cast<unsigned char *>(header)
+           + framesOffset(header->nSlots) + index*align(header->maxFrameBytes);
+}
+
+} /* namespace shm */
+} /* namespace chilitags */
+
+#endif /* ShmProtocol_HPP */
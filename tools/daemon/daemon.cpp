@@ -0,0 +1,119 @@
+/*******************************************************************************
+*   Copyright 2013-2014 EPFL                                                   *
+*   Copyright 2013-2014 Quentin Bonnard                                        *
+*                                                                              *
+*   This file is part of chilitags.                                            *
+*                                                                              *
+*   Chilitags is free software: you can redistribute it and/or modify          *
+*   it under the terms of the Lesser GNU General Public License as             *
+*   published by the Free Software Foundation, either version 3 of the         *
+*   License, or (at your option) any later version.                            *
+*                                                                              *
+*   Chilitags is distributed in the hope that it will be useful,               *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+*   GNU Lesser General Public License for more details.                        *
+*                                                                              *
+*   You should have received a copy of the GNU Lesser General Public License   *
+*   along with Chilitags.  If not, see <http://www.gnu.org/licenses/>.         *
+*******************************************************************************/
+
+#include <chilitags.hpp>
+
+#include "ChilitagsDaemon.hpp"
+
+#include <signal.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+namespace {
+
+volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int)
+{
+    stopRequested = 1;
+}
+
+void usage(const char *program)
+{
+    std::cout
+        << "Usage: " << program << " name [-s slots] [-w width] [-h height]"
+        << " [-m mode] [-c tags.yml] [-k calibration.yml]\n"
+        << " - name is the name of the shared memory segment to create,\n"
+        << "   e.g. /chilitags-camera0; a stale segment of the same name is\n"
+        << "   replaced,\n"
+        << " - slots is the number of frames (and results) which can be\n"
+        << "   waiting in the rings (default: 4),\n"
+        << " - width and height bound the size of the frames\n"
+        << "   (default: 1920x1080),\n"
+        << " - mode is the octal permissions of the segment (default: 600,\n"
+        << "   i.e. only the clients of the same user can connect),\n"
+        << " - tags.yml is a tag configuration, and calibration.yml a camera\n"
+        << "   calibration; if any is given, the 3D poses are estimated too.\n";
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argv[1][0] == '-') {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string name = argv[1];
+    int nSlots = 4;
+    int maxWidth = 1920;
+    int maxHeight = 1080;
+    long mode = 0600;
+    std::string tagConfiguration;
+    std::string calibration;
+    for (int i = 2; i+1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "-s") nSlots = std::atoi(argv[i+1]);
+        else if (option == "-w") maxWidth = std::atoi(argv[i+1]);
+        else if (option == "-h") maxHeight = std::atoi(argv[i+1]);
+        else if (option == "-m") mode = std::strtol(argv[i+1], NULL, 8);
+        else if (option == "-c") tagConfiguration = argv[i+1];
+        else if (option == "-k") calibration = argv[i+1];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (nSlots <= 0 || maxWidth <= 0 || maxHeight <= 0 || mode <= 0 || mode > 0777) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // The detector is warmed up before the clients can send frames
+    chilitags::Chilitags3D estimator(cv::Size(maxWidth, maxHeight));
+    bool estimatePoses = !tagConfiguration.empty() || !calibration.empty();
+    if (!tagConfiguration.empty() && !estimator.readTagConfiguration(tagConfiguration)) {
+        std::cerr << "Could not read the tag configuration " << tagConfiguration << std::endl;
+        return 1;
+    }
+    // The camera of the daemon is fixed: its corners are undistorted with a
+    // lookup table
+    estimator.enableUndistortionLut(true);
+    if (!calibration.empty() && estimator.readCalibration(calibration).area() <= 0) {
+        std::cerr << "Could not read the calibration " << calibration << std::endl;
+        return 1;
+    }
+
+    chilitags::ChilitagsDaemon daemon(estimator, estimatePoses);
+    if (!daemon.start(name, nSlots, maxWidth, maxHeight, (mode_t) mode)) return 1;
+
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+
+    // Wake up regularly to check whether the daemon should stop
+    while (!stopRequested) daemon.processFrame(100);
+
+    daemon.stop();
+
+    return 0;
+}